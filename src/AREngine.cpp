@@ -33,8 +33,8 @@ typedef struct
 } CheatEntry;
 
 // TODO: more sensible size for this? allocate on demand?
-CheatEntry CheatCodes[64];
-u32 NumCheatCodes;
+EMUSTATE CheatEntry* CheatCodes; // 64
+EMUSTATE u32 NumCheatCodes;
 
 
 void ParseTextCode(char* text, int tlen, u32* code, int clen) // or whatever this should be named?
@@ -95,17 +95,18 @@ void ParseTextCode(char* text, int tlen, u32* code, int clen) // or whatever thi
 
 bool Init()
 {
+    CheatCodes = new CheatEntry[64];
     return true;
 }
 
 void DeInit()
 {
-    //
+    delete[] CheatCodes;
 }
 
 void Reset()
 {
-    memset(CheatCodes, 0, sizeof(CheatCodes));
+    memset(CheatCodes, 0, 64 * sizeof(CheatEntry));
     NumCheatCodes = 0;
 
     // TODO: acquire codes from a sensible source!
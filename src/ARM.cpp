@@ -21,6 +21,7 @@
 #include "ARM.h"
 #include "ARMInterpreter.h"
 #include "AREngine.h"
+#include "Profiler.h"
 
 
 // instruction timing notes
@@ -460,6 +461,8 @@ void ARMv5::DataAbort()
 
 void ARMv5::Execute()
 {
+    PROFILE_SCOPE(Prof_ARM9Execute);
+
     if (Halted)
     {
         if (Halted == 2)
@@ -542,6 +545,8 @@ void ARMv5::Execute()
 
 void ARMv4::Execute()
 {
+    PROFILE_SCOPE(Prof_ARM7Execute);
+
     if (Halted)
     {
         if (Halted == 2)
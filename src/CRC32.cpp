@@ -16,54 +16,401 @@
     with melonDS. If not, see http://www.gnu.org/licenses/.
 */
 
+#include <stdio.h>
+#include <atomic>
+#include <thread>
+#include <vector>
 #include "CRC32.h"
+#include "Platform.h"
 
-// http://www.codeproject.com/KB/recipes/crc32_large.aspx
+#if defined(__x86_64__) || defined(__i386__)
+#define CRC32_X86
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
 
-u32 crctable[256];
-bool tableinited = false;
+// slicing-by-8: http://www.codeproject.com/KB/recipes/crc32_large.aspx and
+// Intel's "A Systematic Approach to Building High Performance, Software-based,
+// CRC Generators"
+// PCLMULQDQ folding: Intel's "Fast CRC Computation for Generic Polynomials
+// Using PCLMULQDQ Instruction", constants as used in zlib/Chromium
 
-u32 _reflect(u32 refl, char ch)
+const u32 kPolynomial = 0xEDB88320; // reflected 0x04C11DB7
+
+struct CRCTables
+{
+    u32 Slice[8][256];
+    u32 X2N[32]; // x^(2^n) mod P
+    bool HasPCLMUL;
+};
+
+u32 MultModP(u32 a, u32 b)
+{
+    // a*b mod P, in the reflected representation
+    u32 m = 1 << 31;
+    u32 p = 0;
+    for (;;)
+    {
+        if (a & m)
+        {
+            p ^= b;
+            if ((a & (m - 1)) == 0)
+                break;
+        }
+        m >>= 1;
+        b = (b & 1) ? ((b >> 1) ^ kPolynomial) : (b >> 1);
+    }
+    return p;
+}
+
+CRCTables* MakeTables()
 {
-    u32 value = 0;
+    CRCTables* t = new CRCTables;
+
+    for (u32 i = 0; i < 256; i++)
+    {
+        u32 crc = i;
+        for (int j = 0; j < 8; j++)
+            crc = (crc & 1) ? ((crc >> 1) ^ kPolynomial) : (crc >> 1);
+
+        t->Slice[0][i] = crc;
+    }
+
+    for (u32 i = 0; i < 256; i++)
+    {
+        for (int k = 1; k < 8; k++)
+        {
+            u32 prev = t->Slice[k-1][i];
+            t->Slice[k][i] = (prev >> 8) ^ t->Slice[0][prev & 0xFF];
+        }
+    }
+
+    u32 p = 1 << 30; // x^1
+    t->X2N[0] = p;
+    for (int n = 1; n < 32; n++)
+        t->X2N[n] = p = MultModP(p, p);
 
-    for(int i = 1; i < (ch + 1); i++)
+    t->HasPCLMUL = false;
+#ifdef CRC32_X86
+    unsigned int eax, ebx, ecx, edx;
+    if (__get_cpuid(1, &eax, &ebx, &ecx, &edx))
     {
-        if (refl & 1)
-            value |= 1 << (ch - i);
-        refl >>= 1;
+        // PCLMULQDQ and SSE4.1
+        t->HasPCLMUL = (ecx & (1<<1)) && (ecx & (1<<19));
     }
+#endif
+
+    return t;
+}
 
-	return value;
+const CRCTables& Tables()
+{
+    // built once, on first use, and shared by all threads
+    static const CRCTables* tables = MakeTables();
+    return *tables;
 }
 
-void _inittable()
+
+u32 CRC32_Bytewise(u32 crc, const u8* data, u32 len)
 {
-	u32 polynomial = 0x04C11DB7;
+    const u32* table = Tables().Slice[0];
 
-	for (int i = 0; i < 0x100; i++)
+    crc = ~crc;
+    while (len--)
+        crc = (crc >> 8) ^ table[(crc ^ *data++) & 0xFF];
+
+    return ~crc;
+}
+
+u32 CRC32_Slice8(u32 crc, const u8* data, u32 len)
+{
+    const CRCTables& t = Tables();
+
+    crc = ~crc;
+
+    while (len && ((uintptr_t)data & 3))
     {
-        crctable[i] = _reflect(i, 8) << 24;
+        crc = (crc >> 8) ^ t.Slice[0][(crc ^ *data++) & 0xFF];
+        len--;
+    }
 
-        for (int j = 0; j < 8; j++)
-            crctable[i] = (crctable[i] << 1) ^ (crctable[i] & (1 << 31) ? polynomial : 0);
+    while (len >= 8)
+    {
+        u32 one = *(u32*)&data[0] ^ crc;
+        u32 two = *(u32*)&data[4];
+
+        crc = t.Slice[7][one & 0xFF] ^
+              t.Slice[6][(one >> 8) & 0xFF] ^
+              t.Slice[5][(one >> 16) & 0xFF] ^
+              t.Slice[4][one >> 24] ^
+              t.Slice[3][two & 0xFF] ^
+              t.Slice[2][(two >> 8) & 0xFF] ^
+              t.Slice[1][(two >> 16) & 0xFF] ^
+              t.Slice[0][two >> 24];
+
+        data += 8;
+        len -= 8;
+    }
+
+    while (len--)
+        crc = (crc >> 8) ^ t.Slice[0][(crc ^ *data++) & 0xFF];
+
+    return ~crc;
+}
+
+bool CRC32_HasPCLMUL()
+{
+    return Tables().HasPCLMUL;
+}
+
+#ifdef CRC32_X86
+
+// runs over a multiple of 16 bytes, at least 64.
+// takes and returns the raw CRC register (not inverted).
+__attribute__((target("pclmul,sse4.1")))
+u32 FoldPCLMUL(u32 crc, const u8* data, u32 len)
+{
+    alignas(16) static const u64 k1k2[2] = {0x0154442BD4, 0x01C6E41596};
+    alignas(16) static const u64 k3k4[2] = {0x01751997D0, 0x00CCAA009E};
+    alignas(16) static const u64 k5k0[2] = {0x0163CD6124, 0x0000000000};
+    alignas(16) static const u64 poly[2] = {0x01DB710641, 0x01F7011641};
+
+    __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8;
+    __m128i y5, y6, y7, y8;
+
+    x1 = _mm_loadu_si128((__m128i*)(data + 0x00));
+    x2 = _mm_loadu_si128((__m128i*)(data + 0x10));
+    x3 = _mm_loadu_si128((__m128i*)(data + 0x20));
+    x4 = _mm_loadu_si128((__m128i*)(data + 0x30));
+
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(crc));
+
+    x0 = _mm_load_si128((__m128i*)k1k2);
+
+    data += 64;
+    len -= 64;
+
+    // fold 4x128 bits at a time
+    while (len >= 64)
+    {
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+        x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+        x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+        x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+        x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+
+        y5 = _mm_loadu_si128((__m128i*)(data + 0x00));
+        y6 = _mm_loadu_si128((__m128i*)(data + 0x10));
+        y7 = _mm_loadu_si128((__m128i*)(data + 0x20));
+        y8 = _mm_loadu_si128((__m128i*)(data + 0x30));
+
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), y5);
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), y6);
+        x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), y7);
+        x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), y8);
+
+        data += 64;
+        len -= 64;
+    }
+
+    // fold into 128 bits
+    x0 = _mm_load_si128((__m128i*)k3k4);
+
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+    // remaining 128-bit blocks
+    while (len >= 16)
+    {
+        x2 = _mm_loadu_si128((__m128i*)data);
 
-        crctable[i] = _reflect(crctable[i],  32);
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+
+        data += 16;
+        len -= 16;
+    }
+
+    // fold 128 bits to 64
+    x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+    x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+    x1 = _mm_srli_si128(x1, 8);
+    x1 = _mm_xor_si128(x1, x2);
+
+    x0 = _mm_loadl_epi64((__m128i*)k5k0);
+
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_and_si128(x1, x3);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    // Barrett reduction to 32 bits
+    x0 = _mm_load_si128((__m128i*)poly);
+
+    x2 = _mm_and_si128(x1, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+    x2 = _mm_and_si128(x2, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    return (u32)_mm_extract_epi32(x1, 1);
+}
+
+#endif
+
+u32 CRC32_PCLMUL(u32 crc, const u8* data, u32 len)
+{
+#ifdef CRC32_X86
+    if (len >= 64 && CRC32_HasPCLMUL())
+    {
+        u32 blocklen = len & ~15;
+        crc = ~FoldPCLMUL(~crc, data, blocklen);
+        data += blocklen;
+        len -= blocklen;
+    }
+#endif
+
+    return CRC32_Slice8(crc, data, len);
+}
+
+u32 CRC32_Update(u32 crc, const u8* data, u32 len)
+{
+    // CRC32_PCLMUL() falls back to slicing-by-8 when needed
+    return CRC32_PCLMUL(crc, data, len);
+}
+
+u32 CRC32(u8* data, int len)
+{
+    return CRC32_Update(0, data, (u32)len);
+}
+
+
+u32 X2NModP(u64 n, int k)
+{
+    // x^(n * 2^k) mod P
+    const CRCTables& t = Tables();
+
+    u32 p = 1 << 31; // x^0
+    while (n)
+    {
+        if (n & 1)
+            p = MultModP(t.X2N[k & 31], p);
+        n >>= 1;
+        k++;
+    }
+    return p;
+}
+
+u32 CRC32_ZeroExtend(u32 crc, u64 len)
+{
+    // zero bytes only shift the CRC register
+    return ~MultModP(X2NModP(len, 3), ~crc);
+}
+
+u32 CRC32_Combine(u32 crcA, u32 crcB, u64 lenB)
+{
+    return MultModP(X2NModP(lenB, 3), crcA) ^ crcB;
+}
+
+
+const u32 kParallelChunkLen = 4*1024*1024;
+
+struct ParallelJob
+{
+    const u8* Data;
+    u32 Len;
+    u32 NumChunks;
+    std::atomic<u32> NextChunk;
+    std::vector<u32> Results;
+};
+
+// Platform threads don't take parameters, so there is one job at a time
+ParallelJob* CurParallelJob = NULL;
+
+void ParallelWorker()
+{
+    ParallelJob* job = CurParallelJob;
+
+    for (;;)
+    {
+        u32 chunk = job->NextChunk.fetch_add(1);
+        if (chunk >= job->NumChunks) break;
+
+        u32 start = chunk * kParallelChunkLen;
+        u32 len = job->Len - start;
+        if (len > kParallelChunkLen) len = kParallelChunkLen;
+
+        job->Results[chunk] = CRC32_Update(0, &job->Data[start], len);
     }
 }
 
-u32 CRC32(u8 *data, int len)
+void* GetParallelLock()
 {
-    if (!tableinited)
+    static void* lock = []()
     {
-        _inittable();
-        tableinited = true;
+        void* sema = Platform::Semaphore_Create();
+        Platform::Semaphore_Post(sema);
+        return sema;
+    }();
+
+    return lock;
+}
+
+u32 CRC32_Parallel(const u8* data, u32 len)
+{
+    int numthreads = (int)std::thread::hardware_concurrency();
+    if (numthreads > 8) numthreads = 8;
+
+    if (numthreads < 2 || len < 2*kParallelChunkLen)
+        return CRC32_Update(0, data, len);
+
+    ParallelJob job;
+    job.Data = data;
+    job.Len = len;
+    job.NumChunks = (len + kParallelChunkLen - 1) / kParallelChunkLen;
+    job.NextChunk.store(0);
+    job.Results.resize(job.NumChunks);
+
+    if ((u32)numthreads > job.NumChunks) numthreads = job.NumChunks;
+
+    Platform::Semaphore_Wait(GetParallelLock());
+    CurParallelJob = &job;
+
+    std::vector<void*> threads;
+    for (int i = 1; i < numthreads; i++)
+        threads.push_back(Platform::Thread_Create(ParallelWorker));
+
+    ParallelWorker();
+
+    for (void* thread : threads)
+    {
+        Platform::Thread_Wait(thread);
+        Platform::Thread_Free(thread);
     }
 
-	u32 crc = 0xFFFFFFFF;
+    CurParallelJob = NULL;
+    Platform::Semaphore_Post(GetParallelLock());
 
-	while (len--)
-        crc = (crc >> 8) ^ crctable[(crc & 0xFF) ^ *data++];
+    u32 crc = job.Results[0];
+    for (u32 i = 1; i < job.NumChunks; i++)
+    {
+        u32 chunklen = (i == job.NumChunks-1) ? (len - i*kParallelChunkLen) : kParallelChunkLen;
+        crc = CRC32_Combine(crc, job.Results[i], chunklen);
+    }
 
-	return (crc ^ 0xFFFFFFFF);
+    return crc;
 }
@@ -21,6 +21,27 @@
 
 #include "types.h"
 
+// standard CRC32 (as in zlib)
+// uses PCLMULQDQ when the CPU has it, slicing-by-8 otherwise
+
 u32 CRC32(u8* data, int len);
 
+// continues a CRC32 over more data. start with crc=0.
+u32 CRC32_Update(u32 crc, const u8* data, u32 len);
+
+// same as CRC32_Update() over 'len' zero bytes, without needing them in memory
+u32 CRC32_ZeroExtend(u32 crc, u64 len);
+
+// CRC32 of A followed by B, given CRC32(A), CRC32(B) and the length of B
+u32 CRC32_Combine(u32 crcA, u32 crcB, u64 lenB);
+
+// splits the data in chunks that are hashed on several threads
+u32 CRC32_Parallel(const u8* data, u32 len);
+
+// the individual implementations, for benchmarking
+u32 CRC32_Bytewise(u32 crc, const u8* data, u32 len);
+u32 CRC32_Slice8(u32 crc, const u8* data, u32 len);
+bool CRC32_HasPCLMUL();
+u32 CRC32_PCLMUL(u32 crc, const u8* data, u32 len);
+
 #endif // CRC32_H
@@ -0,0 +1,328 @@
+/*
+    Copyright 2016-2020 Arisotura
+
+    This file is part of melonDS.
+
+    melonDS is free software: you can redistribute it and/or modify it under
+    the terms of the GNU General Public License as published by the Free
+    Software Foundation, either version 3 of the License, or (at your option)
+    any later version.
+
+    melonDS is distributed in the hope that it will be useful, but WITHOUT ANY
+    WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+    FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with melonDS. If not, see http://www.gnu.org/licenses/.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include "CompressedROM.h"
+#include "CRC32.h"
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+
+const u32 kMagic = 0x4D52434D; // MCRM
+const u32 kVersion = 1;
+const u32 kHeaderLength = 0x18;
+
+
+bool CompressedROM::IsCompressed(FILE* f)
+{
+    u32 magic = 0;
+    fseek(f, 0, SEEK_SET);
+    bool ret = (fread(&magic, 4, 1, f) == 1) && (magic == kMagic);
+    fseek(f, 0, SEEK_SET);
+    return ret;
+}
+
+CompressedROM::CompressedROM(FILE* f)
+{
+    file = f;
+    Error = true;
+
+    Length = 0;
+    CRC = 0;
+    blockSize = 0;
+    numBlocks = 0;
+    blockOffsets = NULL;
+    compBuffer = NULL;
+    fileData = NULL;
+    useCounter = 0;
+    for (int i = 0; i < kCacheSize; i++)
+    {
+        cache[i].Block = 0xFFFFFFFF;
+        cache[i].LastUse = 0;
+        cache[i].Data = NULL;
+    }
+
+#ifndef HAVE_ZLIB
+    printf("CompressedROM: built without zlib, can't open compressed ROMs\n");
+    return;
+#endif
+
+    u32 header[6];
+    fseek(file, 0, SEEK_SET);
+    if (fread(header, sizeof(header), 1, file) != 1 || header[0] != kMagic)
+    {
+        printf("CompressedROM: bad header\n");
+        return;
+    }
+
+    if (header[1] != kVersion)
+    {
+        printf("CompressedROM: unsupported version %d\n", header[1]);
+        return;
+    }
+
+    blockSize = header[2];
+    numBlocks = header[3];
+    Length = header[4];
+    CRC = header[5];
+
+    if (blockSize < 0x1000 || blockSize > 0x100000 || (blockSize & (blockSize-1)))
+    {
+        printf("CompressedROM: bad block size %08X\n", blockSize);
+        return;
+    }
+
+    blockShift = 0;
+    while ((1U << blockShift) < blockSize) blockShift++;
+
+    if (numBlocks != (u32)(((u64)Length + blockSize - 1) >> blockShift))
+    {
+        printf("CompressedROM: bad block count\n");
+        return;
+    }
+
+    blockOffsets = new u32[numBlocks + 1];
+    if (fread(blockOffsets, 4, numBlocks + 1, file) != numBlocks + 1)
+    {
+        printf("CompressedROM: truncated block index\n");
+        return;
+    }
+
+    for (u32 i = 0; i < numBlocks; i++)
+    {
+        if (blockOffsets[i+1] < blockOffsets[i] ||
+            (blockOffsets[i+1] - blockOffsets[i]) > blockSize)
+        {
+            printf("CompressedROM: bad block index\n");
+            return;
+        }
+    }
+
+    // a stream without a file descriptor is over memory that belongs to the
+    // caller (ie. a ROM loaded from memory), and may not be there anymore
+    // when later blocks are read. keep a copy of the compressed data then.
+    if (fileno(file) < 0)
+    {
+        u32 datalen = blockOffsets[numBlocks];
+        fileData = new u8[datalen];
+        fseek(file, 0, SEEK_SET);
+        if (datalen > 0 && fread(fileData, datalen, 1, file) != 1)
+        {
+            printf("CompressedROM: truncated file\n");
+            return;
+        }
+
+        fclose(file);
+        file = NULL;
+    }
+
+    compBuffer = new u8[blockSize];
+    for (int i = 0; i < kCacheSize; i++)
+        cache[i].Data = new u8[blockSize];
+
+    Error = false;
+}
+
+CompressedROM::~CompressedROM()
+{
+    if (file) fclose(file);
+
+    if (blockOffsets) delete[] blockOffsets;
+    if (compBuffer) delete[] compBuffer;
+    if (fileData) delete[] fileData;
+    for (int i = 0; i < kCacheSize; i++)
+    {
+        if (cache[i].Data) delete[] cache[i].Data;
+    }
+}
+
+bool CompressedROM::Decompress(u32 block, u8* dst)
+{
+#ifdef HAVE_ZLIB
+    u32 complen = blockOffsets[block+1] - blockOffsets[block];
+    u32 len = blockSize;
+    if (block == numBlocks-1) len = Length - (block << blockShift);
+
+    u8* src = (complen == len) ? dst : compBuffer;
+
+    if (fileData)
+        memcpy(src, &fileData[blockOffsets[block]], complen);
+    else
+    {
+        fseek(file, blockOffsets[block], SEEK_SET);
+        if (fread(src, complen, 1, file) != 1)
+            return false;
+    }
+
+    // stored uncompressed
+    if (src == dst) return true;
+
+    z_stream strm;
+    memset(&strm, 0, sizeof(strm));
+    if (inflateInit2(&strm, -15) != Z_OK)
+        return false;
+
+    strm.next_in = src;
+    strm.avail_in = complen;
+    strm.next_out = dst;
+    strm.avail_out = len;
+
+    int res = inflate(&strm, Z_FINISH);
+    inflateEnd(&strm);
+
+    return (res == Z_STREAM_END) && (strm.avail_out == 0);
+#else
+    return false;
+#endif
+}
+
+u8* CompressedROM::GetBlock(u32 block)
+{
+    useCounter++;
+
+    CacheEntry* victim = &cache[0];
+    for (int i = 0; i < kCacheSize; i++)
+    {
+        if (cache[i].Block == block)
+        {
+            cache[i].LastUse = useCounter;
+            return cache[i].Data;
+        }
+
+        if (cache[i].LastUse < victim->LastUse)
+            victim = &cache[i];
+    }
+
+    if (!Decompress(block, victim->Data))
+    {
+        printf("CompressedROM: failed to decompress block %d\n", block);
+        memset(victim->Data, 0, blockSize);
+    }
+
+    victim->Block = block;
+    victim->LastUse = useCounter;
+    return victim->Data;
+}
+
+void CompressedROM::Read(u32 addr, u8* dst, u32 len)
+{
+    while (len > 0)
+    {
+        if (addr >= Length)
+        {
+            memset(dst, 0, len);
+            return;
+        }
+
+        u32 block = addr >> blockShift;
+        u32 offset = addr & (blockSize-1);
+        u32 chunk = blockSize - offset;
+        if (chunk > len) chunk = len;
+        if (chunk > Length - addr) chunk = Length - addr;
+
+        memcpy(dst, GetBlock(block) + offset, chunk);
+
+        addr += chunk;
+        dst += chunk;
+        len -= chunk;
+    }
+}
+
+
+bool CompressedROM::Compress(FILE* in, FILE* out, u32 blocksize, int level)
+{
+#ifdef HAVE_ZLIB
+    if (blocksize < 0x1000 || blocksize > 0x100000 || (blocksize & (blocksize-1)))
+        return false;
+
+    fseek(in, 0, SEEK_END);
+    u32 len = (u32)ftell(in);
+    fseek(in, 0, SEEK_SET);
+
+    u32 numblocks = (u32)(((u64)len + blocksize - 1) / blocksize);
+    u32* offsets = new u32[numblocks + 1];
+
+    u8* buf = new u8[blocksize];
+    uLong compcap = compressBound(blocksize);
+    u8* compbuf = new u8[compcap];
+
+    u32 header[6] = {kMagic, kVersion, blocksize, numblocks, len, 0};
+    fwrite(header, sizeof(header), 1, out);
+
+    // index gets filled in at the end
+    u32 pos = kHeaderLength + (numblocks + 1) * 4;
+    fseek(out, pos, SEEK_SET);
+
+    u32 crc = 0;
+    bool ok = true;
+
+    for (u32 i = 0; i < numblocks && ok; i++)
+    {
+        u32 blocklen = blocksize;
+        if (i == numblocks-1) blocklen = len - i*blocksize;
+
+        if (fread(buf, blocklen, 1, in) != 1) { ok = false; break; }
+        crc = CRC32_Update(crc, buf, blocklen);
+
+        z_stream strm;
+        memset(&strm, 0, sizeof(strm));
+        if (deflateInit2(&strm, level, Z_DEFLATED, -15, 9, Z_DEFAULT_STRATEGY) != Z_OK) { ok = false; break; }
+
+        strm.next_in = buf;
+        strm.avail_in = blocklen;
+        strm.next_out = compbuf;
+        strm.avail_out = compcap;
+        int res = deflate(&strm, Z_FINISH);
+        u32 complen = compcap - strm.avail_out;
+        deflateEnd(&strm);
+
+        offsets[i] = pos;
+
+        // store blocks that don't compress
+        if (res != Z_STREAM_END || complen >= blocklen)
+        {
+            ok = ok && fwrite(buf, blocklen, 1, out) == 1;
+            pos += blocklen;
+        }
+        else
+        {
+            ok = ok && fwrite(compbuf, complen, 1, out) == 1;
+            pos += complen;
+        }
+    }
+    offsets[numblocks] = pos;
+
+    if (ok)
+    {
+        header[5] = crc;
+        fseek(out, 0, SEEK_SET);
+        ok = fwrite(header, sizeof(header), 1, out) == 1 &&
+             fwrite(offsets, 4, numblocks + 1, out) == numblocks + 1;
+    }
+
+    delete[] offsets;
+    delete[] buf;
+    delete[] compbuf;
+    return ok;
+#else
+    return false;
+#endif
+}
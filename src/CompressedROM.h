@@ -0,0 +1,90 @@
+/*
+    Copyright 2016-2020 Arisotura
+
+    This file is part of melonDS.
+
+    melonDS is free software: you can redistribute it and/or modify it under
+    the terms of the GNU General Public License as published by the Free
+    Software Foundation, either version 3 of the License, or (at your option)
+    any later version.
+
+    melonDS is distributed in the hope that it will be useful, but WITHOUT ANY
+    WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+    FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with melonDS. If not, see http://www.gnu.org/licenses/.
+*/
+
+#ifndef COMPRESSEDROM_H
+#define COMPRESSEDROM_H
+
+#include <stdio.h>
+#include "types.h"
+
+// seekable compressed ROM container (.ndz/.gbz)
+//
+// the ROM is split in fixed-size blocks that are deflated independently,
+// so any part of it can be read without decompressing what comes before.
+//
+// layout (little-endian):
+//   0x00  magic "MCRM"
+//   0x04  version (1)
+//   0x08  block size (power of two, 4K-1M)
+//   0x0C  number of blocks
+//   0x10  uncompressed length
+//   0x14  CRC32 of the uncompressed data
+//   0x18  block offsets, (number of blocks + 1) x u32, from the start of the file
+//   then the block data. a block whose compressed size equals the block size
+//   (or the remaining length, for the last one) is stored uncompressed.
+//
+// needs zlib; without it, compressed ROMs are recognized but can't be opened.
+
+class CompressedROM
+{
+public:
+    static bool IsCompressed(FILE* f);
+
+    // takes ownership of the file
+    CompressedROM(FILE* f);
+    ~CompressedROM();
+
+    bool Error;
+
+    u32 Length;
+    u32 CRC;
+
+    // reads from the uncompressed data, through a small block cache.
+    // reads past the end return zeroes.
+    void Read(u32 addr, u8* dst, u32 len);
+
+    // writes a ROM in the compressed format. 'level' is the zlib level.
+    static bool Compress(FILE* in, FILE* out, u32 blocksize, int level);
+
+private:
+    FILE* file;
+    u8* fileData; // the whole file, when it's kept in memory instead
+
+    u32 blockSize;
+    u32 blockShift;
+    u32 numBlocks;
+    u32* blockOffsets;
+
+    u8* compBuffer;
+
+    struct CacheEntry
+    {
+        u32 Block;
+        u32 LastUse;
+        u8* Data;
+    };
+
+    static const int kCacheSize = 16;
+    CacheEntry cache[kCacheSize];
+    u32 useCounter;
+
+    u8* GetBlock(u32 block);
+    bool Decompress(u32 block, u8* dst);
+};
+
+#endif // COMPRESSEDROM_H
@@ -30,18 +30,26 @@ const char* kConfigFile = "melonDS.ini";
 
 int _3DRenderer;
 int Threaded3D;
+int ThreadedGeometry;
 
 int GL_ScaleFactor;
 int GL_Antialias;
 
+int DLDIEnable;
+char DLDISDPath[1024];
+
 ConfigEntry ConfigFile[] =
 {
     {"3DRenderer", 0, &_3DRenderer, 1, NULL, 0},
     {"Threaded3D", 0, &Threaded3D, 1, NULL, 0},
+    {"ThreadedGeometry", 0, &ThreadedGeometry, 0, NULL, 0},
 
     {"GL_ScaleFactor", 0, &GL_ScaleFactor, 1, NULL, 0},
     {"GL_Antialias", 0, &GL_Antialias, 0, NULL, 0},
 
+    {"DLDIEnable", 0, &DLDIEnable, 0, NULL, 0},
+    {"DLDISDPath", 1, DLDISDPath, 0, "", 1023},
+
     {"", -1, NULL, 0, NULL, 0}
 };
 
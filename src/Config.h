@@ -42,10 +42,14 @@ void Save();
 
 extern int _3DRenderer;
 extern int Threaded3D;
+extern int ThreadedGeometry;
 
 extern int GL_ScaleFactor;
 extern int GL_Antialias;
 
+extern int DLDIEnable;
+extern char DLDISDPath[1024];
+
 }
 
 #endif // CONFIG_H
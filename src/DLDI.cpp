@@ -0,0 +1,252 @@
+/*
+    Copyright 2016-2020 Arisotura
+
+    This file is part of melonDS.
+
+    melonDS is free software: you can redistribute it and/or modify it under
+    the terms of the GNU General Public License as published by the Free
+    Software Foundation, either version 3 of the License, or (at your option)
+    any later version.
+
+    melonDS is distributed in the hope that it will be useful, but WITHOUT ANY
+    WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+    FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with melonDS. If not, see http://www.gnu.org/licenses/.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+#include "NDS.h"
+#include "DLDI.h"
+#include "Platform.h"
+
+
+namespace DLDI
+{
+
+// built from DLDIDriver.s
+const u8 Driver[] =
+{
+    0xED, 0xA5, 0x8D, 0xBF, 0x20, 0x43, 0x68, 0x69, 0x73, 0x68, 0x6D, 0x00, 0x01, 0x0B, 0x08, 0x0B,
+    0x6D, 0x65, 0x6C, 0x6F, 0x6E, 0x44, 0x53, 0x20, 0x53, 0x44, 0x20, 0x63, 0x61, 0x72, 0x64, 0x20,
+    0x69, 0x6D, 0x61, 0x67, 0x65, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x80, 0xBF, 0xE4, 0x01, 0x80, 0xBF, 0xE4, 0x01, 0x80, 0xBF, 0xE4, 0x01, 0x80, 0xBF,
+    0xE4, 0x01, 0x80, 0xBF, 0xE4, 0x01, 0x80, 0xBF, 0xE4, 0x01, 0x80, 0xBF, 0xE4, 0x03, 0x80, 0xBF,
+    0x4D, 0x4C, 0x44, 0x53, 0x13, 0x00, 0x00, 0x00, 0x80, 0x00, 0x80, 0xBF, 0x80, 0x00, 0x80, 0xBF,
+    0xE8, 0x00, 0x80, 0xBF, 0x00, 0x01, 0x80, 0xBF, 0x80, 0x00, 0x80, 0xBF, 0x80, 0x00, 0x80, 0xBF,
+    0x01, 0x00, 0xA0, 0xE3, 0x1E, 0xFF, 0x2F, 0xE1, 0x01, 0xC3, 0xA0, 0xE3, 0x02, 0xCC, 0x8C, 0xE2,
+    0xB4, 0x20, 0xDC, 0xE1, 0x02, 0x2B, 0xC2, 0xE3, 0xB4, 0x20, 0xCC, 0xE1, 0x60, 0xC0, 0x4C, 0xE2,
+    0x02, 0x29, 0xA0, 0xE3, 0xB0, 0x20, 0xCC, 0xE1, 0x08, 0x00, 0x8C, 0xE5, 0x0C, 0x10, 0x8C, 0xE5,
+    0xA7, 0x24, 0xA0, 0xE3, 0x04, 0x20, 0x8C, 0xE5, 0x41, 0x36, 0xA0, 0xE3, 0x04, 0x20, 0x9C, 0xE5,
+    0x02, 0x05, 0x12, 0xE3, 0xFC, 0xFF, 0xFF, 0x0A, 0x10, 0x00, 0x93, 0xE5, 0x04, 0x20, 0x9C, 0xE5,
+    0x02, 0x01, 0x12, 0xE3, 0xFC, 0xFF, 0xFF, 0x1A, 0x1E, 0xFF, 0x2F, 0xE1, 0x00, 0x04, 0xA0, 0xE1,
+    0xC8, 0x00, 0x80, 0xE3, 0xE7, 0xFF, 0xFF, 0xEA, 0xF0, 0x41, 0x2D, 0xE9, 0x00, 0x40, 0xA0, 0xE1,
+    0x01, 0x50, 0xA0, 0xE1, 0x02, 0x60, 0xA0, 0xE1, 0xC9, 0x70, 0xA0, 0xE3, 0x04, 0x00, 0x00, 0xEA,
+    0xF0, 0x41, 0x2D, 0xE9, 0x00, 0x40, 0xA0, 0xE1, 0x01, 0x50, 0xA0, 0xE1, 0x02, 0x60, 0xA0, 0xE1,
+    0xCA, 0x70, 0xA0, 0xE3, 0x26, 0x0C, 0xA0, 0xE1, 0x02, 0x00, 0x50, 0xE3, 0x0F, 0x00, 0x00, 0x1A,
+    0x05, 0x00, 0xA0, 0xE1, 0x06, 0x10, 0xA0, 0xE1, 0xEB, 0xFF, 0xFF, 0xEB, 0x00, 0x00, 0x50, 0xE3,
+    0x07, 0x00, 0x00, 0x1A, 0x07, 0x00, 0xA0, 0xE1, 0x04, 0x10, 0xA0, 0xE1, 0xD1, 0xFF, 0xFF, 0xEB,
+    0x00, 0x00, 0x50, 0xE3, 0x02, 0x00, 0x00, 0x1A, 0x01, 0x00, 0xA0, 0xE3, 0xF0, 0x41, 0xBD, 0xE8,
+    0x1E, 0xFF, 0x2F, 0xE1, 0x00, 0x00, 0xA0, 0xE3, 0xF0, 0x41, 0xBD, 0xE8, 0x1E, 0xFF, 0x2F, 0xE1,
+    0x7C, 0x80, 0x8F, 0xE2, 0x01, 0x00, 0xA0, 0xE3, 0x08, 0x10, 0xA0, 0xE1, 0xDA, 0xFF, 0xFF, 0xEB,
+    0x00, 0x00, 0x50, 0xE3, 0xF6, 0xFF, 0xFF, 0x1A, 0x00, 0x00, 0x55, 0xE3, 0xF1, 0xFF, 0xFF, 0x0A,
+    0xCA, 0x00, 0x57, 0xE3, 0x02, 0x00, 0x00, 0x1A, 0x06, 0x00, 0xA0, 0xE1, 0x08, 0x10, 0xA0, 0xE1,
+    0x0D, 0x00, 0x00, 0xEB, 0x07, 0x00, 0xA0, 0xE1, 0x04, 0x10, 0xA0, 0xE1, 0xB9, 0xFF, 0xFF, 0xEB,
+    0x00, 0x00, 0x50, 0xE3, 0xEA, 0xFF, 0xFF, 0x1A, 0xC9, 0x00, 0x57, 0xE3, 0x02, 0x00, 0x00, 0x1A,
+    0x08, 0x00, 0xA0, 0xE1, 0x06, 0x10, 0xA0, 0xE1, 0x03, 0x00, 0x00, 0xEB, 0x01, 0x40, 0x84, 0xE2,
+    0x02, 0x6C, 0x86, 0xE2, 0x01, 0x50, 0x45, 0xE2, 0xEA, 0xFF, 0xFF, 0xEA, 0x02, 0x2C, 0xA0, 0xE3,
+    0x01, 0x30, 0xD0, 0xE4, 0x01, 0x30, 0xC1, 0xE4, 0x01, 0x20, 0x52, 0xE2, 0xFB, 0xFF, 0xFF, 0x1A,
+    0x1E, 0xFF, 0x2F, 0xE1,
+};
+
+const u32 DriverLength = sizeof(Driver);
+
+
+EMUSTATE FILE* ImageFile;
+EMUSTATE u8* Image;
+EMUSTATE u64 ImageLength;
+
+EMUSTATE u32 BufferAddr;
+EMUSTATE u32 BufferSectors;
+
+
+bool Init()
+{
+    ImageFile = NULL;
+    Image = NULL;
+    ImageLength = 0;
+
+    return true;
+}
+
+void DeInit()
+{
+    Close();
+}
+
+bool Open(const char* path)
+{
+    Close();
+
+    if (!path[0]) return false;
+
+    ImageFile = Platform::OpenFile(path, "r+b", true);
+    if (!ImageFile)
+    {
+        printf("DLDI: can't open SD image %s\n", path);
+        return false;
+    }
+
+#ifdef _WIN32
+    _fseeki64(ImageFile, 0, SEEK_END);
+    ImageLength = (u64)_ftelli64(ImageFile);
+#else
+    fseeko(ImageFile, 0, SEEK_END);
+    ImageLength = (u64)ftello(ImageFile);
+#endif
+
+#ifndef _WIN32
+    // shared mapping: writes go to the page cache, and thus to the file,
+    // without going through stdio
+    if (ImageLength > 0 && ImageLength == (size_t)ImageLength)
+    {
+        void* map = mmap(NULL, ImageLength, PROT_READ|PROT_WRITE, MAP_SHARED, fileno(ImageFile), 0);
+        if (map != MAP_FAILED)
+            Image = (u8*)map;
+    }
+#endif
+
+    BufferAddr = 0;
+    BufferSectors = 0;
+
+    printf("DLDI: SD image %s, %llu bytes%s\n", path, (unsigned long long)ImageLength,
+           Image ? ", mapped" : "");
+    return true;
+}
+
+void Close()
+{
+#ifndef _WIN32
+    if (Image)
+    {
+        msync(Image, ImageLength, MS_SYNC);
+        munmap(Image, ImageLength);
+    }
+#endif
+    Image = NULL;
+
+    if (ImageFile) fclose(ImageFile);
+    ImageFile = NULL;
+    ImageLength = 0;
+}
+
+bool IsOpen()
+{
+    return ImageFile != NULL;
+}
+
+void DetachImage()
+{
+    if (!ImageFile) return;
+
+#ifndef _WIN32
+    // the image is remapped copy-on-write in place: the child keeps working
+    // on what it had, but its writes stay in its own memory
+    if (ImageLength > 0 && ImageLength == (size_t)ImageLength)
+    {
+        void* map = mmap(Image, ImageLength, PROT_READ|PROT_WRITE,
+                         MAP_PRIVATE | (Image ? MAP_FIXED : 0), fileno(ImageFile), 0);
+        if (map != MAP_FAILED)
+        {
+            Image = (u8*)map;
+            return;
+        }
+    }
+#endif
+
+    // can't keep a private copy, so writes would go to the parent's image
+    printf("DLDI: can't detach SD image, closing it\n");
+    Close();
+}
+
+
+bool Access(u64 offset, u8* ram, u32 len, bool write)
+{
+    if (Image)
+    {
+        if (write)
+            memcpy(&Image[offset], ram, len);
+        else
+            memcpy(ram, &Image[offset], len);
+        return true;
+    }
+
+#ifdef _WIN32
+    _fseeki64(ImageFile, offset, SEEK_SET);
+#else
+    fseeko(ImageFile, offset, SEEK_SET);
+#endif
+    if (write)
+        return fwrite(ram, len, 1, ImageFile) == 1;
+    else
+        return fread(ram, len, 1, ImageFile) == 1;
+}
+
+bool Transfer(u32 sector, bool write)
+{
+    // the driver only gives main RAM buffers to the emulator
+    if ((BufferAddr >> 24) != 0x02) return false;
+    if (BufferSectors > (MAIN_RAM_SIZE >> 9)) return false;
+
+    u64 offset = (u64)sector << 9;
+    u32 len = BufferSectors << 9;
+    if (offset + len > ImageLength) return false;
+
+    // main RAM is mirrored: the buffer may wrap around its end, in which
+    // case it's done in two pieces
+    u32 ramoffset = BufferAddr & (MAIN_RAM_SIZE - 1);
+    while (len > 0)
+    {
+        u32 chunk = std::min(len, MAIN_RAM_SIZE - ramoffset);
+        if (!Access(offset, &NDS::MainRAM[ramoffset], chunk, write))
+            return false;
+
+        offset += chunk;
+        len -= chunk;
+        ramoffset = 0;
+    }
+
+    return true;
+}
+
+u32 ROMCommand(u8* cmd)
+{
+    if (!ImageFile) return 1;
+
+    u32 param = cmd[4] | (cmd[5] << 8) | (cmd[6] << 16) | (cmd[7] << 24);
+
+    switch (cmd[0])
+    {
+    case 0xC8: // set buffer
+        BufferAddr = param;
+        BufferSectors = cmd[1] | (cmd[2] << 8) | (cmd[3] << 16);
+        return 0;
+
+    case 0xC9: // read
+        return Transfer(param, false) ? 0 : 1;
+
+    case 0xCA: // write
+        return Transfer(param, true) ? 0 : 1;
+    }
+
+    return 1;
+}
+
+}
@@ -0,0 +1,55 @@
+/*
+    Copyright 2016-2020 Arisotura
+
+    This file is part of melonDS.
+
+    melonDS is free software: you can redistribute it and/or modify it under
+    the terms of the GNU General Public License as published by the Free
+    Software Foundation, either version 3 of the License, or (at your option)
+    any later version.
+
+    melonDS is distributed in the hope that it will be useful, but WITHOUT ANY
+    WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+    FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with melonDS. If not, see http://www.gnu.org/licenses/.
+*/
+
+#ifndef DLDI_H
+#define DLDI_H
+
+#include "types.h"
+
+// DLDI emulation for homebrew: the ROM's DLDI stub is replaced with a driver
+// (DLDIDriver.s) that forwards sector reads and writes to the emulator
+// through custom cart commands. those are serviced from a FAT image on the
+// host, which is memory-mapped when possible.
+//
+// transfers go straight between the image and main RAM, a whole request at
+// a time. buffers elsewhere (ie. DTCM) are handled by the driver, through a
+// bounce buffer.
+
+namespace DLDI
+{
+
+extern const u8 Driver[];
+extern const u32 DriverLength;
+
+bool Init();
+void DeInit();
+
+bool Open(const char* path);
+void Close();
+bool IsOpen();
+
+// for a forked process: keeps using the image as it is, but writes no
+// longer reach the file
+void DetachImage();
+
+// cart commands C8-CA, returns the status word (zero on success)
+u32 ROMCommand(u8* cmd);
+
+}
+
+#endif // DLDI_H
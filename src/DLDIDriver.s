@@ -0,0 +1,183 @@
+@ melonDS DLDI driver
+@
+@ patched into homebrew by NDSCart::ApplyDLDIPatch(), see DLDI.cpp.
+@ after changing this, rebuild the DLDI::Driver array in DLDI.cpp:
+@   llvm-mc -triple=armv5te-none-eabi -filetype=obj DLDIDriver.s -o driver.o
+@ then take the .text bytes up to data_end, with the BL offsets resolved
+@ (the assembler leaves them as relocations).
+@
+@ talks to the emulator through custom cart commands:
+@   C8: set transfer buffer (cmd[1..3] = sector count, cmd[4..7] = address)
+@   C9: read sectors into the buffer (cmd[4..7] = first sector)
+@   CA: write sectors from the buffer (cmd[4..7] = first sector)
+@ each command returns a status word, zero on success.
+@ parameters are little-endian, so the driver doesn't need to byteswap.
+@ buffers outside of main RAM go through a bounce buffer, one sector at a time.
+
+    .syntax unified
+    .arm
+    .text
+
+    .equ BASE, 0xBF800000
+    .equ SIZE_LOG2, 11
+
+start:
+    .word 0xBF8DA5ED
+    .ascii " Chishm\0"
+    .byte 1                     @ version
+    .byte SIZE_LOG2             @ driver size
+    .byte 0x08                  @ fix flags: clear BSS
+    .byte SIZE_LOG2             @ allocated space
+name:
+    .ascii "melonDS SD card image"
+    .space 48 - (. - name)
+
+    .word BASE                          @ data start
+    .word BASE + (data_end - start)     @ data end
+    .word BASE + (data_end - start)     @ glue start
+    .word BASE + (data_end - start)     @ glue end
+    .word BASE + (data_end - start)     @ GOT start
+    .word BASE + (data_end - start)     @ GOT end
+    .word BASE + (bss_start - start)    @ BSS start
+    .word BASE + (bss_end - start)      @ BSS end
+
+    .ascii "MLDS"
+    .word 0x00000013            @ can read, can write, slot-1
+
+    .word BASE + (startup - start)
+    .word BASE + (is_inserted - start)
+    .word BASE + (read_sectors - start)
+    .word BASE + (write_sectors - start)
+    .word BASE + (clear_status - start)
+    .word BASE + (shutdown - start)
+
+startup:
+is_inserted:
+clear_status:
+shutdown:
+    mov r0, #1
+    bx lr
+
+@ r0, r1: command bytes 0-3, 4-7
+@ returns the status word
+issue:
+    mov r12, #0x04000000
+    add r12, r12, #0x200
+    ldrh r2, [r12, #0x04]       @ EXMEMCNT: slot-1 to the ARM9
+    bic r2, r2, #0x800
+    strh r2, [r12, #0x04]
+    sub r12, r12, #0x60         @ 0x040001A0
+    mov r2, #0x8000
+    strh r2, [r12]              @ AUXSPICNT: enable, ROM mode
+    str r0, [r12, #0x08]
+    str r1, [r12, #0x0C]
+    mov r2, #0xA7000000         @ start, 4-byte reply
+    str r2, [r12, #0x04]
+    mov r3, #0x04100000
+1:  ldr r2, [r12, #0x04]
+    tst r2, #0x00800000
+    beq 1b
+    ldr r0, [r3, #0x10]
+2:  ldr r2, [r12, #0x04]
+    tst r2, #0x80000000
+    bne 2b
+    bx lr
+
+@ r0 = sector count, r1 = buffer
+set_buffer:
+    mov r0, r0, lsl #8
+    orr r0, r0, #0xC8
+    b issue
+
+@ r0 = sector, r1 = count, r2 = buffer
+read_sectors:
+    push {r4-r8, lr}
+    mov r4, r0
+    mov r5, r1
+    mov r6, r2
+    mov r7, #0xC9
+    b transfer
+
+write_sectors:
+    push {r4-r8, lr}
+    mov r4, r0
+    mov r5, r1
+    mov r6, r2
+    mov r7, #0xCA
+
+@ r4 = sector, r5 = count, r6 = buffer, r7 = command
+transfer:
+    mov r0, r6, lsr #24
+    cmp r0, #0x02
+    bne bounce
+
+    mov r0, r5
+    mov r1, r6
+    bl set_buffer
+    cmp r0, #0
+    bne fail
+    mov r0, r7
+    mov r1, r4
+    bl issue
+    cmp r0, #0
+    bne fail
+
+done:
+    mov r0, #1
+    pop {r4-r8, lr}
+    bx lr
+
+fail:
+    mov r0, #0
+    pop {r4-r8, lr}
+    bx lr
+
+bounce:
+    adr r8, bss_start
+    mov r0, #1
+    mov r1, r8
+    bl set_buffer
+    cmp r0, #0
+    bne fail
+
+bounce_loop:
+    cmp r5, #0
+    beq done
+
+    cmp r7, #0xCA
+    bne 1f
+    mov r0, r6
+    mov r1, r8
+    bl copy_sector
+
+1:  mov r0, r7
+    mov r1, r4
+    bl issue
+    cmp r0, #0
+    bne fail
+
+    cmp r7, #0xC9
+    bne 2f
+    mov r0, r8
+    mov r1, r6
+    bl copy_sector
+
+2:  add r4, r4, #1
+    add r6, r6, #0x200
+    sub r5, r5, #1
+    b bounce_loop
+
+@ r0 = source, r1 = destination, byte by byte as either may be unaligned
+copy_sector:
+    mov r2, #0x200
+1:  ldrb r3, [r0], #1
+    strb r3, [r1], #1
+    subs r2, r2, #1
+    bne 1b
+    bx lr
+
+    .balign 4
+data_end:
+bss_start:
+    .space 0x200
+bss_end:
@@ -17,10 +17,13 @@
 */
 
 #include <stdio.h>
+#include <string.h>
+#include <algorithm>
 #include "NDS.h"
 #include "DMA.h"
 #include "NDSCart.h"
 #include "GPU.h"
+#include "Profiler.h"
 
 
 // NOTES ON DMA SHIT
@@ -195,8 +198,86 @@ void DMA::Run()
     else          return Run7();
 }
 
+// bulk path for transfers between plain memory regions: copies as many
+// units as possible in one go, up to maxunits and without crossing the end
+// of either region. returns 0 if the current addresses don't allow it, in
+// which case the transfer must go on unit by unit.
+u32 DMA::CopyBulk(u32 unitshift, u32 maxunits)
+{
+    u32 unitsize = 1 << unitshift;
+    if ((CurSrcAddr | CurDstAddr) & (unitsize-1)) return 0;
+
+    NDS::MemRegion src, dst;
+    if (CPU == 0)
+    {
+        if (!NDS::ARM9GetDMAMemRegion(CurSrcAddr, false, &src)) return 0;
+        if (!NDS::ARM9GetDMAMemRegion(CurDstAddr, true, &dst)) return 0;
+    }
+    else
+    {
+        if (!NDS::ARM7GetDMAMemRegion(CurSrcAddr, false, &src)) return 0;
+        if (!NDS::ARM7GetDMAMemRegion(CurDstAddr, true, &dst)) return 0;
+    }
+
+    u8* srcptr = &src.Mem[CurSrcAddr & src.Mask];
+    u8* dstptr = &dst.Mem[CurDstAddr & dst.Mask];
+
+    u32 num = std::min(maxunits, (dst.Mask + 1 - (CurDstAddr & dst.Mask)) >> unitshift);
+    u32 len = num << unitshift;
+
+    if (SrcAddrInc == 0)
+    {
+        // fill. the source must not be overwritten along the way.
+        if (srcptr >= dstptr && srcptr < dstptr+len) return 0;
+
+        if (unitshift == 1)
+        {
+            u16 val = *(u16*)srcptr;
+            for (u32 i = 0; i < len; i += 2) *(u16*)&dstptr[i] = val;
+        }
+        else
+        {
+            u32 val = *(u32*)srcptr;
+            for (u32 i = 0; i < len; i += 4) *(u32*)&dstptr[i] = val;
+        }
+    }
+    else
+    {
+        num = std::min(num, (src.Mask + 1 - (CurSrcAddr & src.Mask)) >> unitshift);
+        len = num << unitshift;
+
+        // going unit by unit, a destination slightly above the source
+        // repeats the start of the data, which memmove wouldn't do
+        if (dstptr > srcptr && dstptr < srcptr+len) return 0;
+
+        memmove(dstptr, srcptr, len);
+    }
+
+    CurSrcAddr += SrcAddrInc * len;
+    CurDstAddr += len;
+    return num;
+}
+
+// bulk path for geometry DMA: hands the command words to the GXFIFO
+// straight from memory. stops early if the FIFO stalls.
+u32 DMA::FeedGXFIFOBulk(u32 maxunits)
+{
+    if (CurSrcAddr & 3) return 0;
+
+    NDS::MemRegion src;
+    if (!NDS::ARM9GetDMAMemRegion(CurSrcAddr, false, &src)) return 0;
+
+    u32 num = std::min(maxunits, (src.Mask + 1 - (CurSrcAddr & src.Mask)) >> 2);
+    num = GPU3D::WriteToGXFIFOBulk((u32*)&src.Mem[CurSrcAddr & src.Mask], num);
+
+    CurSrcAddr += num << 2;
+    return num;
+}
+
 void DMA::Run9()
 {
+    PROFILE_SCOPE(Prof_DMA9);
+
     if (NDS::ARM9Timestamp >= NDS::ARM9Target) return;
 
     Executing = true;
@@ -205,6 +286,13 @@ void DMA::Run9()
     bool burststart = (Running == 2);
     Running = 1;
 
+    // copy between plain memory regions in bulk. anything else, IO
+    // especially (which can stall the DMA), goes unit by unit, except
+    // for geometry commands which have their own bulk path.
+    bool bulk;
+    if (IsGXFIFODMA) bulk = (SrcAddrInc == 1) && (Cnt & (1<<26));
+    else             bulk = (DstAddrInc == 1) && (SrcAddrInc != (u32)-1);
+
     s32 unitcycles;
     //s32 lastcycles = cycles;
 
@@ -230,6 +318,27 @@ void DMA::Run9()
 
         while (IterCount > 0 && !Stall)
         {
+            if (bulk)
+            {
+                // as many units as fit before the target, like the loop below would do
+                u32 maxunits = IterCount;
+                if (unitcycles > 0)
+                    maxunits = std::min((u64)maxunits, (NDS::ARM9Target - NDS::ARM9Timestamp + (unitcycles << NDS::ARM9ClockShift) - 1) / (unitcycles << NDS::ARM9ClockShift));
+
+                u32 num = CopyBulk(1, maxunits);
+                if (num)
+                {
+                    NDS::ARM9Timestamp += ((u64)num * unitcycles) << NDS::ARM9ClockShift;
+                    IterCount -= num;
+                    RemCount -= num;
+
+                    if (NDS::ARM9Timestamp >= NDS::ARM9Target) break;
+                    continue;
+                }
+
+                bulk = false;
+            }
+
             NDS::ARM9Timestamp += (unitcycles << NDS::ARM9ClockShift);
 
             NDS::ARM9Write16(CurDstAddr, NDS::ARM9Read16(CurSrcAddr));
@@ -266,6 +375,27 @@ void DMA::Run9()
 
         while (IterCount > 0 && !Stall)
         {
+            if (bulk)
+            {
+                // as many units as fit before the target, like the loop below would do
+                u32 maxunits = IterCount;
+                if (unitcycles > 0)
+                    maxunits = std::min((u64)maxunits, (NDS::ARM9Target - NDS::ARM9Timestamp + (unitcycles << NDS::ARM9ClockShift) - 1) / (unitcycles << NDS::ARM9ClockShift));
+
+                u32 num = IsGXFIFODMA ? FeedGXFIFOBulk(maxunits) : CopyBulk(2, maxunits);
+                if (num)
+                {
+                    NDS::ARM9Timestamp += ((u64)num * unitcycles) << NDS::ARM9ClockShift;
+                    IterCount -= num;
+                    RemCount -= num;
+
+                    if (NDS::ARM9Timestamp >= NDS::ARM9Target) break;
+                    continue;
+                }
+
+                bulk = false;
+            }
+
             NDS::ARM9Timestamp += (unitcycles << NDS::ARM9ClockShift);
 
             NDS::ARM9Write32(CurDstAddr, NDS::ARM9Read32(CurSrcAddr));
@@ -309,6 +439,8 @@ void DMA::Run9()
 
 void DMA::Run7()
 {
+    PROFILE_SCOPE(Prof_DMA7);
+
     if (NDS::ARM7Timestamp >= NDS::ARM7Target) return;
 
     Executing = true;
@@ -317,6 +449,10 @@ void DMA::Run7()
     bool burststart = (Running == 2);
     Running = 1;
 
+    // copy between plain memory regions in bulk. anything else, IO
+    // especially (which can stall the DMA), goes unit by unit.
+    bool bulk = (DstAddrInc == 1) && (SrcAddrInc != (u32)-1);
+
     s32 unitcycles;
     //s32 lastcycles = cycles;
 
@@ -342,6 +478,27 @@ void DMA::Run7()
 
         while (IterCount > 0 && !Stall)
         {
+            if (bulk)
+            {
+                // as many units as fit before the target, like the loop below would do
+                u32 maxunits = IterCount;
+                if (unitcycles > 0)
+                    maxunits = std::min((u64)maxunits, (NDS::ARM7Target - NDS::ARM7Timestamp + unitcycles - 1) / unitcycles);
+
+                u32 num = CopyBulk(1, maxunits);
+                if (num)
+                {
+                    NDS::ARM7Timestamp += (u64)num * unitcycles;
+                    IterCount -= num;
+                    RemCount -= num;
+
+                    if (NDS::ARM7Timestamp >= NDS::ARM7Target) break;
+                    continue;
+                }
+
+                bulk = false;
+            }
+
             NDS::ARM7Timestamp += unitcycles;
 
             NDS::ARM7Write16(CurDstAddr, NDS::ARM7Read16(CurSrcAddr));
@@ -378,6 +535,27 @@ void DMA::Run7()
 
         while (IterCount > 0 && !Stall)
         {
+            if (bulk)
+            {
+                // as many units as fit before the target, like the loop below would do
+                u32 maxunits = IterCount;
+                if (unitcycles > 0)
+                    maxunits = std::min((u64)maxunits, (NDS::ARM7Target - NDS::ARM7Timestamp + unitcycles - 1) / unitcycles);
+
+                u32 num = CopyBulk(2, maxunits);
+                if (num)
+                {
+                    NDS::ARM7Timestamp += (u64)num * unitcycles;
+                    IterCount -= num;
+                    RemCount -= num;
+
+                    if (NDS::ARM7Timestamp >= NDS::ARM7Target) break;
+                    continue;
+                }
+
+                bulk = false;
+            }
+
             NDS::ARM7Timestamp += unitcycles;
 
             NDS::ARM7Write32(CurDstAddr, NDS::ARM7Read32(CurSrcAddr));
@@ -415,3 +593,63 @@ void DMA::Run7()
     InProgress = false;
     NDS::ResumeCPU(1, 1<<Num);
 }
+
+s32 DMA::BulkCardTransfer(const u8* data, u32 len)
+{
+    if (Running || InProgress) return -1;
+
+    // 32-bit, repeat, no IRQ, one word from a fixed ROMDATA to an incrementing destination
+    if ((Cnt & 0x47E00000) != 0x07000000) return -1;
+    if ((Cnt & CountMask) != 1) return -1;
+    if (SrcAddr != 0x04100010) return -1;
+
+    u32 dst = CurDstAddr & ~3;
+    s32 cycles = 0;
+
+    u32 pageshift = (CPU == 0) ? 14 : 15;
+    for (u32 pos = 0; pos < len; )
+    {
+        // timings only change from one page to the next
+        u32 chunk = (1 << pageshift) - (dst & ((1 << pageshift) - 1));
+        if (chunk > len - pos) chunk = len - pos;
+
+        s32 unitcycles;
+        if (CPU == 0)
+        {
+            unitcycles = NDS::ARM9MemTimings[SrcAddr >> 14][3] + NDS::ARM9MemTimings[dst >> 14][3];
+            if ((SrcAddr >> 24) == (dst >> 24))
+                unitcycles++;
+        }
+        else
+        {
+            unitcycles = NDS::ARM7MemTimings[SrcAddr >> 15][3] + NDS::ARM7MemTimings[dst >> 15][3];
+            if ((SrcAddr >> 23) == (dst >> 23))
+                unitcycles++;
+        }
+        cycles += unitcycles * (chunk >> 2);
+
+        if ((dst >> 24) == 0x02)
+        {
+            // main RAM, mirrored
+            u32 offset = dst & (MAIN_RAM_SIZE - 1);
+            u32 len1 = std::min(chunk, (u32)MAIN_RAM_SIZE - offset);
+            memcpy(&NDS::MainRAM[offset], &data[pos], len1);
+            if (len1 < chunk)
+                memcpy(&NDS::MainRAM[0], &data[pos+len1], chunk - len1);
+        }
+        else
+        {
+            for (u32 i = 0; i < chunk; i += 4)
+            {
+                if (CPU == 0) NDS::ARM9Write32(dst+i, *(u32*)&data[pos+i]);
+                else          NDS::ARM7Write32(dst+i, *(u32*)&data[pos+i]);
+            }
+        }
+
+        dst += chunk;
+        pos += chunk;
+    }
+
+    CurDstAddr += len;
+    return cycles;
+}
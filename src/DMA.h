@@ -39,6 +39,12 @@ public:
     void Run9();
     void Run7();
 
+    // card transfer fast path: if this DMA is set up the usual way for
+    // reading the card (repeat, one word per DRQ from ROMDATA), performs the
+    // whole transfer at once. returns the per-word DMA cycles summed over the
+    // transfer, or -1 if the DMA can't take it and must run word by word.
+    s32 BulkCardTransfer(const u8* data, u32 len);
+
     bool IsInMode(u32 mode)
     {
         return ((mode == StartMode) && (Cnt & 0x80000000));
@@ -86,6 +92,9 @@ private:
     bool Stall;
 
     bool IsGXFIFODMA;
+
+    u32 CopyBulk(u32 unitshift, u32 maxunits);
+    u32 FeedGXFIFOBulk(u32 maxunits);
 };
 
 #endif
@@ -20,6 +20,8 @@
 #include <string.h>
 #include "GBACart.h"
 #include "CRC32.h"
+#include "CompressedROM.h"
+#include "SaveWriter.h"
 #include "Platform.h"
 
 
@@ -45,13 +47,13 @@ struct FlashProperties
     u8 bank;
 };
 
-u8* SRAM;
-FILE* SRAMFile;
-u32 SRAMLength;
-SaveType SRAMType;
-FlashProperties SRAMFlashState;
+EMUSTATE u8* SRAM;
+EMUSTATE SaveWriter::Save* SRAMWriter;
+EMUSTATE u32 SRAMLength;
+EMUSTATE SaveType SRAMType;
+EMUSTATE FlashProperties SRAMFlashState;
 
-char SRAMPath[1024];
+EMUSTATE char SRAMPath[1024];
 
 void (*WriteFunc)(u32 addr, u8 val);
 
@@ -65,13 +67,15 @@ void Write_Flash(u32 addr, u8 val);
 bool Init()
 {
     SRAM = NULL;
-    SRAMFile = NULL;
+    SRAMWriter = NULL;
     return true;
 }
 
 void DeInit()
 {
-    if (SRAMFile) fclose(SRAMFile);
+    SaveWriter::Close(SRAMWriter, true);
+    SRAMWriter = NULL;
+
     if (SRAM) delete[] SRAM;
 }
 
@@ -82,10 +86,10 @@ void Reset()
 
 void Eject()
 {
-    if (SRAMFile) fclose(SRAMFile);
+    SaveWriter::Close(SRAMWriter, true);
     if (SRAM) delete[] SRAM;
     SRAM = NULL;
-    SRAMFile = NULL;
+    SRAMWriter = NULL;
     SRAMLength = 0;
     SRAMType = S_NULL;
     SRAMFlashState = {};
@@ -104,21 +108,29 @@ void DoSavestate(Savestate* file)
     if (SRAMLength != oldlen)
     {
         // reallocate save memory
+        SaveWriter::Close(SRAMWriter, true);
+        SRAMWriter = NULL;
+
         if (oldlen) delete[] SRAM;
         if (SRAMLength) SRAM = new u8[SRAMLength];
+
+        if (SRAMLength && SRAMPath[0])
+            SRAMWriter = SaveWriter::Open(SRAMPath, SRAM, SRAMLength);
     }
     if (SRAMLength)
     {
         // fill save memory if data is present
         file->VarArray(SRAM, SRAMLength);
+
+        // the file will get all of it on the next write
+        if (!file->Saving)
+            SaveWriter::Reload(SRAMWriter, SRAM);
     }
     else
     {
         // no save data, clear the current state
         SRAMType = SaveType::S_NULL;
-        if (SRAMFile) fclose(SRAMFile);
         SRAM = NULL;
-        SRAMFile = NULL;
         return;
     }
 
@@ -134,13 +146,17 @@ void DoSavestate(Savestate* file)
 
 void LoadSave(const char* path)
 {
+    SaveWriter::Close(SRAMWriter, true);
+    SRAMWriter = NULL;
+
     if (SRAM) delete[] SRAM;
+    SRAM = NULL;
 
     strncpy(SRAMPath, path, 1023);
     SRAMPath[1023] = '\0';
     SRAMLength = 0;
 
-    FILE* f = Platform::OpenFile(SRAMPath, "r+b");
+    FILE* f = Platform::OpenFile(SRAMPath, "rb");
     if (f)
     {
         fseek(f, 0, SEEK_END);
@@ -150,7 +166,10 @@ void LoadSave(const char* path)
         fseek(f, 0, SEEK_SET);
         fread(SRAM, SRAMLength, 1, f);
 
-        SRAMFile = f;
+        fclose(f);
+
+        if (SRAMLength)
+            SRAMWriter = SaveWriter::Open(SRAMPath, SRAM, SRAMLength);
     }
 
     switch (SRAMLength)
@@ -197,6 +216,14 @@ void LoadSave(const char* path)
     }
 }
 
+void DetachSave()
+{
+    // keep the save memory, but stop writing it back
+    SaveWriter::Close(SRAMWriter, false);
+    SRAMWriter = NULL;
+    SRAMPath[0] = '\0';
+}
+
 void RelocateSave(const char* path, bool write)
 {
     if (!write)
@@ -205,18 +232,21 @@ void RelocateSave(const char* path, bool write)
         return;
     }
 
+    // pending changes still go to the old file
+    SaveWriter::Close(SRAMWriter, true);
+    SRAMWriter = NULL;
+
     strncpy(SRAMPath, path, 1023);
     SRAMPath[1023] = '\0';
 
-    FILE *f = Platform::OpenFile(path, "r+b");
-    if (!f)
+    if (!SaveWriter::WriteFile(path, SRAM, SRAMLength))
     {
         printf("GBACart_SRAM::RelocateSave: failed to create new file. fuck\n");
         return;
     }
 
-    SRAMFile = f;
-    fwrite(SRAM, SRAMLength, 1, SRAMFile);
+    if (SRAMLength)
+        SRAMWriter = SaveWriter::Open(SRAMPath, SRAM, SRAMLength);
 }
 
 // mostly ported from DeSmuME
@@ -343,12 +373,7 @@ void Write_Flash(u32 addr, u8 val)
             {
                 u32 start_addr = addr + 0x10000 * SRAMFlashState.bank;
                 memset((u8*)&SRAM[start_addr], 0xFF, 0x1000);
-
-                if (SRAMFile)
-                {
-                    fseek(SRAMFile, start_addr, SEEK_SET);
-                    fwrite((u8*)&SRAM[start_addr], 1, 0x1000, SRAMFile);
-                }
+                SaveWriter::MarkDirty(SRAMWriter, start_addr, 0x1000);
             }
             SRAMFlashState.state = 0;
             SRAMFlashState.cmd = 0;
@@ -397,12 +422,7 @@ void Write_SRAM(u32 addr, u8 val)
     if (prev != val)
     {
         *(u8*)&SRAM[addr] = val;
-
-        if (SRAMFile)
-        {
-            fseek(SRAMFile, addr, SEEK_SET);
-            fwrite((u8*)&SRAM[addr], 1, 1, SRAMFile);
-        }
+        SaveWriter::MarkDirty(SRAMWriter, addr, 1);
     }
 }
 
@@ -501,13 +521,13 @@ const char SOLAR_SENSOR_GAMECODES[10][5] =
 };
 
 
-bool CartInserted;
-bool HasSolarSensor;
-u8* CartROM;
-u32 CartROMSize;
-u32 CartCRC;
-u32 CartID;
-GPIO CartGPIO; // overridden GPIO parameters
+EMUSTATE bool CartInserted;
+EMUSTATE bool HasSolarSensor;
+EMUSTATE u8* CartROM;
+EMUSTATE u32 CartROMSize;
+EMUSTATE u32 CartCRC;
+EMUSTATE u32 CartID;
+EMUSTATE GPIO CartGPIO; // overridden GPIO parameters
 
 
 bool Init()
@@ -580,12 +600,11 @@ void DoSavestate(Savestate* file)
         if (CartROM) delete[] CartROM;
         CartROM = new u8[CartROMSize];
 
-        // clear the SRAM file handle; writes will not be committed
-        if (GBACart_SRAM::SRAMFile)
-        {
-            fclose(GBACart_SRAM::SRAMFile);
-            GBACart_SRAM::SRAMFile = NULL;
-        }
+        // detach the SRAM file; further writes will not be committed
+        // (pending ones still belong to the previous cartridge)
+        SaveWriter::Close(GBACart_SRAM::SRAMWriter, true);
+        GBACart_SRAM::SRAMWriter = NULL;
+        GBACart_SRAM::SRAMPath[0] = '\0';
     }
 
     // only save/load the cartridge header
@@ -628,21 +647,53 @@ bool LoadROM(const char* path, const char* sram)
         return false;
     }
 
+    // the GBA ROM is mapped straight on the bus, so a compressed ROM gets
+    // decompressed entirely
+    CompressedROM* comp = NULL;
+    if (CompressedROM::IsCompressed(f))
+    {
+        comp = new CompressedROM(f);
+        if (comp->Error)
+        {
+            delete comp;
+            return false;
+        }
+    }
+
     if (CartInserted)
     {
         Reset();
     }
 
-    fseek(f, 0, SEEK_END);
-    u32 len = (u32)ftell(f);
+    u32 len;
+    if (comp)
+        len = comp->Length;
+    else
+    {
+        fseek(f, 0, SEEK_END);
+        len = (u32)ftell(f);
+    }
 
     CartROMSize = 0x200;
     while (CartROMSize < len)
         CartROMSize <<= 1;
 
+    CartROM = new u8[CartROMSize];
+    memset(CartROM, 0, CartROMSize);
+    if (comp)
+    {
+        comp->Read(0, CartROM, len);
+        delete comp;
+    }
+    else
+    {
+        fseek(f, 0, SEEK_SET);
+        fread(CartROM, 1, len, f);
+        fclose(f);
+    }
+
     char gamecode[5] = { '\0' };
-    fseek(f, 0xAC, SEEK_SET);
-    fread(&gamecode, 1, 4, f);
+    memcpy(gamecode, &CartROM[0xAC], 4);
     printf("Game code: %s\n", gamecode);
 
     for (int i = 0; i < sizeof(SOLAR_SENSOR_GAMECODES)/sizeof(SOLAR_SENSOR_GAMECODES[0]); i++)
@@ -655,14 +706,7 @@ bool LoadROM(const char* path, const char* sram)
         printf("GBA solar sensor support detected!\n");
     }
 
-    CartROM = new u8[CartROMSize];
-    memset(CartROM, 0, CartROMSize);
-    fseek(f, 0, SEEK_SET);
-    fread(CartROM, 1, len, f);
-
-    fclose(f);
-
-    CartCRC = CRC32(CartROM, CartROMSize);
+    CartCRC = CRC32_Parallel(CartROM, CartROMSize);
     printf("ROM CRC32: %08X\n", CartCRC);
 
     CartInserted = true;
@@ -680,6 +724,11 @@ void RelocateSave(const char* path, bool write)
     GBACart_SRAM::RelocateSave(path, write);
 }
 
+void DetachSave()
+{
+    GBACart_SRAM::DetachSave();
+}
+
 // referenced from mGBA
 void WriteGPIO(u32 addr, u16 val)
 {
@@ -723,10 +772,10 @@ void WriteGPIO(u32 addr, u16 val)
 namespace GBACart_SolarSensor
 {
 
-bool LightEdge;
-u8 LightCounter;
-u8 LightSample;
-u8 LightLevel; // 0-10 range
+EMUSTATE bool LightEdge;
+EMUSTATE u8 LightCounter;
+EMUSTATE u8 LightSample;
+EMUSTATE u8 LightLevel; // 0-10 range
 
 // levels from mGBA
 const int GBA_LUX_LEVELS[11] = { 0, 5, 11, 18, 27, 42, 62, 84, 109, 139, 183 };
@@ -26,8 +26,8 @@
 namespace GBACart_SRAM
 {
 
-extern u8* SRAM;
-extern u32 SRAMLength;
+extern EMUSTATE u8* SRAM;
+extern EMUSTATE u32 SRAMLength;
 
 void Reset();
 void DoSavestate(Savestate* file);
@@ -53,11 +53,11 @@ struct GPIO
     u16 control;
 };
 
-extern bool CartInserted;
-extern bool HasSolarSensor;
-extern u8* CartROM;
-extern u32 CartROMSize;
-extern u32 CartCRC;
+extern EMUSTATE bool CartInserted;
+extern EMUSTATE bool HasSolarSensor;
+extern EMUSTATE u8* CartROM;
+extern EMUSTATE u32 CartROMSize;
+extern EMUSTATE u32 CartCRC;
 
 bool Init();
 void DeInit();
@@ -67,6 +67,7 @@ void Eject();
 void DoSavestate(Savestate* file);
 bool LoadROM(const char* path, const char* sram);
 void RelocateSave(const char* path, bool write);
+void DetachSave();
 
 void WriteGPIO(u32 addr, u16 val);
 
@@ -76,7 +77,7 @@ void WriteGPIO(u32 addr, u16 val);
 namespace GBACart_SolarSensor
 {
 
-extern u8 LightLevel;
+extern EMUSTATE u8 LightLevel;
 
 void Reset();
 void DoSavestate(Savestate* file);
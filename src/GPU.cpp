@@ -28,64 +28,83 @@ namespace GPU
 #define HBLANK_CYCLES (48+(256*6))
 #define FRAME_CYCLES  (LINE_CYCLES * 263)
 
-u16 VCount;
-u32 NextVCount;
-u16 TotalScanlines;
+EMUSTATE u16 VCount;
+EMUSTATE u32 NextVCount;
+EMUSTATE u16 TotalScanlines;
 
-bool RunFIFO;
+EMUSTATE bool RunFIFO;
 
-u16 DispStat[2], VMatch[2];
+EMUSTATE u16 DispStat[2], VMatch[2];
 
-u8 Palette[2*1024];
-u8 OAM[2*1024];
+EMUSTATE u8 Palette[2*1024];
+EMUSTATE u8 OAM[2*1024];
 
-u8 VRAM_A[128*1024];
-u8 VRAM_B[128*1024];
-u8 VRAM_C[128*1024];
-u8 VRAM_D[128*1024];
-u8 VRAM_E[ 64*1024];
-u8 VRAM_F[ 16*1024];
-u8 VRAM_G[ 16*1024];
-u8 VRAM_H[ 32*1024];
-u8 VRAM_I[ 16*1024];
-u8* VRAM[9]     = {VRAM_A,  VRAM_B,  VRAM_C,  VRAM_D,  VRAM_E, VRAM_F, VRAM_G, VRAM_H, VRAM_I};
-u32 VRAMMask[9] = {0x1FFFF, 0x1FFFF, 0x1FFFF, 0x1FFFF, 0xFFFF, 0x3FFF, 0x3FFF, 0x7FFF, 0x3FFF};
+EMUSTATE u8* VRAM_A; // 128K
+EMUSTATE u8* VRAM_B; // 128K
+EMUSTATE u8* VRAM_C; // 128K
+EMUSTATE u8* VRAM_D; // 128K
+EMUSTATE u8* VRAM_E; // 64K
+EMUSTATE u8* VRAM_F; // 16K
+EMUSTATE u8* VRAM_G; // 16K
+EMUSTATE u8* VRAM_H; // 32K
+EMUSTATE u8* VRAM_I; // 16K
+EMUSTATE u8* VRAM[9];
+EMUSTATE u32 VRAMMask[9] = {0x1FFFF, 0x1FFFF, 0x1FFFF, 0x1FFFF, 0xFFFF, 0x3FFF, 0x3FFF, 0x7FFF, 0x3FFF};
 
-u8 VRAMCNT[9];
-u8 VRAMSTAT;
+EMUSTATE u8 VRAMCNT[9];
+EMUSTATE u8 VRAMSTAT;
 
-u32 VRAMMap_LCDC;
+EMUSTATE u32 VRAMMap_LCDC;
 
-u32 VRAMMap_ABG[0x20];
-u32 VRAMMap_AOBJ[0x10];
-u32 VRAMMap_BBG[0x8];
-u32 VRAMMap_BOBJ[0x8];
+EMUSTATE u32 VRAMMap_ABG[0x20];
+EMUSTATE u32 VRAMMap_AOBJ[0x10];
+EMUSTATE u32 VRAMMap_BBG[0x8];
+EMUSTATE u32 VRAMMap_BOBJ[0x8];
 
-u32 VRAMMap_ABGExtPal[4];
-u32 VRAMMap_AOBJExtPal;
-u32 VRAMMap_BBGExtPal[4];
-u32 VRAMMap_BOBJExtPal;
+EMUSTATE u32 VRAMMap_ABGExtPal[4];
+EMUSTATE u32 VRAMMap_AOBJExtPal;
+EMUSTATE u32 VRAMMap_BBGExtPal[4];
+EMUSTATE u32 VRAMMap_BOBJExtPal;
 
-u32 VRAMMap_Texture[4];
-u32 VRAMMap_TexPal[8];
+EMUSTATE u32 VRAMMap_Texture[4];
+EMUSTATE u32 VRAMMap_TexPal[8];
 
-u32 VRAMMap_ARM7[2];
+// texture/palette banks can't be written to while they're mapped as such,
+// so their contents can only change when their mapping does
+// this is bumped when that happens (or when VRAM is reset/loaded)
+EMUSTATE u32 VRAMTexVersion;
 
-u8* VRAMPtr_ABG[0x20];
-u8* VRAMPtr_AOBJ[0x10];
-u8* VRAMPtr_BBG[0x8];
-u8* VRAMPtr_BOBJ[0x8];
+EMUSTATE u32 VRAMMap_ARM7[2];
 
-int FrontBuffer;
-u32* Framebuffer[2][2];
-bool Accelerated;
+EMUSTATE u8* VRAMPtr_ABG[0x20];
+EMUSTATE u8* VRAMPtr_AOBJ[0x10];
+EMUSTATE u8* VRAMPtr_BBG[0x8];
+EMUSTATE u8* VRAMPtr_BOBJ[0x8];
 
-GPU2D* GPU2D_A;
-GPU2D* GPU2D_B;
+EMUSTATE int FrontBuffer;
+EMUSTATE u32* Framebuffer[2][2];
+EMUSTATE bool Accelerated;
+
+EMUSTATE GPU2D* GPU2D_A;
+EMUSTATE GPU2D* GPU2D_B;
 
 
 bool Init()
 {
+    VRAM_A = new u8[128*1024];
+    VRAM_B = new u8[128*1024];
+    VRAM_C = new u8[128*1024];
+    VRAM_D = new u8[128*1024];
+    VRAM_E = new u8[ 64*1024];
+    VRAM_F = new u8[ 16*1024];
+    VRAM_G = new u8[ 16*1024];
+    VRAM_H = new u8[ 32*1024];
+    VRAM_I = new u8[ 16*1024];
+
+    VRAM[0] = VRAM_A; VRAM[1] = VRAM_B; VRAM[2] = VRAM_C;
+    VRAM[3] = VRAM_D; VRAM[4] = VRAM_E; VRAM[5] = VRAM_F;
+    VRAM[6] = VRAM_G; VRAM[7] = VRAM_H; VRAM[8] = VRAM_I;
+
     GPU2D_A = new GPU2D(0);
     GPU2D_B = new GPU2D(1);
     if (!GPU3D::Init()) return false;
@@ -109,6 +128,9 @@ void DeInit()
     if (Framebuffer[0][1]) delete[] Framebuffer[0][1];
     if (Framebuffer[1][0]) delete[] Framebuffer[1][0];
     if (Framebuffer[1][1]) delete[] Framebuffer[1][1];
+
+    for (int i = 0; i < 9; i++)
+        delete[] VRAM[i];
 }
 
 void Reset()
@@ -152,6 +174,7 @@ void Reset()
 
     memset(VRAMMap_Texture, 0, sizeof(VRAMMap_Texture));
     memset(VRAMMap_TexPal, 0, sizeof(VRAMMap_TexPal));
+    VRAMTexVersion++;
 
     VRAMMap_ARM7[0] = 0;
     VRAMMap_ARM7[1] = 0;
@@ -244,6 +267,8 @@ void DoSavestate(Savestate* file)
 
     if (!file->Saving)
     {
+        VRAMTexVersion++;
+
         for (int i = 0; i < 0x20; i++)
             VRAMPtr_ABG[i] = GetUniqueBankPtr(VRAMMap_ABG[i], i << 14);
         for (int i = 0; i < 0x10; i++)
@@ -388,6 +413,7 @@ void MapVRAM_AB(u32 bank, u8 cnt)
 
         case 3: // texture
             VRAMMap_Texture[oldofs] &= ~bankmask;
+            VRAMTexVersion++;
             break;
         }
     }
@@ -411,6 +437,7 @@ void MapVRAM_AB(u32 bank, u8 cnt)
 
         case 3: // texture
             VRAMMap_Texture[ofs] |= bankmask;
+            VRAMTexVersion++;
             break;
         }
     }
@@ -448,6 +475,7 @@ void MapVRAM_CD(u32 bank, u8 cnt)
 
         case 3: // texture
             VRAMMap_Texture[oldofs] &= ~bankmask;
+            VRAMTexVersion++;
             break;
 
         case 4: // BBG/BOBJ
@@ -483,6 +511,7 @@ void MapVRAM_CD(u32 bank, u8 cnt)
 
         case 3: // texture
             VRAMMap_Texture[ofs] |= bankmask;
+            VRAMTexVersion++;
             break;
 
         case 4: // BBG/BOBJ
@@ -526,6 +555,7 @@ void MapVRAM_E(u32 bank, u8 cnt)
 
         case 3: // texture palette
             UNMAP_RANGE(TexPal, 0, 4);
+            VRAMTexVersion++;
             break;
 
         case 4: // ABG ext palette
@@ -554,6 +584,7 @@ void MapVRAM_E(u32 bank, u8 cnt)
 
         case 3: // texture palette
             MAP_RANGE(TexPal, 0, 4);
+            VRAMTexVersion++;
             break;
 
         case 4: // ABG ext palette
@@ -606,6 +637,7 @@ void MapVRAM_FG(u32 bank, u8 cnt)
 
         case 3: // texture palette
             VRAMMap_TexPal[(oldofs & 0x1) + ((oldofs & 0x2) << 1)] &= ~bankmask;
+            VRAMTexVersion++;
             break;
 
         case 4: // ABG ext palette
@@ -651,6 +683,7 @@ void MapVRAM_FG(u32 bank, u8 cnt)
 
         case 3: // texture palette
             VRAMMap_TexPal[(ofs & 0x1) + ((ofs & 0x2) << 1)] |= bankmask;
+            VRAMTexVersion++;
             break;
 
         case 4: // ABG ext palette
@@ -25,52 +25,53 @@
 namespace GPU
 {
 
-extern u16 VCount;
-extern u16 TotalScanlines;
-
-extern u16 DispStat[2];
-
-extern u8 VRAMCNT[9];
-extern u8 VRAMSTAT;
-
-extern u8 Palette[2*1024];
-extern u8 OAM[2*1024];
-
-extern u8 VRAM_A[128*1024];
-extern u8 VRAM_B[128*1024];
-extern u8 VRAM_C[128*1024];
-extern u8 VRAM_D[128*1024];
-extern u8 VRAM_E[ 64*1024];
-extern u8 VRAM_F[ 16*1024];
-extern u8 VRAM_G[ 16*1024];
-extern u8 VRAM_H[ 32*1024];
-extern u8 VRAM_I[ 16*1024];
-
-extern u8* VRAM[9];
-
-extern u32 VRAMMap_LCDC;
-extern u32 VRAMMap_ABG[0x20];
-extern u32 VRAMMap_AOBJ[0x10];
-extern u32 VRAMMap_BBG[0x8];
-extern u32 VRAMMap_BOBJ[0x8];
-extern u32 VRAMMap_ABGExtPal[4];
-extern u32 VRAMMap_AOBJExtPal;
-extern u32 VRAMMap_BBGExtPal[4];
-extern u32 VRAMMap_BOBJExtPal;
-extern u32 VRAMMap_Texture[4];
-extern u32 VRAMMap_TexPal[8];
-extern u32 VRAMMap_ARM7[2];
-
-extern u8* VRAMPtr_ABG[0x20];
-extern u8* VRAMPtr_AOBJ[0x10];
-extern u8* VRAMPtr_BBG[0x8];
-extern u8* VRAMPtr_BOBJ[0x8];
-
-extern int FrontBuffer;
-extern u32* Framebuffer[2][2];
-
-extern GPU2D* GPU2D_A;
-extern GPU2D* GPU2D_B;
+extern EMUSTATE u16 VCount;
+extern EMUSTATE u16 TotalScanlines;
+
+extern EMUSTATE u16 DispStat[2];
+
+extern EMUSTATE u8 VRAMCNT[9];
+extern EMUSTATE u8 VRAMSTAT;
+
+extern EMUSTATE u8 Palette[2*1024];
+extern EMUSTATE u8 OAM[2*1024];
+
+extern EMUSTATE u8* VRAM_A;
+extern EMUSTATE u8* VRAM_B;
+extern EMUSTATE u8* VRAM_C;
+extern EMUSTATE u8* VRAM_D;
+extern EMUSTATE u8* VRAM_E;
+extern EMUSTATE u8* VRAM_F;
+extern EMUSTATE u8* VRAM_G;
+extern EMUSTATE u8* VRAM_H;
+extern EMUSTATE u8* VRAM_I;
+
+extern EMUSTATE u8* VRAM[9];
+
+extern EMUSTATE u32 VRAMMap_LCDC;
+extern EMUSTATE u32 VRAMMap_ABG[0x20];
+extern EMUSTATE u32 VRAMMap_AOBJ[0x10];
+extern EMUSTATE u32 VRAMMap_BBG[0x8];
+extern EMUSTATE u32 VRAMMap_BOBJ[0x8];
+extern EMUSTATE u32 VRAMMap_ABGExtPal[4];
+extern EMUSTATE u32 VRAMMap_AOBJExtPal;
+extern EMUSTATE u32 VRAMMap_BBGExtPal[4];
+extern EMUSTATE u32 VRAMMap_BOBJExtPal;
+extern EMUSTATE u32 VRAMMap_Texture[4];
+extern EMUSTATE u32 VRAMMap_TexPal[8];
+extern EMUSTATE u32 VRAMTexVersion;
+extern EMUSTATE u32 VRAMMap_ARM7[2];
+
+extern EMUSTATE u8* VRAMPtr_ABG[0x20];
+extern EMUSTATE u8* VRAMPtr_AOBJ[0x10];
+extern EMUSTATE u8* VRAMPtr_BBG[0x8];
+extern EMUSTATE u8* VRAMPtr_BOBJ[0x8];
+
+extern EMUSTATE int FrontBuffer;
+extern EMUSTATE u32* Framebuffer[2][2];
+
+extern EMUSTATE GPU2D* GPU2D_A;
+extern EMUSTATE GPU2D* GPU2D_B;
 
 
 bool Init();
@@ -20,6 +20,7 @@
 #include <string.h>
 #include "NDS.h"
 #include "GPU.h"
+#include "Profiler.h"
 
 
 // notes on color conversion
@@ -751,6 +752,8 @@ void GPU2D::UpdateMosaicCounters(u32 line)
 
 void GPU2D::DrawScanline(u32 line)
 {
+    PROFILE_SCOPE(Prof_GPU2DDrawScanline);
+
     int stride = Accelerated ? (256*3 + 1) : 256;
     u32* dst = &Framebuffer[stride * line];
 
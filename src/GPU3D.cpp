@@ -19,10 +19,19 @@
 #include <stdio.h>
 #include <string.h>
 #include <algorithm>
+#include <atomic>
+#include <vector>
 #include "NDS.h"
 #include "GPU.h"
 #include "FIFO.h"
 #include "Config.h"
+#include "Platform.h"
+#include "Profiler.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define GPU3D_X86
+#include <immintrin.h>
+#endif
 
 
 // 3D engine notes
@@ -94,6 +103,15 @@
 //   polygon setup time is 27 cycles for a triangle and 36 for a quad
 //   except: only one time slot is taken if the polygon is rejected by culling/clipping
 // * additionally, some commands (BEGIN, LIGHT_VECTOR, BOXTEST) stall the polygon pipeline
+//
+// commands are run in two parts: ProcessCommand() updates the geometry state,
+// CommandTiming() accounts for the time they take. the latter only depends on
+// state it keeps track of itself, and on the results of culling/clipping.
+// with the geometry thread enabled, ProcessCommand() runs on that thread, and
+// polygons are assumed to never be culled or clipped away, as their fate isn't
+// known when their timing is accounted for. the emulation thread only waits for
+// the geometry thread when something it produces is read (test results, matrices,
+// polygon counts...), and at VBlank.
 
 
 namespace GPU3D
@@ -147,137 +165,188 @@ typedef union
 
 } CmdFIFOEntry;
 
-FIFO<CmdFIFOEntry>* CmdFIFO;
-FIFO<CmdFIFOEntry>* CmdPIPE;
+EMUSTATE FIFO<CmdFIFOEntry>* CmdFIFO;
+EMUSTATE FIFO<CmdFIFOEntry>* CmdPIPE;
 
-FIFO<CmdFIFOEntry>* CmdStallQueue;
+EMUSTATE FIFO<CmdFIFOEntry>* CmdStallQueue;
 
-u32 NumCommands, CurCommand, ParamCount, TotalParams;
+EMUSTATE u32 NumCommands, CurCommand, ParamCount, TotalParams;
 
-bool GeometryEnabled;
-bool RenderingEnabled;
+EMUSTATE bool GeometryEnabled;
+EMUSTATE bool RenderingEnabled;
 
-int Renderer;
+EMUSTATE int Renderer;
 
-u32 DispCnt;
-u8 AlphaRefVal, AlphaRef;
+EMUSTATE u32 DispCnt;
+EMUSTATE u8 AlphaRefVal, AlphaRef;
 
-u16 ToonTable[32];
-u16 EdgeTable[8];
+EMUSTATE u16 ToonTable[32];
+EMUSTATE u16 EdgeTable[8];
 
-u32 FogColor, FogOffset;
-u8 FogDensityTable[32];
+EMUSTATE u32 FogColor, FogOffset;
+EMUSTATE u8 FogDensityTable[32];
 
-u32 ClearAttr1, ClearAttr2;
+EMUSTATE u32 ClearAttr1, ClearAttr2;
 
-u32 RenderDispCnt;
-u8 RenderAlphaRef;
+EMUSTATE u32 RenderDispCnt;
+EMUSTATE u8 RenderAlphaRef;
 
-u16 RenderToonTable[32];
-u16 RenderEdgeTable[8];
+EMUSTATE u16 RenderToonTable[32];
+EMUSTATE u16 RenderEdgeTable[8];
 
-u32 RenderFogColor, RenderFogOffset, RenderFogShift;
-u8 RenderFogDensityTable[34];
+EMUSTATE u32 RenderFogColor, RenderFogOffset, RenderFogShift;
+EMUSTATE u8 RenderFogDensityTable[34];
 
-u32 RenderClearAttr1, RenderClearAttr2;
+EMUSTATE u32 RenderClearAttr1, RenderClearAttr2;
 
-u32 GXStat;
+EMUSTATE u32 GXStat;
 
-u32 ExecParams[32];
-u32 ExecParamCount;
+EMUSTATE u32 ExecParams[32];
+EMUSTATE u32 ExecParamCount;
 
-u64 Timestamp;
-s32 CycleCount;
-s32 VertexPipeline;
-s32 NormalPipeline;
-s32 PolygonPipeline;
-s32 VertexSlotCounter;
-u32 VertexSlotsFree;
+EMUSTATE u64 Timestamp;
+EMUSTATE s32 CycleCount;
+EMUSTATE s32 VertexPipeline;
+EMUSTATE s32 NormalPipeline;
+EMUSTATE s32 PolygonPipeline;
+EMUSTATE s32 VertexSlotCounter;
+EMUSTATE u32 VertexSlotsFree;
 
-u32 NumPushPopCommands;
-u32 NumTestCommands;
+EMUSTATE u32 NumPushPopCommands;
+EMUSTATE u32 NumTestCommands;
 
 
-u32 MatrixMode;
+EMUSTATE u32 MatrixMode;
 
-s32 ProjMatrix[16];
-s32 PosMatrix[16];
-s32 VecMatrix[16];
-s32 TexMatrix[16];
+EMUSTATE s32 ProjMatrix[16];
+EMUSTATE s32 PosMatrix[16];
+EMUSTATE s32 VecMatrix[16];
+EMUSTATE s32 TexMatrix[16];
 
-s32 ClipMatrix[16];
-bool ClipMatrixDirty;
+EMUSTATE s32 ClipMatrix[16];
+EMUSTATE bool ClipMatrixDirty;
 
-u32 Viewport[6];
+EMUSTATE u32 Viewport[6];
 
-s32 ProjMatrixStack[16];
-s32 PosMatrixStack[32][16];
-s32 VecMatrixStack[32][16];
-s32 TexMatrixStack[16];
-s32 ProjMatrixStackPointer;
-s32 PosMatrixStackPointer;
-s32 TexMatrixStackPointer;
+EMUSTATE s32 ProjMatrixStack[16];
+EMUSTATE s32 PosMatrixStack[32][16];
+EMUSTATE s32 VecMatrixStack[32][16];
+EMUSTATE s32 TexMatrixStack[16];
+EMUSTATE s32 ProjMatrixStackPointer;
+EMUSTATE s32 PosMatrixStackPointer;
+EMUSTATE s32 TexMatrixStackPointer;
 
 void MatrixLoadIdentity(s32* m);
 void UpdateClipMatrix();
 
 
-u32 PolygonMode;
-s16 CurVertex[3];
-u8 VertexColor[3];
-s16 TexCoords[2];
-s16 RawTexCoords[2];
-s16 Normal[3];
-
-s16 LightDirection[4][3];
-u8 LightColor[4][3];
-u8 MatDiffuse[3];
-u8 MatAmbient[3];
-u8 MatSpecular[3];
-u8 MatEmission[3];
-
-bool UseShininessTable;
-u8 ShininessTable[128];
-
-u32 PolygonAttr;
-u32 CurPolygonAttr;
-
-u32 TexParam;
-u32 TexPalette;
-
-s32 PosTestResult[4];
-s16 VecTestResult[3];
-
-Vertex TempVertexBuffer[4];
-u32 VertexNum;
-u32 VertexNumInPoly;
-u32 NumConsecutivePolygons;
-Polygon* LastStripPolygon;
-u32 NumOpaquePolygons;
-
-Vertex VertexRAM[6144 * 2];
-Polygon PolygonRAM[2048 * 2];
-
-Vertex* CurVertexRAM;
-Polygon* CurPolygonRAM;
-u32 NumVertices, NumPolygons;
-u32 CurRAMBank;
-
-std::array<Polygon*,2048> RenderPolygonRAM;
-u32 RenderNumPolygons;
-
-u32 FlushRequest;
-u32 FlushAttributes;
+EMUSTATE u32 PolygonMode;
+EMUSTATE s16 CurVertex[3];
+EMUSTATE u8 VertexColor[3];
+EMUSTATE s16 TexCoords[2];
+EMUSTATE s16 RawTexCoords[2];
+EMUSTATE s16 Normal[3];
+
+EMUSTATE s16 LightDirection[4][3];
+EMUSTATE u8 LightColor[4][3];
+EMUSTATE u8 MatDiffuse[3];
+EMUSTATE u8 MatAmbient[3];
+EMUSTATE u8 MatSpecular[3];
+EMUSTATE u8 MatEmission[3];
+
+EMUSTATE bool UseShininessTable;
+EMUSTATE u8 ShininessTable[128];
+
+EMUSTATE u32 PolygonAttr;
+EMUSTATE u32 CurPolygonAttr;
+
+EMUSTATE u32 TexParam;
+EMUSTATE u32 TexPalette;
+
+EMUSTATE s32 PosTestResult[4];
+EMUSTATE s16 VecTestResult[3];
+
+EMUSTATE Vertex TempVertexBuffer[4];
+EMUSTATE u32 VertexNum;
+EMUSTATE u32 VertexNumInPoly;
+EMUSTATE u32 NumConsecutivePolygons;
+EMUSTATE Polygon* LastStripPolygon;
+EMUSTATE u32 NumOpaquePolygons;
+
+EMUSTATE Vertex* VertexRAM; // 6144 * 2
+EMUSTATE Polygon* PolygonRAM; // 2048 * 2
+
+EMUSTATE Vertex* CurVertexRAM;
+EMUSTATE Polygon* CurPolygonRAM;
+EMUSTATE u32 NumVertices, NumPolygons;
+EMUSTATE u32 CurRAMBank;
+
+EMUSTATE std::array<Polygon*,2048> RenderPolygonRAM;
+EMUSTATE u32 RenderNumPolygons;
+
+// how many times in a row the renderer has been given the same frame
+// everything the renderers use is packed in FrameData, and compared with
+// what was packed for the previous frame
+EMUSTATE u32 RenderFrameRepeats;
+EMUSTATE std::vector<u32> FrameData[2];
+EMUSTATE u32 FrameDataLength[2];
+EMUSTATE int CurFrameData;
+
+EMUSTATE u32 FlushRequest;
+EMUSTATE u32 FlushAttributes;
+
+// results from the geometry side that go to registers, see UpdateGeometryStatus()
+EMUSTATE bool BoxTestResult;
+EMUSTATE bool MatrixStackError;
+EMUSTATE bool PolygonRAMOverflow;
+EMUSTATE s32 SubmittedPolygonVerts;
+
+// copies of the state command timings depend on, kept by CommandTiming()
+EMUSTATE u32 TimingMatrixMode;
+EMUSTATE u32 TimingPolygonAttr;
+EMUSTATE u32 TimingLights;
+EMUSTATE u32 TimingPolygonMode;
+EMUSTATE u32 TimingVertexNumInPoly;
+EMUSTATE u32 TimingNumConsecutivePolygons;
+
+// geometry thread
+// commands are passed through a ring buffer: one word with the command and
+// the number of parameters, followed by the parameters
+
+const u32 kGeometryQueueSize = 0x10000;
+
+EMUSTATE void* GeometryThread;
+EMUSTATE bool GeometryThreadRunning;
+EMUSTATE bool GeometryStatusPending;
+EMUSTATE u32* GeometryQueue;
+EMUSTATE std::atomic<u32> GeometryQueueWrite;
+EMUSTATE std::atomic<u32> GeometryQueueRead;
+EMUSTATE std::atomic<bool> GeometryThreadStop;
+EMUSTATE std::atomic<bool> GeometryThreadSleeping;
+EMUSTATE std::atomic<bool> GeometryIdleWaiting;
+EMUSTATE void* Sema_GeometryWork;
+EMUSTATE void* Sema_GeometryIdle;
+
+void SyncGeometryThread();
+void ResetTimingState();
 
 
 
 bool Init()
 {
+    VertexRAM = new Vertex[6144 * 2]();
+    PolygonRAM = new Polygon[2048 * 2]();
+
     CmdFIFO = new FIFO<CmdFIFOEntry>(256);
     CmdPIPE = new FIFO<CmdFIFOEntry>(4);
 
     CmdStallQueue = new FIFO<CmdFIFOEntry>(64);
 
+    GeometryQueue = new u32[kGeometryQueueSize];
+    Sema_GeometryWork = Platform::Semaphore_Create();
+    Sema_GeometryIdle = Platform::Semaphore_Create();
+    GeometryThreadRunning = false;
+
     Renderer = -1;
     // SetRenderer() will be called to set it up later
 
@@ -286,6 +355,8 @@ bool Init()
 
 void DeInit()
 {
+    StopGeometryThread();
+
     if (Renderer == 0) SoftRenderer::DeInit();
     else               GLRenderer::DeInit();
 
@@ -293,12 +364,21 @@ void DeInit()
     delete CmdPIPE;
 
     delete CmdStallQueue;
+
+    delete[] GeometryQueue;
+    Platform::Semaphore_Free(Sema_GeometryWork);
+    Platform::Semaphore_Free(Sema_GeometryIdle);
+
+    delete[] VertexRAM;
+    delete[] PolygonRAM;
 }
 
 void ResetRenderingState()
 {
     RenderNumPolygons = 0;
 
+    ResetFrameRepeats();
+
     RenderDispCnt = 0;
     RenderAlphaRef = 0;
 
@@ -316,6 +396,8 @@ void ResetRenderingState()
 
 void Reset()
 {
+    SyncGeometryThread();
+
     CmdFIFO->Clear();
     CmdPIPE->Clear();
 
@@ -386,6 +468,11 @@ void Reset()
     FlushRequest = 0;
     FlushAttributes = 0;
 
+    BoxTestResult = false;
+    MatrixStackError = false;
+    PolygonRAMOverflow = false;
+    ResetTimingState();
+
     ResetRenderingState();
     if (Renderer == 0) SoftRenderer::Reset();
     else               GLRenderer::Reset();
@@ -393,6 +480,8 @@ void Reset()
 
 void DoSavestate(Savestate* file)
 {
+    SyncGeometryThread();
+
     file->Section("GP3D");
 
     CmdFIFO->DoSavestate(file);
@@ -602,6 +691,9 @@ void DoSavestate(Savestate* file)
         // better safe than sorry, I guess
         // might cause a blank frame but atleast it won't shit itself
         RenderNumPolygons = 0;
+
+        BoxTestResult = (GXStat & (1<<1)) != 0;
+        ResetTimingState();
     }
 }
 
@@ -629,6 +721,7 @@ int InitRenderer(bool hasGL)
     if (renderer == 0) SoftRenderer::Init();
 
     Renderer = renderer;
+    ResetFrameRepeats();
     UpdateRendererConfig();
     GPU::SetDisplaySettings(Renderer != 0);
     return renderer;
@@ -650,6 +743,8 @@ void UpdateRendererConfig()
     {
         GLRenderer::UpdateDisplaySettings();
     }
+
+    SetupGeometryThread();
 }
 
 
@@ -675,7 +770,101 @@ void MatrixLoad4x3(s32* m, s32* s)
     m[12] = s[9]; m[13] = s[10]; m[14] = s[11]; m[15] = 0x1000;
 }
 
-void MatrixMult4x4(s32* m, s32* s)
+// SIMD versions of the matrix math. they give the exact same results as the
+// scalar code: products and sums are done on 64 bits, and only the low 32
+// bits of the result are kept, so a logical shift can stand in for the
+// arithmetic one.
+
+int SIMDLevel()
+{
+#ifdef GPU3D_X86
+    // checked once, shared by all instances
+    static const int level = __builtin_cpu_supports("avx2") ? SIMD_AVX2 :
+                             __builtin_cpu_supports("sse4.1") ? SIMD_SSE41 : SIMD_None;
+    return level;
+#else
+    return SIMD_None;
+#endif
+}
+
+#ifdef GPU3D_X86
+
+// out = v*mat, v being a 4-component row vector
+__attribute__((target("sse4.1")))
+void VecMult4x4_SSE41(s32* out, const s32* v, const s32* mat)
+{
+    __m128i even = _mm_setzero_si128(); // columns 0 and 2
+    __m128i odd = _mm_setzero_si128();  // columns 1 and 3
+
+    for (int k = 0; k < 4; k++)
+    {
+        __m128i row = _mm_loadu_si128((const __m128i*)&mat[k*4]);
+        __m128i vk = _mm_set1_epi32(v[k]);
+
+        even = _mm_add_epi64(even, _mm_mul_epi32(vk, row));
+        odd = _mm_add_epi64(odd, _mm_mul_epi32(vk, _mm_srli_epi64(row, 32)));
+    }
+
+    even = _mm_srli_epi64(even, 12);
+    odd = _mm_slli_epi64(_mm_srli_epi64(odd, 12), 32);
+    _mm_storeu_si128((__m128i*)out, _mm_blend_epi16(even, odd, 0xCC));
+}
+
+__attribute__((target("sse4.1")))
+void MatrixMult4x4_SSE41(s32* m, s32* s)
+{
+    s32 tmp[16];
+    memcpy(tmp, m, 16*4);
+
+    for (int r = 0; r < 4; r++)
+        VecMult4x4_SSE41(&m[r*4], &s[r*4], tmp);
+}
+
+__attribute__((target("avx2")))
+void MatrixMult4x4_AVX2(s32* m, s32* s)
+{
+    // one row per register, one column per 64-bit lane
+    __m256i rows[4];
+    for (int k = 0; k < 4; k++)
+        rows[k] = _mm256_cvtepi32_epi64(_mm_loadu_si128((const __m128i*)&m[k*4]));
+
+    const __m256i pack = _mm256_setr_epi32(0, 2, 4, 6, 0, 0, 0, 0);
+
+    for (int r = 0; r < 4; r++)
+    {
+        __m256i acc = _mm256_mul_epi32(_mm256_set1_epi64x(s[r*4+0]), rows[0]);
+        acc = _mm256_add_epi64(acc, _mm256_mul_epi32(_mm256_set1_epi64x(s[r*4+1]), rows[1]));
+        acc = _mm256_add_epi64(acc, _mm256_mul_epi32(_mm256_set1_epi64x(s[r*4+2]), rows[2]));
+        acc = _mm256_add_epi64(acc, _mm256_mul_epi32(_mm256_set1_epi64x(s[r*4+3]), rows[3]));
+
+        acc = _mm256_permutevar8x32_epi32(_mm256_srli_epi64(acc, 12), pack);
+        _mm_storeu_si128((__m128i*)&m[r*4], _mm256_castsi256_si128(acc));
+    }
+}
+
+#endif
+
+// out = v*mat, v being a 4-component row vector
+void VecMult4x4_Scalar(s32* out, const s32* v, const s32* mat)
+{
+    for (int c = 0; c < 4; c++)
+        out[c] = ((s64)v[0]*mat[c] + (s64)v[1]*mat[4+c] + (s64)v[2]*mat[8+c] + (s64)v[3]*mat[12+c]) >> 12;
+}
+
+void VecMult4x4(s32* out, const s32* v, const s32* mat)
+{
+#ifdef GPU3D_X86
+    if (SIMDLevel() >= SIMD_SSE41)
+    {
+        VecMult4x4_SSE41(out, v, mat);
+        return;
+    }
+#endif
+
+    VecMult4x4_Scalar(out, v, mat);
+}
+
+void MatrixMult4x4_Scalar(s32* m, s32* s)
 {
     s32 tmp[16];
     memcpy(tmp, m, 16*4);
@@ -702,8 +891,32 @@ void MatrixMult4x4(s32* m, s32* s)
     m[15] = ((s64)s[12]*tmp[3] + (s64)s[13]*tmp[7] + (s64)s[14]*tmp[11] + (s64)s[15]*tmp[15]) >> 12;
 }
 
+void MatrixMult4x4(s32* m, s32* s)
+{
+#ifdef GPU3D_X86
+    switch (SIMDLevel())
+    {
+    case SIMD_AVX2:  MatrixMult4x4_AVX2(m, s); return;
+    case SIMD_SSE41: MatrixMult4x4_SSE41(m, s); return;
+    }
+#endif
+
+    MatrixMult4x4_Scalar(m, s);
+}
+
 void MatrixMult4x3(s32* m, s32* s)
 {
+    if (SIMDLevel() != SIMD_None)
+    {
+        // same as a 4x4 product with the missing column filled in
+        s32 s4[16] = {s[0], s[1],  s[2],  0,
+                      s[3], s[4],  s[5],  0,
+                      s[6], s[7],  s[8],  0,
+                      s[9], s[10], s[11], 0x1000};
+        MatrixMult4x4(m, s4);
+        return;
+    }
+
     s32 tmp[16];
     memcpy(tmp, m, 16*4);
 
@@ -731,6 +944,17 @@ void MatrixMult4x3(s32* m, s32* s)
 
 void MatrixMult3x3(s32* m, s32* s)
 {
+    if (SIMDLevel() != SIMD_None)
+    {
+        // the identity bottom row leaves the translation as it is
+        s32 s4[16] = {s[0], s[1], s[2], 0,
+                      s[3], s[4], s[5], 0,
+                      s[6], s[7], s[8], 0,
+                      0,    0,    0,    0x1000};
+        MatrixMult4x4(m, s4);
+        return;
+    }
+
     s32 tmp[12];
     memcpy(tmp, m, 12*4);
 
@@ -771,6 +995,15 @@ void MatrixScale(s32* m, s32* s)
 
 void MatrixTranslate(s32* m, s32* s)
 {
+    if (SIMDLevel() != SIMD_None)
+    {
+        s32 v[4] = {s[0], s[1], s[2], 0};
+        s32 t[4];
+        VecMult4x4(t, v, m);
+        m[12] += t[0]; m[13] += t[1]; m[14] += t[2]; m[15] += t[3];
+        return;
+    }
+
     m[12] += ((s64)s[0]*m[0] + (s64)s[1]*m[4] + (s64)s[2]*m[8]) >> 12;
     m[13] += ((s64)s[0]*m[1] + (s64)s[1]*m[5] + (s64)s[2]*m[9]) >> 12;
     m[14] += ((s64)s[0]*m[2] + (s64)s[1]*m[6] + (s64)s[2]*m[10]) >> 12;
@@ -997,6 +1230,57 @@ int ClipAgainstPlane(Vertex* vertices, int nverts, int clipstart)
     return c;
 }
 
+// outcodes: bit N set if component N (X/Y/Z) is beyond +W, bit N+3 if it is beyond -W
+u32 ClipOutcode(Vertex* vtx)
+{
+    s32 w = vtx->Position[3];
+    u32 code = 0;
+
+    for (int i = 0; i < 3; i++)
+    {
+        if (vtx->Position[i] > w) code |= (1 << i);
+        if (vtx->Position[i] < -w) code |= (8 << i);
+    }
+
+    return code;
+}
+
+// outcodes of vertices start to nverts-1, ORed and ANDed together
+void ClipOutcodes_Scalar(Vertex* vertices, int start, int nverts, u32* codeor, u32* codeand)
+{
+    *codeor = 0; *codeand = 0x3F;
+    for (int i = start; i < nverts; i++)
+    {
+        u32 code = ClipOutcode(&vertices[i]);
+        *codeor |= code;
+        *codeand &= code;
+    }
+}
+
+#ifdef GPU3D_X86
+__attribute__((target("sse4.1")))
+void ClipOutcodes_SSE41(Vertex* vertices, int start, int nverts, u32* codeor, u32* codeand)
+{
+    __m128i gtor = _mm_setzero_si128(), ltor = _mm_setzero_si128();
+    __m128i gtand = _mm_set1_epi32(-1), ltand = _mm_set1_epi32(-1);
+
+    for (int i = start; i < nverts; i++)
+    {
+        __m128i pos = _mm_loadu_si128((const __m128i*)vertices[i].Position);
+        __m128i w = _mm_shuffle_epi32(pos, 0xFF);
+
+        __m128i gt = _mm_cmpgt_epi32(pos, w);
+        __m128i lt = _mm_cmplt_epi32(pos, _mm_sub_epi32(_mm_setzero_si128(), w));
+
+        gtor = _mm_or_si128(gtor, gt); gtand = _mm_and_si128(gtand, gt);
+        ltor = _mm_or_si128(ltor, lt); ltand = _mm_and_si128(ltand, lt);
+    }
+
+    *codeor = (_mm_movemask_ps(_mm_castsi128_ps(gtor)) & 0x7) | ((_mm_movemask_ps(_mm_castsi128_ps(ltor)) & 0x7) << 3);
+    *codeand = (_mm_movemask_ps(_mm_castsi128_ps(gtand)) & 0x7) | ((_mm_movemask_ps(_mm_castsi128_ps(ltand)) & 0x7) << 3);
+}
+#endif
+
 template<bool attribs>
 int ClipPolygon(Vertex* vertices, int nverts, int clipstart)
 {
@@ -1010,14 +1294,68 @@ int ClipPolygon(Vertex* vertices, int nverts, int clipstart)
     // some vertices that should get Y=-0x1000 get Y=0x1000 for some reason on hardware. it doesn't make sense.
     // clipping seems to process the Y plane before the X plane.
 
+    // fast path: most polygons don't cross any plane, or are entirely outside one.
+    // going by the outcodes, the leading planes that don't need clipping are skipped.
+    // this only works while the vertices are still the original ones, so everything
+    // from the first plane that is actually crossed goes through the full clipper.
+    // the reused strip vertices (below clipstart) are known to be inside.
+
+    u32 codeor, codeand;
+#ifdef GPU3D_X86
+    if (SIMDLevel() >= SIMD_SSE41)
+        ClipOutcodes_SSE41(vertices, clipstart, nverts, &codeor, &codeand);
+    else
+#endif
+        ClipOutcodes_Scalar(vertices, clipstart, nverts, &codeor, &codeand);
+
+    // polygons crossing the far plane are rejected unless told otherwise
+    // (strip polygons are left to the full clipper, which keeps the reused vertices)
+    if (clipstart == 0 && (codeor & (1<<2)) && (!(CurPolygonAttr & (1<<12))))
+        return 0;
+
+    int comp;
+    for (comp = 2; comp >= 0; comp--)
+    {
+        u32 planemask = (1 << comp) | (8 << comp);
+        if (!(codeor & planemask))
+            continue;
+
+        // all the vertices are outside on the same side
+        // (with negative W, a vertex can be past both sides: the +W side is
+        // clipped first, so the -W side only counts if that didn't happen)
+        if (clipstart == 0)
+        {
+            if (codeand & (1 << comp))
+                return 0;
+            if ((codeand & (8 << comp)) && !(codeor & (1 << comp)))
+                return 0;
+        }
+
+        break;
+    }
+
+    if (comp < 2)
+    {
+        // skipped planes: only the color adjustment from ClipAgainstPlane() applies,
+        // and it has to be done before any interpolation
+        for (int i = 0; i < nverts; i++)
+        {
+            Vertex* vtx = &vertices[i];
+
+            vtx->Color[0] &= ~0xFFF; vtx->Color[0] += 0xFFF;
+            vtx->Color[1] &= ~0xFFF; vtx->Color[1] += 0xFFF;
+            vtx->Color[2] &= ~0xFFF; vtx->Color[2] += 0xFFF;
+        }
+    }
+
     // Z clipping
-    nverts = ClipAgainstPlane<2, attribs>(vertices, nverts, clipstart);
+    if (comp >= 2) nverts = ClipAgainstPlane<2, attribs>(vertices, nverts, clipstart);
 
     // Y clipping
-    nverts = ClipAgainstPlane<1, attribs>(vertices, nverts, clipstart);
+    if (comp >= 1) nverts = ClipAgainstPlane<1, attribs>(vertices, nverts, clipstart);
 
     // X clipping
-    nverts = ClipAgainstPlane<0, attribs>(vertices, nverts, clipstart);
+    if (comp >= 0) nverts = ClipAgainstPlane<0, attribs>(vertices, nverts, clipstart);
 
     return nverts;
 }
@@ -1040,12 +1378,8 @@ void SubmitPolygon()
     int nverts = PolygonMode & 0x1 ? 4:3;
     int prev, next;
 
-    // submitting a polygon starts the polygon pipeline
-    // noting that for now we are only reserving one vertex slot
-    // further slots only get reserved if the polygon makes it through culling/clipping
-    PolygonPipeline = 8;
-    VertexSlotCounter = 1;
-    VertexSlotsFree = 0b11110;
+    // for the polygon pipeline timings, see VertexTiming()
+    SubmittedPolygonVerts = 0;
 
     // culling
     // TODO: work out how it works on the real thing
@@ -1172,25 +1506,12 @@ void SubmitPolygon()
 
     // build the actual polygon
 
-    if (nverts == 4)
-    {
-        PolygonPipeline = 35;
-        VertexSlotCounter = 1;
-        if (PolygonMode & 0x2) VertexSlotsFree = 0b11100;
-        else                   VertexSlotsFree = 0b11110;
-    }
-    else
-    {
-        PolygonPipeline = 26;
-        VertexSlotCounter = 1;
-        if (PolygonMode & 0x2) VertexSlotsFree = 0b1000;
-        else                   VertexSlotsFree = 0b1110;
-    }
+    SubmittedPolygonVerts = nverts;
 
     if (NumPolygons >= 2048 || NumVertices+nverts > 6144)
     {
         LastStripPolygon = NULL;
-        DispCnt |= (1<<13);
+        PolygonRAMOverflow = true;
         return;
     }
 
@@ -1380,11 +1701,11 @@ void SubmitVertex()
     s64 vertex[4] = {(s64)CurVertex[0], (s64)CurVertex[1], (s64)CurVertex[2], 0x1000};
     Vertex* vertextrans = &TempVertexBuffer[VertexNumInPoly];
 
+    SubmittedPolygonVerts = -1;
+
     UpdateClipMatrix();
-    vertextrans->Position[0] = (vertex[0]*ClipMatrix[0] + vertex[1]*ClipMatrix[4] + vertex[2]*ClipMatrix[8] + vertex[3]*ClipMatrix[12]) >> 12;
-    vertextrans->Position[1] = (vertex[0]*ClipMatrix[1] + vertex[1]*ClipMatrix[5] + vertex[2]*ClipMatrix[9] + vertex[3]*ClipMatrix[13]) >> 12;
-    vertextrans->Position[2] = (vertex[0]*ClipMatrix[2] + vertex[1]*ClipMatrix[6] + vertex[2]*ClipMatrix[10] + vertex[3]*ClipMatrix[14]) >> 12;
-    vertextrans->Position[3] = (vertex[0]*ClipMatrix[3] + vertex[1]*ClipMatrix[7] + vertex[2]*ClipMatrix[11] + vertex[3]*ClipMatrix[15]) >> 12;
+    s32 pos[4] = {CurVertex[0], CurVertex[1], CurVertex[2], 0x1000};
+    VecMult4x4(vertextrans->Position, pos, ClipMatrix);
 
     // this probably shouldn't be.
     // the way color is handled during clipping needs investigation. TODO
@@ -1468,10 +1789,84 @@ void SubmitVertex()
         }
         break;
     }
+}
 
-    VertexPipeline = 7;
-    AddCycles(3);
+// diffuse and shininess levels for all 4 lights, before the shininess table
+void LightLevels_Scalar(const s16* normal, const s32* vecmatrix, const s16 (*lightdir)[3],
+                        s32* difflevels, s32* shinelevels)
+{
+    s32 normaltrans[3];
+    normaltrans[0] = (normal[0]*vecmatrix[0] + normal[1]*vecmatrix[4] + normal[2]*vecmatrix[8]) >> 12;
+    normaltrans[1] = (normal[0]*vecmatrix[1] + normal[1]*vecmatrix[5] + normal[2]*vecmatrix[9]) >> 12;
+    normaltrans[2] = (normal[0]*vecmatrix[2] + normal[1]*vecmatrix[6] + normal[2]*vecmatrix[10]) >> 12;
+
+    // overflow handling (for example, if the normal length is >1)
+    // according to some hardware tests
+    // * diffuse level is saturated to 255
+    // * shininess level mirrors back to 0 and is ANDed with 0xFF, that before being squared
+    // TODO: check how it behaves when the computed shininess is >=0x200
+
+    for (int i = 0; i < 4; i++)
+    {
+        s32 difflevel = (-(lightdir[i][0]*normaltrans[0] +
+                         lightdir[i][1]*normaltrans[1] +
+                         lightdir[i][2]*normaltrans[2])) >> 10;
+        if (difflevel < 0) difflevel = 0;
+        else if (difflevel > 255) difflevel = 255;
+
+        s32 shinelevel = -(((lightdir[i][0]>>1)*normaltrans[0] +
+                          (lightdir[i][1]>>1)*normaltrans[1] +
+                          ((lightdir[i][2]-0x200)>>1)*normaltrans[2]) >> 10);
+        if (shinelevel < 0) shinelevel = 0;
+        else if (shinelevel > 255) shinelevel = (0x100 - shinelevel) & 0xFF;
+        shinelevel = ((shinelevel * shinelevel) >> 7) - 0x100; // really (2*shinelevel*shinelevel)-1
+        if (shinelevel < 0) shinelevel = 0;
+
+        difflevels[i] = difflevel;
+        shinelevels[i] = shinelevel;
+    }
+}
+
+#ifdef GPU3D_X86
+// all 4 lights at once, one per lane
+__attribute__((target("sse4.1")))
+void LightLevels_SSE41(const s16* normal, const s32* vecmatrix, const s16 (*lightdir)[3],
+                       s32* difflevels, s32* shinelevels)
+{
+    __m128i n = _mm_mullo_epi32(_mm_set1_epi32(normal[0]), _mm_loadu_si128((const __m128i*)&vecmatrix[0]));
+    n = _mm_add_epi32(n, _mm_mullo_epi32(_mm_set1_epi32(normal[1]), _mm_loadu_si128((const __m128i*)&vecmatrix[4])));
+    n = _mm_add_epi32(n, _mm_mullo_epi32(_mm_set1_epi32(normal[2]), _mm_loadu_si128((const __m128i*)&vecmatrix[8])));
+    n = _mm_srai_epi32(n, 12);
+
+    __m128i n0 = _mm_shuffle_epi32(n, 0x00);
+    __m128i n1 = _mm_shuffle_epi32(n, 0x55);
+    __m128i n2 = _mm_shuffle_epi32(n, 0xAA);
+
+    __m128i lx = _mm_setr_epi32(lightdir[0][0], lightdir[1][0], lightdir[2][0], lightdir[3][0]);
+    __m128i ly = _mm_setr_epi32(lightdir[0][1], lightdir[1][1], lightdir[2][1], lightdir[3][1]);
+    __m128i lz = _mm_setr_epi32(lightdir[0][2], lightdir[1][2], lightdir[2][2], lightdir[3][2]);
+
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i max = _mm_set1_epi32(255);
+
+    __m128i dot = _mm_add_epi32(_mm_add_epi32(_mm_mullo_epi32(lx, n0), _mm_mullo_epi32(ly, n1)), _mm_mullo_epi32(lz, n2));
+    __m128i diff = _mm_srai_epi32(_mm_sub_epi32(zero, dot), 10);
+    diff = _mm_min_epi32(_mm_max_epi32(diff, zero), max);
+    _mm_storeu_si128((__m128i*)difflevels, diff);
+
+    lz = _mm_sub_epi32(lz, _mm_set1_epi32(0x200));
+    dot = _mm_add_epi32(_mm_add_epi32(_mm_mullo_epi32(_mm_srai_epi32(lx, 1), n0),
+                                      _mm_mullo_epi32(_mm_srai_epi32(ly, 1), n1)),
+                        _mm_mullo_epi32(_mm_srai_epi32(lz, 1), n2));
+    __m128i shine = _mm_sub_epi32(zero, _mm_srai_epi32(dot, 10));
+    shine = _mm_max_epi32(shine, zero);
+    __m128i mirror = _mm_and_si128(_mm_sub_epi32(_mm_set1_epi32(0x100), shine), max);
+    shine = _mm_blendv_epi8(shine, mirror, _mm_cmpgt_epi32(shine, max));
+    shine = _mm_sub_epi32(_mm_srai_epi32(_mm_mullo_epi32(shine, shine), 7), _mm_set1_epi32(0x100));
+    shine = _mm_max_epi32(shine, zero);
+    _mm_storeu_si128((__m128i*)shinelevels, shine);
 }
+#endif
 
 void CalculateLighting()
 {
@@ -1481,40 +1876,25 @@ void CalculateLighting()
         TexCoords[1] = RawTexCoords[1] + (((s64)Normal[0]*TexMatrix[1] + (s64)Normal[1]*TexMatrix[5] + (s64)Normal[2]*TexMatrix[9]) >> 21);
     }
 
-    s32 normaltrans[3];
-    normaltrans[0] = (Normal[0]*VecMatrix[0] + Normal[1]*VecMatrix[4] + Normal[2]*VecMatrix[8]) >> 12;
-    normaltrans[1] = (Normal[0]*VecMatrix[1] + Normal[1]*VecMatrix[5] + Normal[2]*VecMatrix[9]) >> 12;
-    normaltrans[2] = (Normal[0]*VecMatrix[2] + Normal[1]*VecMatrix[6] + Normal[2]*VecMatrix[10]) >> 12;
-
     VertexColor[0] = MatEmission[0];
     VertexColor[1] = MatEmission[1];
     VertexColor[2] = MatEmission[2];
 
-    s32 c = 0;
+    s32 difflevels[4], shinelevels[4];
+#ifdef GPU3D_X86
+    if (SIMDLevel() >= SIMD_SSE41)
+        LightLevels_SSE41(Normal, VecMatrix, LightDirection, difflevels, shinelevels);
+    else
+#endif
+        LightLevels_Scalar(Normal, VecMatrix, LightDirection, difflevels, shinelevels);
+
     for (int i = 0; i < 4; i++)
     {
         if (!(CurPolygonAttr & (1<<i)))
             continue;
 
-        // overflow handling (for example, if the normal length is >1)
-        // according to some hardware tests
-        // * diffuse level is saturated to 255
-        // * shininess level mirrors back to 0 and is ANDed with 0xFF, that before being squared
-        // TODO: check how it behaves when the computed shininess is >=0x200
-
-        s32 difflevel = (-(LightDirection[i][0]*normaltrans[0] +
-                         LightDirection[i][1]*normaltrans[1] +
-                         LightDirection[i][2]*normaltrans[2])) >> 10;
-        if (difflevel < 0) difflevel = 0;
-        else if (difflevel > 255) difflevel = 255;
-
-        s32 shinelevel = -(((LightDirection[i][0]>>1)*normaltrans[0] +
-                          (LightDirection[i][1]>>1)*normaltrans[1] +
-                          ((LightDirection[i][2]-0x200)>>1)*normaltrans[2]) >> 10);
-        if (shinelevel < 0) shinelevel = 0;
-        else if (shinelevel > 255) shinelevel = (0x100 - shinelevel) & 0xFF;
-        shinelevel = ((shinelevel * shinelevel) >> 7) - 0x100; // really (2*shinelevel*shinelevel)-1
-        if (shinelevel < 0) shinelevel = 0;
+        s32 difflevel = difflevels[i];
+        s32 shinelevel = shinelevels[i];
 
         if (UseShininessTable)
         {
@@ -1538,13 +1918,7 @@ void CalculateLighting()
         if (VertexColor[0] > 31) VertexColor[0] = 31;
         if (VertexColor[1] > 31) VertexColor[1] = 31;
         if (VertexColor[2] > 31) VertexColor[2] = 31;
-
-        c++;
     }
-
-    if (c < 1) c = 1;
-    NormalPipeline = 7;
-    AddCycles(c);
 }
 
 
@@ -1554,8 +1928,7 @@ void BoxTest(u32* params)
     Vertex face[10];
     int res;
 
-    AddCycles(254);
-    GXStat &= ~(1<<1);
+    BoxTestResult = false;
 
     s16 x0 = (s16)(params[0] & 0xFFFF);
     s16 y0 = ((s32)params[0]) >> 16;
@@ -1580,14 +1953,8 @@ void BoxTest(u32* params)
     UpdateClipMatrix();
     for (int i = 0; i < 8; i++)
     {
-        s32 x = cube[i].Position[0];
-        s32 y = cube[i].Position[1];
-        s32 z = cube[i].Position[2];
-
-        cube[i].Position[0] = ((s64)x*ClipMatrix[0] + (s64)y*ClipMatrix[4] + (s64)z*ClipMatrix[8] + (s64)0x1000*ClipMatrix[12]) >> 12;
-        cube[i].Position[1] = ((s64)x*ClipMatrix[1] + (s64)y*ClipMatrix[5] + (s64)z*ClipMatrix[9] + (s64)0x1000*ClipMatrix[13]) >> 12;
-        cube[i].Position[2] = ((s64)x*ClipMatrix[2] + (s64)y*ClipMatrix[6] + (s64)z*ClipMatrix[10] + (s64)0x1000*ClipMatrix[14]) >> 12;
-        cube[i].Position[3] = ((s64)x*ClipMatrix[3] + (s64)y*ClipMatrix[7] + (s64)z*ClipMatrix[11] + (s64)0x1000*ClipMatrix[15]) >> 12;
+        s32 pos[4] = {cube[i].Position[0], cube[i].Position[1], cube[i].Position[2], 0x1000};
+        VecMult4x4(cube[i].Position, pos, ClipMatrix);
     }
 
     // front face (-Z)
@@ -1595,7 +1962,7 @@ void BoxTest(u32* params)
     res = ClipPolygon<false>(face, 4, 0);
     if (res > 0)
     {
-        GXStat |= (1<<1);
+        BoxTestResult = true;
         return;
     }
 
@@ -1604,7 +1971,7 @@ void BoxTest(u32* params)
     res = ClipPolygon<false>(face, 4, 0);
     if (res > 0)
     {
-        GXStat |= (1<<1);
+        BoxTestResult = true;
         return;
     }
 
@@ -1613,7 +1980,7 @@ void BoxTest(u32* params)
     res = ClipPolygon<false>(face, 4, 0);
     if (res > 0)
     {
-        GXStat |= (1<<1);
+        BoxTestResult = true;
         return;
     }
 
@@ -1622,7 +1989,7 @@ void BoxTest(u32* params)
     res = ClipPolygon<false>(face, 4, 0);
     if (res > 0)
     {
-        GXStat |= (1<<1);
+        BoxTestResult = true;
         return;
     }
 
@@ -1631,7 +1998,7 @@ void BoxTest(u32* params)
     res = ClipPolygon<false>(face, 4, 0);
     if (res > 0)
     {
-        GXStat |= (1<<1);
+        BoxTestResult = true;
         return;
     }
 
@@ -1640,22 +2007,17 @@ void BoxTest(u32* params)
     res = ClipPolygon<false>(face, 4, 0);
     if (res > 0)
     {
-        GXStat |= (1<<1);
+        BoxTestResult = true;
         return;
     }
 }
 
 void PosTest()
 {
-    s64 vertex[4] = {(s64)CurVertex[0], (s64)CurVertex[1], (s64)CurVertex[2], 0x1000};
+    s32 vertex[4] = {CurVertex[0], CurVertex[1], CurVertex[2], 0x1000};
 
     UpdateClipMatrix();
-    PosTestResult[0] = (vertex[0]*ClipMatrix[0] + vertex[1]*ClipMatrix[4] + vertex[2]*ClipMatrix[8] + vertex[3]*ClipMatrix[12]) >> 12;
-    PosTestResult[1] = (vertex[0]*ClipMatrix[1] + vertex[1]*ClipMatrix[5] + vertex[2]*ClipMatrix[9] + vertex[3]*ClipMatrix[13]) >> 12;
-    PosTestResult[2] = (vertex[0]*ClipMatrix[2] + vertex[1]*ClipMatrix[6] + vertex[2]*ClipMatrix[10] + vertex[3]*ClipMatrix[14]) >> 12;
-    PosTestResult[3] = (vertex[0]*ClipMatrix[3] + vertex[1]*ClipMatrix[7] + vertex[2]*ClipMatrix[11] + vertex[3]*ClipMatrix[15]) >> 12;
-
-    AddCycles(5);
+    VecMult4x4(PosTestResult, vertex, ClipMatrix);
 }
 
 void VecTest(u32* params)
@@ -1675,8 +2037,6 @@ void VecTest(u32* params)
     if (VecTestResult[0] & 0x1000) VecTestResult[0] |= 0xF000;
     if (VecTestResult[1] & 0x1000) VecTestResult[1] |= 0xF000;
     if (VecTestResult[2] & 0x1000) VecTestResult[2] |= 0xF000;
-
-    AddCycles(4);
 }
 
 
@@ -1752,594 +2112,913 @@ CmdFIFOEntry CmdFIFORead()
 
 
 
-void ExecuteCommand()
+void ProcessCommand(u8 cmd, u32* params)
 {
-    CmdFIFOEntry entry = CmdFIFORead();
-
-    //printf("FIFO: processing %02X %08X. Levels: FIFO=%d, PIPE=%d\n", entry.Command, entry.Param, CmdFIFO->Level(), CmdPIPE->Level());
+    // this only updates the geometry state, timings are handled by CommandTiming()
+    // this may run on the geometry thread, so it mustn't touch anything else
 
-    // each FIFO entry takes 1 cycle to be processed
-    // commands (presumably) run when all the needed parameters have been read
-    // which is where we add the remaining cycles if any
-    if (ExecParamCount == 0)
+    switch (cmd)
     {
-        // delay the first command entry as needed
-        switch (entry.Command)
-        {
-        // commands that stall the polygon pipeline
-        case 0x32: StallPolygonPipeline(8 + 1,  2); break; // 32 can run 6 cycles after a vertex
-        case 0x40: StallPolygonPipeline(1,      0); break;
-        case 0x70: StallPolygonPipeline(10 + 1, 0); break;
-
-        case 0x23:
-        case 0x24:
-        case 0x25:
-        case 0x26:
-        case 0x27:
-        case 0x28:
-            // vertex
-            if (!(VertexSlotsFree & 0x1)) NextVertexSlot();
-            else                          AddCycles(1);
-            NormalPipeline = 0;
-            break;
+    case 0x10: // matrix mode
+        MatrixMode = params[0] & 0x3;
+        break;
 
-        case 0x20:
-        case 0x30:
-        case 0x31:
-        case 0x72:
-            // commands that can run 6 cycles after a vertex
-            if (VertexPipeline > 2) AddCycles((VertexPipeline - 2) + 1);
-            else                    AddCycles(NormalPipeline + 1);
-            NormalPipeline = 0;
-            break;
+    case 0x11: // push matrix
+        if (MatrixMode == 0)
+        {
+            if (ProjMatrixStackPointer > 0) MatrixStackError = true;
 
-        case 0x29:
-        case 0x2A:
-        case 0x2B:
-        case 0x33:
-        case 0x34:
-        case 0x41:
-        case 0x60:
-        case 0x71:
-            // command that can run 8 cycles after a vertex
-            if (VertexPipeline > 0) AddCycles(VertexPipeline + 1);
-            else                    AddCycles(NormalPipeline + 1);
-            NormalPipeline = 0;
-            break;
+            memcpy(ProjMatrixStack, ProjMatrix, 16*4);
+            ProjMatrixStackPointer++;
+            ProjMatrixStackPointer &= 0x1;
+        }
+        else if (MatrixMode == 3)
+        {
+            if (TexMatrixStackPointer > 0) MatrixStackError = true;
 
-        default:
-            // all other commands can run 4 cycles after a vertex
-            // no need to do much here since that is the minimum
-            AddCycles(NormalPipeline + 1);
-            NormalPipeline = 0;
-            break;
+            memcpy(TexMatrixStack, TexMatrix, 16*4);
+            TexMatrixStackPointer++;
+            TexMatrixStackPointer &= 0x1;
         }
-    }
-    else
-        AddCycles(1);
+        else
+        {
+            if (PosMatrixStackPointer > 30) MatrixStackError = true;
 
-    ExecParams[ExecParamCount] = entry.Param;
-    ExecParamCount++;
+            memcpy(PosMatrixStack[PosMatrixStackPointer & 0x1F], PosMatrix, 16*4);
+            memcpy(VecMatrixStack[PosMatrixStackPointer & 0x1F], VecMatrix, 16*4);
+            PosMatrixStackPointer++;
+            PosMatrixStackPointer &= 0x3F;
+        }
+        break;
 
-    if (ExecParamCount >= CmdNumParams[entry.Command])
-    {
-        /*printf("[GXS:%08X] 0x%02X,  ", GXStat, entry.Command);
-        for (int k = 0; k < ExecParamCount; k++) printf("0x%08X, ", ExecParams[k]);
-        printf("\n");*/
+    case 0x12: // pop matrix
+        if (MatrixMode == 0)
+        {
+            if (ProjMatrixStackPointer == 0) MatrixStackError = true;
 
-        ExecParamCount = 0;
+            ProjMatrixStackPointer--;
+            ProjMatrixStackPointer &= 0x1;
+            memcpy(ProjMatrix, ProjMatrixStack, 16*4);
+            ClipMatrixDirty = true;
+        }
+        else if (MatrixMode == 3)
+        {
+            if (TexMatrixStackPointer == 0) MatrixStackError = true;
 
-        switch (entry.Command)
+            TexMatrixStackPointer--;
+            TexMatrixStackPointer &= 0x1;
+            memcpy(TexMatrix, TexMatrixStack, 16*4);
+        }
+        else
         {
-        case 0x10: // matrix mode
-            MatrixMode = ExecParams[0] & 0x3;
-            break;
+            s32 offset = (s32)(params[0] << 26) >> 26;
+            PosMatrixStackPointer -= offset;
+            PosMatrixStackPointer &= 0x3F;
 
-        case 0x11: // push matrix
-            NumPushPopCommands--;
-            if (MatrixMode == 0)
-            {
-                if (ProjMatrixStackPointer > 0) GXStat |= (1<<15);
+            if (PosMatrixStackPointer > 30) MatrixStackError = true;
 
-                memcpy(ProjMatrixStack, ProjMatrix, 16*4);
-                ProjMatrixStackPointer++;
-                ProjMatrixStackPointer &= 0x1;
-            }
-            else if (MatrixMode == 3)
-            {
-                if (TexMatrixStackPointer > 0) GXStat |= (1<<15);
+            memcpy(PosMatrix, PosMatrixStack[PosMatrixStackPointer & 0x1F], 16*4);
+            memcpy(VecMatrix, VecMatrixStack[PosMatrixStackPointer & 0x1F], 16*4);
+            ClipMatrixDirty = true;
+        }
+        break;
 
-                memcpy(TexMatrixStack, TexMatrix, 16*4);
-                TexMatrixStackPointer++;
-                TexMatrixStackPointer &= 0x1;
-            }
-            else
-            {
-                if (PosMatrixStackPointer > 30) GXStat |= (1<<15);
+    case 0x13: // store matrix
+        if (MatrixMode == 0)
+        {
+            memcpy(ProjMatrixStack, ProjMatrix, 16*4);
+        }
+        else if (MatrixMode == 3)
+        {
+            memcpy(TexMatrixStack, TexMatrix, 16*4);
+        }
+        else
+        {
+            u32 addr = params[0] & 0x1F;
+            if (addr > 30) MatrixStackError = true;
 
-                memcpy(PosMatrixStack[PosMatrixStackPointer & 0x1F], PosMatrix, 16*4);
-                memcpy(VecMatrixStack[PosMatrixStackPointer & 0x1F], VecMatrix, 16*4);
-                PosMatrixStackPointer++;
-                PosMatrixStackPointer &= 0x3F;
-            }
-            AddCycles(16);
-            break;
+            memcpy(PosMatrixStack[addr], PosMatrix, 16*4);
+            memcpy(VecMatrixStack[addr], VecMatrix, 16*4);
+        }
+        break;
 
-        case 0x12: // pop matrix
-            NumPushPopCommands--;
-            if (MatrixMode == 0)
-            {
-                if (ProjMatrixStackPointer == 0) GXStat |= (1<<15);
+    case 0x14: // restore matrix
+        if (MatrixMode == 0)
+        {
+            memcpy(ProjMatrix, ProjMatrixStack, 16*4);
+            ClipMatrixDirty = true;
+        }
+        else if (MatrixMode == 3)
+        {
+            memcpy(TexMatrix, TexMatrixStack, 16*4);
+        }
+        else
+        {
+            u32 addr = params[0] & 0x1F;
+            if (addr > 30) MatrixStackError = true;
 
-                ProjMatrixStackPointer--;
-                ProjMatrixStackPointer &= 0x1;
-                memcpy(ProjMatrix, ProjMatrixStack, 16*4);
-                ClipMatrixDirty = true;
-                AddCycles(35);
-            }
-            else if (MatrixMode == 3)
-            {
-                if (TexMatrixStackPointer == 0) GXStat |= (1<<15);
+            memcpy(PosMatrix, PosMatrixStack[addr], 16*4);
+            memcpy(VecMatrix, VecMatrixStack[addr], 16*4);
+            ClipMatrixDirty = true;
+        }
+        break;
 
-                TexMatrixStackPointer--;
-                TexMatrixStackPointer &= 0x1;
-                memcpy(TexMatrix, TexMatrixStack, 16*4);
-                AddCycles(17);
-            }
-            else
-            {
-                s32 offset = (s32)(ExecParams[0] << 26) >> 26;
-                PosMatrixStackPointer -= offset;
-                PosMatrixStackPointer &= 0x3F;
+    case 0x15: // identity
+        if (MatrixMode == 0)
+        {
+            MatrixLoadIdentity(ProjMatrix);
+            ClipMatrixDirty = true;
+        }
+        else if (MatrixMode == 3)
+            MatrixLoadIdentity(TexMatrix);
+        else
+        {
+            MatrixLoadIdentity(PosMatrix);
+            if (MatrixMode == 2)
+                MatrixLoadIdentity(VecMatrix);
+            ClipMatrixDirty = true;
+        }
+        break;
 
-                if (PosMatrixStackPointer > 30) GXStat |= (1<<15);
+    case 0x16: // load 4x4
+        if (MatrixMode == 0)
+        {
+            MatrixLoad4x4(ProjMatrix, (s32*)params);
+            ClipMatrixDirty = true;
+        }
+        else if (MatrixMode == 3)
+        {
+            MatrixLoad4x4(TexMatrix, (s32*)params);
+        }
+        else
+        {
+            MatrixLoad4x4(PosMatrix, (s32*)params);
+            if (MatrixMode == 2)
+                MatrixLoad4x4(VecMatrix, (s32*)params);
+            ClipMatrixDirty = true;
+        }
+        break;
 
-                memcpy(PosMatrix, PosMatrixStack[PosMatrixStackPointer & 0x1F], 16*4);
-                memcpy(VecMatrix, VecMatrixStack[PosMatrixStackPointer & 0x1F], 16*4);
-                ClipMatrixDirty = true;
-                AddCycles(35);
-            }
-            break;
+    case 0x17: // load 4x3
+        if (MatrixMode == 0)
+        {
+            MatrixLoad4x3(ProjMatrix, (s32*)params);
+            ClipMatrixDirty = true;
+        }
+        else if (MatrixMode == 3)
+        {
+            MatrixLoad4x3(TexMatrix, (s32*)params);
+        }
+        else
+        {
+            MatrixLoad4x3(PosMatrix, (s32*)params);
+            if (MatrixMode == 2)
+                MatrixLoad4x3(VecMatrix, (s32*)params);
+            ClipMatrixDirty = true;
+        }
+        break;
 
-        case 0x13: // store matrix
-            if (MatrixMode == 0)
-            {
-                memcpy(ProjMatrixStack, ProjMatrix, 16*4);
-            }
-            else if (MatrixMode == 3)
-            {
-                memcpy(TexMatrixStack, TexMatrix, 16*4);
-            }
-            else
-            {
-                u32 addr = ExecParams[0] & 0x1F;
-                if (addr > 30) GXStat |= (1<<15);
+    case 0x18: // mult 4x4
+        if (MatrixMode == 0)
+        {
+            MatrixMult4x4(ProjMatrix, (s32*)params);
+            ClipMatrixDirty = true;
+        }
+        else if (MatrixMode == 3)
+        {
+            MatrixMult4x4(TexMatrix, (s32*)params);
+        }
+        else
+        {
+            MatrixMult4x4(PosMatrix, (s32*)params);
+            if (MatrixMode == 2)
+                MatrixMult4x4(VecMatrix, (s32*)params);
+            ClipMatrixDirty = true;
+        }
+        break;
 
-                memcpy(PosMatrixStack[addr], PosMatrix, 16*4);
-                memcpy(VecMatrixStack[addr], VecMatrix, 16*4);
-            }
-            AddCycles(16);
-            break;
+    case 0x19: // mult 4x3
+        if (MatrixMode == 0)
+        {
+            MatrixMult4x3(ProjMatrix, (s32*)params);
+            ClipMatrixDirty = true;
+        }
+        else if (MatrixMode == 3)
+        {
+            MatrixMult4x3(TexMatrix, (s32*)params);
+        }
+        else
+        {
+            MatrixMult4x3(PosMatrix, (s32*)params);
+            if (MatrixMode == 2)
+                MatrixMult4x3(VecMatrix, (s32*)params);
+            ClipMatrixDirty = true;
+        }
+        break;
 
-        case 0x14: // restore matrix
-            if (MatrixMode == 0)
-            {
-                memcpy(ProjMatrix, ProjMatrixStack, 16*4);
-                ClipMatrixDirty = true;
-                AddCycles(35);
-            }
-            else if (MatrixMode == 3)
+    case 0x1A: // mult 3x3
+        if (MatrixMode == 0)
+        {
+            MatrixMult3x3(ProjMatrix, (s32*)params);
+            ClipMatrixDirty = true;
+        }
+        else if (MatrixMode == 3)
+        {
+            MatrixMult3x3(TexMatrix, (s32*)params);
+        }
+        else
+        {
+            MatrixMult3x3(PosMatrix, (s32*)params);
+            if (MatrixMode == 2)
+                MatrixMult3x3(VecMatrix, (s32*)params);
+            ClipMatrixDirty = true;
+        }
+        break;
+
+    case 0x1B: // scale
+        if (MatrixMode == 0)
+        {
+            MatrixScale(ProjMatrix, (s32*)params);
+            ClipMatrixDirty = true;
+        }
+        else if (MatrixMode == 3)
+        {
+            MatrixScale(TexMatrix, (s32*)params);
+        }
+        else
+        {
+            MatrixScale(PosMatrix, (s32*)params);
+            ClipMatrixDirty = true;
+        }
+        break;
+
+    case 0x1C: // translate
+        if (MatrixMode == 0)
+        {
+            MatrixTranslate(ProjMatrix, (s32*)params);
+            ClipMatrixDirty = true;
+        }
+        else if (MatrixMode == 3)
+        {
+            MatrixTranslate(TexMatrix, (s32*)params);
+        }
+        else
+        {
+            MatrixTranslate(PosMatrix, (s32*)params);
+            if (MatrixMode == 2)
+                MatrixTranslate(VecMatrix, (s32*)params);
+            ClipMatrixDirty = true;
+        }
+        break;
+
+    case 0x20: // vertex color
+        {
+            u32 c = params[0];
+            u32 r = c & 0x1F;
+            u32 g = (c >> 5) & 0x1F;
+            u32 b = (c >> 10) & 0x1F;
+            VertexColor[0] = r;
+            VertexColor[1] = g;
+            VertexColor[2] = b;
+        }
+        break;
+
+    case 0x21: // normal
+        Normal[0] = (s16)((params[0] & 0x000003FF) << 6) >> 6;
+        Normal[1] = (s16)((params[0] & 0x000FFC00) >> 4) >> 6;
+        Normal[2] = (s16)((params[0] & 0x3FF00000) >> 14) >> 6;
+        CalculateLighting();
+        break;
+
+    case 0x22: // texcoord
+        RawTexCoords[0] = params[0] & 0xFFFF;
+        RawTexCoords[1] = params[0] >> 16;
+        if ((TexParam >> 30) == 1)
+        {
+            TexCoords[0] = (RawTexCoords[0]*TexMatrix[0] + RawTexCoords[1]*TexMatrix[4] + TexMatrix[8] + TexMatrix[12]) >> 12;
+            TexCoords[1] = (RawTexCoords[0]*TexMatrix[1] + RawTexCoords[1]*TexMatrix[5] + TexMatrix[9] + TexMatrix[13]) >> 12;
+        }
+        else
+        {
+            TexCoords[0] = RawTexCoords[0];
+            TexCoords[1] = RawTexCoords[1];
+        }
+        break;
+
+    case 0x23: // full vertex
+        CurVertex[0] = params[0] & 0xFFFF;
+        CurVertex[1] = params[0] >> 16;
+        CurVertex[2] = params[1] & 0xFFFF;
+        SubmitVertex();
+        break;
+
+    case 0x24: // 10-bit vertex
+        CurVertex[0] = (params[0] & 0x000003FF) << 6;
+        CurVertex[1] = (params[0] & 0x000FFC00) >> 4;
+        CurVertex[2] = (params[0] & 0x3FF00000) >> 14;
+        SubmitVertex();
+        break;
+
+    case 0x25: // vertex XY
+        CurVertex[0] = params[0] & 0xFFFF;
+        CurVertex[1] = params[0] >> 16;
+        SubmitVertex();
+        break;
+
+    case 0x26: // vertex XZ
+        CurVertex[0] = params[0] & 0xFFFF;
+        CurVertex[2] = params[0] >> 16;
+        SubmitVertex();
+        break;
+
+    case 0x27: // vertex YZ
+        CurVertex[1] = params[0] & 0xFFFF;
+        CurVertex[2] = params[0] >> 16;
+        SubmitVertex();
+        break;
+
+    case 0x28: // 10-bit delta vertex
+        CurVertex[0] += (s16)((params[0] & 0x000003FF) << 6) >> 6;
+        CurVertex[1] += (s16)((params[0] & 0x000FFC00) >> 4) >> 6;
+        CurVertex[2] += (s16)((params[0] & 0x3FF00000) >> 14) >> 6;
+        SubmitVertex();
+        break;
+
+    case 0x29: // polygon attributes
+        PolygonAttr = params[0];
+        break;
+
+    case 0x2A: // texture param
+        TexParam = params[0];
+        break;
+
+    case 0x2B: // texture palette
+        TexPalette = params[0] & 0x1FFF;
+        break;
+
+    case 0x30: // diffuse/ambient material
+        MatDiffuse[0] = params[0] & 0x1F;
+        MatDiffuse[1] = (params[0] >> 5) & 0x1F;
+        MatDiffuse[2] = (params[0] >> 10) & 0x1F;
+        MatAmbient[0] = (params[0] >> 16) & 0x1F;
+        MatAmbient[1] = (params[0] >> 21) & 0x1F;
+        MatAmbient[2] = (params[0] >> 26) & 0x1F;
+        if (params[0] & 0x8000)
+        {
+            VertexColor[0] = MatDiffuse[0];
+            VertexColor[1] = MatDiffuse[1];
+            VertexColor[2] = MatDiffuse[2];
+        }
+        break;
+
+    case 0x31: // specular/emission material
+        MatSpecular[0] = params[0] & 0x1F;
+        MatSpecular[1] = (params[0] >> 5) & 0x1F;
+        MatSpecular[2] = (params[0] >> 10) & 0x1F;
+        MatEmission[0] = (params[0] >> 16) & 0x1F;
+        MatEmission[1] = (params[0] >> 21) & 0x1F;
+        MatEmission[2] = (params[0] >> 26) & 0x1F;
+        UseShininessTable = (params[0] & 0x8000) != 0;
+        break;
+
+    case 0x32: // light direction
+        {
+            u32 l = params[0] >> 30;
+            s16 dir[3];
+            dir[0] = (s16)((params[0] & 0x000003FF) << 6) >> 6;
+            dir[1] = (s16)((params[0] & 0x000FFC00) >> 4) >> 6;
+            dir[2] = (s16)((params[0] & 0x3FF00000) >> 14) >> 6;
+            LightDirection[l][0] = (dir[0]*VecMatrix[0] + dir[1]*VecMatrix[4] + dir[2]*VecMatrix[8]) >> 12;
+            LightDirection[l][1] = (dir[0]*VecMatrix[1] + dir[1]*VecMatrix[5] + dir[2]*VecMatrix[9]) >> 12;
+            LightDirection[l][2] = (dir[0]*VecMatrix[2] + dir[1]*VecMatrix[6] + dir[2]*VecMatrix[10]) >> 12;
+        }
+        break;
+
+    case 0x33: // light color
+        {
+            u32 l = params[0] >> 30;
+            LightColor[l][0] = params[0] & 0x1F;
+            LightColor[l][1] = (params[0] >> 5) & 0x1F;
+            LightColor[l][2] = (params[0] >> 10) & 0x1F;
+        }
+        break;
+
+    case 0x34: // shininess table
+        {
+            for (int i = 0; i < 128; i += 4)
             {
-                memcpy(TexMatrix, TexMatrixStack, 16*4);
-                AddCycles(17);
+                u32 val = params[i >> 2];
+                ShininessTable[i + 0] = val & 0xFF;
+                ShininessTable[i + 1] = (val >> 8) & 0xFF;
+                ShininessTable[i + 2] = (val >> 16) & 0xFF;
+                ShininessTable[i + 3] = val >> 24;
             }
-            else
-            {
-                u32 addr = ExecParams[0] & 0x1F;
-                if (addr > 30) GXStat |= (1<<15);
+        }
+        break;
 
-                memcpy(PosMatrix, PosMatrixStack[addr], 16*4);
-                memcpy(VecMatrix, VecMatrixStack[addr], 16*4);
-                ClipMatrixDirty = true;
-                AddCycles(35);
-            }
-            break;
+    case 0x40: // begin polygons
+        // TODO: check if there was a polygon being defined but incomplete
+        // such cases seem to freeze the GPU
+        PolygonMode = params[0] & 0x3;
+        VertexNum = 0;
+        VertexNumInPoly = 0;
+        NumConsecutivePolygons = 0;
+        LastStripPolygon = NULL;
+        CurPolygonAttr = PolygonAttr;
+        break;
+
+    case 0x41: // end polygons
+        // TODO: research this?
+        // it doesn't seem to have any effect whatsoever, but
+        // its timing characteristics are different from those of other
+        // no-op commands
+        break;
+
+    case 0x50: // flush
+        FlushAttributes = params[0] & 0x3;
+        break;
+
+    case 0x60: // viewport x1,y1,x2,y2
+        // note: viewport Y coordinates are upside-down
+        Viewport[0] = params[0] & 0xFF;                                 // x0
+        Viewport[1] = (191 - ((params[0] >> 8) & 0xFF)) & 0xFF;         // y0
+        Viewport[2] = (params[0] >> 16) & 0xFF;                         // x1
+        Viewport[3] = (191 - (params[0] >> 24)) & 0xFF;                 // y1
+        Viewport[4] = (Viewport[2] - Viewport[0] + 1) & 0x1FF;          // width
+        Viewport[5] = (Viewport[1] - Viewport[3] + 1) & 0xFF;           // height
+        break;
+
+    case 0x70: // box test
+        BoxTest(params);
+        break;
+
+    case 0x71: // pos test
+        CurVertex[0] = params[0] & 0xFFFF;
+        CurVertex[1] = params[0] >> 16;
+        CurVertex[2] = params[1] & 0xFFFF;
+        PosTest();
+        break;
+
+    case 0x72: // vec test
+        VecTest(params);
+        break;
+
+    default:
+        //printf("!! UNKNOWN GX COMMAND %02X %08X\n", cmd, params[0]);
+        break;
+    }
+}
+
+void UpdateGeometryStatus()
+{
+    GXStat = (GXStat & ~(1<<1)) | (BoxTestResult ? (1<<1) : 0);
+
+    if (MatrixStackError)
+    {
+        GXStat |= (1<<15);
+        MatrixStackError = false;
+    }
+
+    if (PolygonRAMOverflow)
+    {
+        DispCnt |= (1<<13);
+        PolygonRAMOverflow = false;
+    }
+}
+
+void ResetTimingState()
+{
+    TimingMatrixMode = MatrixMode;
+    TimingPolygonAttr = PolygonAttr;
+    TimingLights = CurPolygonAttr & 0xF;
+    TimingPolygonMode = PolygonMode;
+    TimingVertexNumInPoly = VertexNumInPoly;
+    TimingNumConsecutivePolygons = NumConsecutivePolygons;
+}
+
+void VertexTiming()
+{
+    bool submit = false;
+
+    TimingVertexNumInPoly++;
+    switch (TimingPolygonMode)
+    {
+    case 0: // triangle
+        submit = (TimingVertexNumInPoly == 3);
+        if (submit) TimingVertexNumInPoly = 0;
+        break;
+    case 1: // quad
+        submit = (TimingVertexNumInPoly == 4);
+        if (submit) TimingVertexNumInPoly = 0;
+        break;
+    case 2: // triangle strip
+        submit = (TimingNumConsecutivePolygons & 1) || (TimingVertexNumInPoly == 3);
+        if (submit) TimingVertexNumInPoly = 2;
+        break;
+    case 3: // quad strip
+        submit = (TimingVertexNumInPoly == 4);
+        if (submit) TimingVertexNumInPoly = 2;
+        break;
+    }
+
+    if (submit)
+        TimingNumConsecutivePolygons++;
+
+    // how many vertices the submitted polygon ended up with after clipping
+    // 0 if it was culled or clipped away, -1 if no polygon was submitted
+    // the geometry thread may not have gotten there yet, so assume the
+    // polygon made it through unclipped
+    s32 nverts;
+    if (GeometryThreadRunning)
+        nverts = submit ? ((TimingPolygonMode & 0x1) ? 4 : 3) : -1;
+    else
+        nverts = SubmittedPolygonVerts;
+
+    if (nverts >= 0)
+    {
+        // submitting a polygon starts the polygon pipeline
+        // noting that for now we are only reserving one vertex slot
+        // further slots only get reserved if the polygon makes it through culling/clipping
+        PolygonPipeline = 8;
+        VertexSlotCounter = 1;
+        VertexSlotsFree = 0b11110;
+
+        if (nverts == 4)
+        {
+            PolygonPipeline = 35;
+            VertexSlotCounter = 1;
+            if (TimingPolygonMode & 0x2) VertexSlotsFree = 0b11100;
+            else                         VertexSlotsFree = 0b11110;
+        }
+        else if (nverts > 0)
+        {
+            PolygonPipeline = 26;
+            VertexSlotCounter = 1;
+            if (TimingPolygonMode & 0x2) VertexSlotsFree = 0b1000;
+            else                         VertexSlotsFree = 0b1110;
+        }
+    }
+
+    VertexPipeline = 7;
+    AddCycles(3);
+}
+
+void CommandTiming(u8 cmd, u32* params)
+{
+    // matrix commands: texture matrix ops are a bit faster, and mode 2
+    // also updates the vector matrix
+    u32 mode = TimingMatrixMode;
+
+    switch (cmd)
+    {
+    case 0x10: // matrix mode
+        TimingMatrixMode = params[0] & 0x3;
+        break;
+
+    case 0x11: // push matrix
+        NumPushPopCommands--;
+        AddCycles(16);
+        break;
+
+    case 0x12: // pop matrix
+        NumPushPopCommands--;
+        AddCycles((mode == 3) ? 17 : 35);
+        break;
+
+    case 0x13: // store matrix
+        AddCycles(16);
+        break;
+
+    case 0x14: // restore matrix
+        AddCycles((mode == 3) ? 17 : 35);
+        break;
+
+    case 0x15: // identity
+        if (mode != 3) AddCycles(18);
+        break;
+
+    case 0x16: // load 4x4
+        AddCycles((mode == 3) ? 10 : 18);
+        break;
+
+    case 0x17: // load 4x3
+        AddCycles((mode == 3) ? 7 : 18);
+        break;
+
+    case 0x18: // mult 4x4
+    case 0x19: // mult 4x3
+    case 0x1A: // mult 3x3
+    case 0x1C: // translate
+        {
+            // the parameters were already accounted for
+            s32 numparams = CmdNumParams[cmd];
+            if (mode == 3)      AddCycles(33 - numparams);
+            else if (mode == 2) AddCycles(35 + 30 - numparams);
+            else                AddCycles(35 - numparams);
+        }
+        break;
+
+    case 0x1B: // scale
+        AddCycles((mode == 3) ? (33 - 3) : (35 - 3));
+        break;
+
+    case 0x21: // normal
+        {
+            s32 c = __builtin_popcount(TimingLights);
+            if (c < 1) c = 1;
+            NormalPipeline = 7;
+            AddCycles(c);
+        }
+        break;
+
+    case 0x23: // vertex
+    case 0x24:
+    case 0x25:
+    case 0x26:
+    case 0x27:
+    case 0x28:
+        VertexTiming();
+        break;
+
+    case 0x29: // polygon attributes
+        TimingPolygonAttr = params[0];
+        break;
+
+    case 0x30: // diffuse/ambient material
+    case 0x31: // specular/emission material
+        AddCycles(3);
+        break;
+
+    case 0x32: // light direction
+        AddCycles(5);
+        break;
+
+    case 0x33: // light color
+        AddCycles(1);
+        break;
+
+    case 0x40: // begin polygons
+        TimingPolygonMode = params[0] & 0x3;
+        TimingVertexNumInPoly = 0;
+        TimingNumConsecutivePolygons = 0;
+        TimingLights = TimingPolygonAttr & 0xF;
+        break;
+
+    case 0x50: // flush
+        FlushRequest = 1;
+        CycleCount = 325;
+        // probably safe to just reset all pipelines
+        // but needs checked
+        VertexPipeline = 0;
+        NormalPipeline = 0;
+        PolygonPipeline = 0;
+        VertexSlotCounter = 0;
+        VertexSlotsFree = 1;
+        break;
+
+    case 0x70: // box test
+        NumTestCommands -= 3;
+        AddCycles(254);
+        break;
+
+    case 0x71: // pos test
+        NumTestCommands -= 2;
+        AddCycles(5);
+        break;
+
+    case 0x72: // vec test
+        NumTestCommands--;
+        AddCycles(4);
+        break;
+    }
+}
+
+
+void QueueCommand(u8 cmd, u32* params)
+{
+    u32 numparams = CmdNumParams[cmd];
+    u32 wr = GeometryQueueWrite.load(std::memory_order_relaxed);
+
+    // make sure there's room for the command and its parameters
+    if (((wr - GeometryQueueRead.load(std::memory_order_acquire)) & (kGeometryQueueSize-1)) >= (kGeometryQueueSize - 64))
+        SyncGeometryThread();
+
+    GeometryQueue[wr] = cmd | (numparams << 8);
+    wr = (wr + 1) & (kGeometryQueueSize-1);
+    for (u32 i = 0; i < numparams; i++)
+    {
+        GeometryQueue[wr] = params[i];
+        wr = (wr + 1) & (kGeometryQueueSize-1);
+    }
+    GeometryQueueWrite.store(wr);
 
-        case 0x15: // identity
-            if (MatrixMode == 0)
-            {
-                MatrixLoadIdentity(ProjMatrix);
-                ClipMatrixDirty = true;
-                AddCycles(18);
-            }
-            else if (MatrixMode == 3)
-                MatrixLoadIdentity(TexMatrix);
-            else
-            {
-                MatrixLoadIdentity(PosMatrix);
-                if (MatrixMode == 2)
-                    MatrixLoadIdentity(VecMatrix);
-                ClipMatrixDirty = true;
-                AddCycles(18);
-            }
-            break;
+    // commands whose results show up in GXSTAT
+    if ((cmd >= 0x11 && cmd <= 0x14) || cmd == 0x70)
+        GeometryStatusPending = true;
 
-        case 0x16: // load 4x4
-            if (MatrixMode == 0)
-            {
-                MatrixLoad4x4(ProjMatrix, (s32*)ExecParams);
-                ClipMatrixDirty = true;
-                AddCycles(18);
-            }
-            else if (MatrixMode == 3)
-            {
-                MatrixLoad4x4(TexMatrix, (s32*)ExecParams);
-                AddCycles(10);
-            }
-            else
-            {
-                MatrixLoad4x4(PosMatrix, (s32*)ExecParams);
-                if (MatrixMode == 2)
-                    MatrixLoad4x4(VecMatrix, (s32*)ExecParams);
-                ClipMatrixDirty = true;
-                AddCycles(18);
-            }
-            break;
+    if (GeometryThreadSleeping.load() && GeometryThreadSleeping.exchange(false))
+        Platform::Semaphore_Post(Sema_GeometryWork);
+}
 
-        case 0x17: // load 4x3
-            if (MatrixMode == 0)
-            {
-                MatrixLoad4x3(ProjMatrix, (s32*)ExecParams);
-                ClipMatrixDirty = true;
-                AddCycles(18);
-            }
-            else if (MatrixMode == 3)
-            {
-                MatrixLoad4x3(TexMatrix, (s32*)ExecParams);
-                AddCycles(7);
-            }
-            else
-            {
-                MatrixLoad4x3(PosMatrix, (s32*)ExecParams);
-                if (MatrixMode == 2)
-                    MatrixLoad4x3(VecMatrix, (s32*)ExecParams);
-                ClipMatrixDirty = true;
-                AddCycles(18);
-            }
-            break;
+void GeometryThreadFunc()
+{
+    u32 params[32];
 
-        case 0x18: // mult 4x4
-            if (MatrixMode == 0)
-            {
-                MatrixMult4x4(ProjMatrix, (s32*)ExecParams);
-                ClipMatrixDirty = true;
-                AddCycles(35 - 16);
-            }
-            else if (MatrixMode == 3)
-            {
-                MatrixMult4x4(TexMatrix, (s32*)ExecParams);
-                AddCycles(33 - 16);
-            }
-            else
+    for (;;)
+    {
+        u32 rd = GeometryQueueRead.load(std::memory_order_relaxed);
+        if (rd != GeometryQueueWrite.load(std::memory_order_acquire))
+        {
+            u32 header = GeometryQueue[rd];
+            u8 cmd = header & 0xFF;
+            u32 numparams = header >> 8;
+            rd = (rd + 1) & (kGeometryQueueSize-1);
+            for (u32 i = 0; i < numparams; i++)
             {
-                MatrixMult4x4(PosMatrix, (s32*)ExecParams);
-                if (MatrixMode == 2)
-                {
-                    MatrixMult4x4(VecMatrix, (s32*)ExecParams);
-                    AddCycles(35 + 30 - 16);
-                }
-                else AddCycles(35 - 16);
-                ClipMatrixDirty = true;
+                params[i] = GeometryQueue[rd];
+                rd = (rd + 1) & (kGeometryQueueSize-1);
             }
-            break;
 
-        case 0x19: // mult 4x3
-            if (MatrixMode == 0)
-            {
-                MatrixMult4x3(ProjMatrix, (s32*)ExecParams);
-                ClipMatrixDirty = true;
-                AddCycles(35 - 12);
-            }
-            else if (MatrixMode == 3)
-            {
-                MatrixMult4x3(TexMatrix, (s32*)ExecParams);
-                AddCycles(33 - 12);
-            }
-            else
-            {
-                MatrixMult4x3(PosMatrix, (s32*)ExecParams);
-                if (MatrixMode == 2)
-                {
-                    MatrixMult4x3(VecMatrix, (s32*)ExecParams);
-                    AddCycles(35 + 30 - 12);
-                }
-                else AddCycles(35 - 12);
-                ClipMatrixDirty = true;
-            }
-            break;
+            ProcessCommand(cmd, params);
+            GeometryQueueRead.store(rd, std::memory_order_release);
+            continue;
+        }
 
-        case 0x1A: // mult 3x3
-            if (MatrixMode == 0)
-            {
-                MatrixMult3x3(ProjMatrix, (s32*)ExecParams);
-                ClipMatrixDirty = true;
-                AddCycles(35 - 9);
-            }
-            else if (MatrixMode == 3)
-            {
-                MatrixMult3x3(TexMatrix, (s32*)ExecParams);
-                AddCycles(33 - 9);
-            }
-            else
-            {
-                MatrixMult3x3(PosMatrix, (s32*)ExecParams);
-                if (MatrixMode == 2)
-                {
-                    MatrixMult3x3(VecMatrix, (s32*)ExecParams);
-                    AddCycles(35 + 30 - 9);
-                }
-                else AddCycles(35 - 9);
-                ClipMatrixDirty = true;
-            }
-            break;
+        if (GeometryIdleWaiting.exchange(false))
+            Platform::Semaphore_Post(Sema_GeometryIdle);
 
-        case 0x1B: // scale
-            if (MatrixMode == 0)
-            {
-                MatrixScale(ProjMatrix, (s32*)ExecParams);
-                ClipMatrixDirty = true;
-                AddCycles(35 - 3);
-            }
-            else if (MatrixMode == 3)
-            {
-                MatrixScale(TexMatrix, (s32*)ExecParams);
-                AddCycles(33 - 3);
-            }
-            else
-            {
-                MatrixScale(PosMatrix, (s32*)ExecParams);
-                ClipMatrixDirty = true;
-                AddCycles(35 - 3);
-            }
-            break;
+        if (GeometryThreadStop.load())
+            return;
 
-        case 0x1C: // translate
-            if (MatrixMode == 0)
-            {
-                MatrixTranslate(ProjMatrix, (s32*)ExecParams);
-                ClipMatrixDirty = true;
-                AddCycles(35 - 3);
-            }
-            else if (MatrixMode == 3)
-            {
-                MatrixTranslate(TexMatrix, (s32*)ExecParams);
-                AddCycles(33 - 3);
-            }
-            else
-            {
-                MatrixTranslate(PosMatrix, (s32*)ExecParams);
-                if (MatrixMode == 2)
-                {
-                    MatrixTranslate(VecMatrix, (s32*)ExecParams);
-                    AddCycles(35 + 30 - 3);
-                }
-                else AddCycles(35 - 3);
-                ClipMatrixDirty = true;
-            }
-            break;
+        // go to sleep, unless something came in in the meantime
+        GeometryThreadSleeping = true;
+        if (rd != GeometryQueueWrite.load() || GeometryThreadStop.load() || GeometryIdleWaiting.load())
+        {
+            // if the emulation thread already woke us up, eat the wakeup
+            if (!GeometryThreadSleeping.exchange(false))
+                Platform::Semaphore_Wait(Sema_GeometryWork);
+            continue;
+        }
 
-        case 0x20: // vertex color
-            {
-                u32 c = ExecParams[0];
-                u32 r = c & 0x1F;
-                u32 g = (c >> 5) & 0x1F;
-                u32 b = (c >> 10) & 0x1F;
-                VertexColor[0] = r;
-                VertexColor[1] = g;
-                VertexColor[2] = b;
-            }
-            break;
+        Platform::Semaphore_Wait(Sema_GeometryWork);
+    }
+}
 
-        case 0x21: // normal
-            Normal[0] = (s16)((ExecParams[0] & 0x000003FF) << 6) >> 6;
-            Normal[1] = (s16)((ExecParams[0] & 0x000FFC00) >> 4) >> 6;
-            Normal[2] = (s16)((ExecParams[0] & 0x3FF00000) >> 14) >> 6;
-            CalculateLighting();
-            break;
+void SyncGeometryThread()
+{
+    if (!GeometryThreadRunning)
+        return;
 
-        case 0x22: // texcoord
-            RawTexCoords[0] = ExecParams[0] & 0xFFFF;
-            RawTexCoords[1] = ExecParams[0] >> 16;
-            if ((TexParam >> 30) == 1)
-            {
-                TexCoords[0] = (RawTexCoords[0]*TexMatrix[0] + RawTexCoords[1]*TexMatrix[4] + TexMatrix[8] + TexMatrix[12]) >> 12;
-                TexCoords[1] = (RawTexCoords[0]*TexMatrix[1] + RawTexCoords[1]*TexMatrix[5] + TexMatrix[9] + TexMatrix[13]) >> 12;
-            }
-            else
-            {
-                TexCoords[0] = RawTexCoords[0];
-                TexCoords[1] = RawTexCoords[1];
-            }
-            break;
+    if (GeometryQueueRead.load() != GeometryQueueWrite.load())
+    {
+        GeometryIdleWaiting = true;
+        if (GeometryThreadSleeping.load() && GeometryThreadSleeping.exchange(false))
+            Platform::Semaphore_Post(Sema_GeometryWork);
 
-        case 0x23: // full vertex
-            CurVertex[0] = ExecParams[0] & 0xFFFF;
-            CurVertex[1] = ExecParams[0] >> 16;
-            CurVertex[2] = ExecParams[1] & 0xFFFF;
-            SubmitVertex();
-            break;
+        if (GeometryQueueRead.load() != GeometryQueueWrite.load() || !GeometryIdleWaiting.exchange(false))
+            Platform::Semaphore_Wait(Sema_GeometryIdle);
+    }
 
-        case 0x24: // 10-bit vertex
-            CurVertex[0] = (ExecParams[0] & 0x000003FF) << 6;
-            CurVertex[1] = (ExecParams[0] & 0x000FFC00) >> 4;
-            CurVertex[2] = (ExecParams[0] & 0x3FF00000) >> 14;
-            SubmitVertex();
-            break;
+    GeometryStatusPending = false;
+    UpdateGeometryStatus();
+}
 
-        case 0x25: // vertex XY
-            CurVertex[0] = ExecParams[0] & 0xFFFF;
-            CurVertex[1] = ExecParams[0] >> 16;
-            SubmitVertex();
-            break;
+void SetupGeometryThread()
+{
+#ifdef MULTI_INSTANCE
+    // per-instance state can't be shared with another thread
+    bool threaded = false;
+#else
+    bool threaded = Config::ThreadedGeometry != 0;
+#endif
+
+    if (threaded == GeometryThreadRunning)
+        return;
 
-        case 0x26: // vertex XZ
-            CurVertex[0] = ExecParams[0] & 0xFFFF;
-            CurVertex[2] = ExecParams[0] >> 16;
-            SubmitVertex();
-            break;
+    if (!threaded)
+    {
+        StopGeometryThread();
+        return;
+    }
 
-        case 0x27: // vertex YZ
-            CurVertex[1] = ExecParams[0] & 0xFFFF;
-            CurVertex[2] = ExecParams[0] >> 16;
-            SubmitVertex();
-            break;
+    GeometryQueueRead = 0;
+    GeometryQueueWrite = 0;
+    GeometryThreadStop = false;
+    GeometryThreadSleeping = false;
+    GeometryIdleWaiting = false;
+    Platform::Semaphore_Reset(Sema_GeometryWork);
+    Platform::Semaphore_Reset(Sema_GeometryIdle);
 
-        case 0x28: // 10-bit delta vertex
-            CurVertex[0] += (s16)((ExecParams[0] & 0x000003FF) << 6) >> 6;
-            CurVertex[1] += (s16)((ExecParams[0] & 0x000FFC00) >> 4) >> 6;
-            CurVertex[2] += (s16)((ExecParams[0] & 0x3FF00000) >> 14) >> 6;
-            SubmitVertex();
-            break;
+    GeometryThread = Platform::Thread_Create(GeometryThreadFunc);
+    GeometryThreadRunning = true;
+}
 
-        case 0x29: // polygon attributes
-            PolygonAttr = ExecParams[0];
-            break;
+void StopGeometryThread()
+{
+    if (!GeometryThreadRunning)
+        return;
 
-        case 0x2A: // texture param
-            TexParam = ExecParams[0];
-            break;
+    SyncGeometryThread();
 
-        case 0x2B: // texture palette
-            TexPalette = ExecParams[0] & 0x1FFF;
-            break;
+    GeometryThreadStop = true;
+    if (GeometryThreadSleeping.exchange(false))
+        Platform::Semaphore_Post(Sema_GeometryWork);
 
-        case 0x30: // diffuse/ambient material
-            MatDiffuse[0] = ExecParams[0] & 0x1F;
-            MatDiffuse[1] = (ExecParams[0] >> 5) & 0x1F;
-            MatDiffuse[2] = (ExecParams[0] >> 10) & 0x1F;
-            MatAmbient[0] = (ExecParams[0] >> 16) & 0x1F;
-            MatAmbient[1] = (ExecParams[0] >> 21) & 0x1F;
-            MatAmbient[2] = (ExecParams[0] >> 26) & 0x1F;
-            if (ExecParams[0] & 0x8000)
-            {
-                VertexColor[0] = MatDiffuse[0];
-                VertexColor[1] = MatDiffuse[1];
-                VertexColor[2] = MatDiffuse[2];
-            }
-            AddCycles(3);
-            break;
+    Platform::Thread_Wait(GeometryThread);
+    Platform::Thread_Free(GeometryThread);
+    GeometryThreadRunning = false;
+}
 
-        case 0x31: // specular/emission material
-            MatSpecular[0] = ExecParams[0] & 0x1F;
-            MatSpecular[1] = (ExecParams[0] >> 5) & 0x1F;
-            MatSpecular[2] = (ExecParams[0] >> 10) & 0x1F;
-            MatEmission[0] = (ExecParams[0] >> 16) & 0x1F;
-            MatEmission[1] = (ExecParams[0] >> 21) & 0x1F;
-            MatEmission[2] = (ExecParams[0] >> 26) & 0x1F;
-            UseShininessTable = (ExecParams[0] & 0x8000) != 0;
-            AddCycles(3);
-            break;
+void ExecuteCommand()
+{
+    PROFILE_SCOPE_ASYNC(Prof_GPU3DExecuteCommand);
 
-        case 0x32: // light direction
-            {
-                u32 l = ExecParams[0] >> 30;
-                s16 dir[3];
-                dir[0] = (s16)((ExecParams[0] & 0x000003FF) << 6) >> 6;
-                dir[1] = (s16)((ExecParams[0] & 0x000FFC00) >> 4) >> 6;
-                dir[2] = (s16)((ExecParams[0] & 0x3FF00000) >> 14) >> 6;
-                LightDirection[l][0] = (dir[0]*VecMatrix[0] + dir[1]*VecMatrix[4] + dir[2]*VecMatrix[8]) >> 12;
-                LightDirection[l][1] = (dir[0]*VecMatrix[1] + dir[1]*VecMatrix[5] + dir[2]*VecMatrix[9]) >> 12;
-                LightDirection[l][2] = (dir[0]*VecMatrix[2] + dir[1]*VecMatrix[6] + dir[2]*VecMatrix[10]) >> 12;
-            }
-            AddCycles(5);
-            break;
+    CmdFIFOEntry entry = CmdFIFORead();
 
-        case 0x33: // light color
-            {
-                u32 l = ExecParams[0] >> 30;
-                LightColor[l][0] = ExecParams[0] & 0x1F;
-                LightColor[l][1] = (ExecParams[0] >> 5) & 0x1F;
-                LightColor[l][2] = (ExecParams[0] >> 10) & 0x1F;
-            }
-            AddCycles(1);
-            break;
+    //printf("FIFO: processing %02X %08X. Levels: FIFO=%d, PIPE=%d\n", entry.Command, entry.Param, CmdFIFO->Level(), CmdPIPE->Level());
 
-        case 0x34: // shininess table
-            {
-                for (int i = 0; i < 128; i += 4)
-                {
-                    u32 val = ExecParams[i >> 2];
-                    ShininessTable[i + 0] = val & 0xFF;
-                    ShininessTable[i + 1] = (val >> 8) & 0xFF;
-                    ShininessTable[i + 2] = (val >> 16) & 0xFF;
-                    ShininessTable[i + 3] = val >> 24;
-                }
-            }
-            break;
+    // each FIFO entry takes 1 cycle to be processed
+    // commands (presumably) run when all the needed parameters have been read
+    // which is where we add the remaining cycles if any
+    if (ExecParamCount == 0)
+    {
+        // delay the first command entry as needed
+        switch (entry.Command)
+        {
+        // commands that stall the polygon pipeline
+        case 0x32: StallPolygonPipeline(8 + 1,  2); break; // 32 can run 6 cycles after a vertex
+        case 0x40: StallPolygonPipeline(1,      0); break;
+        case 0x70: StallPolygonPipeline(10 + 1, 0); break;
 
-        case 0x40: // begin polygons
-            // TODO: check if there was a polygon being defined but incomplete
-            // such cases seem to freeze the GPU
-            PolygonMode = ExecParams[0] & 0x3;
-            VertexNum = 0;
-            VertexNumInPoly = 0;
-            NumConsecutivePolygons = 0;
-            LastStripPolygon = NULL;
-            CurPolygonAttr = PolygonAttr;
+        case 0x23:
+        case 0x24:
+        case 0x25:
+        case 0x26:
+        case 0x27:
+        case 0x28:
+            // vertex
+            if (!(VertexSlotsFree & 0x1)) NextVertexSlot();
+            else                          AddCycles(1);
+            NormalPipeline = 0;
             break;
 
-        case 0x41: // end polygons
-            // TODO: research this?
-            // it doesn't seem to have any effect whatsoever, but
-            // its timing characteristics are different from those of other
-            // no-op commands
+        case 0x20:
+        case 0x30:
+        case 0x31:
+        case 0x72:
+            // commands that can run 6 cycles after a vertex
+            if (VertexPipeline > 2) AddCycles((VertexPipeline - 2) + 1);
+            else                    AddCycles(NormalPipeline + 1);
+            NormalPipeline = 0;
             break;
 
-        case 0x50: // flush
-            FlushRequest = 1;
-            FlushAttributes = ExecParams[0] & 0x3;
-            CycleCount = 325;
-            // probably safe to just reset all pipelines
-            // but needs checked
-            VertexPipeline = 0;
+        case 0x29:
+        case 0x2A:
+        case 0x2B:
+        case 0x33:
+        case 0x34:
+        case 0x41:
+        case 0x60:
+        case 0x71:
+            // command that can run 8 cycles after a vertex
+            if (VertexPipeline > 0) AddCycles(VertexPipeline + 1);
+            else                    AddCycles(NormalPipeline + 1);
             NormalPipeline = 0;
-            PolygonPipeline = 0;
-            VertexSlotCounter = 0;
-            VertexSlotsFree = 1;
             break;
 
-        case 0x60: // viewport x1,y1,x2,y2
-            // note: viewport Y coordinates are upside-down
-            Viewport[0] = ExecParams[0] & 0xFF;                             // x0
-            Viewport[1] = (191 - ((ExecParams[0] >> 8) & 0xFF)) & 0xFF;     // y0
-            Viewport[2] = (ExecParams[0] >> 16) & 0xFF;                     // x1
-            Viewport[3] = (191 - (ExecParams[0] >> 24)) & 0xFF;             // y1
-            Viewport[4] = (Viewport[2] - Viewport[0] + 1) & 0x1FF;          // width
-            Viewport[5] = (Viewport[1] - Viewport[3] + 1) & 0xFF;           // height
+        default:
+            // all other commands can run 4 cycles after a vertex
+            // no need to do much here since that is the minimum
+            AddCycles(NormalPipeline + 1);
+            NormalPipeline = 0;
             break;
+        }
+    }
+    else
+        AddCycles(1);
 
-        case 0x70: // box test
-            NumTestCommands -= 3;
-            BoxTest(ExecParams);
-            break;
+    ExecParams[ExecParamCount] = entry.Param;
+    ExecParamCount++;
 
-        case 0x71: // pos test
-            NumTestCommands -= 2;
-            CurVertex[0] = ExecParams[0] & 0xFFFF;
-            CurVertex[1] = ExecParams[0] >> 16;
-            CurVertex[2] = ExecParams[1] & 0xFFFF;
-            PosTest();
-            break;
+    if (ExecParamCount >= CmdNumParams[entry.Command])
+    {
+        /*printf("[GXS:%08X] 0x%02X,  ", GXStat, entry.Command);
+        for (int k = 0; k < ExecParamCount; k++) printf("0x%08X, ", ExecParams[k]);
+        printf("\n");*/
 
-        case 0x72: // vec test
-            NumTestCommands--;
-            VecTest(ExecParams);
-            break;
+        ExecParamCount = 0;
 
-        default:
-            //printf("!! UNKNOWN GX COMMAND %02X %08X\n", entry.Command, entry.Param);
-            break;
+        if (GeometryThreadRunning)
+        {
+            QueueCommand(entry.Command, ExecParams);
+        }
+        else
+        {
+            ProcessCommand(entry.Command, ExecParams);
+            UpdateGeometryStatus();
         }
+
+        CommandTiming(entry.Command, ExecParams);
     }
 }
 
@@ -2365,6 +3044,8 @@ void FinishWork(s32 cycles)
 
 void Run()
 {
+    PROFILE_SCOPE(Prof_GPU3DRun);
+
     if (!GeometryEnabled || FlushRequest ||
         (CmdPIPE->IsEmpty() && !(GXStat & (1<<27))))
     {
@@ -2437,6 +3118,8 @@ bool YSort(Polygon* a, Polygon* b)
 
 void VBlank()
 {
+    SyncGeometryThread();
+
     if (GeometryEnabled)
     {
         if (RenderingEnabled)
@@ -2499,8 +3182,101 @@ void VBlank()
     }
 }
 
+void ResetFrameRepeats()
+{
+    RenderFrameRepeats = 0;
+    FrameDataLength[0] = 0;
+    FrameDataLength[1] = 0;
+}
+
+void CheckFrameRepeat()
+{
+    // header, plus up to 2048 polygons with 10 vertices each
+    const u32 maxlength = 128 + 2048 * (10 + 10*10);
+
+    std::vector<u32>& data = FrameData[CurFrameData];
+    if (data.size() < maxlength)
+        data.resize(maxlength);
+
+    u32* ptr = &data[0];
+
+    // render state
+    *ptr++ = RenderDispCnt;
+    *ptr++ = RenderAlphaRef;
+    memcpy(ptr, RenderToonTable, 32*2); ptr += 16;
+    memcpy(ptr, RenderEdgeTable, 8*2);  ptr += 4;
+    *ptr++ = RenderFogColor;
+    *ptr++ = RenderFogOffset;
+    *ptr++ = RenderFogShift;
+    ptr[8] = 0;
+    memcpy(ptr, RenderFogDensityTable, 34); ptr += 9;
+    *ptr++ = RenderClearAttr1;
+    *ptr++ = RenderClearAttr2;
+
+    // texture data (also used for the rear-plane bitmap)
+    memcpy(ptr, GPU::VRAMMap_Texture, 4*4); ptr += 4;
+    memcpy(ptr, GPU::VRAMMap_TexPal, 8*4);  ptr += 8;
+    *ptr++ = GPU::VRAMTexVersion;
+
+    // polygons, only what the renderers use
+    *ptr++ = RenderNumPolygons;
+    for (u32 i = 0; i < RenderNumPolygons; i++)
+    {
+        Polygon* poly = RenderPolygonRAM[i];
+
+        *ptr++ = poly->NumVertices;
+        *ptr++ = poly->Attr;
+        *ptr++ = poly->TexParam;
+        *ptr++ = poly->TexPalette;
+        *ptr++ = poly->WBuffer | (poly->Degenerate << 1) | (poly->FacingView << 2) |
+                 (poly->Translucent << 3) | (poly->IsShadowMask << 4) | (poly->IsShadow << 5) |
+                 (poly->Type << 8);
+        *ptr++ = poly->VTop;
+        *ptr++ = poly->VBottom;
+        *ptr++ = poly->YTop;
+        *ptr++ = poly->YBottom;
+        *ptr++ = 0;
+
+        for (u32 j = 0; j < poly->NumVertices; j++)
+        {
+            Vertex* vtx = poly->Vertices[j];
+
+            *ptr++ = poly->FinalZ[j];
+            *ptr++ = poly->FinalW[j];
+            *ptr++ = vtx->FinalPosition[0];
+            *ptr++ = vtx->FinalPosition[1];
+            *ptr++ = vtx->FinalColor[0];
+            *ptr++ = vtx->FinalColor[1];
+            *ptr++ = vtx->FinalColor[2];
+            *ptr++ = (u16)vtx->TexCoords[0] | ((u32)(u16)vtx->TexCoords[1] << 16);
+            *ptr++ = vtx->HiresPosition[0];
+            *ptr++ = vtx->HiresPosition[1];
+        }
+    }
+
+    u32 length = ptr - &data[0];
+    int prev = CurFrameData ^ 1;
+
+    if (length == FrameDataLength[prev] &&
+        !memcmp(&data[0], &FrameData[prev][0], length*4))
+    {
+        // keep the previous copy, saves switching buffers around
+        RenderFrameRepeats++;
+        return;
+    }
+
+    RenderFrameRepeats = 0;
+    FrameDataLength[CurFrameData] = length;
+    CurFrameData = prev;
+}
+
 void VCount215()
 {
+    CheckFrameRepeat();
+
+    if (Capture::Active())
+        Capture::CaptureFrame();
+
     if (Renderer == 0) SoftRenderer::RenderFrame();
     else               GLRenderer::RenderFrame();
 }
@@ -2551,16 +3327,84 @@ void WriteToGXFIFO(u32 val)
 }
 
 
+// same as calling WriteToGXFIFO() for each word, for geometry DMA.
+// the packed command parser state is kept local for the whole batch.
+// stops after the word that fills the FIFO, as the stall stops the DMA
+// there. returns the number of words consumed.
+u32 WriteToGXFIFOBulk(const u32* data, u32 count)
+{
+    if (!GeometryEnabled) return 0;
+    if (!CmdStallQueue->IsEmpty()) return 0;
+
+    u32 numcmds = NumCommands;
+    u32 curcmd = CurCommand;
+    u32 paramcount = ParamCount;
+    u32 totalparams = TotalParams;
+
+    u32 i = 0;
+    while (i < count)
+    {
+        u32 val = data[i++];
+
+        if (numcmds == 0)
+        {
+            numcmds = 4;
+            curcmd = val;
+            paramcount = 0;
+            totalparams = CmdNumParams[curcmd & 0xFF];
+
+            if (totalparams > 0) continue;
+        }
+        else
+            paramcount++;
+
+        for (;;)
+        {
+            if ((curcmd & 0xFF) || (numcmds == 4 && curcmd == 0))
+            {
+                CmdFIFOEntry entry;
+                entry.Command = curcmd & 0xFF;
+                entry.Param = val;
+                CmdFIFOWrite(entry);
+            }
+
+            if (paramcount >= totalparams)
+            {
+                curcmd >>= 8;
+                numcmds--;
+                if (numcmds == 0) break;
+
+                paramcount = 0;
+                totalparams = CmdNumParams[curcmd & 0xFF];
+            }
+            if (paramcount < totalparams)
+                break;
+        }
+
+        if (!CmdStallQueue->IsEmpty())
+            break;
+    }
+
+    NumCommands = numcmds;
+    CurCommand = curcmd;
+    ParamCount = paramcount;
+    TotalParams = totalparams;
+    return i;
+}
+
+
 u8 Read8(u32 addr)
 {
     switch (addr)
     {
     case 0x04000600:
         Run();
+        if (GeometryStatusPending) SyncGeometryThread();
         return GXStat & 0xFF;
     case 0x04000601:
         {
             Run();
+            if (GeometryStatusPending) SyncGeometryThread();
             return ((GXStat >> 8) & 0xFF) |
                    (PosMatrixStackPointer & 0x1F) |
                    ((ProjMatrixStackPointer & 0x1) << 5);
@@ -2595,6 +3439,7 @@ u16 Read16(u32 addr)
     switch (addr)
     {
     case 0x04000060:
+        SyncGeometryThread();
         return DispCnt;
 
     case 0x04000320:
@@ -2603,6 +3448,7 @@ u16 Read16(u32 addr)
     case 0x04000600:
         {
             Run();
+            if (GeometryStatusPending) SyncGeometryThread();
 
             return (GXStat & 0xFFFF) |
                    ((PosMatrixStackPointer & 0x1F) << 8) |
@@ -2621,13 +3467,17 @@ u16 Read16(u32 addr)
         }
 
     case 0x04000604:
+        SyncGeometryThread();
         return NumPolygons;
     case 0x04000606:
+        SyncGeometryThread();
         return NumVertices;
 
-    case 0x04000630: return VecTestResult[0];
-    case 0x04000632: return VecTestResult[1];
-    case 0x04000634: return VecTestResult[2];
+    case 0x04000630:
+    case 0x04000632:
+    case 0x04000634:
+        SyncGeometryThread();
+        return VecTestResult[(addr & 0x7) >> 1];
     }
 
     printf("unknown GPU3D read16 %08X\n", addr);
@@ -2639,6 +3489,7 @@ u32 Read32(u32 addr)
     switch (addr)
     {
     case 0x04000060:
+        SyncGeometryThread();
         return DispCnt;
 
     case 0x04000320:
@@ -2647,6 +3498,7 @@ u32 Read32(u32 addr)
     case 0x04000600:
         {
             Run();
+            if (GeometryStatusPending) SyncGeometryThread();
 
             u32 fifolevel = CmdFIFO->Level();
 
@@ -2659,8 +3511,16 @@ u32 Read32(u32 addr)
         }
 
     case 0x04000604:
+        SyncGeometryThread();
         return NumPolygons | (NumVertices << 16);
+    }
+
+    // test results and matrices are produced by the geometry thread
+    if (addr >= 0x04000620 && addr < 0x040006A4)
+        SyncGeometryThread();
 
+    switch (addr)
+    {
     case 0x04000620: return PosTestResult[0];
     case 0x04000624: return PosTestResult[1];
     case 0x04000628: return PosTestResult[2];
@@ -2702,6 +3562,7 @@ void Write8(u32 addr, u8 val)
     case 0x04000601:
         if (val & 0x80)
         {
+            SyncGeometryThread();
             GXStat &= ~0x8000;
             ProjMatrixStackPointer = 0;
             //PosMatrixStackPointer = 0;
@@ -2733,6 +3594,7 @@ void Write16(u32 addr, u16 val)
     switch (addr)
     {
     case 0x04000060:
+        SyncGeometryThread();
         DispCnt = (val & 0x4FFF) | (DispCnt & 0x3000);
         if (val & (1<<12)) DispCnt &= ~(1<<12);
         if (val & (1<<13)) DispCnt &= ~(1<<13);
@@ -2770,6 +3632,7 @@ void Write16(u32 addr, u16 val)
     case 0x04000600:
         if (val & 0x8000)
         {
+            SyncGeometryThread();
             GXStat &= ~0x8000;
             ProjMatrixStackPointer = 0;
             //PosMatrixStackPointer = 0;
@@ -2815,6 +3678,7 @@ void Write32(u32 addr, u32 val)
     switch (addr)
     {
     case 0x04000060:
+        SyncGeometryThread();
         DispCnt = (val & 0x4FFF) | (DispCnt & 0x3000);
         if (val & (1<<12)) DispCnt &= ~(1<<12);
         if (val & (1<<13)) DispCnt &= ~(1<<13);
@@ -2843,6 +3707,7 @@ void Write32(u32 addr, u32 val)
     case 0x04000600:
         if (val & 0x8000)
         {
+            SyncGeometryThread();
             GXStat &= ~0x8000;
             ProjMatrixStackPointer = 0;
             //PosMatrixStackPointer = 0;
@@ -76,23 +76,27 @@ typedef struct
 
 } Polygon;
 
-extern u32 RenderDispCnt;
-extern u8 RenderAlphaRef;
+extern EMUSTATE u32 RenderDispCnt;
+extern EMUSTATE u8 RenderAlphaRef;
 
-extern u16 RenderToonTable[32];
-extern u16 RenderEdgeTable[8];
+extern EMUSTATE u16 RenderToonTable[32];
+extern EMUSTATE u16 RenderEdgeTable[8];
 
-extern u32 RenderFogColor, RenderFogOffset, RenderFogShift;
-extern u8 RenderFogDensityTable[34];
+extern EMUSTATE u32 RenderFogColor, RenderFogOffset, RenderFogShift;
+extern EMUSTATE u8 RenderFogDensityTable[34];
 
-extern u32 RenderClearAttr1, RenderClearAttr2;
+extern EMUSTATE u32 RenderClearAttr1, RenderClearAttr2;
 
-extern std::array<Polygon*,2048> RenderPolygonRAM;
-extern u32 RenderNumPolygons;
+extern EMUSTATE std::array<Polygon*,2048> RenderPolygonRAM;
+extern EMUSTATE u32 RenderNumPolygons;
 
-extern u64 Timestamp;
+// how many frames in a row had the exact same contents as this one
+// renderers can reuse their previous output instead of rendering it again
+extern EMUSTATE u32 RenderFrameRepeats;
 
-extern int Renderer;
+extern EMUSTATE u64 Timestamp;
+
+extern EMUSTATE int Renderer;
 
 bool Init();
 void DeInit();
@@ -105,6 +109,35 @@ void SetEnabled(bool geometry, bool rendering);
 int InitRenderer(bool hasGL);
 void DeInitRenderer();
 void UpdateRendererConfig();
+void ResetFrameRepeats();
+
+// vector instructions usable on this CPU, for the code that has SIMD versions
+enum
+{
+    SIMD_None = 0,
+    SIMD_SSE41,
+    SIMD_AVX2,
+};
+
+int SIMDLevel();
+
+// the kernels that have SIMD versions, each next to its scalar version, for
+// melonDS-simdtest. the SIMD ones only exist on x86, and must only be called
+// when SIMDLevel() says so.
+void VecMult4x4_Scalar(s32* out, const s32* v, const s32* mat);
+void VecMult4x4_SSE41(s32* out, const s32* v, const s32* mat);
+void MatrixMult4x4_Scalar(s32* m, s32* s);
+void MatrixMult4x4_SSE41(s32* m, s32* s);
+void MatrixMult4x4_AVX2(s32* m, s32* s);
+void ClipOutcodes_Scalar(Vertex* vertices, int start, int nverts, u32* codeor, u32* codeand);
+void ClipOutcodes_SSE41(Vertex* vertices, int start, int nverts, u32* codeor, u32* codeand);
+void LightLevels_Scalar(const s16* normal, const s32* vecmatrix, const s16 (*lightdir)[3],
+                        s32* difflevels, s32* shinelevels);
+void LightLevels_SSE41(const s16* normal, const s32* vecmatrix, const s16 (*lightdir)[3],
+                       s32* difflevels, s32* shinelevels);
+
+void SetupGeometryThread();
+void StopGeometryThread();
 
 void ExecuteCommand();
 
@@ -119,6 +152,7 @@ void VCount215();
 u32* GetLine(int line);
 
 void WriteToGXFIFO(u32 val);
+u32 WriteToGXFIFOBulk(const u32* data, u32 count);
 
 u8 Read8(u32 addr);
 u16 Read16(u32 addr);
@@ -135,11 +169,37 @@ void DeInit();
 void Reset();
 
 void SetupRenderThread();
+void StopRenderThread();
 
 void VCount144();
 void RenderFrame();
 u32* GetLine(int line);
 
+// for melonDS-simdtest: sets a pixel of the topmost (layer 0) or second
+// layer, x and y going from -1 to 256/192 to include the border. then runs
+// the final pass over the whole screen, with the AVX2 code (which must only
+// be done when SIMDLevel() allows it) or the scalar code.
+void SetPixel(int layer, int x, int y, u32 color, u32 depth, u32 attr);
+void FinalPass(bool simd);
+
+}
+
+namespace Capture
+{
+
+// records what the renderers are given for the next frames, see GPU3D_Capture.cpp
+bool Start(const char* path, u32 numframes);
+void Stop();
+bool Active();
+void CaptureFrame();
+
+// loads captured frames in place of the emulated ones
+// OpenReplay() returns the number of frames, 0 if the file can't be used
+u32 OpenReplay(const char* path);
+void CloseReplay();
+void RewindReplay();
+bool ReplayFrame();
+
 }
 
 namespace GLRenderer
@@ -156,6 +216,16 @@ void PrepareCaptureFrame();
 u32* GetLine(int line);
 void SetupAccelFrame();
 
+// number of draw calls the last frame took
+u32 GetDrawCallCount();
+
+// frames read back for display capture so far, and how many of those
+// the emulation had to wait for
+void GetReadbackStats(u32* frames, u32* stalls);
+
+// textures decoded into the texture cache so far, and how many bytes that was
+void GetTexCacheStats(u32* decoded, u64* uploaded);
+
 }
 
 }
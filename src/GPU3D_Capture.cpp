@@ -0,0 +1,612 @@
+/*
+    Copyright 2016-2020 Arisotura
+
+    This file is part of melonDS.
+
+    melonDS is free software: you can redistribute it and/or modify it under
+    the terms of the GNU General Public License as published by the Free
+    Software Foundation, either version 3 of the License, or (at your option)
+    any later version.
+
+    melonDS is distributed in the hope that it will be useful, but WITHOUT ANY
+    WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+    FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with melonDS. If not, see http://www.gnu.org/licenses/.
+*/
+
+// capture of what the 3D renderers are given, to replay it without emulating
+// anything else (see headless/gxreplay.cpp)
+//
+// file layout (little-endian):
+//   0x00  magic "MGXC"
+//   0x04  version (1)
+//   0x08  number of frames
+//   0x0C  reserved (0)
+//   then one record per frame:
+//   0x00  stored length
+//   0x04  uncompressed length
+//   0x08  frame data, deflated unless both lengths are equal
+//
+// frame data:
+//   render state: DispCnt, AlphaRef, toon table (32 x u16), edge table (8 x u16),
+//     fog color, fog offset, fog shift, fog density table (34 bytes, padded to 36),
+//     clear attributes 1 and 2
+//   VRAM: u32 flags, bits 0-3: texture slots present, bits 8-13: palette slots
+//     present, bit 31: same VRAM as the previous frame (nothing else stored).
+//     then the contents of the slots present, 128K per texture slot and 16K
+//     per palette slot
+//   u32 number of vertices, then 16 words per vertex
+//   u32 number of polygons, then for each polygon: number of vertices, vertex
+//     indices, FinalZ and FinalW for each vertex, then 13 words of attributes
+//
+// needs zlib for compression; without it, frames are stored uncompressed
+// and compressed captures can't be replayed.
+
+#include <stdio.h>
+#include <string.h>
+#include <unordered_map>
+#include <vector>
+#include "NDS.h"
+#include "GPU.h"
+#include "GPU3D.h"
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+
+namespace GPU3D
+{
+namespace Capture
+{
+
+const u32 kMagic = 0x4358474D; // MGXC
+const u32 kVersion = 1;
+
+const u32 kVRAMSame = (1<<31);
+
+// capture
+EMUSTATE FILE* CaptureFile;
+EMUSTATE u32 FramesLeft;
+EMUSTATE u32 NumCapturedFrames;
+EMUSTATE bool HaveLastVRAM;
+EMUSTATE u32 LastTexVersion;
+EMUSTATE u32 LastVRAMMap[4 + 8];
+
+// replay
+EMUSTATE FILE* ReplayFile;
+EMUSTATE u32 ReplayNumFrames;
+EMUSTATE u32 ReplayCurFrame;
+EMUSTATE std::vector<Vertex> ReplayVertices;
+EMUSTATE std::vector<Polygon> ReplayPolygons;
+
+
+// everything in the file is little-endian, whatever the host is
+
+void Put16(std::vector<u8>& buf, u16 val)
+{
+    u8 tmp[2] = {(u8)val, (u8)(val >> 8)};
+    buf.insert(buf.end(), tmp, tmp+2);
+}
+
+void Put32(std::vector<u8>& buf, u32 val)
+{
+    u8 tmp[4] = {(u8)val, (u8)(val >> 8), (u8)(val >> 16), (u8)(val >> 24)};
+    buf.insert(buf.end(), tmp, tmp+4);
+}
+
+void PutData(std::vector<u8>& buf, const void* data, u32 len)
+{
+    buf.insert(buf.end(), (const u8*)data, (const u8*)data + len);
+}
+
+bool WriteHeader(FILE* f, u32 numframes)
+{
+    std::vector<u8> header;
+    Put32(header, kMagic);
+    Put32(header, kVersion);
+    Put32(header, numframes);
+    Put32(header, 0);
+
+    fseek(f, 0, SEEK_SET);
+    return fwrite(&header[0], 16, 1, f) == 1;
+}
+
+bool Start(const char* path, u32 numframes)
+{
+    Stop();
+
+    if (numframes == 0)
+        return false;
+
+    CaptureFile = fopen(path, "wb");
+    if (!CaptureFile)
+    {
+        printf("GX capture: can't create %s\n", path);
+        return false;
+    }
+
+    if (!WriteHeader(CaptureFile, 0))
+    {
+        printf("GX capture: can't write to %s\n", path);
+        fclose(CaptureFile);
+        CaptureFile = NULL;
+        return false;
+    }
+
+    FramesLeft = numframes;
+    NumCapturedFrames = 0;
+    HaveLastVRAM = false;
+    return true;
+}
+
+void Stop()
+{
+    if (!CaptureFile)
+        return;
+
+    WriteHeader(CaptureFile, NumCapturedFrames);
+    fclose(CaptureFile);
+    CaptureFile = NULL;
+
+    printf("GX capture: %u frames captured\n", NumCapturedFrames);
+}
+
+bool Active()
+{
+    return CaptureFile != NULL;
+}
+
+void CaptureVRAM(std::vector<u8>& buf)
+{
+    u32 map[4 + 8];
+    memcpy(&map[0], GPU::VRAMMap_Texture, 4*4);
+    memcpy(&map[4], GPU::VRAMMap_TexPal, 8*4);
+
+    if (HaveLastVRAM && LastTexVersion == GPU::VRAMTexVersion &&
+        !memcmp(map, LastVRAMMap, sizeof(map)))
+    {
+        Put32(buf, kVRAMSame);
+        return;
+    }
+
+    HaveLastVRAM = true;
+    LastTexVersion = GPU::VRAMTexVersion;
+    memcpy(LastVRAMMap, map, sizeof(map));
+
+    // only 6 palette slots can be mapped
+    u32 flags = 0;
+    for (int i = 0; i < 4; i++)
+        if (GPU::VRAMMap_Texture[i]) flags |= (1 << i);
+    for (int i = 0; i < 6; i++)
+        if (GPU::VRAMMap_TexPal[i]) flags |= (1 << (8+i));
+    Put32(buf, flags);
+
+    // going through the regular accessors takes care of overlapping banks
+    for (int i = 0; i < 4; i++)
+    {
+        if (!(flags & (1 << i))) continue;
+
+        u32 base = buf.size();
+        buf.resize(base + 0x20000);
+        for (u32 j = 0; j < 0x20000; j += 4)
+        {
+            u32 val = GPU::ReadVRAM_Texture<u32>((i << 17) + j);
+            memcpy(&buf[base + j], &val, 4);
+        }
+    }
+
+    for (int i = 0; i < 6; i++)
+    {
+        if (!(flags & (1 << (8+i)))) continue;
+
+        u32 base = buf.size();
+        buf.resize(base + 0x4000);
+        for (u32 j = 0; j < 0x4000; j += 4)
+        {
+            u32 val = GPU::ReadVRAM_TexPal<u32>((i << 14) + j);
+            memcpy(&buf[base + j], &val, 4);
+        }
+    }
+}
+
+void CaptureFrame()
+{
+    if (!CaptureFile)
+        return;
+
+    std::vector<u8> buf;
+    buf.reserve(0x10000);
+
+    Put32(buf, RenderDispCnt);
+    Put32(buf, RenderAlphaRef);
+    for (int i = 0; i < 32; i++) Put16(buf, RenderToonTable[i]);
+    for (int i = 0; i < 8; i++) Put16(buf, RenderEdgeTable[i]);
+    Put32(buf, RenderFogColor);
+    Put32(buf, RenderFogOffset);
+    Put32(buf, RenderFogShift);
+    PutData(buf, RenderFogDensityTable, 34);
+    PutData(buf, "\0\0", 2);
+    Put32(buf, RenderClearAttr1);
+    Put32(buf, RenderClearAttr2);
+
+    CaptureVRAM(buf);
+
+    // vertices can be shared by several polygons (strips)
+    std::unordered_map<Vertex*, u32> vtxindex;
+    std::vector<Vertex*> vertices;
+    for (u32 i = 0; i < RenderNumPolygons; i++)
+    {
+        Polygon* poly = RenderPolygonRAM[i];
+        for (u32 j = 0; j < poly->NumVertices; j++)
+        {
+            if (vtxindex.emplace(poly->Vertices[j], vertices.size()).second)
+                vertices.push_back(poly->Vertices[j]);
+        }
+    }
+
+    Put32(buf, vertices.size());
+    for (Vertex* vtx : vertices)
+    {
+        for (int k = 0; k < 4; k++) Put32(buf, vtx->Position[k]);
+        for (int k = 0; k < 3; k++) Put32(buf, vtx->Color[k]);
+        Put32(buf, (u16)vtx->TexCoords[0] | ((u32)(u16)vtx->TexCoords[1] << 16));
+        Put32(buf, vtx->Clipped);
+        for (int k = 0; k < 2; k++) Put32(buf, vtx->FinalPosition[k]);
+        for (int k = 0; k < 3; k++) Put32(buf, vtx->FinalColor[k]);
+        for (int k = 0; k < 2; k++) Put32(buf, vtx->HiresPosition[k]);
+    }
+
+    Put32(buf, RenderNumPolygons);
+    for (u32 i = 0; i < RenderNumPolygons; i++)
+    {
+        Polygon* poly = RenderPolygonRAM[i];
+
+        Put32(buf, poly->NumVertices);
+        for (u32 j = 0; j < poly->NumVertices; j++)
+            Put32(buf, vtxindex[poly->Vertices[j]]);
+        for (u32 j = 0; j < poly->NumVertices; j++)
+        {
+            Put32(buf, poly->FinalZ[j]);
+            Put32(buf, poly->FinalW[j]);
+        }
+
+        Put32(buf, poly->Attr);
+        Put32(buf, poly->TexParam);
+        Put32(buf, poly->TexPalette);
+        Put32(buf, poly->WBuffer | (poly->Degenerate << 1) | (poly->FacingView << 2) |
+                   (poly->Translucent << 3) | (poly->IsShadowMask << 4) | (poly->IsShadow << 5));
+        Put32(buf, poly->Type);
+        Put32(buf, poly->VTop);
+        Put32(buf, poly->VBottom);
+        Put32(buf, poly->YTop);
+        Put32(buf, poly->YBottom);
+        Put32(buf, poly->XTop);
+        Put32(buf, poly->XBottom);
+        Put32(buf, poly->SortKey);
+        Put32(buf, 0);
+    }
+
+    u32 rawlen = buf.size();
+    const u8* data = &buf[0];
+    u32 len = rawlen;
+
+#ifdef HAVE_ZLIB
+    // favor speed, this runs while the game does
+    std::vector<u8> comp(compressBound(rawlen));
+    uLongf complen = comp.size();
+    if (compress2(&comp[0], &complen, &buf[0], rawlen, 1) == Z_OK && complen < rawlen)
+    {
+        data = &comp[0];
+        len = complen;
+    }
+#endif
+
+    std::vector<u8> header;
+    Put32(header, len);
+    Put32(header, rawlen);
+    if (fwrite(&header[0], 8, 1, CaptureFile) != 1 ||
+        fwrite(data, len, 1, CaptureFile) != 1)
+    {
+        printf("GX capture: write error, stopping\n");
+        Stop();
+        return;
+    }
+
+    NumCapturedFrames++;
+    if (--FramesLeft == 0)
+        Stop();
+}
+
+
+class Reader
+{
+public:
+    Reader(const std::vector<u8>& buf) : Buf(buf), Pos(0), Error(false) {}
+
+    u16 Get16()
+    {
+        u8 tmp[2];
+        Get(tmp, 2);
+        return tmp[0] | (tmp[1] << 8);
+    }
+
+    u32 Get32()
+    {
+        u8 tmp[4];
+        Get(tmp, 4);
+        return tmp[0] | (tmp[1] << 8) | (tmp[2] << 16) | ((u32)tmp[3] << 24);
+    }
+
+    void Get(void* dst, u32 len)
+    {
+        if (Pos + len > Buf.size())
+        {
+            Error = true;
+            memset(dst, 0, len);
+            return;
+        }
+
+        memcpy(dst, &Buf[Pos], len);
+        Pos += len;
+    }
+
+    const std::vector<u8>& Buf;
+    u32 Pos;
+    bool Error;
+};
+
+u32 OpenReplay(const char* path)
+{
+    CloseReplay();
+
+    ReplayFile = fopen(path, "rb");
+    if (!ReplayFile)
+    {
+        printf("GX replay: can't open %s\n", path);
+        return 0;
+    }
+
+    std::vector<u8> header(16);
+    bool ok = fread(&header[0], 16, 1, ReplayFile) == 1;
+
+    Reader rd(header);
+    u32 magic = rd.Get32();
+    u32 version = rd.Get32();
+    if (!ok || magic != kMagic || version != kVersion)
+    {
+        printf("GX replay: %s isn't a GX capture\n", path);
+        CloseReplay();
+        return 0;
+    }
+
+    ReplayNumFrames = rd.Get32();
+    ReplayCurFrame = 0;
+
+    ReplayVertices.resize(2048 * 10);
+    ReplayPolygons.resize(2048);
+
+    return ReplayNumFrames;
+}
+
+void CloseReplay()
+{
+    if (!ReplayFile)
+        return;
+
+    fclose(ReplayFile);
+    ReplayFile = NULL;
+}
+
+void RewindReplay()
+{
+    if (!ReplayFile)
+        return;
+
+    fseek(ReplayFile, 16, SEEK_SET);
+    ReplayCurFrame = 0;
+}
+
+bool LoadVRAM(Reader& rd)
+{
+    u32 flags = rd.Get32();
+    if (flags == kVRAMSame)
+    {
+        // only valid if there was a previous frame
+        return ReplayCurFrame > 0;
+    }
+
+    // texture slots go in banks A-D, palette slots 0-3 in bank E, 4-5 in F and G
+    for (int i = 0; i < 4; i++)
+    {
+        if (flags & (1 << i))
+        {
+            rd.Get(GPU::VRAM[i], 0x20000);
+            GPU::VRAMMap_Texture[i] = (1 << i);
+        }
+        else
+            GPU::VRAMMap_Texture[i] = 0;
+    }
+
+    for (int i = 0; i < 8; i++)
+    {
+        if (i < 6 && (flags & (1 << (8+i))))
+        {
+            u8* dst;
+            u32 bank;
+            if (i < 4)       { dst = &GPU::VRAM_E[i << 14]; bank = 4; }
+            else if (i == 4) { dst = GPU::VRAM_F; bank = 5; }
+            else             { dst = GPU::VRAM_G; bank = 6; }
+
+            rd.Get(dst, 0x4000);
+            GPU::VRAMMap_TexPal[i] = (1 << bank);
+        }
+        else
+            GPU::VRAMMap_TexPal[i] = 0;
+    }
+
+    GPU::VRAMTexVersion++;
+    return true;
+}
+
+bool ReplayFrame()
+{
+    if (!ReplayFile || ReplayCurFrame >= ReplayNumFrames)
+        return false;
+
+    std::vector<u8> header(8);
+    if (fread(&header[0], 8, 1, ReplayFile) != 1)
+    {
+        printf("GX replay: unexpected end of file\n");
+        return false;
+    }
+
+    Reader hd(header);
+    u32 len = hd.Get32();
+    u32 rawlen = hd.Get32();
+    if (len > rawlen || rawlen > 0x4000000)
+    {
+        printf("GX replay: bad frame record\n");
+        return false;
+    }
+
+    std::vector<u8> buf(rawlen);
+    if (len == rawlen)
+    {
+        if (rawlen && fread(&buf[0], rawlen, 1, ReplayFile) != 1)
+        {
+            printf("GX replay: unexpected end of file\n");
+            return false;
+        }
+    }
+    else
+    {
+#ifdef HAVE_ZLIB
+        std::vector<u8> comp(len);
+        uLongf outlen = rawlen;
+        if (fread(&comp[0], len, 1, ReplayFile) != 1 ||
+            uncompress(&buf[0], &outlen, &comp[0], len) != Z_OK || outlen != rawlen)
+        {
+            printf("GX replay: corrupted frame\n");
+            return false;
+        }
+#else
+        printf("GX replay: compressed captures need zlib\n");
+        return false;
+#endif
+    }
+
+    Reader rd(buf);
+
+    RenderDispCnt = rd.Get32();
+    RenderAlphaRef = rd.Get32();
+    for (int i = 0; i < 32; i++) RenderToonTable[i] = rd.Get16();
+    for (int i = 0; i < 8; i++) RenderEdgeTable[i] = rd.Get16();
+    RenderFogColor = rd.Get32();
+    RenderFogOffset = rd.Get32();
+    RenderFogShift = rd.Get32();
+    rd.Get(RenderFogDensityTable, 34);
+    rd.Pos += 2;
+    RenderClearAttr1 = rd.Get32();
+    RenderClearAttr2 = rd.Get32();
+
+    if (!LoadVRAM(rd))
+    {
+        printf("GX replay: bad VRAM data\n");
+        return false;
+    }
+
+    u32 numvertices = rd.Get32();
+    if (numvertices > ReplayVertices.size())
+    {
+        printf("GX replay: too many vertices\n");
+        return false;
+    }
+
+    for (u32 i = 0; i < numvertices; i++)
+    {
+        Vertex* vtx = &ReplayVertices[i];
+
+        for (int k = 0; k < 4; k++) vtx->Position[k] = rd.Get32();
+        for (int k = 0; k < 3; k++) vtx->Color[k] = rd.Get32();
+        u32 texcoords = rd.Get32();
+        vtx->TexCoords[0] = texcoords & 0xFFFF;
+        vtx->TexCoords[1] = texcoords >> 16;
+        vtx->Clipped = rd.Get32() != 0;
+        for (int k = 0; k < 2; k++) vtx->FinalPosition[k] = rd.Get32();
+        for (int k = 0; k < 3; k++) vtx->FinalColor[k] = rd.Get32();
+        for (int k = 0; k < 2; k++) vtx->HiresPosition[k] = rd.Get32();
+    }
+
+    u32 numpolys = rd.Get32();
+    if (numpolys > ReplayPolygons.size())
+    {
+        printf("GX replay: too many polygons\n");
+        return false;
+    }
+
+    for (u32 i = 0; i < numpolys; i++)
+    {
+        Polygon* poly = &ReplayPolygons[i];
+
+        poly->NumVertices = rd.Get32();
+        if (poly->NumVertices > 10)
+        {
+            printf("GX replay: bad polygon\n");
+            return false;
+        }
+
+        for (u32 j = 0; j < poly->NumVertices; j++)
+        {
+            u32 idx = rd.Get32();
+            if (idx >= numvertices)
+            {
+                printf("GX replay: bad vertex index\n");
+                return false;
+            }
+            poly->Vertices[j] = &ReplayVertices[idx];
+        }
+        for (u32 j = 0; j < poly->NumVertices; j++)
+        {
+            poly->FinalZ[j] = rd.Get32();
+            poly->FinalW[j] = rd.Get32();
+        }
+
+        poly->Attr = rd.Get32();
+        poly->TexParam = rd.Get32();
+        poly->TexPalette = rd.Get32();
+        u32 flags = rd.Get32();
+        poly->WBuffer = flags & (1<<0);
+        poly->Degenerate = flags & (1<<1);
+        poly->FacingView = flags & (1<<2);
+        poly->Translucent = flags & (1<<3);
+        poly->IsShadowMask = flags & (1<<4);
+        poly->IsShadow = flags & (1<<5);
+        poly->Type = rd.Get32();
+        poly->VTop = rd.Get32();
+        poly->VBottom = rd.Get32();
+        poly->YTop = rd.Get32();
+        poly->YBottom = rd.Get32();
+        poly->XTop = rd.Get32();
+        poly->XBottom = rd.Get32();
+        poly->SortKey = rd.Get32();
+        rd.Get32();
+
+        RenderPolygonRAM[i] = poly;
+    }
+    RenderNumPolygons = numpolys;
+
+    if (rd.Error)
+    {
+        printf("GX replay: truncated frame\n");
+        return false;
+    }
+
+    ReplayCurFrame++;
+    return true;
+}
+
+}
+}
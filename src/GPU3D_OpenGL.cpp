@@ -18,12 +18,20 @@
 
 #include <stdio.h>
 #include <string.h>
+#include <algorithm>
+#include <unordered_map>
+#include <vector>
 #include "NDS.h"
 #include "GPU.h"
 #include "Config.h"
 #include "OpenGLSupport.h"
 #include "GPU3D_OpenGL_shaders.h"
 
+#ifdef __SSE2__
+#define OGL_SSE2
+#include <emmintrin.h>
+#endif
+
 namespace GPU3D
 {
 namespace GLRenderer
@@ -43,13 +51,13 @@ enum
 };
 
 
-GLuint ClearShaderPlain[3];
+EMUSTATE GLuint ClearShaderPlain[3];
 
-GLuint RenderShader[16][3];
-GLuint CurShaderID = -1;
+EMUSTATE GLuint RenderShader[16][3];
+EMUSTATE GLuint CurShaderID = -1;
 
-GLuint FinalPassEdgeShader[3];
-GLuint FinalPassFogShader[3];
+EMUSTATE GLuint FinalPassEdgeShader[3];
+EMUSTATE GLuint FinalPassFogShader[3];
 
 struct
 {
@@ -65,28 +73,57 @@ struct
 
 } ShaderConfig;
 
-GLuint ShaderConfigUBO;
+EMUSTATE GLuint ShaderConfigUBO;
 
 typedef struct
 {
     Polygon* PolyData;
 
+    // index data is in the GL index buffer, these are offsets into it
     u32 NumIndices;
-    u16* Indices;
+    u32 IndicesOffset;
     GLuint PrimType;
 
     u32 NumEdgeIndices;
-    u16* EdgeIndices;
+    u32 EdgeIndicesOffset;
 
     u32 RenderKey;
 
+    // palette address, or where the texture is in the texture cache
+    u32 TexPalette;
+
+    // screen area the polygon can touch, in 8x8 tiles (see GroupPolygons())
+    u8 TileX0, TileY0, TileX1, TileY1;
+
 } RendererPolygon;
 
-RendererPolygon PolygonList[2048];
-int NumFinalPolys, NumOpaqueFinalPolys;
+EMUSTATE RendererPolygon* PolygonList; // 2048
+EMUSTATE int NumFinalPolys, NumOpaqueFinalPolys;
+
+// polygon grouping, see GroupPolygons()
+// overlap is checked on 8x8 tiles (at native resolution), one bit per tile,
+// one word per row of tiles.
+
+typedef struct
+{
+    GLuint PrimType;
+    u32 RenderKey;
+
+    // tiles covered by the polygons drawn after this group
+    u32 Covered[24];
+
+} PolygonGroup;
+
+// how far back a polygon can be moved, in groups
+const int MaxGroupLookback = 32;
 
-GLuint ClearVertexBufferID, ClearVertexArrayID;
-GLint ClearUniformLoc[4];
+EMUSTATE PolygonGroup* Groups; // 2048
+EMUSTATE u16 PolygonGroupID[2048];
+EMUSTATE u16 GroupStart[2048+1];
+EMUSTATE RendererPolygon* SortedPolygons; // 2048
+
+EMUSTATE GLuint ClearVertexBufferID, ClearVertexArrayID;
+EMUSTATE GLint ClearUniformLoc[4];
 
 // vertex buffer
 // * XYZW: 4x16bit
@@ -100,24 +137,62 @@ GLint ClearUniformLoc[4];
 // * bit8: front-facing (?)
 // * bit9: W-buffering (?)
 
-GLuint VertexBufferID;
-u32 VertexBuffer[10240 * 7];
-u32 NumVertices;
-
-GLuint VertexArrayID;
-u16 IndexBuffer[2048 * 40];
-
-GLuint TexMemID;
-GLuint TexPalMemID;
-
-int ScaleFactor;
-bool Antialias;
-int ScreenW, ScreenH;
-
-GLuint FramebufferTex[8];
-int FrontBuffer;
-GLuint FramebufferID[4], PixelbufferID;
-u32 Framebuffer[256*192];
+EMUSTATE GLuint VertexBufferID;
+const int VertexBufferSize = 10240 * 7;
+EMUSTATE u32* VertexBuffer;
+EMUSTATE u32 NumVertices;
+
+EMUSTATE GLuint VertexArrayID;
+EMUSTATE GLuint IndexBufferID;
+const int IndexBufferSize = 2048 * 40;
+EMUSTATE u16* IndexBuffer;
+EMUSTATE u32 NumIndices, NumEdgeIndices;
+
+// the vertex and index buffers are split in slots, each frame uses the next
+// one so it doesn't have to wait for the GPU to be done with the previous
+// frames. when possible, the slots are kept mapped and vertices are written
+// straight to them, with a fence per slot telling when it can be reused.
+// otherwise they are built in VertexBuffer/IndexBuffer and uploaded.
+const int UploadSlots = 3;
+
+EMUSTATE bool PersistentBuffers;
+EMUSTATE u32* MappedVertices;
+EMUSTATE u16* MappedIndices;
+EMUSTATE GLsync UploadFence[UploadSlots];
+EMUSTATE int UploadSlot;
+
+EMUSTATE u32 NumDrawCalls;
+
+EMUSTATE GLuint TexMemID;
+EMUSTATE GLuint TexPalMemID;
+
+EMUSTATE int ScaleFactor;
+EMUSTATE bool Antialias;
+EMUSTATE int ScreenW, ScreenH;
+
+EMUSTATE GLuint FramebufferTex[8];
+EMUSTATE int FrontBuffer;
+EMUSTATE GLuint FramebufferID[4];
+EMUSTATE u32* Framebuffer; // 256*192
+
+// readback of the 3D output for display capture
+// frames are read into a ring of pixel buffers, in bands of scanlines with a
+// fence each, and GetLine() only maps a band once it's needed. when the
+// previous frame was captured, the readback is started as soon as the frame
+// is rendered instead of when the capture begins, which gives the GPU until
+// the end of VBlank to get it done.
+const int ReadbackSlots = 3;
+const int ReadbackBands = 4;
+const int ReadbackBandLines = 192 / ReadbackBands;
+
+EMUSTATE GLuint ReadbackBufferID[ReadbackSlots];
+EMUSTATE GLsync ReadbackFence[ReadbackSlots][ReadbackBands];
+EMUSTATE bool ReadbackFences;
+EMUSTATE int ReadbackSlot;
+EMUSTATE u32 ReadbackBandsDone;
+EMUSTATE bool ReadbackStarted, ReadbackStalled;
+EMUSTATE bool CaptureRequested, CaptureLastFrame;
+EMUSTATE u32 ReadbackFrames, ReadbackStallFrames;
 
 
 
@@ -170,6 +245,8 @@ bool BuildRenderShader(u32 flags, const char* vs, const char* fs)
     glUniform1i(uni_id, 0);
     uni_id = glGetUniformLocation(prog, "TexPalMem");
     glUniform1i(uni_id, 1);
+    uni_id = glGetUniformLocation(prog, "TexCache");
+    glUniform1i(uni_id, 2);
 
     return true;
 }
@@ -190,10 +267,630 @@ void SetupDefaultTexParams(GLuint tex)
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
 }
 
+bool SetupPersistentBuffers()
+{
+    // needs OpenGL 4.4 or ARB_buffer_storage, and fences (3.2)
+    if (!glBufferStorage || !glFenceSync || !glClientWaitSync || !glDeleteSync)
+        return false;
+    if (!OpenGL_Supports(4, 4, "GL_ARB_buffer_storage"))
+        return false;
+
+    GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+
+    glBufferStorage(GL_ARRAY_BUFFER, VertexBufferSize * 4 * UploadSlots, NULL, flags);
+    glBufferStorage(GL_ELEMENT_ARRAY_BUFFER, IndexBufferSize * 2 * UploadSlots, NULL, flags);
+
+    MappedVertices = (u32*)glMapBufferRange(GL_ARRAY_BUFFER, 0, VertexBufferSize * 4 * UploadSlots, flags);
+    MappedIndices = (u16*)glMapBufferRange(GL_ELEMENT_ARRAY_BUFFER, 0, IndexBufferSize * 2 * UploadSlots, flags);
+
+    return MappedVertices && MappedIndices;
+}
+
+void SetupUploadBuffers()
+{
+    // expects VertexArrayID to be bound, as it keeps the index buffer binding
+
+    glGenBuffers(1, &VertexBufferID);
+    glBindBuffer(GL_ARRAY_BUFFER, VertexBufferID);
+    glGenBuffers(1, &IndexBufferID);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, IndexBufferID);
+
+    memset(UploadFence, 0, sizeof(UploadFence));
+    UploadSlot = 0;
+
+    PersistentBuffers = SetupPersistentBuffers();
+    if (PersistentBuffers) return;
+
+    // buffer storage can't be respecified, start over with new buffers
+    if (MappedVertices || MappedIndices)
+    {
+        printf("GL: failed to map the vertex buffers, falling back to uploads\n");
+        glDeleteBuffers(1, &VertexBufferID);
+        glDeleteBuffers(1, &IndexBufferID);
+        MappedVertices = NULL;
+        MappedIndices = NULL;
+
+        glGenBuffers(1, &VertexBufferID);
+        glBindBuffer(GL_ARRAY_BUFFER, VertexBufferID);
+        glGenBuffers(1, &IndexBufferID);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, IndexBufferID);
+    }
+
+    glBufferData(GL_ARRAY_BUFFER, VertexBufferSize * 4 * UploadSlots, NULL, GL_DYNAMIC_DRAW);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, IndexBufferSize * 2 * UploadSlots, NULL, GL_DYNAMIC_DRAW);
+}
+
+// texture cache
+// textures are decoded the first time they're used into an atlas, where they
+// stay until the VRAM they came from changes, or until their space is needed
+// for other textures, in which case the least recently used ones are evicted.
+// the atlas size is the memory budget: 2048x2048 RGBA8, 16MB.
+//
+// texture VRAM can only be written while it isn't mapped as such, and
+// GPU::VRAMTexVersion changes whenever that mapping does. so VRAM only needs
+// to be checked when the version changes: a copy of what the cached textures
+// were decoded from is kept, and compared against it in 4K pages. textures
+// decoded from pages that changed are dropped.
+//
+// decoded texels hold the color components times 8, so that the blended
+// colors of compressed textures are exact, and alpha as 0-31.
+// textures that don't fit are sampled from the raw VRAM like before.
+
+const int TexCacheSize = 2048;
+const int TexCacheLevels = 9; // 8 to 2048 texels
+
+enum
+{
+    TexNode_Free = 0,
+    TexNode_Used,
+    TexNode_Split,
+};
+
+// the atlas is split in halves as needed, alternating between width and
+// height to keep blocks as square as possible. two free halves are merged
+// back together.
+typedef struct
+{
+    u16 X, Y;
+    u8 LogW, LogH; // size is 8<<log
+    u8 State;
+
+    s32 Parent;
+    s32 Children; // the second child follows the first one
+
+    s32 Prev, Next; // free list for this size
+
+} TexCacheNode;
+
+typedef struct
+{
+    u64 Key;
+    s32 Node;
+    u32 LastUsed;
+
+    // VRAM pages the texture was decoded from
+    u64 TexPages[2];
+    u32 PalPages;
+
+    s32 Prev, Next; // LRU list, most recent first
+
+} TexCacheEntry;
+
+EMUSTATE GLuint TexCacheID;
+
+EMUSTATE std::vector<TexCacheNode> TexCacheNodes;
+EMUSTATE std::vector<s32> TexCacheFreePairs;
+EMUSTATE s32 TexCacheFreeNodes[TexCacheLevels][TexCacheLevels];
+
+EMUSTATE std::vector<TexCacheEntry> TexCacheEntries;
+EMUSTATE std::vector<s32> TexCacheFreeEntries;
+EMUSTATE std::unordered_map<u64, s32> TexCacheMap;
+EMUSTATE s32 TexCacheLRUHead, TexCacheLRUTail;
+EMUSTATE u32 TexCacheFrame;
+
+EMUSTATE u8* TexCacheVRAM; // 0x80000
+EMUSTATE u16* TexCachePalVRAM; // 0xC000
+EMUSTATE u32 TexCacheVRAMVersion;
+EMUSTATE bool TexCacheVRAMValid;
+
+// set when a texture couldn't be cached, and whether TexMem/TexPalMem need
+// to be updated for it
+EMUSTATE bool TexCacheMissed;
+EMUSTATE bool RawTexDirty;
+
+EMUSTATE u64 TexReadPages[2];
+EMUSTATE u32 PalReadPages;
+EMUSTATE std::vector<u32> TexDecodeBuffer;
+
+EMUSTATE u32 TexCacheDecodes;
+EMUSTATE u64 TexCacheUploadSize;
+
+
+void TexCacheLinkFree(s32 n)
+{
+    TexCacheNode& node = TexCacheNodes[n];
+    s32& head = TexCacheFreeNodes[node.LogW][node.LogH];
+
+    node.State = TexNode_Free;
+    node.Prev = -1;
+    node.Next = head;
+    if (head >= 0) TexCacheNodes[head].Prev = n;
+    head = n;
+}
+
+void TexCacheUnlinkFree(s32 n)
+{
+    TexCacheNode& node = TexCacheNodes[n];
+
+    if (node.Prev >= 0) TexCacheNodes[node.Prev].Next = node.Next;
+    else                TexCacheFreeNodes[node.LogW][node.LogH] = node.Next;
+    if (node.Next >= 0) TexCacheNodes[node.Next].Prev = node.Prev;
+}
+
+s32 TexCacheAllocNode(int logw, int logh)
+{
+    // take the smallest free block that's big enough
+    s32 n = -1;
+    int best = 0x7FFFFFFF;
+    for (int w = logw; w < TexCacheLevels; w++)
+    {
+        for (int h = logh; h < TexCacheLevels; h++)
+        {
+            if (TexCacheFreeNodes[w][h] < 0) continue;
+            if ((w + h) >= best) continue;
+
+            n = TexCacheFreeNodes[w][h];
+            best = w + h;
+        }
+    }
+    if (n < 0) return -1;
+
+    TexCacheUnlinkFree(n);
+
+    while (TexCacheNodes[n].LogW > logw || TexCacheNodes[n].LogH > logh)
+    {
+        s32 children;
+        if (!TexCacheFreePairs.empty())
+        {
+            children = TexCacheFreePairs.back();
+            TexCacheFreePairs.pop_back();
+        }
+        else
+        {
+            children = TexCacheNodes.size();
+            TexCacheNodes.resize(children + 2);
+        }
+
+        // the vector may have moved
+        TexCacheNode& node = TexCacheNodes[n];
+        TexCacheNode& a = TexCacheNodes[children];
+        TexCacheNode& b = TexCacheNodes[children+1];
+
+        a.X = b.X = node.X;
+        a.Y = b.Y = node.Y;
+        a.LogW = b.LogW = node.LogW;
+        a.LogH = b.LogH = node.LogH;
+        a.Parent = b.Parent = n;
+
+        if ((node.LogW - logw) >= (node.LogH - logh))
+        {
+            a.LogW--; b.LogW--;
+            b.X += (8 << b.LogW);
+        }
+        else
+        {
+            a.LogH--; b.LogH--;
+            b.Y += (8 << b.LogH);
+        }
+
+        node.State = TexNode_Split;
+        node.Children = children;
+
+        TexCacheLinkFree(children+1);
+        n = children;
+    }
+
+    TexCacheNodes[n].State = TexNode_Used;
+    return n;
+}
+
+void TexCacheFreeNode(s32 n)
+{
+    for (;;)
+    {
+        s32 parent = TexCacheNodes[n].Parent;
+        if (parent < 0) break;
+
+        s32 children = TexCacheNodes[parent].Children;
+        s32 sibling = (n == children) ? (children+1) : children;
+        if (TexCacheNodes[sibling].State != TexNode_Free) break;
+
+        TexCacheUnlinkFree(sibling);
+        TexCacheFreePairs.push_back(children);
+        n = parent;
+    }
+
+    TexCacheLinkFree(n);
+}
+
+void TexCacheUnlinkLRU(s32 e)
+{
+    TexCacheEntry& entry = TexCacheEntries[e];
+
+    if (entry.Prev >= 0) TexCacheEntries[entry.Prev].Next = entry.Next;
+    else                 TexCacheLRUHead = entry.Next;
+    if (entry.Next >= 0) TexCacheEntries[entry.Next].Prev = entry.Prev;
+    else                 TexCacheLRUTail = entry.Prev;
+}
+
+void TexCacheLinkLRU(s32 e)
+{
+    TexCacheEntry& entry = TexCacheEntries[e];
+
+    entry.Prev = -1;
+    entry.Next = TexCacheLRUHead;
+    if (TexCacheLRUHead >= 0) TexCacheEntries[TexCacheLRUHead].Prev = e;
+    else                      TexCacheLRUTail = e;
+    TexCacheLRUHead = e;
+}
+
+void TexCacheRemoveEntry(s32 e)
+{
+    TexCacheEntry& entry = TexCacheEntries[e];
+
+    TexCacheFreeNode(entry.Node);
+    TexCacheMap.erase(entry.Key);
+    TexCacheUnlinkLRU(e);
+    TexCacheFreeEntries.push_back(e);
+}
+
+void ResetTexCache()
+{
+    TexCacheNodes.clear();
+    TexCacheFreePairs.clear();
+    for (int w = 0; w < TexCacheLevels; w++)
+        for (int h = 0; h < TexCacheLevels; h++)
+            TexCacheFreeNodes[w][h] = -1;
+
+    TexCacheNodes.resize(1);
+    TexCacheNode& root = TexCacheNodes[0];
+    root.X = 0; root.Y = 0;
+    root.LogW = TexCacheLevels-1;
+    root.LogH = TexCacheLevels-1;
+    root.Parent = -1;
+    TexCacheLinkFree(0);
+
+    TexCacheEntries.clear();
+    TexCacheFreeEntries.clear();
+    TexCacheMap.clear();
+    TexCacheLRUHead = -1;
+    TexCacheLRUTail = -1;
+    TexCacheFrame = 0;
+
+    memset(TexCacheVRAM, 0, 0x80000);
+    memset(TexCachePalVRAM, 0, 0xC000 * 2);
+    TexCacheVRAMValid = false;
+    RawTexDirty = true;
+
+    TexCacheDecodes = 0;
+    TexCacheUploadSize = 0;
+}
+
+void UpdateTexCacheVRAM()
+{
+    if (TexCacheVRAMValid && TexCacheVRAMVersion == GPU::VRAMTexVersion)
+        return;
+
+    TexCacheVRAMVersion = GPU::VRAMTexVersion;
+    TexCacheVRAMValid = true;
+
+    // like the raw VRAM textures always were: unmapped slots keep
+    // whatever was there last
+    u64 texdirty[2] = {0, 0};
+    for (int i = 0; i < 4; i++)
+    {
+        u32 mask = GPU::VRAMMap_Texture[i];
+        u8* vram;
+        if (!mask) continue;
+        else if (mask & (1<<0)) vram = GPU::VRAM_A;
+        else if (mask & (1<<1)) vram = GPU::VRAM_B;
+        else if (mask & (1<<2)) vram = GPU::VRAM_C;
+        else if (mask & (1<<3)) vram = GPU::VRAM_D;
+
+        for (int j = 0; j < 32; j++)
+        {
+            u8* dst = &TexCacheVRAM[(i << 17) + (j << 12)];
+            u8* src = &vram[j << 12];
+            if (!memcmp(dst, src, 0x1000)) continue;
+
+            memcpy(dst, src, 0x1000);
+            int page = (i << 5) + j;
+            texdirty[page >> 6] |= (1ULL << (page & 0x3F));
+        }
+    }
+
+    u32 paldirty = 0;
+    for (int i = 0; i < 6; i++)
+    {
+        u32 mask = GPU::VRAMMap_TexPal[i];
+        u8* vram;
+        if (!mask) continue;
+        else if (mask & (1<<4)) vram = &GPU::VRAM_E[(i&3)*0x4000];
+        else if (mask & (1<<5)) vram = GPU::VRAM_F;
+        else if (mask & (1<<6)) vram = GPU::VRAM_G;
+
+        for (int j = 0; j < 4; j++)
+        {
+            u8* dst = (u8*)&TexCachePalVRAM[(i << 13) + (j << 11)];
+            u8* src = &vram[j << 12];
+            if (!memcmp(dst, src, 0x1000)) continue;
+
+            memcpy(dst, src, 0x1000);
+            paldirty |= (1 << ((i << 2) + j));
+        }
+    }
+
+    if (!(texdirty[0] | texdirty[1] | paldirty))
+        return;
+
+    RawTexDirty = true;
+
+    for (s32 e = TexCacheLRUHead; e >= 0;)
+    {
+        TexCacheEntry& entry = TexCacheEntries[e];
+        s32 next = entry.Next;
+
+        if ((entry.TexPages[0] & texdirty[0]) ||
+            (entry.TexPages[1] & texdirty[1]) ||
+            (entry.PalPages & paldirty))
+            TexCacheRemoveEntry(e);
+
+        e = next;
+    }
+}
+
+void UploadRawTexVRAM()
+{
+    // expects TexMem and TexPalMem to be bound to texture units 0 and 1
+    if (!RawTexDirty) return;
+    RawTexDirty = false;
+
+    glActiveTexture(GL_TEXTURE0);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, 1024, 512, GL_RED_INTEGER, GL_UNSIGNED_BYTE, TexCacheVRAM);
+
+    glActiveTexture(GL_TEXTURE1);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, 1024, 48, GL_RGBA, GL_UNSIGNED_SHORT_1_5_5_5_REV, TexCachePalVRAM);
+}
+
+// the decoders below mirror the TextureFetch_* functions of the shader
+
+inline u8 TexCacheReadTex(u32 addr)
+{
+    addr &= 0x7FFFF;
+    TexReadPages[addr >> 18] |= (1ULL << ((addr >> 12) & 0x3F));
+    return TexCacheVRAM[addr];
+}
+
+inline u32 TexCacheReadPal(u32 index)
+{
+    // palette VRAM is only 96K, anything past that reads as zero
+    if (index >= 0xC000) return 0;
+    PalReadPages |= (1 << (index >> 11));
+
+    u16 c = TexCachePalVRAM[index];
+    return (c & 0x1F) | ((c & 0x3E0) << 3) | ((c & 0x7C00) << 6);
+}
+
+void DecodeTexture(u32 texparam, u32 texpal, u32* dst)
+{
+    u32 addr = (texparam & 0xFFFF) << 3;
+    u32 tw = 8 << ((texparam >> 20) & 0x7);
+    u32 th = 8 << ((texparam >> 23) & 0x7);
+    u32 alpha0 = (texparam & (1<<29)) ? 0 : (31<<24);
+
+    switch ((texparam >> 26) & 0x7)
+    {
+    case 1: // A3I5
+        for (u32 i = 0; i < tw*th; i++)
+        {
+            u8 pixel = TexCacheReadTex(addr + i);
+            u32 a = pixel >> 5;
+            a = (a << 2) + (a >> 1);
+            *dst++ = (TexCacheReadPal((texpal << 3) + (pixel & 0x1F)) << 3) | (a << 24);
+        }
+        break;
+
+    case 2: // 4-color
+        for (u32 i = 0; i < tw*th; i++)
+        {
+            u8 pixel = TexCacheReadTex(addr + (i >> 2));
+            pixel = (pixel >> (2 * (i & 3))) & 0x3;
+            *dst++ = (TexCacheReadPal((texpal << 2) + pixel) << 3) | (pixel ? (31<<24) : alpha0);
+        }
+        break;
+
+    case 3: // 16-color
+        for (u32 i = 0; i < tw*th; i++)
+        {
+            u8 pixel = TexCacheReadTex(addr + (i >> 1));
+            if (i & 1) pixel >>= 4;
+            else       pixel &= 0x0F;
+            *dst++ = (TexCacheReadPal((texpal << 3) + pixel) << 3) | (pixel ? (31<<24) : alpha0);
+        }
+        break;
+
+    case 4: // 256-color
+        for (u32 i = 0; i < tw*th; i++)
+        {
+            u8 pixel = TexCacheReadTex(addr + i);
+            *dst++ = (TexCacheReadPal((texpal << 3) + pixel) << 3) | (pixel ? (31<<24) : alpha0);
+        }
+        break;
+
+    case 5: // compressed
+        for (u32 t = 0; t < th; t++)
+        {
+            for (u32 s = 0; s < tw; s++)
+            {
+                u32 blockaddr = (addr + ((t & 0x3FC) * (tw >> 2)) + (s & 0x3FC) + (t & 0x3)) & 0x7FFFF;
+                u8 val = (TexCacheReadTex(blockaddr) >> (2 * (s & 0x3))) & 0x3;
+
+                u32 slot1addr = 0x20000 + ((blockaddr & 0x1FFFC) >> 1);
+                if (blockaddr >= 0x40000) slot1addr += 0x10000;
+
+                u16 palinfo = TexCacheReadTex(slot1addr) | (TexCacheReadTex(slot1addr+1) << 8);
+                u32 paladdr = (texpal << 3) + ((palinfo & 0x3FFF) << 1);
+                u32 mode = palinfo >> 14;
+
+                u32 color;
+                if (val == 0)
+                    color = TexCacheReadPal(paladdr) << 3;
+                else if (val == 1)
+                    color = TexCacheReadPal(paladdr+1) << 3;
+                else if (val == 2)
+                {
+                    // the components are 5 bits, so these don't carry over
+                    if (mode == 1)
+                        color = (TexCacheReadPal(paladdr) + TexCacheReadPal(paladdr+1)) << 2;
+                    else if (mode == 3)
+                        color = TexCacheReadPal(paladdr) * 5 + TexCacheReadPal(paladdr+1) * 3;
+                    else
+                        color = TexCacheReadPal(paladdr+2) << 3;
+                }
+                else
+                {
+                    if (mode == 2)
+                        color = TexCacheReadPal(paladdr+3) << 3;
+                    else if (mode == 3)
+                        color = TexCacheReadPal(paladdr) * 3 + TexCacheReadPal(paladdr+1) * 5;
+                    else
+                    {
+                        *dst++ = 0;
+                        continue;
+                    }
+                }
+
+                *dst++ = color | (31<<24);
+            }
+        }
+        break;
+
+    case 6: // A5I3
+        for (u32 i = 0; i < tw*th; i++)
+        {
+            u8 pixel = TexCacheReadTex(addr + i);
+            *dst++ = (TexCacheReadPal((texpal << 3) + (pixel & 0x7)) << 3) | ((pixel >> 3) << 24);
+        }
+        break;
+
+    case 7: // direct color
+        for (u32 i = 0; i < tw*th; i++)
+        {
+            u16 c = TexCacheReadTex(addr + (i << 1)) | (TexCacheReadTex(addr + (i << 1) + 1) << 8);
+            u32 color = (c & 0x1F) | ((c & 0x3E0) << 3) | ((c & 0x7C00) << 6);
+            *dst++ = (color << 3) | ((c & 0x8000) ? (31<<24) : 0);
+        }
+        break;
+    }
+}
+
+// returns where the texture is in the atlas, as given to the shader in place
+// of the palette address, or 0 if it couldn't be cached
+// expects the atlas to be bound to the active texture unit
+u32 GetCachedTexture(u32 texparam, u32 texpal)
+{
+    u32 fmt = (texparam >> 26) & 0x7;
+    u64 key = texparam & 0x3FF0FFFF;
+    if (fmt != 7) key |= ((u64)(texpal & 0x1FFF) << 32);
+
+    s32 e;
+    auto it = TexCacheMap.find(key);
+    if (it != TexCacheMap.end())
+    {
+        e = it->second;
+        TexCacheUnlinkLRU(e);
+    }
+    else
+    {
+        int logw = (texparam >> 20) & 0x7;
+        int logh = (texparam >> 23) & 0x7;
+
+        s32 node;
+        for (;;)
+        {
+            node = TexCacheAllocNode(logw, logh);
+            if (node >= 0) break;
+
+            // textures used by this frame need to stay
+            s32 tail = TexCacheLRUTail;
+            if (tail < 0 || TexCacheEntries[tail].LastUsed == TexCacheFrame)
+                return 0;
+
+            TexCacheRemoveEntry(tail);
+        }
+
+        if (!TexCacheFreeEntries.empty())
+        {
+            e = TexCacheFreeEntries.back();
+            TexCacheFreeEntries.pop_back();
+        }
+        else
+        {
+            e = TexCacheEntries.size();
+            TexCacheEntries.resize(e + 1);
+        }
+
+        TexReadPages[0] = 0;
+        TexReadPages[1] = 0;
+        PalReadPages = 0;
+        DecodeTexture(texparam, texpal & 0x1FFF, &TexDecodeBuffer[0]);
+
+        TexCacheNode& n = TexCacheNodes[node];
+        int tw = 8 << logw;
+        int th = 8 << logh;
+        glTexSubImage2D(GL_TEXTURE_2D, 0, n.X, n.Y, tw, th, GL_RGBA_INTEGER, GL_UNSIGNED_BYTE, &TexDecodeBuffer[0]);
+
+        TexCacheDecodes++;
+        TexCacheUploadSize += tw * th * 4;
+
+        TexCacheEntry& entry = TexCacheEntries[e];
+        entry.Key = key;
+        entry.Node = node;
+        entry.TexPages[0] = TexReadPages[0];
+        entry.TexPages[1] = TexReadPages[1];
+        entry.PalPages = PalReadPages;
+        TexCacheMap[key] = e;
+    }
+
+    TexCacheEntry& entry = TexCacheEntries[e];
+    entry.LastUsed = TexCacheFrame;
+    TexCacheLinkLRU(e);
+
+    TexCacheNode& n = TexCacheNodes[entry.Node];
+    return 0x80000000 | (n.X >> 3) | ((n.Y >> 3) << 8);
+}
+
 bool Init()
 {
     GLint uni_id;
 
+    // without a context, OpenGL_Init() hasn't loaded anything, and the
+    // caller falls back to the software renderer
+    if (!glCreateShader)
+    {
+        printf("GL renderer: OpenGL isn't initialized\n");
+        return false;
+    }
+
+    PolygonList = new RendererPolygon[2048];
+    Groups = new PolygonGroup[2048];
+    SortedPolygons = new RendererPolygon[2048];
+    VertexBuffer = new u32[VertexBufferSize];
+    IndexBuffer = new u16[IndexBufferSize];
+    Framebuffer = new u32[256*192];
+    TexCacheVRAM = new u8[0x80000];
+    TexCachePalVRAM = new u16[0xC000];
+
     glEnable(GL_DEPTH_TEST);
     glEnable(GL_STENCIL_TEST);
 
@@ -304,12 +1001,11 @@ bool Init()
     glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, (void*)(0));
 
 
-    glGenBuffers(1, &VertexBufferID);
-    glBindBuffer(GL_ARRAY_BUFFER, VertexBufferID);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(VertexBuffer), NULL, GL_DYNAMIC_DRAW);
-
     glGenVertexArrays(1, &VertexArrayID);
     glBindVertexArray(VertexArrayID);
+
+    SetupUploadBuffers();
+
     glEnableVertexAttribArray(0); // position
     glVertexAttribIPointer(0, 4, GL_UNSIGNED_SHORT, 7*4, (void*)(0));
     glEnableVertexAttribArray(1); // color
@@ -351,7 +1047,24 @@ bool Init()
     glEnable(GL_BLEND);
     glBlendEquationSeparate(GL_FUNC_ADD, GL_MAX);
 
-    glGenBuffers(1, &PixelbufferID);
+    glGenBuffers(ReadbackSlots, &ReadbackBufferID[0]);
+    for (int i = 0; i < ReadbackSlots; i++)
+    {
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, ReadbackBufferID[i]);
+        glBufferData(GL_PIXEL_PACK_BUFFER, 256*192*4, NULL, GL_STREAM_READ);
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+    memset(ReadbackFence, 0, sizeof(ReadbackFence));
+    ReadbackFences = glFenceSync && glClientWaitSync && glDeleteSync &&
+                     OpenGL_Supports(3, 2, "GL_ARB_sync");
+    ReadbackSlot = 0;
+    ReadbackBandsDone = 0;
+    ReadbackStarted = false;
+    CaptureRequested = false;
+    CaptureLastFrame = false;
+    ReadbackFrames = 0;
+    ReadbackStallFrames = 0;
 
     glActiveTexture(GL_TEXTURE0);
     glGenTextures(1, &TexMemID);
@@ -371,6 +1084,16 @@ bool Init()
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
     glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB5_A1, 1024, 48, 0, GL_RGBA, GL_UNSIGNED_SHORT_1_5_5_5_REV, NULL);
 
+    glActiveTexture(GL_TEXTURE2);
+    glGenTextures(1, &TexCacheID);
+    SetupDefaultTexParams(TexCacheID);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8UI, TexCacheSize, TexCacheSize, 0, GL_RGBA_INTEGER, GL_UNSIGNED_BYTE, NULL);
+
+    TexDecodeBuffer.resize(1024*1024);
+    ResetTexCache();
+
+    glActiveTexture(GL_TEXTURE0);
+
     return true;
 }
 
@@ -378,12 +1101,46 @@ void DeInit()
 {
     glDeleteTextures(1, &TexMemID);
     glDeleteTextures(1, &TexPalMemID);
+    glDeleteTextures(1, &TexCacheID);
+
+    ResetTexCache();
+    TexDecodeBuffer.clear();
+    TexDecodeBuffer.shrink_to_fit();
+
+    delete[] PolygonList;
+    delete[] Groups;
+    delete[] SortedPolygons;
+    delete[] VertexBuffer;
+    delete[] IndexBuffer;
+    delete[] Framebuffer;
+    delete[] TexCacheVRAM;
+    delete[] TexCachePalVRAM;
 
     glDeleteFramebuffers(4, &FramebufferID[0]);
     glDeleteTextures(8, &FramebufferTex[0]);
 
+    for (int i = 0; i < ReadbackSlots; i++)
+    {
+        for (int j = 0; j < ReadbackBands; j++)
+        {
+            if (ReadbackFence[i][j]) glDeleteSync(ReadbackFence[i][j]);
+            ReadbackFence[i][j] = 0;
+        }
+    }
+    glDeleteBuffers(ReadbackSlots, &ReadbackBufferID[0]);
+
+    for (int i = 0; i < UploadSlots; i++)
+    {
+        if (UploadFence[i]) glDeleteSync(UploadFence[i]);
+        UploadFence[i] = 0;
+    }
+
+    // deleting the buffers also unmaps them
     glDeleteVertexArrays(1, &VertexArrayID);
     glDeleteBuffers(1, &VertexBufferID);
+    glDeleteBuffers(1, &IndexBufferID);
+    MappedVertices = NULL;
+    MappedIndices = NULL;
     glDeleteVertexArrays(1, &ClearVertexArrayID);
     glDeleteBuffers(1, &ClearVertexBufferID);
 
@@ -475,11 +1232,11 @@ void UpdateDisplaySettings()
 
     glBindFramebuffer(GL_FRAMEBUFFER, FramebufferID[0]);
 
-    glBindBuffer(GL_PIXEL_PACK_BUFFER, PixelbufferID);
-    glBufferData(GL_PIXEL_PACK_BUFFER, 256*192*4, NULL, GL_DYNAMIC_READ);
-
     //glLineWidth(scale);
     //glLineWidth(1.5);
+
+    // the framebuffers were reallocated
+    ResetFrameRepeats();
 }
 
 
@@ -524,22 +1281,192 @@ void SetupPolygon(RendererPolygon* rp, Polygon* polygon)
     {
         rp->RenderKey |= 0x30000;
     }
+
+    rp->PrimType = (polygon->Type == 1) ? GL_LINES : GL_TRIANGLES;
+
+    rp->TexPalette = polygon->TexPalette;
+    if ((RenderDispCnt & (1<<0)) && ((polygon->TexParam >> 26) & 0x7))
+    {
+        u32 loc = GetCachedTexture(polygon->TexParam, polygon->TexPalette);
+        if (loc) rp->TexPalette = loc;
+        else     TexCacheMissed = true;
+    }
+
+    // bounds, from the same positions BuildPolygons() uses. the polygon
+    // can't touch pixels outside of them, except for the edge marking lines,
+    // which only set a flag and don't depend on the drawing order.
+    s32 x0 = 0x7FFFFFFF, y0 = 0x7FFFFFFF, x1 = -0x7FFFFFFF, y1 = -0x7FFFFFFF;
+    for (u32 j = 0; j < polygon->NumVertices; j++)
+    {
+        Vertex* vtx = polygon->Vertices[j];
+
+        s32 x, y;
+        if (ScaleFactor > 1)
+        {
+            x = (vtx->HiresPosition[0] * ScaleFactor) >> 4;
+            y = (vtx->HiresPosition[1] * ScaleFactor) >> 4;
+        }
+        else
+        {
+            x = vtx->FinalPosition[0];
+            y = vtx->FinalPosition[1];
+        }
+
+        // W=0 vertices don't end up where their position says
+        if ((polygon->FinalW[j] & 0xFFFF) == 0)
+        {
+            x0 = -0x7FFFFFFF; x1 = 0x7FFFFFFF;
+            y0 = -0x7FFFFFFF; y1 = 0x7FFFFFFF;
+            break;
+        }
+
+        x0 = std::min(x0, x); x1 = std::max(x1, x);
+        y0 = std::min(y0, y); y1 = std::max(y1, y);
+    }
+
+    // edges, and lines in particular, can be rasterized a pixel past the
+    // vertices, so the bounds are padded by a (native) pixel on every side
+    s32 pad = ScaleFactor;
+    x0 = std::max(x0, -0x7FFFFFFF + pad) - pad;
+    y0 = std::max(y0, -0x7FFFFFFF + pad) - pad;
+    x1 = std::min(x1, 0x7FFFFFFF - pad) + pad;
+    y1 = std::min(y1, 0x7FFFFFFF - pad) + pad;
+
+    // nothing is drawn outside of the screen, so the tiles can be clamped
+    s32 tilesize = 8 * ScaleFactor;
+    rp->TileX0 = std::min(std::max(x0 / tilesize, 0), 31);
+    rp->TileX1 = std::min(std::max(x1 / tilesize, 0), 31);
+    rp->TileY0 = std::min(std::max(y0 / tilesize, 0), 23);
+    rp->TileY1 = std::min(std::max(y1 / tilesize, 0), 23);
+}
+
+// polygons only affect each other where they overlap: depth ties go to the
+// polygon drawn first, translucent ones are blended in order, and the stencil
+// and attribute buffers are per pixel. so a polygon can be moved back next to
+// an earlier one with the same render state, as long as it doesn't overlap
+// anything drawn in between, and both are then drawn by the same call.
+// shadow masks and shadows depend on each other through the stencil buffer
+// and are left alone, nothing is moved across them.
+
+void GroupPolygonRange(int start, int end)
+{
+    int ngroups = 0;
+
+    for (int i = start; i < end; i++)
+    {
+        RendererPolygon* rp = &PolygonList[i];
+
+        int first = std::max(ngroups - MaxGroupLookback, 0);
+        int target = -1;
+
+        u32 tilemask = (0xFFFFFFFF >> (31 - rp->TileX1)) & (0xFFFFFFFF << rp->TileX0);
+
+        // only the latest matching group needs checking, older ones
+        // have everything it covers on top of them
+        for (int g = ngroups-1; g >= first; g--)
+        {
+            PolygonGroup* group = &Groups[g];
+            if (group->PrimType != rp->PrimType || group->RenderKey != rp->RenderKey)
+                continue;
+
+            bool overlap = false;
+            for (int y = rp->TileY0; y <= rp->TileY1; y++)
+                overlap |= (group->Covered[y] & tilemask) != 0;
+
+            if (!overlap) target = g;
+            break;
+        }
+
+        if (target < 0)
+        {
+            target = ngroups++;
+
+            PolygonGroup* group = &Groups[target];
+            group->PrimType = rp->PrimType;
+            group->RenderKey = rp->RenderKey;
+            memset(group->Covered, 0, sizeof(group->Covered));
+        }
+
+        PolygonGroupID[i] = target;
+
+        // groups further back than the lookback won't be looked at again
+        for (int g = std::max(ngroups - MaxGroupLookback, 0); g < target; g++)
+        {
+            PolygonGroup* group = &Groups[g];
+            for (int y = rp->TileY0; y <= rp->TileY1; y++)
+                group->Covered[y] |= tilemask;
+        }
+    }
+
+    if (ngroups == end - start) return;
+
+    // reorder the polygons by group, keeping their order within groups
+    memset(GroupStart, 0, sizeof(GroupStart[0]) * (ngroups+1));
+    for (int i = start; i < end; i++)
+        GroupStart[PolygonGroupID[i] + 1]++;
+    for (int g = 0; g < ngroups; g++)
+        GroupStart[g + 1] += GroupStart[g];
+
+    for (int i = start; i < end; i++)
+        SortedPolygons[GroupStart[PolygonGroupID[i]]++] = PolygonList[i];
+
+    memcpy(&PolygonList[start], SortedPolygons, sizeof(RendererPolygon) * (end - start));
+}
+
+void GroupPolygons(int npolys)
+{
+    // opaque and translucent polygons are kept apart, shadow masks and
+    // shadows split the list
+    int start = 0;
+    for (int i = 0; i <= npolys; i++)
+    {
+        bool split;
+        if (i == npolys)
+            split = true;
+        else
+        {
+            Polygon* poly = PolygonList[i].PolyData;
+            split = poly->IsShadowMask || poly->IsShadow ||
+                    (i > start && poly->Translucent != PolygonList[start].PolyData->Translucent);
+        }
+
+        if (!split) continue;
+
+        if ((i - start) > 1)
+            GroupPolygonRange(start, i);
+
+        start = i;
+        if (i < npolys && (PolygonList[i].PolyData->IsShadowMask || PolygonList[i].PolyData->IsShadow))
+            start++;
+    }
 }
 
 void BuildPolygons(RendererPolygon* polygons, int npolys)
 {
-    u32* vptr = &VertexBuffer[0];
-    u32 vidx = 0;
+    u32* vbuf = VertexBuffer;
+    u16* ibuf = IndexBuffer;
+    if (PersistentBuffers)
+    {
+        vbuf = &MappedVertices[UploadSlot * (10240*7)];
+        ibuf = &MappedIndices[UploadSlot * (2048*40)];
+    }
+
+    // indices are relative to the start of the buffers, not the slot
+    u32 vidx_base = UploadSlot * 10240;
+    u32 iofs_base = UploadSlot * (2048*40);
+
+    u32* vptr = vbuf;
+    u32 vidx = vidx_base;
 
-    u16* iptr = &IndexBuffer[0];
-    u16* eiptr = &IndexBuffer[2048*30];
+    u16* iptr = &ibuf[0];
+    u16* eiptr = &ibuf[2048*30];
 
     for (int i = 0; i < npolys; i++)
     {
         RendererPolygon* rp = &polygons[i];
         Polygon* poly = rp->PolyData;
 
-        rp->Indices = iptr;
+        rp->IndicesOffset = iofs_base + (iptr - ibuf);
         rp->NumIndices = 0;
 
         u32 vidx_first = vidx;
@@ -555,8 +1482,6 @@ void BuildPolygons(RendererPolygon* polygons, int npolys)
         // assemble vertices
         if (poly->Type == 1) // line
         {
-            rp->PrimType = GL_LINES;
-
             u32 lastx, lasty;
             int nout = 0;
             for (int j = 0; j < poly->NumVertices; j++)
@@ -599,7 +1524,7 @@ void BuildPolygons(RendererPolygon* polygons, int npolys)
 
                 *vptr++ = vtxattr | (zshift << 16);
                 *vptr++ = poly->TexParam;
-                *vptr++ = poly->TexPalette;
+                *vptr++ = rp->TexPalette;
 
                 *iptr++ = vidx;
                 rp->NumIndices++;
@@ -611,8 +1536,6 @@ void BuildPolygons(RendererPolygon* polygons, int npolys)
         }
         else
         {
-            rp->PrimType = GL_TRIANGLES;
-
             for (int j = 0; j < poly->NumVertices; j++)
             {
                 Vertex* vtx = poly->Vertices[j];
@@ -648,7 +1571,7 @@ void BuildPolygons(RendererPolygon* polygons, int npolys)
 
                 *vptr++ = vtxattr | (zshift << 16);
                 *vptr++ = poly->TexParam;
-                *vptr++ = poly->TexPalette;
+                *vptr++ = rp->TexPalette;
 
                 if (j >= 2)
                 {
@@ -663,7 +1586,7 @@ void BuildPolygons(RendererPolygon* polygons, int npolys)
             }
         }
 
-        rp->EdgeIndices = eiptr;
+        rp->EdgeIndicesOffset = iofs_base + (eiptr - ibuf);
         rp->NumEdgeIndices = 0;
 
         u32 vidx_cur = vidx_first;
@@ -679,14 +1602,66 @@ void BuildPolygons(RendererPolygon* polygons, int npolys)
         rp->NumEdgeIndices += 2;
     }
 
-    NumVertices = vidx;
+    NumVertices = vidx - vidx_base;
+    NumIndices = iptr - &ibuf[0];
+    NumEdgeIndices = eiptr - &ibuf[2048*30];
+}
+
+void WaitForUploadSlot()
+{
+    if (!UploadFence[UploadSlot]) return;
+
+    for (;;)
+    {
+        GLenum res = glClientWaitSync(UploadFence[UploadSlot], GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000);
+        if (res != GL_TIMEOUT_EXPIRED) break;
+    }
+
+    glDeleteSync(UploadFence[UploadSlot]);
+    UploadFence[UploadSlot] = 0;
+}
+
+void UploadPolygons()
+{
+    // with persistent buffers, BuildPolygons() already wrote them
+    if (PersistentBuffers) return;
+
+    glBindBuffer(GL_ARRAY_BUFFER, VertexBufferID);
+    glBufferSubData(GL_ARRAY_BUFFER, UploadSlot * VertexBufferSize * 4,
+                    NumVertices*7*4, VertexBuffer);
+
+    u32 iofs = UploadSlot * IndexBufferSize * 2;
+    glBufferSubData(GL_ELEMENT_ARRAY_BUFFER, iofs,
+                    NumIndices*2, &IndexBuffer[0]);
+    glBufferSubData(GL_ELEMENT_ARRAY_BUFFER, iofs + (2048*30)*2,
+                    NumEdgeIndices*2, &IndexBuffer[2048*30]);
+}
+
+void EndUploadSlot()
+{
+    if (PersistentBuffers)
+        UploadFence[UploadSlot] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+
+    UploadSlot = (UploadSlot + 1) % UploadSlots;
+}
+
+void DrawElements(GLenum mode, u32 count, u32 offset)
+{
+    glDrawElements(mode, count, GL_UNSIGNED_SHORT, (void*)(size_t)(offset * 2));
+    NumDrawCalls++;
+}
+
+void DrawArrays(GLenum mode, u32 count)
+{
+    glDrawArrays(mode, 0, count);
+    NumDrawCalls++;
 }
 
 void RenderSinglePolygon(int i)
 {
     RendererPolygon* rp = &PolygonList[i];
 
-    glDrawElements(rp->PrimType, rp->NumIndices, GL_UNSIGNED_SHORT, rp->Indices);
+    DrawElements(rp->PrimType, rp->NumIndices, rp->IndicesOffset);
 }
 
 int RenderPolygonBatch(int i)
@@ -707,7 +1682,7 @@ int RenderPolygonBatch(int i)
         numindices += cur_rp->NumIndices;
     }
 
-    glDrawElements(primtype, numindices, GL_UNSIGNED_SHORT, rp->Indices);
+    DrawElements(primtype, numindices, rp->IndicesOffset);
     return numpolys;
 }
 
@@ -727,10 +1702,97 @@ int RenderPolygonEdgeBatch(int i)
         numindices += cur_rp->NumEdgeIndices;
     }
 
-    glDrawElements(GL_LINES, numindices, GL_UNSIGNED_SHORT, rp->EdgeIndices);
+    DrawElements(GL_LINES, numindices, rp->EdgeIndicesOffset);
     return numpolys;
 }
 
+// state changed a lot while rendering polygons, only sent to GL when it
+// actually changes. ResetRenderState() must be called before using it,
+// as anything else may have changed the state in between.
+
+typedef struct
+{
+    GLenum StencilFunc;
+    GLint StencilRef;
+    GLuint StencilFuncMask;
+    GLenum StencilOp[3];
+    s64 StencilMask;
+    int DepthMask;
+    int ColorMask[2];
+    int Blend;
+
+} RenderStateCache;
+
+EMUSTATE RenderStateCache RenderState;
+
+void ResetRenderState()
+{
+    // values GL never uses, so the next call of each always goes through
+    RenderState.StencilFunc = GL_NONE;
+    RenderState.StencilOp[0] = GL_NONE;
+    RenderState.StencilMask = -1;
+    RenderState.DepthMask = -1;
+    RenderState.ColorMask[0] = -1;
+    RenderState.ColorMask[1] = -1;
+    RenderState.Blend = -1;
+}
+
+void SetStencilFunc(GLenum func, GLint ref, GLuint mask)
+{
+    if (func == RenderState.StencilFunc && ref == RenderState.StencilRef && mask == RenderState.StencilFuncMask)
+        return;
+
+    glStencilFunc(func, ref, mask);
+    RenderState.StencilFunc = func;
+    RenderState.StencilRef = ref;
+    RenderState.StencilFuncMask = mask;
+}
+
+void SetStencilOp(GLenum sfail, GLenum dpfail, GLenum dppass)
+{
+    if (sfail == RenderState.StencilOp[0] && dpfail == RenderState.StencilOp[1] && dppass == RenderState.StencilOp[2])
+        return;
+
+    glStencilOp(sfail, dpfail, dppass);
+    RenderState.StencilOp[0] = sfail;
+    RenderState.StencilOp[1] = dpfail;
+    RenderState.StencilOp[2] = dppass;
+}
+
+void SetStencilMask(GLuint mask)
+{
+    if (mask == RenderState.StencilMask) return;
+
+    glStencilMask(mask);
+    RenderState.StencilMask = mask;
+}
+
+void SetDepthMask(GLboolean enable)
+{
+    if (enable == RenderState.DepthMask) return;
+
+    glDepthMask(enable);
+    RenderState.DepthMask = enable;
+}
+
+void SetColorMask(int buf, GLboolean r, GLboolean g, GLboolean b, GLboolean a)
+{
+    int mask = r | (g << 1) | (b << 2) | (a << 3);
+    if (mask == RenderState.ColorMask[buf]) return;
+
+    glColorMaski(buf, r, g, b, a);
+    RenderState.ColorMask[buf] = mask;
+}
+
+void SetBlend(bool enable)
+{
+    if ((int)enable == RenderState.Blend) return;
+
+    if (enable) glEnable(GL_BLEND);
+    else        glDisable(GL_BLEND);
+    RenderState.Blend = enable;
+}
+
 void RenderSceneChunk(int y, int h)
 {
     u32 flags = 0;
@@ -742,13 +1804,15 @@ void RenderSceneChunk(int y, int h)
 
     // pass 1: opaque pixels
 
+    ResetRenderState();
+
     UseRenderShader(flags);
     glLineWidth(1.0);
 
-    glColorMaski(1, GL_TRUE, GL_TRUE, fogenable, GL_FALSE);
+    SetColorMask(1, GL_TRUE, GL_TRUE, fogenable, GL_FALSE);
 
     glDepthFunc(GL_LESS);
-    glDepthMask(GL_TRUE);
+    SetDepthMask(GL_TRUE);
 
     glBindVertexArray(VertexArrayID);
 
@@ -758,15 +1822,12 @@ void RenderSceneChunk(int y, int h)
 
         if (rp->PolyData->IsShadowMask) { i++; continue; }
 
-        // zorp
-        glDepthFunc(GL_LESS);
-
         u32 polyattr = rp->PolyData->Attr;
         u32 polyid = (polyattr >> 24) & 0x3F;
 
-        glStencilFunc(GL_ALWAYS, polyid, 0xFF);
-        glStencilOp(GL_KEEP, GL_KEEP, GL_REPLACE);
-        glStencilMask(0xFF);
+        SetStencilFunc(GL_ALWAYS, polyid, 0xFF);
+        SetStencilOp(GL_KEEP, GL_KEEP, GL_REPLACE);
+        SetStencilMask(0xFF);
 
         i += RenderPolygonBatch(i);
     }
@@ -777,15 +1838,15 @@ void RenderSceneChunk(int y, int h)
         UseRenderShader(flags | RenderFlag_Edge);
         glLineWidth(1.5);
 
-        glColorMaski(0, GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
-        glColorMaski(1, GL_FALSE, GL_TRUE, GL_FALSE, GL_FALSE);
+        SetColorMask(0, GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+        SetColorMask(1, GL_FALSE, GL_TRUE, GL_FALSE, GL_FALSE);
 
         glDepthFunc(GL_ALWAYS);
-        glDepthMask(GL_FALSE);
+        SetDepthMask(GL_FALSE);
 
-        glStencilFunc(GL_ALWAYS, 0, 0xFF);
-        glStencilOp(GL_KEEP, GL_KEEP, GL_KEEP);
-        glStencilMask(0);
+        SetStencilFunc(GL_ALWAYS, 0, 0xFF);
+        SetStencilOp(GL_KEEP, GL_KEEP, GL_KEEP);
+        SetStencilMask(0);
 
         for (int i = 0; i < NumFinalPolys; )
         {
@@ -796,10 +1857,11 @@ void RenderSceneChunk(int y, int h)
             i += RenderPolygonEdgeBatch(i);
         }
 
-        glDepthMask(GL_TRUE);
+        glDepthFunc(GL_LESS);
+        SetDepthMask(GL_TRUE);
     }
 
-    glEnable(GL_BLEND);
+    SetBlend(true);
     glBlendEquationSeparate(GL_FUNC_ADD, GL_MAX);
 
     if (RenderDispCnt & (1<<3))
@@ -816,7 +1878,7 @@ void RenderSceneChunk(int y, int h)
 
         if ((RenderClearAttr1 & 0x001F0000) == 0)
         {
-            glDisable(GL_BLEND);
+            SetBlend(false);
 
             for (int i = 0; i < NumFinalPolys; )
             {
@@ -828,15 +1890,15 @@ void RenderSceneChunk(int y, int h)
 
                     UseRenderShader(flags | RenderFlag_ShadowMask);
 
-                    glDisable(GL_BLEND);
-                    glColorMaski(0, GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
-                    glColorMaski(1, GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
-                    glDepthMask(GL_FALSE);
+                    SetBlend(false);
+                    SetColorMask(0, GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+                    SetColorMask(1, GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+                    SetDepthMask(GL_FALSE);
 
                     glDepthFunc(GL_LESS);
-                    glStencilFunc(GL_EQUAL, 0xFF, 0xFF);
-                    glStencilOp(GL_KEEP, GL_INVERT, GL_KEEP);
-                    glStencilMask(0x01);
+                    SetStencilFunc(GL_EQUAL, 0xFF, 0xFF);
+                    SetStencilOp(GL_KEEP, GL_INVERT, GL_KEEP);
+                    SetStencilMask(0x01);
 
                     i += RenderPolygonBatch(i);
                 }
@@ -844,9 +1906,6 @@ void RenderSceneChunk(int y, int h)
                 {
                     UseRenderShader(flags | RenderFlag_Trans);
 
-                    // zorp
-                    glDepthFunc(GL_LESS);
-
                     u32 polyattr = rp->PolyData->Attr;
                     u32 polyid = (polyattr >> 24) & 0x3F;
 
@@ -860,30 +1919,30 @@ void RenderSceneChunk(int y, int h)
                         u32 clrpolyid = (RenderClearAttr1 >> 24) & 0x3F;
                         if (polyid != clrpolyid) { i++; continue; }
 
-                        glEnable(GL_BLEND);
-                        glColorMaski(0, GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
-                        glColorMaski(1, GL_FALSE, GL_FALSE, transfog, GL_FALSE);
+                        SetBlend(true);
+                        SetColorMask(0, GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+                        SetColorMask(1, GL_FALSE, GL_FALSE, transfog, GL_FALSE);
 
-                        glStencilFunc(GL_EQUAL, 0xFE, 0xFF);
-                        glStencilOp(GL_KEEP, GL_KEEP, GL_INVERT);
-                        glStencilMask(~(0x40|polyid)); // heheh
+                        SetStencilFunc(GL_EQUAL, 0xFE, 0xFF);
+                        SetStencilOp(GL_KEEP, GL_KEEP, GL_INVERT);
+                        SetStencilMask(~(0x40|polyid)); // heheh
 
-                        if (polyattr & (1<<11)) glDepthMask(GL_TRUE);
-                        else                    glDepthMask(GL_FALSE);
+                        if (polyattr & (1<<11)) SetDepthMask(GL_TRUE);
+                        else                    SetDepthMask(GL_FALSE);
 
                         i += RenderPolygonBatch(i);
                     }
                     else
                     {
-                        glColorMaski(0, GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
-                        glColorMaski(1, GL_FALSE, GL_FALSE, transfog, GL_FALSE);
+                        SetColorMask(0, GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+                        SetColorMask(1, GL_FALSE, GL_FALSE, transfog, GL_FALSE);
 
-                        glStencilFunc(GL_EQUAL, 0xFF, 0xFE);
-                        glStencilOp(GL_KEEP, GL_KEEP, GL_INVERT);
-                        glStencilMask(~(0x40|polyid)); // heheh
+                        SetStencilFunc(GL_EQUAL, 0xFF, 0xFE);
+                        SetStencilOp(GL_KEEP, GL_KEEP, GL_INVERT);
+                        SetStencilMask(~(0x40|polyid)); // heheh
 
-                        if (polyattr & (1<<11)) glDepthMask(GL_TRUE);
-                        else                    glDepthMask(GL_FALSE);
+                        if (polyattr & (1<<11)) SetDepthMask(GL_TRUE);
+                        else                    SetDepthMask(GL_FALSE);
 
                         i += RenderPolygonBatch(i);
                     }
@@ -892,8 +1951,8 @@ void RenderSceneChunk(int y, int h)
                     i++;
             }
 
-            glEnable(GL_BLEND);
-            glStencilMask(0xFF);
+            SetBlend(true);
+            SetStencilMask(0xFF);
         }
 
         // pass 3: translucent pixels
@@ -906,21 +1965,21 @@ void RenderSceneChunk(int y, int h)
             {
                 // clear shadow bits in stencil buffer
 
-                glStencilMask(0x80);
+                SetStencilMask(0x80);
                 glClear(GL_STENCIL_BUFFER_BIT);
 
                 // draw actual shadow mask
 
                 UseRenderShader(flags | RenderFlag_ShadowMask);
 
-                glDisable(GL_BLEND);
-                glColorMaski(0, GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
-                glColorMaski(1, GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
-                glDepthMask(GL_FALSE);
+                SetBlend(false);
+                SetColorMask(0, GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+                SetColorMask(1, GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+                SetDepthMask(GL_FALSE);
 
                 glDepthFunc(GL_LESS);
-                glStencilFunc(GL_ALWAYS, 0x80, 0x80);
-                glStencilOp(GL_KEEP, GL_REPLACE, GL_KEEP);
+                SetStencilFunc(GL_ALWAYS, 0x80, 0x80);
+                SetStencilOp(GL_KEEP, GL_REPLACE, GL_KEEP);
 
                 i += RenderPolygonBatch(i);
             }
@@ -935,47 +1994,44 @@ void RenderSceneChunk(int y, int h)
                 if (!(polyattr & (1<<15))) transfog = fogenable;
                 else                       transfog = GL_FALSE;
 
-                // zorp
-                glDepthFunc(GL_LESS);
-
                 if (rp->PolyData->IsShadow)
                 {
-                    glDisable(GL_BLEND);
-                    glColorMaski(0, GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
-                    glColorMaski(1, GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
-                    glDepthMask(GL_FALSE);
-                    glStencilFunc(GL_EQUAL, polyid, 0x3F);
-                    glStencilOp(GL_KEEP, GL_KEEP, GL_ZERO);
-                    glStencilMask(0x80);
+                    SetBlend(false);
+                    SetColorMask(0, GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+                    SetColorMask(1, GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+                    SetDepthMask(GL_FALSE);
+                    SetStencilFunc(GL_EQUAL, polyid, 0x3F);
+                    SetStencilOp(GL_KEEP, GL_KEEP, GL_ZERO);
+                    SetStencilMask(0x80);
 
                     RenderSinglePolygon(i);
 
-                    glEnable(GL_BLEND);
-                    glColorMaski(0, GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
-                    glColorMaski(1, GL_FALSE, GL_FALSE, transfog, GL_FALSE);
+                    SetBlend(true);
+                    SetColorMask(0, GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+                    SetColorMask(1, GL_FALSE, GL_FALSE, transfog, GL_FALSE);
 
-                    glStencilFunc(GL_EQUAL, 0xC0|polyid, 0x80);
-                    glStencilOp(GL_KEEP, GL_KEEP, GL_REPLACE);
-                    glStencilMask(0x7F);
+                    SetStencilFunc(GL_EQUAL, 0xC0|polyid, 0x80);
+                    SetStencilOp(GL_KEEP, GL_KEEP, GL_REPLACE);
+                    SetStencilMask(0x7F);
 
-                    if (polyattr & (1<<11)) glDepthMask(GL_TRUE);
-                    else                    glDepthMask(GL_FALSE);
+                    if (polyattr & (1<<11)) SetDepthMask(GL_TRUE);
+                    else                    SetDepthMask(GL_FALSE);
 
                     RenderSinglePolygon(i);
                     i++;
                 }
                 else
                 {
-                    glEnable(GL_BLEND);
-                    glColorMaski(0, GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
-                    glColorMaski(1, GL_FALSE, GL_FALSE, transfog, GL_FALSE);
+                    SetBlend(true);
+                    SetColorMask(0, GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+                    SetColorMask(1, GL_FALSE, GL_FALSE, transfog, GL_FALSE);
 
-                    glStencilFunc(GL_NOTEQUAL, 0x40|polyid, 0x7F);
-                    glStencilOp(GL_KEEP, GL_KEEP, GL_REPLACE);
-                    glStencilMask(0x7F);
+                    SetStencilFunc(GL_NOTEQUAL, 0x40|polyid, 0x7F);
+                    SetStencilOp(GL_KEEP, GL_KEEP, GL_REPLACE);
+                    SetStencilMask(0x7F);
 
-                    if (polyattr & (1<<11)) glDepthMask(GL_TRUE);
-                    else                    glDepthMask(GL_FALSE);
+                    if (polyattr & (1<<11)) SetDepthMask(GL_TRUE);
+                    else                    SetDepthMask(GL_FALSE);
 
                     i += RenderPolygonBatch(i);
                 }
@@ -1018,7 +2074,7 @@ void RenderSceneChunk(int y, int h)
 
             glBlendFuncSeparate(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA, GL_ZERO, GL_ONE);
 
-            glDrawArrays(GL_TRIANGLES, 0, 2*3);
+            DrawArrays(GL_TRIANGLES, 2*3);
         }
 
         if (RenderDispCnt & (1<<7))
@@ -1042,7 +2098,7 @@ void RenderSceneChunk(int y, int h)
                 glBlendColor((float)b/31.0, (float)g/31.0, (float)r/31.0, (float)a/31.0);
             }
 
-            glDrawArrays(GL_TRIANGLES, 0, 2*3);
+            DrawArrays(GL_TRIANGLES, 2*3);
         }
 
         glFlush();
@@ -1050,8 +2106,65 @@ void RenderSceneChunk(int y, int h)
 }
 
 
+void StartReadback()
+{
+    // TODO: make sure this picks the right buffer when doing antialiasing
+    int original_fb = FrontBuffer^1;
+
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, FramebufferID[original_fb]);
+    glReadBuffer(GL_COLOR_ATTACHMENT0);
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, FramebufferID[3]);
+    glDrawBuffer(GL_COLOR_ATTACHMENT0);
+    glBlitFramebuffer(0, 0, ScreenW, ScreenH, 0, 0, 256, 192, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, FramebufferID[3]);
+
+    ReadbackSlot = (ReadbackSlot + 1) % ReadbackSlots;
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, ReadbackBufferID[ReadbackSlot]);
+
+    for (int b = 0; b < ReadbackBands; b++)
+    {
+        u32 y = b * ReadbackBandLines;
+        glReadPixels(0, y, 256, ReadbackBandLines, GL_BGRA, GL_UNSIGNED_BYTE, (void*)(size_t)(y*256*4));
+
+        if (!ReadbackFences) continue;
+
+        // a readback that was started but never used
+        if (ReadbackFence[ReadbackSlot][b]) glDeleteSync(ReadbackFence[ReadbackSlot][b]);
+        ReadbackFence[ReadbackSlot][b] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    }
+
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+    // get the GPU going on it right away
+    glFlush();
+
+    ReadbackBandsDone = 0;
+    ReadbackStarted = true;
+    ReadbackStalled = false;
+    ReadbackFrames++;
+}
+
+
 void RenderFrame()
 {
+    NumDrawCalls = 0;
+
+    CaptureLastFrame = CaptureRequested;
+    CaptureRequested = false;
+    ReadbackStarted = false;
+
+    // the previous frame was the same as the one before it,
+    // so both framebuffers already hold this frame
+    if (RenderFrameRepeats >= 2)
+    {
+        glBindFramebuffer(GL_FRAMEBUFFER, FramebufferID[FrontBuffer]);
+        FrontBuffer = FrontBuffer ? 0 : 1;
+
+        if (CaptureLastFrame) StartReadback();
+        return;
+    }
+
     CurShaderID = -1;
 
     if (Antialias) glBindFramebuffer(GL_FRAMEBUFFER, FramebufferID[2]);
@@ -1112,37 +2225,17 @@ void RenderFrame()
     if (unibuf) memcpy(unibuf, &ShaderConfig, sizeof(ShaderConfig));
     glUnmapBuffer(GL_UNIFORM_BUFFER);
 
-    // SUCKY!!!!!!!!!!!!!!!!!!
-    // TODO: detect when VRAM blocks are modified!
     glActiveTexture(GL_TEXTURE0);
     glBindTexture(GL_TEXTURE_2D, TexMemID);
-    for (int i = 0; i < 4; i++)
-    {
-        u32 mask = GPU::VRAMMap_Texture[i];
-        u8* vram;
-        if (!mask) continue;
-        else if (mask & (1<<0)) vram = GPU::VRAM_A;
-        else if (mask & (1<<1)) vram = GPU::VRAM_B;
-        else if (mask & (1<<2)) vram = GPU::VRAM_C;
-        else if (mask & (1<<3)) vram = GPU::VRAM_D;
-
-        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, i*128, 1024, 128, GL_RED_INTEGER, GL_UNSIGNED_BYTE, vram);
-    }
-
     glActiveTexture(GL_TEXTURE1);
     glBindTexture(GL_TEXTURE_2D, TexPalMemID);
-    for (int i = 0; i < 6; i++)
-    {
-        // 6 x 16K chunks
-        u32 mask = GPU::VRAMMap_TexPal[i];
-        u8* vram;
-        if (!mask) continue;
-        else if (mask & (1<<4)) vram = &GPU::VRAM_E[(i&3)*0x4000];
-        else if (mask & (1<<5)) vram = GPU::VRAM_F;
-        else if (mask & (1<<6)) vram = GPU::VRAM_G;
+    glActiveTexture(GL_TEXTURE2);
+    glBindTexture(GL_TEXTURE_2D, TexCacheID);
 
-        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, i*8, 1024, 8, GL_RGBA, GL_UNSIGNED_SHORT_1_5_5_5_REV, vram);
-    }
+    // textures are decoded as polygons are set up
+    UpdateTexCacheVRAM();
+    TexCacheFrame++;
+    TexCacheMissed = false;
 
     glDisable(GL_SCISSOR_TEST);
     glEnable(GL_DEPTH_TEST);
@@ -1186,7 +2279,7 @@ void RenderFrame()
 
         glBindBuffer(GL_ARRAY_BUFFER, ClearVertexBufferID);
         glBindVertexArray(ClearVertexArrayID);
-        glDrawArrays(GL_TRIANGLES, 0, 2*3);
+        DrawArrays(GL_TRIANGLES, 2*3);
     }
 
     if (RenderNumPolygons)
@@ -1210,11 +2303,17 @@ void RenderFrame()
         NumFinalPolys = npolys;
         NumOpaqueFinalPolys = firsttrans;
 
+        if (TexCacheMissed) UploadRawTexVRAM();
+
+        GroupPolygons(npolys);
+
+        glBindVertexArray(VertexArrayID);
+        WaitForUploadSlot();
         BuildPolygons(&PolygonList[0], npolys);
-        glBindBuffer(GL_ARRAY_BUFFER, VertexBufferID);
-        glBufferSubData(GL_ARRAY_BUFFER, 0, NumVertices*7*4, VertexBuffer);
+        UploadPolygons();
 
         RenderSceneChunk(0, 192);
+        EndUploadSlot();
     }
 
     if (Antialias)
@@ -1226,44 +2325,95 @@ void RenderFrame()
 
     glBindFramebuffer(GL_FRAMEBUFFER, FramebufferID[FrontBuffer]);
     FrontBuffer = FrontBuffer ? 0 : 1;
+
+    // games that capture usually do so every frame
+    if (CaptureLastFrame) StartReadback();
 }
 
 void PrepareCaptureFrame()
 {
-    // TODO: make sure this picks the right buffer when doing antialiasing
-    int original_fb = FrontBuffer^1;
+    CaptureRequested = true;
 
-    glBindFramebuffer(GL_READ_FRAMEBUFFER, FramebufferID[original_fb]);
-    glReadBuffer(GL_COLOR_ATTACHMENT0);
-    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, FramebufferID[3]);
-    glDrawBuffer(GL_COLOR_ATTACHMENT0);
-    glBlitFramebuffer(0, 0, ScreenW, ScreenH, 0, 0, 256, 192, GL_COLOR_BUFFER_BIT, GL_NEAREST);
-
-    glBindFramebuffer(GL_READ_FRAMEBUFFER, FramebufferID[3]);
-    glReadPixels(0, 0, 256, 192, GL_BGRA, GL_UNSIGNED_BYTE, NULL);
+    // may have been started already, right after rendering
+    if (!ReadbackStarted) StartReadback();
 }
 
-u32* GetLine(int line)
+void ConvertPixels(u32* dst, u32* src, int count)
 {
-    int stride = 256;
-
-    if (line == 0)
+    // BGRA8 to the 2D engines' format: 6-bit color, 5-bit alpha
+    int i = 0;
+#ifdef OGL_SSE2
+    const __m128i rgbmask = _mm_set1_epi32(0x00FCFCFC);
+    const __m128i amask = _mm_set1_epi32(0xF8000000);
+    for (; i + 4 <= count; i += 4)
     {
-        u8* data = (u8*)glMapBuffer(GL_PIXEL_PACK_BUFFER, GL_READ_ONLY);
-        if (data) memcpy(&Framebuffer[stride*0], data, 4*stride*192);
-        glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+        __m128i px = _mm_loadu_si128((__m128i*)&src[i]);
+        __m128i rgb = _mm_srli_epi32(_mm_and_si128(px, rgbmask), 2);
+        __m128i a = _mm_srli_epi32(_mm_and_si128(px, amask), 3);
+        _mm_storeu_si128((__m128i*)&dst[i], _mm_or_si128(rgb, a));
     }
+#endif
+    for (; i < count; i++)
+    {
+        u32 px = src[i];
+        dst[i] = ((px & 0x00FCFCFC) >> 2) | ((px & 0xF8000000) >> 3);
+    }
+}
 
-    u64* ptr = (u64*)&Framebuffer[stride * line];
-    for (int i = 0; i < stride; i+=2)
+void FetchReadbackBand(int band)
+{
+    GLsync& fence = ReadbackFence[ReadbackSlot][band];
+    if (fence)
     {
-        u64 rgb = *ptr & 0x00FCFCFC00FCFCFC;
-        u64 a = *ptr & 0xF8000000F8000000;
+        // not done yet: the emulation has to wait for the GPU
+        if (glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 0) == GL_TIMEOUT_EXPIRED)
+        {
+            if (!ReadbackStalled) ReadbackStallFrames++;
+            ReadbackStalled = true;
 
-        *ptr++ = (rgb >> 2) | (a >> 3);
+            while (glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000) == GL_TIMEOUT_EXPIRED);
+        }
+
+        glDeleteSync(fence);
+        fence = 0;
     }
 
-    return &Framebuffer[stride * line];
+    u32 offset = band * ReadbackBandLines * 256;
+    u32 count = ReadbackBandLines * 256;
+
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, ReadbackBufferID[ReadbackSlot]);
+    u32* data = (u32*)glMapBufferRange(GL_PIXEL_PACK_BUFFER, offset*4, count*4, GL_MAP_READ_BIT);
+    if (data) ConvertPixels(&Framebuffer[offset], data, count);
+    glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+    ReadbackBandsDone |= (1 << band);
+}
+
+void GetReadbackStats(u32* frames, u32* stalls)
+{
+    *frames = ReadbackFrames;
+    *stalls = ReadbackStallFrames;
+}
+
+void GetTexCacheStats(u32* decoded, u64* uploaded)
+{
+    *decoded = TexCacheDecodes;
+    *uploaded = TexCacheUploadSize;
+}
+
+u32 GetDrawCallCount()
+{
+    return NumDrawCalls;
+}
+
+u32* GetLine(int line)
+{
+    int band = line / ReadbackBandLines;
+    if (!(ReadbackBandsDone & (1 << band)))
+        FetchReadbackBand(band);
+
+    return &Framebuffer[256 * line];
 }
 
 void SetupAccelFrame()
@@ -243,6 +243,7 @@ const char* kRenderFSCommon = R"(
 
 uniform usampler2D TexMem;
 uniform sampler2D TexPalMem;
+uniform usampler2D TexCache;
 
 layout(std140) uniform uConfig
 {
@@ -454,6 +455,17 @@ vec4 TextureFetch_Direct(ivec2 addr, ivec4 st, int wrapmode)
     return color;
 }
 
+vec4 TextureFetch_Cached(ivec2 pos, ivec4 st, int wrapmode)
+{
+    st.x = TexcoordWrap(st.x, st.z, wrapmode>>0);
+    st.y = TexcoordWrap(st.y, st.w, wrapmode>>1);
+
+    // color components are stored times 8
+    ivec4 pixel = ivec4(texelFetch(TexCache, pos + st.xy, 0));
+
+    return vec4(vec3(pixel.rgb) * (1.0 / 248.0), float(pixel.a) / 31.0);
+}
+
 vec4 TextureLookup_Nearest(vec2 st)
 {
     int attr = int(fPolygonAttr.y);
@@ -470,8 +482,12 @@ vec4 TextureLookup_Nearest(vec2 st)
     ivec2 vramaddr = ivec2((attr & 0xFFFF) << 3, paladdr);
     int wrapmode = (attr >> 16);
 
+    // bit31 set: the texture is in the texture cache, at this position
+    ivec2 cachepos = ivec2((paladdr & 0xFF) << 3, ((paladdr >> 8) & 0xFF) << 3);
+
     int type = (attr >> 26) & 0x7;
-    if      (type == 5) return TextureFetch_Compressed(vramaddr, st_full, wrapmode);
+    if      (paladdr < 0) return TextureFetch_Cached(cachepos, st_full, wrapmode);
+    else if (type == 5) return TextureFetch_Compressed(vramaddr, st_full, wrapmode);
     else if (type == 2) return TextureFetch_I2        (vramaddr, st_full, wrapmode, alpha0);
     else if (type == 3) return TextureFetch_I4        (vramaddr, st_full, wrapmode, alpha0);
     else if (type == 4) return TextureFetch_I8        (vramaddr, st_full, wrapmode, alpha0);
@@ -499,9 +515,18 @@ vec4 TextureLookup_Linear(vec2 texcoord)
     ivec2 vramaddr = ivec2((attr & 0xFFFF) << 3, paladdr);
     int wrapmode = (attr >> 16);
 
+    ivec2 cachepos = ivec2((paladdr & 0xFF) << 3, ((paladdr >> 8) & 0xFF) << 3);
+
     vec4 A, B, C, D;
     int type = (attr >> 26) & 0x7;
-    if (type == 5)
+    if (paladdr < 0)
+    {
+        A = TextureFetch_Cached(cachepos, st_full                 , wrapmode);
+        B = TextureFetch_Cached(cachepos, st_full + ivec4(1,0,0,0), wrapmode);
+        C = TextureFetch_Cached(cachepos, st_full + ivec4(0,1,0,0), wrapmode);
+        D = TextureFetch_Cached(cachepos, st_full + ivec4(1,1,0,0), wrapmode);
+    }
+    else if (type == 5)
     {
         A = TextureFetch_Compressed(vramaddr, st_full                 , wrapmode);
         B = TextureFetch_Compressed(vramaddr, st_full + ivec4(1,0,0,0), wrapmode);
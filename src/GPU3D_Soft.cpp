@@ -22,6 +22,17 @@
 #include "GPU.h"
 #include "Config.h"
 #include "Platform.h"
+#include "Profiler.h"
+
+#ifdef __SSE2__
+#define SOFT_SSE2
+#include <emmintrin.h>
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SOFT_X86
+#include <immintrin.h>
+#endif
 
 
 namespace GPU3D
@@ -29,20 +40,38 @@ namespace GPU3D
 namespace SoftRenderer
 {
 
-// buffer dimensions are 258x194 to add a offscreen 1px border
-// which simplifies edge marking tests
+// buffer dimensions are 272x194 to add a offscreen border
+// which simplifies edge marking tests: only the pixels right next to
+// the screen (x=-1, x=256, first and last line) are used, the rest
+// is padding so every line starts on a pixel group boundary
 // buffer is duplicated to keep track of the two topmost pixels
 // TODO: check if the hardware can accidentally plot pixels
 // offscreen in that border
 
-const int ScanlineWidth = 258;
+const int ScanlineWidth = 272;
 const int NumScanlines = 194;
 const int BufferSize = ScanlineWidth * NumScanlines;
-const int FirstPixelOffset = ScanlineWidth + 1;
+const int FirstPixelOffset = ScanlineWidth + 8;
+
+// the color, depth and attribute of a pixel are all accessed together when
+// rendering, so they're stored in groups of 8 pixels: 8 colors, 8 depths,
+// then 8 attributes. this keeps them within the same cache lines, while the
+// final pass and the clear still get contiguous runs of the same kind of value.
+
+const int PixelGroupSize = 8 * 3;
+
+const int PixelBufferSize = (BufferSize * 2 / 8) * PixelGroupSize;
+
+// aligned to 64 bytes, for the vector code
+EMUSTATE u8* PixelBufferMem;
+EMUSTATE u32* PixelBuffer;
 
-u32 ColorBuffer[BufferSize * 2];
-u32 DepthBuffer[BufferSize * 2];
-u32 AttrBuffer[BufferSize * 2];
+inline u32& PixelColor(u32 addr) { return PixelBuffer[((addr >> 3) * PixelGroupSize) + (addr & 7)]; }
+inline u32& PixelDepth(u32 addr) { return PixelBuffer[((addr >> 3) * PixelGroupSize) + 8 + (addr & 7)]; }
+inline u32& PixelAttr(u32 addr)  { return PixelBuffer[((addr >> 3) * PixelGroupSize) + 16 + (addr & 7)]; }
+
+// final colors, as handed to GPU2D
+EMUSTATE u32* OutputBuffer; // 256 * 192
 
 // attribute buffer:
 // bit0-3: edge flags (left/right/top/bottom)
@@ -53,19 +82,19 @@ u32 AttrBuffer[BufferSize * 2];
 // bit22: translucent flag
 // bit24-29: polygon ID for opaque pixels
 
-u8 StencilBuffer[256*2];
-bool PrevIsShadowMask;
+EMUSTATE u8 StencilBuffer[256*2];
+EMUSTATE bool PrevIsShadowMask;
 
-bool Enabled;
+EMUSTATE bool Enabled;
 
 // threading
 
-void* RenderThread;
-bool RenderThreadRunning;
-bool RenderThreadRendering;
-void* Sema_RenderStart;
-void* Sema_RenderDone;
-void* Sema_ScanlineCount;
+EMUSTATE void* RenderThread;
+EMUSTATE bool RenderThreadRunning;
+EMUSTATE bool RenderThreadRendering;
+EMUSTATE void* Sema_RenderStart;
+EMUSTATE void* Sema_RenderDone;
+EMUSTATE void* Sema_ScanlineCount;
 
 void RenderThreadFunc();
 
@@ -83,10 +112,19 @@ void StopRenderThread()
 
 void SetupRenderThread()
 {
-    if (Config::Threaded3D)
+    bool threaded = Config::Threaded3D != 0;
+#ifdef MULTI_INSTANCE
+    // the render thread wouldn't see this instance's state
+    threaded = false;
+#endif
+
+    if (threaded)
     {
         if (!RenderThreadRunning)
         {
+            // a previously stopped thread may have left a completion signal behind
+            Platform::Semaphore_Reset(Sema_RenderDone);
+
             RenderThreadRunning = true;
             RenderThread = Platform::Thread_Create(RenderThreadFunc);
         }
@@ -106,40 +144,6 @@ void SetupRenderThread()
 }
 
 
-bool Init()
-{
-    Sema_RenderStart = Platform::Semaphore_Create();
-    Sema_RenderDone = Platform::Semaphore_Create();
-    Sema_ScanlineCount = Platform::Semaphore_Create();
-
-    RenderThreadRunning = false;
-    RenderThreadRendering = false;
-
-    return true;
-}
-
-void DeInit()
-{
-    StopRenderThread();
-
-    Platform::Semaphore_Free(Sema_RenderStart);
-    Platform::Semaphore_Free(Sema_RenderDone);
-    Platform::Semaphore_Free(Sema_ScanlineCount);
-}
-
-void Reset()
-{
-    memset(ColorBuffer, 0, BufferSize * 2 * 4);
-    memset(DepthBuffer, 0, BufferSize * 2 * 4);
-    memset(AttrBuffer, 0, BufferSize * 2 * 4);
-
-    PrevIsShadowMask = false;
-
-    SetupRenderThread();
-}
-
-
-
 // Notes on the interpolator:
 //
 // This is a theory on how the DS hardware interpolates values. It matches hardware output
@@ -540,7 +544,48 @@ typedef struct
 
 } RendererPolygon;
 
-RendererPolygon PolygonList[2048];
+EMUSTATE RendererPolygon* PolygonList; // 2048
+
+
+bool Init()
+{
+    PixelBufferMem = new u8[PixelBufferSize * 4 + 63];
+    PixelBuffer = (u32*)(((uintptr_t)PixelBufferMem + 63) & ~(uintptr_t)63);
+    OutputBuffer = new u32[256 * 192];
+    PolygonList = new RendererPolygon[2048];
+
+    Sema_RenderStart = Platform::Semaphore_Create();
+    Sema_RenderDone = Platform::Semaphore_Create();
+    Sema_ScanlineCount = Platform::Semaphore_Create();
+
+    RenderThreadRunning = false;
+    RenderThreadRendering = false;
+
+    return true;
+}
+
+void DeInit()
+{
+    StopRenderThread();
+
+    Platform::Semaphore_Free(Sema_RenderStart);
+    Platform::Semaphore_Free(Sema_RenderDone);
+    Platform::Semaphore_Free(Sema_ScanlineCount);
+
+    delete[] PixelBufferMem;
+    delete[] OutputBuffer;
+    delete[] PolygonList;
+}
+
+void Reset()
+{
+    memset(PixelBuffer, 0, PixelBufferSize * 4);
+    memset(OutputBuffer, 0, 256 * 192 * 4);
+
+    PrevIsShadowMask = false;
+
+    SetupRenderThread();
+}
 
 
 void TextureLookup(u32 texparam, u32 texpal, s16 s, s16 t, u16* color, u8* alpha)
@@ -959,7 +1004,7 @@ u32 RenderPixel(Polygon* polygon, u8 vr, u8 vg, u8 vb, s16 s, s16 t)
 
 void PlotTranslucentPixel(u32 pixeladdr, u32 color, u32 z, u32 polyattr, u32 shadow)
 {
-    u32 dstattr = AttrBuffer[pixeladdr];
+    u32 dstattr = PixelAttr(pixeladdr);
     u32 attr = (polyattr & 0xE0F0) | ((polyattr >> 8) & 0xFF0000) | (1<<22) | (dstattr & 0xFF001F0F);
 
     if (shadow)
@@ -987,13 +1032,13 @@ void PlotTranslucentPixel(u32 pixeladdr, u32 color, u32 z, u32 polyattr, u32 sha
     if (!(dstattr & (1<<15)))
         attr &= ~(1<<15);
 
-    color = AlphaBlend(color, ColorBuffer[pixeladdr], color>>24);
+    color = AlphaBlend(color, PixelColor(pixeladdr), color>>24);
 
     if (z != -1)
-        DepthBuffer[pixeladdr] = z;
+        PixelDepth(pixeladdr) = z;
 
-    ColorBuffer[pixeladdr] = color;
-    AttrBuffer[pixeladdr] = attr;
+    PixelColor(pixeladdr) = color;
+    PixelAttr(pixeladdr) = attr;
 }
 
 void SetupPolygonLeftEdge(RendererPolygon* rp, s32 y)
@@ -1240,19 +1285,19 @@ void RenderShadowMaskScanline(RendererPolygon* rp, s32 y)
         interpX.SetX(x);
 
         s32 z = interpX.InterpolateZ(zl, zr, polygon->WBuffer);
-        u32 dstattr = AttrBuffer[pixeladdr];
+        u32 dstattr = PixelAttr(pixeladdr);
 
         // checkme
         if (!l_filledge)
             continue;
 
-        if (!fnDepthTest(DepthBuffer[pixeladdr], z, dstattr))
+        if (!fnDepthTest(PixelDepth(pixeladdr), z, dstattr))
             StencilBuffer[256*(y&0x1) + x] |= 0x1;
 
         if (dstattr & 0x3)
         {
             pixeladdr += BufferSize;
-            if (!fnDepthTest(DepthBuffer[pixeladdr], z, AttrBuffer[pixeladdr]))
+            if (!fnDepthTest(PixelDepth(pixeladdr), z, PixelAttr(pixeladdr)))
                 StencilBuffer[256*(y&0x1) + x] |= 0x2;
         }
     }
@@ -1270,15 +1315,15 @@ void RenderShadowMaskScanline(RendererPolygon* rp, s32 y)
         interpX.SetX(x);
 
         s32 z = interpX.InterpolateZ(zl, zr, polygon->WBuffer);
-        u32 dstattr = AttrBuffer[pixeladdr];
+        u32 dstattr = PixelAttr(pixeladdr);
 
-        if (!fnDepthTest(DepthBuffer[pixeladdr], z, dstattr))
+        if (!fnDepthTest(PixelDepth(pixeladdr), z, dstattr))
             StencilBuffer[256*(y&0x1) + x] = 1;
 
         if (dstattr & 0x3)
         {
             pixeladdr += BufferSize;
-            if (!fnDepthTest(DepthBuffer[pixeladdr], z, AttrBuffer[pixeladdr]))
+            if (!fnDepthTest(PixelDepth(pixeladdr), z, PixelAttr(pixeladdr)))
                 StencilBuffer[256*(y&0x1) + x] |= 0x2;
         }
     }
@@ -1295,19 +1340,19 @@ void RenderShadowMaskScanline(RendererPolygon* rp, s32 y)
         interpX.SetX(x);
 
         s32 z = interpX.InterpolateZ(zl, zr, polygon->WBuffer);
-        u32 dstattr = AttrBuffer[pixeladdr];
+        u32 dstattr = PixelAttr(pixeladdr);
 
         // checkme
         if (!r_filledge)
             continue;
 
-        if (!fnDepthTest(DepthBuffer[pixeladdr], z, dstattr))
+        if (!fnDepthTest(PixelDepth(pixeladdr), z, dstattr))
             StencilBuffer[256*(y&0x1) + x] = 1;
 
         if (dstattr & 0x3)
         {
             pixeladdr += BufferSize;
-            if (!fnDepthTest(DepthBuffer[pixeladdr], z, AttrBuffer[pixeladdr]))
+            if (!fnDepthTest(PixelDepth(pixeladdr), z, PixelAttr(pixeladdr)))
                 StencilBuffer[256*(y&0x1) + x] |= 0x2;
         }
     }
@@ -1471,7 +1516,7 @@ void RenderPolygonScanline(RendererPolygon* rp, s32 y)
     for (; x < xlimit; x++)
     {
         u32 pixeladdr = FirstPixelOffset + (y*ScanlineWidth) + x;
-        u32 dstattr = AttrBuffer[pixeladdr];
+        u32 dstattr = PixelAttr(pixeladdr);
 
         // check stencil buffer for shadows
         if (polygon->IsShadow)
@@ -1491,13 +1536,14 @@ void RenderPolygonScanline(RendererPolygon* rp, s32 y)
 
         // if depth test against the topmost pixel fails, test
         // against the pixel underneath
-        if (!fnDepthTest(DepthBuffer[pixeladdr], z, dstattr))
+        if (!fnDepthTest(PixelDepth(pixeladdr), z, dstattr))
         {
-            if (!(dstattr & 0x3)) continue;
+            // shadows may already be testing the pixel underneath
+            if (!(dstattr & 0x3) || pixeladdr >= BufferSize) continue;
 
             pixeladdr += BufferSize;
-            dstattr = AttrBuffer[pixeladdr];
-            if (!fnDepthTest(DepthBuffer[pixeladdr], z, dstattr))
+            dstattr = PixelAttr(pixeladdr);
+            if (!fnDepthTest(PixelDepth(pixeladdr), z, dstattr))
                 continue;
         }
 
@@ -1535,15 +1581,15 @@ void RenderPolygonScanline(RendererPolygon* rp, s32 y)
                 // push old pixel down if needed
                 if (pixeladdr < BufferSize)
                 {
-                    ColorBuffer[pixeladdr+BufferSize] = ColorBuffer[pixeladdr];
-                    DepthBuffer[pixeladdr+BufferSize] = DepthBuffer[pixeladdr];
-                    AttrBuffer[pixeladdr+BufferSize] = AttrBuffer[pixeladdr];
+                    PixelColor(pixeladdr+BufferSize) = PixelColor(pixeladdr);
+                    PixelDepth(pixeladdr+BufferSize) = PixelDepth(pixeladdr);
+                    PixelAttr(pixeladdr+BufferSize) = PixelAttr(pixeladdr);
                 }
             }
 
-            DepthBuffer[pixeladdr] = z;
-            ColorBuffer[pixeladdr] = color;
-            AttrBuffer[pixeladdr] = attr;
+            PixelDepth(pixeladdr) = z;
+            PixelColor(pixeladdr) = color;
+            PixelAttr(pixeladdr) = attr;
         }
         else
         {
@@ -1567,7 +1613,7 @@ void RenderPolygonScanline(RendererPolygon* rp, s32 y)
     for (; x < xlimit; x++)
     {
         u32 pixeladdr = FirstPixelOffset + (y*ScanlineWidth) + x;
-        u32 dstattr = AttrBuffer[pixeladdr];
+        u32 dstattr = PixelAttr(pixeladdr);
 
         // check stencil buffer for shadows
         if (polygon->IsShadow)
@@ -1587,13 +1633,14 @@ void RenderPolygonScanline(RendererPolygon* rp, s32 y)
 
         // if depth test against the topmost pixel fails, test
         // against the pixel underneath
-        if (!fnDepthTest(DepthBuffer[pixeladdr], z, dstattr))
+        if (!fnDepthTest(PixelDepth(pixeladdr), z, dstattr))
         {
-            if (!(dstattr & 0x3)) continue;
+            // shadows may already be testing the pixel underneath
+            if (!(dstattr & 0x3) || pixeladdr >= BufferSize) continue;
 
             pixeladdr += BufferSize;
-            dstattr = AttrBuffer[pixeladdr];
-            if (!fnDepthTest(DepthBuffer[pixeladdr], z, dstattr))
+            dstattr = PixelAttr(pixeladdr);
+            if (!fnDepthTest(PixelDepth(pixeladdr), z, dstattr))
                 continue;
         }
 
@@ -1613,9 +1660,9 @@ void RenderPolygonScanline(RendererPolygon* rp, s32 y)
         if (alpha == 31)
         {
             u32 attr = polyattr | edge;
-            DepthBuffer[pixeladdr] = z;
-            ColorBuffer[pixeladdr] = color;
-            AttrBuffer[pixeladdr] = attr;
+            PixelDepth(pixeladdr) = z;
+            PixelColor(pixeladdr) = color;
+            PixelAttr(pixeladdr) = attr;
         }
         else
         {
@@ -1642,7 +1689,7 @@ void RenderPolygonScanline(RendererPolygon* rp, s32 y)
     for (; x < xlimit; x++)
     {
         u32 pixeladdr = FirstPixelOffset + (y*ScanlineWidth) + x;
-        u32 dstattr = AttrBuffer[pixeladdr];
+        u32 dstattr = PixelAttr(pixeladdr);
 
         // check stencil buffer for shadows
         if (polygon->IsShadow)
@@ -1662,13 +1709,14 @@ void RenderPolygonScanline(RendererPolygon* rp, s32 y)
 
         // if depth test against the topmost pixel fails, test
         // against the pixel underneath
-        if (!fnDepthTest(DepthBuffer[pixeladdr], z, dstattr))
+        if (!fnDepthTest(PixelDepth(pixeladdr), z, dstattr))
         {
-            if (!(dstattr & 0x3)) continue;
+            // shadows may already be testing the pixel underneath
+            if (!(dstattr & 0x3) || pixeladdr >= BufferSize) continue;
 
             pixeladdr += BufferSize;
-            dstattr = AttrBuffer[pixeladdr];
-            if (!fnDepthTest(DepthBuffer[pixeladdr], z, dstattr))
+            dstattr = PixelAttr(pixeladdr);
+            if (!fnDepthTest(PixelDepth(pixeladdr), z, dstattr))
                 continue;
         }
 
@@ -1706,15 +1754,15 @@ void RenderPolygonScanline(RendererPolygon* rp, s32 y)
                 // push old pixel down if needed
                 if (pixeladdr < BufferSize)
                 {
-                    ColorBuffer[pixeladdr+BufferSize] = ColorBuffer[pixeladdr];
-                    DepthBuffer[pixeladdr+BufferSize] = DepthBuffer[pixeladdr];
-                    AttrBuffer[pixeladdr+BufferSize] = AttrBuffer[pixeladdr];
+                    PixelColor(pixeladdr+BufferSize) = PixelColor(pixeladdr);
+                    PixelDepth(pixeladdr+BufferSize) = PixelDepth(pixeladdr);
+                    PixelAttr(pixeladdr+BufferSize) = PixelAttr(pixeladdr);
                 }
             }
 
-            DepthBuffer[pixeladdr] = z;
-            ColorBuffer[pixeladdr] = color;
-            AttrBuffer[pixeladdr] = attr;
+            PixelDepth(pixeladdr) = z;
+            PixelColor(pixeladdr) = color;
+            PixelAttr(pixeladdr) = attr;
         }
         else
         {
@@ -1751,7 +1799,7 @@ void RenderScanline(s32 y, int npolys)
 
 u32 CalculateFogDensity(u32 pixeladdr)
 {
-    u32 z = DepthBuffer[pixeladdr];
+    u32 z = PixelDepth(pixeladdr);
     u32 densityid, densityfrac;
 
     if (z < RenderFogOffset)
@@ -1788,7 +1836,254 @@ u32 CalculateFogDensity(u32 pixeladdr)
     return density;
 }
 
-void ScanlineFinalPass(s32 y)
+#ifdef SOFT_X86
+
+// AVX2 version of the final pass. each pass works on whole pixel groups, so
+// the colors, depths and attributes of 8 pixels are loaded at once. the
+// results are the exact same as the scalar code: products are small enough
+// to be done on 16 bits, and the cases where the scalar code leaves a
+// channel unchanged are done by blending with a factor that keeps it as is.
+
+__attribute__((target("avx2")))
+__m256i FogDensity_AVX2(__m256i z, const u32* densitytable)
+{
+    __m256i fogoffset = _mm256_set1_epi32(RenderFogOffset);
+    __m256i infog = _mm256_cmpeq_epi32(_mm256_max_epu32(z, fogoffset), z);
+
+    z = _mm256_srli_epi32(_mm256_sub_epi32(z, fogoffset), 2);
+    z = _mm256_sll_epi32(z, _mm_cvtsi32_si128(RenderFogShift));
+
+    __m256i densityid = _mm256_srli_epi32(z, 17);
+    __m256i densityfrac = _mm256_and_si256(z, _mm256_set1_epi32(0x1FFFF));
+    densityfrac = _mm256_andnot_si256(_mm256_cmpgt_epi32(densityid, _mm256_set1_epi32(31)), densityfrac);
+    densityid = _mm256_min_epu32(densityid, _mm256_set1_epi32(32));
+
+    densityid = _mm256_and_si256(densityid, infog);
+    densityfrac = _mm256_and_si256(densityfrac, infog);
+
+    // each entry holds two consecutive densities
+    __m256i density = _mm256_i32gather_epi32((const int*)densitytable, densityid, 4);
+    __m256i density0 = _mm256_and_si256(density, _mm256_set1_epi32(0xFFFF));
+    __m256i density1 = _mm256_srli_epi32(density, 16);
+
+    density = _mm256_add_epi32(_mm256_mullo_epi32(density0, _mm256_sub_epi32(_mm256_set1_epi32(0x20000), densityfrac)),
+                               _mm256_mullo_epi32(density1, densityfrac));
+    density = _mm256_srli_epi32(density, 17);
+
+    return _mm256_blendv_epi8(density, _mm256_set1_epi32(128), _mm256_cmpgt_epi32(density, _mm256_set1_epi32(126)));
+}
+
+// (a*factor + b*(total-factor)) >> shift for every channel, red/blue and
+// green/alpha being done as pairs of 16-bit values
+__attribute__((target("avx2")))
+__m256i BlendChannels_AVX2(__m256i a_rb, __m256i a_ga, __m256i b, __m256i factor_rb, __m256i factor_ga, u16 total, int shift)
+{
+    __m256i b_rb = _mm256_and_si256(b, _mm256_set1_epi32(0x003F003F));
+    __m256i b_ga = _mm256_and_si256(_mm256_srli_epi32(b, 8), _mm256_set1_epi32(0x001F003F));
+    __m256i vtotal = _mm256_set1_epi16(total);
+
+    __m256i rb = _mm256_add_epi16(_mm256_mullo_epi16(a_rb, factor_rb),
+                                  _mm256_mullo_epi16(b_rb, _mm256_sub_epi16(vtotal, factor_rb)));
+    __m256i ga = _mm256_add_epi16(_mm256_mullo_epi16(a_ga, factor_ga),
+                                  _mm256_mullo_epi16(b_ga, _mm256_sub_epi16(vtotal, factor_ga)));
+
+    rb = _mm256_srli_epi16(rb, shift);
+    ga = _mm256_srli_epi16(ga, shift);
+    return _mm256_or_si256(rb, _mm256_slli_epi32(ga, 8));
+}
+
+__attribute__((target("avx2")))
+void ScanlineFinalPass_AVX2(s32 y)
+{
+    u32* line = &PixelColor(FirstPixelOffset + (y*ScanlineWidth));
+    const int linestride = (ScanlineWidth / 8) * PixelGroupSize;
+    const int lowerlayer = (BufferSize / 8) * PixelGroupSize;
+
+    if (RenderDispCnt & (1<<5))
+    {
+        // edge marking
+
+        alignas(32) u32 edgecolors[8];
+        for (int i = 0; i < 8; i++)
+        {
+            u16 edgecolor = RenderEdgeTable[i];
+            u32 edgeR = (edgecolor << 1) & 0x3E; if (edgeR) edgeR++;
+            u32 edgeG = (edgecolor >> 4) & 0x3E; if (edgeG) edgeG++;
+            u32 edgeB = (edgecolor >> 9) & 0x3E; if (edgeB) edgeB++;
+            edgecolors[i] = edgeR | (edgeG << 8) | (edgeB << 16);
+        }
+        __m256i vedgecolors = _mm256_load_si256((__m256i*)edgecolors);
+
+        // to get the pixels left and right of each pixel in the group
+        const __m256i rotleft = _mm256_setr_epi32(7, 0, 1, 2, 3, 4, 5, 6);
+        const __m256i rotright = _mm256_setr_epi32(1, 2, 3, 4, 5, 6, 7, 0);
+
+        for (int x = 0; x < 256; x += 8)
+        {
+            u32* group = &line[(x >> 3) * PixelGroupSize];
+
+            __m256i attr = _mm256_load_si256((__m256i*)&group[16]);
+            __m256i edgeflags = _mm256_and_si256(attr, _mm256_set1_epi32(0xF));
+            if (_mm256_testz_si256(edgeflags, edgeflags)) continue;
+
+            __m256i polyid = _mm256_srli_epi32(attr, 24);
+            __m256i z = _mm256_load_si256((__m256i*)&group[8]);
+
+            __m256i prevattr = _mm256_load_si256((__m256i*)&group[16 - PixelGroupSize]);
+            __m256i prevz = _mm256_load_si256((__m256i*)&group[8 - PixelGroupSize]);
+            __m256i nextattr = _mm256_load_si256((__m256i*)&group[16 + PixelGroupSize]);
+            __m256i nextz = _mm256_load_si256((__m256i*)&group[8 + PixelGroupSize]);
+
+            __m256i neighborattr[4], neighborz[4];
+            neighborattr[0] = _mm256_blend_epi32(_mm256_permutevar8x32_epi32(attr, rotleft),
+                                                 _mm256_permutevar8x32_epi32(prevattr, rotleft), 0x01);
+            neighborz[0] = _mm256_blend_epi32(_mm256_permutevar8x32_epi32(z, rotleft),
+                                              _mm256_permutevar8x32_epi32(prevz, rotleft), 0x01);
+            neighborattr[1] = _mm256_blend_epi32(_mm256_permutevar8x32_epi32(attr, rotright),
+                                                 _mm256_permutevar8x32_epi32(nextattr, rotright), 0x80);
+            neighborz[1] = _mm256_blend_epi32(_mm256_permutevar8x32_epi32(z, rotright),
+                                              _mm256_permutevar8x32_epi32(nextz, rotright), 0x80);
+            neighborattr[2] = _mm256_load_si256((__m256i*)&group[16 - linestride]);
+            neighborz[2] = _mm256_load_si256((__m256i*)&group[8 - linestride]);
+            neighborattr[3] = _mm256_load_si256((__m256i*)&group[16 + linestride]);
+            neighborz[3] = _mm256_load_si256((__m256i*)&group[8 + linestride]);
+
+            // a pixel is kept as is if no neighbor has both a different polygon ID and a greater depth
+            __m256i keep = _mm256_cmpeq_epi32(edgeflags, _mm256_setzero_si256());
+            __m256i nomark = _mm256_set1_epi32(-1);
+            for (int i = 0; i < 4; i++)
+            {
+                __m256i sameid = _mm256_cmpeq_epi32(polyid, _mm256_srli_epi32(neighborattr[i], 24));
+                __m256i notbehind = _mm256_cmpeq_epi32(_mm256_max_epu32(z, neighborz[i]), z);
+                nomark = _mm256_and_si256(nomark, _mm256_or_si256(sameid, notbehind));
+            }
+            keep = _mm256_or_si256(keep, nomark);
+            if (_mm256_testc_si256(keep, _mm256_set1_epi32(-1))) continue;
+
+            __m256i color = _mm256_load_si256((__m256i*)&group[0]);
+            __m256i edgecolor = _mm256_permutevar8x32_epi32(vedgecolors, _mm256_srli_epi32(polyid, 3));
+            edgecolor = _mm256_or_si256(edgecolor, _mm256_and_si256(color, _mm256_set1_epi32(0xFF000000)));
+            _mm256_store_si256((__m256i*)&group[0], _mm256_blendv_epi8(edgecolor, color, keep));
+
+            // break antialiasing coverage (checkme)
+            __m256i edgeattr = _mm256_or_si256(_mm256_and_si256(attr, _mm256_set1_epi32(0xFFFFE0FF)), _mm256_set1_epi32(0x00001000));
+            _mm256_store_si256((__m256i*)&group[16], _mm256_blendv_epi8(edgeattr, attr, keep));
+        }
+    }
+
+    if (RenderDispCnt & (1<<7))
+    {
+        // fog
+
+        bool fogcolor = !(RenderDispCnt & (1<<6));
+
+        u32 fogR = (RenderFogColor << 1) & 0x3E; if (fogR) fogR++;
+        u32 fogG = (RenderFogColor >> 4) & 0x3E; if (fogG) fogG++;
+        u32 fogB = (RenderFogColor >> 9) & 0x3E; if (fogB) fogB++;
+        u32 fogA = (RenderFogColor >> 16) & 0x1F;
+        __m256i fog_rb = _mm256_set1_epi32(fogR | (fogB << 16));
+        __m256i fog_ga = _mm256_set1_epi32(fogG | (fogA << 16));
+
+        u32 densitytable[33];
+        for (int i = 0; i < 33; i++)
+            densitytable[i] = RenderFogDensityTable[i] | (RenderFogDensityTable[i+1] << 16);
+
+        const __m256i fogflag = _mm256_set1_epi32(1<<15);
+
+        for (int x = 0; x < 256; x += 8)
+        {
+            u32* group = &line[(x >> 3) * PixelGroupSize];
+
+            __m256i attr = _mm256_load_si256((__m256i*)&group[16]);
+            __m256i fogmask = _mm256_cmpeq_epi32(_mm256_and_si256(attr, fogflag), fogflag);
+            if (_mm256_testz_si256(fogmask, fogmask)) continue;
+
+            // fog for lower pixel, for those whose upper pixel is fogged
+            __m256i loweredge = _mm256_cmpeq_epi32(_mm256_and_si256(attr, _mm256_set1_epi32(0x3)), _mm256_setzero_si256());
+            __m256i lowerattr = _mm256_load_si256((__m256i*)&group[lowerlayer + 16]);
+            __m256i lowermask = _mm256_andnot_si256(loweredge, fogmask);
+            lowermask = _mm256_and_si256(lowermask, _mm256_cmpeq_epi32(_mm256_and_si256(lowerattr, fogflag), fogflag));
+
+            for (int layer = 0; layer < 2; layer++)
+            {
+                u32* pixels = layer ? &group[lowerlayer] : group;
+                __m256i mask = layer ? lowermask : fogmask;
+                if (layer && _mm256_testz_si256(mask, mask)) break;
+
+                __m256i density = FogDensity_AVX2(_mm256_load_si256((__m256i*)&pixels[8]), densitytable);
+                __m256i density_ga = _mm256_or_si256(density, _mm256_slli_epi32(density, 16));
+                __m256i density_rb = density_ga;
+                if (!fogcolor)
+                {
+                    // only alpha is blended
+                    density_rb = _mm256_setzero_si256();
+                    density_ga = _mm256_slli_epi32(density, 16);
+                }
+
+                __m256i color = _mm256_load_si256((__m256i*)&pixels[0]);
+                __m256i fogged = BlendChannels_AVX2(fog_rb, fog_ga, color, density_rb, density_ga, 128, 7);
+                _mm256_store_si256((__m256i*)&pixels[0], _mm256_blendv_epi8(color, fogged, mask));
+            }
+        }
+    }
+
+    if (RenderDispCnt & (1<<4))
+    {
+        // anti-aliasing
+
+        for (int x = 0; x < 256; x += 8)
+        {
+            u32* group = &line[(x >> 3) * PixelGroupSize];
+
+            __m256i attr = _mm256_load_si256((__m256i*)&group[16]);
+            __m256i coverage = _mm256_and_si256(_mm256_srli_epi32(attr, 8), _mm256_set1_epi32(0x1F));
+            __m256i skip = _mm256_or_si256(_mm256_cmpeq_epi32(_mm256_and_si256(attr, _mm256_set1_epi32(0x3)), _mm256_setzero_si256()),
+                                           _mm256_cmpeq_epi32(coverage, _mm256_set1_epi32(0x1F)));
+            if (_mm256_testc_si256(skip, _mm256_set1_epi32(-1))) continue;
+
+            __m256i topcolor = _mm256_load_si256((__m256i*)&group[0]);
+            __m256i botcolor = _mm256_load_si256((__m256i*)&group[lowerlayer]);
+
+            // only blend color if the bottom pixel isn't fully transparent
+            __m256i botalpha = _mm256_and_si256(botcolor, _mm256_set1_epi32(0x1F000000));
+            __m256i colorcoverage = _mm256_add_epi32(coverage, _mm256_set1_epi32(1));
+            __m256i alphacoverage = colorcoverage;
+            colorcoverage = _mm256_blendv_epi8(colorcoverage, _mm256_set1_epi32(32),
+                                               _mm256_cmpeq_epi32(botalpha, _mm256_setzero_si256()));
+
+            __m256i coverage_rb = _mm256_or_si256(colorcoverage, _mm256_slli_epi32(colorcoverage, 16));
+            __m256i coverage_ga = _mm256_or_si256(colorcoverage, _mm256_slli_epi32(alphacoverage, 16));
+
+            __m256i top_rb = _mm256_and_si256(topcolor, _mm256_set1_epi32(0x003F003F));
+            __m256i top_ga = _mm256_and_si256(_mm256_srli_epi32(topcolor, 8), _mm256_set1_epi32(0x001F003F));
+            __m256i blended = BlendChannels_AVX2(top_rb, top_ga, botcolor, coverage_rb, coverage_ga, 32, 5);
+
+            // zero coverage takes the bottom pixel as is
+            blended = _mm256_blendv_epi8(blended, botcolor, _mm256_cmpeq_epi32(coverage, _mm256_setzero_si256()));
+            _mm256_store_si256((__m256i*)&group[0], _mm256_blendv_epi8(blended, topcolor, skip));
+        }
+    }
+}
+
+#endif
+
+void OutputScanline(s32 y)
+{
+    // hand the finished line over to GPU2D
+    u32* group = &PixelColor(FirstPixelOffset + (y*ScanlineWidth));
+    u32* out = &OutputBuffer[y * 256];
+    for (int x = 0; x < 256; x += 8, group += PixelGroupSize)
+    {
+#ifdef SOFT_SSE2
+        _mm_storeu_si128((__m128i*)&out[x], _mm_load_si128((__m128i*)&group[0]));
+        _mm_storeu_si128((__m128i*)&out[x+4], _mm_load_si128((__m128i*)&group[4]));
+#else
+        memcpy(&out[x], group, 8*4);
+#endif
+    }
+}
+
+void ScanlineFinalPass_Scalar(s32 y)
 {
     // to consider:
     // clearing all polygon fog flags if the master flag isn't set?
@@ -1803,26 +2098,26 @@ void ScanlineFinalPass(s32 y)
         {
             u32 pixeladdr = FirstPixelOffset + (y*ScanlineWidth) + x;
 
-            u32 attr = AttrBuffer[pixeladdr];
+            u32 attr = PixelAttr(pixeladdr);
             if (!(attr & 0xF)) continue;
 
             u32 polyid = attr >> 24; // opaque polygon IDs are used for edgemarking
-            u32 z = DepthBuffer[pixeladdr];
+            u32 z = PixelDepth(pixeladdr);
 
-            if (((polyid != (AttrBuffer[pixeladdr-1] >> 24)) && (z < DepthBuffer[pixeladdr-1])) ||
-                ((polyid != (AttrBuffer[pixeladdr+1] >> 24)) && (z < DepthBuffer[pixeladdr+1])) ||
-                ((polyid != (AttrBuffer[pixeladdr-ScanlineWidth] >> 24)) && (z < DepthBuffer[pixeladdr-ScanlineWidth])) ||
-                ((polyid != (AttrBuffer[pixeladdr+ScanlineWidth] >> 24)) && (z < DepthBuffer[pixeladdr+ScanlineWidth])))
+            if (((polyid != (PixelAttr(pixeladdr-1) >> 24)) && (z < PixelDepth(pixeladdr-1))) ||
+                ((polyid != (PixelAttr(pixeladdr+1) >> 24)) && (z < PixelDepth(pixeladdr+1))) ||
+                ((polyid != (PixelAttr(pixeladdr-ScanlineWidth) >> 24)) && (z < PixelDepth(pixeladdr-ScanlineWidth))) ||
+                ((polyid != (PixelAttr(pixeladdr+ScanlineWidth) >> 24)) && (z < PixelDepth(pixeladdr+ScanlineWidth))))
             {
                 u16 edgecolor = RenderEdgeTable[polyid >> 3];
                 u32 edgeR = (edgecolor << 1) & 0x3E; if (edgeR) edgeR++;
                 u32 edgeG = (edgecolor >> 4) & 0x3E; if (edgeG) edgeG++;
                 u32 edgeB = (edgecolor >> 9) & 0x3E; if (edgeB) edgeB++;
 
-                ColorBuffer[pixeladdr] = edgeR | (edgeG << 8) | (edgeB << 16) | (ColorBuffer[pixeladdr] & 0xFF000000);
+                PixelColor(pixeladdr) = edgeR | (edgeG << 8) | (edgeB << 16) | (PixelColor(pixeladdr) & 0xFF000000);
 
                 // break antialiasing coverage (checkme)
-                AttrBuffer[pixeladdr] = (AttrBuffer[pixeladdr] & 0xFFFFE0FF) | 0x00001000;
+                PixelAttr(pixeladdr) = (PixelAttr(pixeladdr) & 0xFFFFE0FF) | 0x00001000;
             }
         }
     }
@@ -1852,12 +2147,12 @@ void ScanlineFinalPass(s32 y)
             u32 pixeladdr = FirstPixelOffset + (y*ScanlineWidth) + x;
             u32 density, srccolor, srcR, srcG, srcB, srcA;
 
-            u32 attr = AttrBuffer[pixeladdr];
+            u32 attr = PixelAttr(pixeladdr);
             if (!(attr & (1<<15))) continue;
 
             density = CalculateFogDensity(pixeladdr);
 
-            srccolor = ColorBuffer[pixeladdr];
+            srccolor = PixelColor(pixeladdr);
             srcR = srccolor & 0x3F;
             srcG = (srccolor >> 8) & 0x3F;
             srcB = (srccolor >> 16) & 0x3F;
@@ -1872,7 +2167,7 @@ void ScanlineFinalPass(s32 y)
 
             srcA = ((fogA * density) + (srcA * (128-density))) >> 7;
 
-            ColorBuffer[pixeladdr] = srcR | (srcG << 8) | (srcB << 16) | (srcA << 24);
+            PixelColor(pixeladdr) = srcR | (srcG << 8) | (srcB << 16) | (srcA << 24);
 
             // fog for lower pixel
             // TODO: make this code nicer, but avoid using a loop
@@ -1880,12 +2175,12 @@ void ScanlineFinalPass(s32 y)
             if (!(attr & 0x3)) continue;
             pixeladdr += BufferSize;
 
-            attr = AttrBuffer[pixeladdr];
+            attr = PixelAttr(pixeladdr);
             if (!(attr & (1<<15))) continue;
 
             density = CalculateFogDensity(pixeladdr);
 
-            srccolor = ColorBuffer[pixeladdr];
+            srccolor = PixelColor(pixeladdr);
             srcR = srccolor & 0x3F;
             srcG = (srccolor >> 8) & 0x3F;
             srcB = (srccolor >> 16) & 0x3F;
@@ -1900,7 +2195,7 @@ void ScanlineFinalPass(s32 y)
 
             srcA = ((fogA * density) + (srcA * (128-density))) >> 7;
 
-            ColorBuffer[pixeladdr] = srcR | (srcG << 8) | (srcB << 16) | (srcA << 24);
+            PixelColor(pixeladdr) = srcR | (srcG << 8) | (srcB << 16) | (srcA << 24);
         }
     }
 
@@ -1915,7 +2210,7 @@ void ScanlineFinalPass(s32 y)
         {
             u32 pixeladdr = FirstPixelOffset + (y*ScanlineWidth) + x;
 
-            u32 attr = AttrBuffer[pixeladdr];
+            u32 attr = PixelAttr(pixeladdr);
             if (!(attr & 0x3)) continue;
 
             u32 coverage = (attr >> 8) & 0x1F;
@@ -1923,17 +2218,17 @@ void ScanlineFinalPass(s32 y)
 
             if (coverage == 0)
             {
-                ColorBuffer[pixeladdr] = ColorBuffer[pixeladdr+BufferSize];
+                PixelColor(pixeladdr) = PixelColor(pixeladdr+BufferSize);
                 continue;
             }
 
-            u32 topcolor = ColorBuffer[pixeladdr];
+            u32 topcolor = PixelColor(pixeladdr);
             u32 topR = topcolor & 0x3F;
             u32 topG = (topcolor >> 8) & 0x3F;
             u32 topB = (topcolor >> 16) & 0x3F;
             u32 topA = (topcolor >> 24) & 0x1F;
 
-            u32 botcolor = ColorBuffer[pixeladdr+BufferSize];
+            u32 botcolor = PixelColor(pixeladdr+BufferSize);
             u32 botR = botcolor & 0x3F;
             u32 botG = (botcolor >> 8) & 0x3F;
             u32 botB = (botcolor >> 16) & 0x3F;
@@ -1952,11 +2247,23 @@ void ScanlineFinalPass(s32 y)
             // alpha is always blended
             topA = ((topA * coverage) + (botA * (32-coverage))) >> 5;
 
-            ColorBuffer[pixeladdr] = topR | (topG << 8) | (topB << 16) | (topA << 24);
+            PixelColor(pixeladdr) = topR | (topG << 8) | (topB << 16) | (topA << 24);
         }
     }
 }
 
+void ScanlineFinalPass(s32 y)
+{
+#ifdef SOFT_X86
+    if (SIMDLevel() >= SIMD_AVX2)
+        ScanlineFinalPass_AVX2(y);
+    else
+#endif
+        ScanlineFinalPass_Scalar(y);
+
+    OutputScanline(y);
+}
+
 void ClearBuffers()
 {
     u32 clearz = ((RenderClearAttr2 & 0x7FFF) * 0x200) + 0x1FF;
@@ -1964,28 +2271,30 @@ void ClearBuffers()
 
     // fill screen borders for edge marking
 
-    for (int x = 0; x < ScanlineWidth; x++)
+    for (int x = -1; x <= 256; x++)
     {
-        ColorBuffer[x] = 0;
-        DepthBuffer[x] = clearz;
-        AttrBuffer[x] = polyid;
-    }
+        u32 top = FirstPixelOffset - ScanlineWidth + x;
+        u32 bottom = FirstPixelOffset + (192*ScanlineWidth) + x;
 
-    for (int x = ScanlineWidth; x < ScanlineWidth*193; x+=ScanlineWidth)
-    {
-        ColorBuffer[x] = 0;
-        DepthBuffer[x] = clearz;
-        AttrBuffer[x] = polyid;
-        ColorBuffer[x+257] = 0;
-        DepthBuffer[x+257] = clearz;
-        AttrBuffer[x+257] = polyid;
+        PixelColor(top) = 0;
+        PixelDepth(top) = clearz;
+        PixelAttr(top) = polyid;
+        PixelColor(bottom) = 0;
+        PixelDepth(bottom) = clearz;
+        PixelAttr(bottom) = polyid;
     }
 
-    for (int x = ScanlineWidth*193; x < ScanlineWidth*194; x++)
+    for (int y = 0; y < ScanlineWidth*192; y+=ScanlineWidth)
     {
-        ColorBuffer[x] = 0;
-        DepthBuffer[x] = clearz;
-        AttrBuffer[x] = polyid;
+        u32 left = FirstPixelOffset + y - 1;
+        u32 right = FirstPixelOffset + y + 256;
+
+        PixelColor(left) = 0;
+        PixelDepth(left) = clearz;
+        PixelAttr(left) = polyid;
+        PixelColor(right) = 0;
+        PixelDepth(right) = clearz;
+        PixelAttr(right) = polyid;
     }
 
     // clear the screen
@@ -2012,9 +2321,9 @@ void ClearBuffers()
                 u32 z = ((val3 & 0x7FFF) * 0x200) + 0x1FF;
 
                 u32 pixeladdr = FirstPixelOffset + y + x;
-                ColorBuffer[pixeladdr] = color;
-                DepthBuffer[pixeladdr] = z;
-                AttrBuffer[pixeladdr] = polyid | (val3 & 0x8000);
+                PixelColor(pixeladdr) = color;
+                PixelDepth(pixeladdr) = z;
+                PixelAttr(pixeladdr) = polyid | (val3 & 0x8000);
 
                 xoff++;
             }
@@ -2033,21 +2342,45 @@ void ClearBuffers()
 
 		polyid |= (RenderClearAttr1 & 0x8000);
 
-        for (int y = 0; y < ScanlineWidth*192; y+=ScanlineWidth)
-        {
-            for (int x = 0; x < 256; x++)
+        // the screen area is made of whole pixel groups, fill them directly
+        u32* group = &PixelColor(FirstPixelOffset);
+#ifdef SOFT_SSE2
+        __m128i vcolor = _mm_set1_epi32(color);
+        __m128i vdepth = _mm_set1_epi32(clearz);
+        __m128i vattr = _mm_set1_epi32(polyid);
+#endif
+        for (int y = 0; y < 192; y++)
+        {
+#ifdef SOFT_SSE2
+            for (int x = 0; x < 256; x += 8, group += PixelGroupSize)
             {
-                u32 pixeladdr = FirstPixelOffset + y + x;
-                ColorBuffer[pixeladdr] = color;
-                DepthBuffer[pixeladdr] = clearz;
-                AttrBuffer[pixeladdr] = polyid;
+                _mm_store_si128((__m128i*)&group[0], vcolor);
+                _mm_store_si128((__m128i*)&group[4], vcolor);
+                _mm_store_si128((__m128i*)&group[8], vdepth);
+                _mm_store_si128((__m128i*)&group[12], vdepth);
+                _mm_store_si128((__m128i*)&group[16], vattr);
+                _mm_store_si128((__m128i*)&group[20], vattr);
             }
+#else
+            for (int x = 0; x < 256; x += 8, group += PixelGroupSize)
+            {
+                for (int i = 0; i < 8; i++)
+                {
+                    group[i] = color;
+                    group[8+i] = clearz;
+                    group[16+i] = polyid;
+                }
+            }
+#endif
+            group += ((ScanlineWidth - 256) / 8) * PixelGroupSize;
         }
     }
 }
 
 void RenderPolygons(bool threaded, Polygon** polygons, int npolys)
 {
+    PROFILE_SCOPE_ASYNC(Prof_SoftRenderPolygons);
+
     int j = 0;
     for (int i = 0; i < npolys; i++)
     {
@@ -2084,7 +2417,7 @@ void RenderFrame()
     {
         Platform::Semaphore_Post(Sema_RenderStart);
     }
-    else
+    else if (RenderFrameRepeats == 0)
     {
         ClearBuffers();
         RenderPolygons(false, &RenderPolygonRAM[0], RenderNumPolygons);
@@ -2099,8 +2432,17 @@ void RenderThreadFunc()
         if (!RenderThreadRunning) return;
 
         RenderThreadRendering = true;
-        ClearBuffers();
-        RenderPolygons(true, &RenderPolygonRAM[0], RenderNumPolygons);
+        if (RenderFrameRepeats == 0)
+        {
+            ClearBuffers();
+            RenderPolygons(true, &RenderPolygonRAM[0], RenderNumPolygons);
+        }
+        else
+        {
+            // the output buffer already holds this frame
+            for (int i = 0; i < 192; i++)
+                Platform::Semaphore_Post(Sema_ScanlineCount);
+        }
 
         Platform::Semaphore_Post(Sema_RenderDone);
         RenderThreadRendering = false;
@@ -2115,7 +2457,32 @@ u32* GetLine(int line)
             Platform::Semaphore_Wait(Sema_ScanlineCount);
     }
 
-    return &ColorBuffer[(line * ScanlineWidth) + FirstPixelOffset];
+    return &OutputBuffer[line * 256];
+}
+
+void SetPixel(int layer, int x, int y, u32 color, u32 depth, u32 attr)
+{
+    u32 pixeladdr = FirstPixelOffset + (y*ScanlineWidth) + x;
+    if (layer) pixeladdr += BufferSize;
+
+    PixelColor(pixeladdr) = color;
+    PixelDepth(pixeladdr) = depth;
+    PixelAttr(pixeladdr) = attr;
+}
+
+void FinalPass(bool simd)
+{
+    for (int y = 0; y < 192; y++)
+    {
+#ifdef SOFT_X86
+        if (simd)
+            ScanlineFinalPass_AVX2(y);
+        else
+#endif
+            ScanlineFinalPass_Scalar(y);
+
+        OutputScanline(y);
+    }
 }
 
 }
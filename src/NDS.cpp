@@ -18,11 +18,15 @@
 
 #include <stdio.h>
 #include <string.h>
+#ifndef _WIN32
+#include <unistd.h>
+#endif
 #include "Config.h"
 #include "NDS.h"
 #include "ARM.h"
 #include "NDSCart.h"
 #include "GBACart.h"
+#include "DLDI.h"
 #include "DMA.h"
 #include "FIFO.h"
 #include "GPU.h"
@@ -31,7 +35,9 @@
 #include "RTC.h"
 #include "Wifi.h"
 #include "AREngine.h"
+#include "SaveWriter.h"
 #include "Platform.h"
+#include "Profiler.h"
 
 
 namespace NDS
@@ -59,94 +65,94 @@ namespace NDS
 //
 // timings for GBA slot and wifi are set up at runtime
 
-u8 ARM9MemTimings[0x40000][4];
-u8 ARM7MemTimings[0x20000][4];
+EMUSTATE u8 (*ARM9MemTimings)[4]; // 0x40000 entries
+EMUSTATE u8 (*ARM7MemTimings)[4]; // 0x20000 entries
 
-ARMv5* ARM9;
-ARMv4* ARM7;
+EMUSTATE ARMv5* ARM9;
+EMUSTATE ARMv4* ARM7;
 
-u32 NumFrames;
-u64 LastSysClockCycles;
-u64 FrameStartTimestamp;
+EMUSTATE u32 NumFrames;
+EMUSTATE u64 LastSysClockCycles;
+EMUSTATE u64 FrameStartTimestamp;
 
-int CurCPU;
+EMUSTATE int CurCPU;
 
 const s32 kMaxIterationCycles = 64;
 
-u32 ARM9ClockShift;
+EMUSTATE u32 ARM9ClockShift;
 
 // no need to worry about those overflowing, they can keep going for atleast 4350 years
-u64 ARM9Timestamp, ARM9Target;
-u64 ARM7Timestamp, ARM7Target;
-u64 SysTimestamp;
+EMUSTATE u64 ARM9Timestamp, ARM9Target;
+EMUSTATE u64 ARM7Timestamp, ARM7Target;
+EMUSTATE u64 SysTimestamp;
 
-SchedEvent SchedList[Event_MAX];
-u32 SchedListMask;
+EMUSTATE SchedEvent SchedList[Event_MAX];
+EMUSTATE u32 SchedListMask;
 
-u32 CPUStop;
+EMUSTATE u32 CPUStop;
 
-u8 ARM9BIOS[0x1000];
-u8 ARM7BIOS[0x4000];
+EMUSTATE u8 ARM9BIOS[0x1000];
+EMUSTATE u8 ARM7BIOS[0x4000];
 
-u8 MainRAM[MAIN_RAM_SIZE];
+EMUSTATE u8* MainRAM;
 
-u8 SharedWRAM[0x8000];
-u8 WRAMCnt;
-u8* SWRAM_ARM9;
-u8* SWRAM_ARM7;
-u32 SWRAM_ARM9Mask;
-u32 SWRAM_ARM7Mask;
+EMUSTATE u8* SharedWRAM; // 32K
+EMUSTATE u8 WRAMCnt;
+EMUSTATE u8* SWRAM_ARM9;
+EMUSTATE u8* SWRAM_ARM7;
+EMUSTATE u32 SWRAM_ARM9Mask;
+EMUSTATE u32 SWRAM_ARM7Mask;
 
-u8 ARM7WRAM[0x10000];
+EMUSTATE u8* ARM7WRAM; // 64K
 
-u16 ExMemCnt[2];
+EMUSTATE u16 ExMemCnt[2];
 
 // TODO: these belong in NDSCart!
-u8 ROMSeed0[2*8];
-u8 ROMSeed1[2*8];
+EMUSTATE u8 ROMSeed0[2*8];
+EMUSTATE u8 ROMSeed1[2*8];
 
 // IO shit
-u32 IME[2];
-u32 IE[2], IF[2];
+EMUSTATE u32 IME[2];
+EMUSTATE u32 IE[2], IF[2];
 
-u8 PostFlag9;
-u8 PostFlag7;
-u16 PowerControl9;
-u16 PowerControl7;
+EMUSTATE u8 PostFlag9;
+EMUSTATE u8 PostFlag7;
+EMUSTATE u16 PowerControl9;
+EMUSTATE u16 PowerControl7;
 
-u16 WifiWaitCnt;
+EMUSTATE u16 WifiWaitCnt;
 
-u16 ARM7BIOSProt;
+EMUSTATE u16 ARM7BIOSProt;
 
-Timer Timers[8];
-u8 TimerCheckMask[2];
-u64 TimerTimestamp[2];
+EMUSTATE Timer Timers[8];
+EMUSTATE u8 TimerCheckMask[2];
+EMUSTATE u64 TimerTimestamp[2];
 
-DMA* DMAs[8];
-u32 DMA9Fill[4];
+EMUSTATE DMA* DMAs[8];
+EMUSTATE u32 DMA9Fill[4];
 
-u16 IPCSync9, IPCSync7;
-u16 IPCFIFOCnt9, IPCFIFOCnt7;
-FIFO<u32>* IPCFIFO9; // FIFO in which the ARM9 writes
-FIFO<u32>* IPCFIFO7;
+EMUSTATE u16 IPCSync9, IPCSync7;
+EMUSTATE u16 IPCFIFOCnt9, IPCFIFOCnt7;
+EMUSTATE FIFO<u32>* IPCFIFO9; // FIFO in which the ARM9 writes
+EMUSTATE FIFO<u32>* IPCFIFO7;
 
-u16 DivCnt;
-u32 DivNumerator[2];
-u32 DivDenominator[2];
-u32 DivQuotient[2];
-u32 DivRemainder[2];
+EMUSTATE u16 DivCnt;
+EMUSTATE u32 DivNumerator[2];
+EMUSTATE u32 DivDenominator[2];
+EMUSTATE u32 DivQuotient[2];
+EMUSTATE u32 DivRemainder[2];
 
-u16 SqrtCnt;
-u32 SqrtVal[2];
-u32 SqrtRes;
+EMUSTATE u16 SqrtCnt;
+EMUSTATE u32 SqrtVal[2];
+EMUSTATE u32 SqrtRes;
 
-u32 KeyInput;
-u16 KeyCnt;
-u16 RCnt;
+EMUSTATE u32 KeyInput;
+EMUSTATE u16 KeyCnt;
+EMUSTATE u16 RCnt;
 
-bool Running;
+EMUSTATE bool Running;
 
-bool RunningGame;
+EMUSTATE bool RunningGame;
 
 
 void DivDone(u32 param);
@@ -158,6 +164,12 @@ void SetGBASlotTimings();
 
 bool Init()
 {
+    ARM9MemTimings = new u8[0x40000][4];
+    ARM7MemTimings = new u8[0x20000][4];
+    MainRAM = new u8[MAIN_RAM_SIZE];
+    SharedWRAM = new u8[0x8000];
+    ARM7WRAM = new u8[0x10000];
+
     ARM9 = new ARMv5();
     ARM7 = new ARMv4();
 
@@ -206,6 +218,12 @@ void DeInit()
     Wifi::DeInit();
 
     AREngine::DeInit();
+
+    delete[] ARM9MemTimings;
+    delete[] ARM7MemTimings;
+    delete[] MainRAM;
+    delete[] SharedWRAM;
+    delete[] ARM7WRAM;
 }
 
 
@@ -320,13 +338,15 @@ void SetupDirectBoot()
 
     for (u32 i = 0; i < bootparams[3]; i+=4)
     {
-        u32 tmp = *(u32*)&NDSCart::CartROM[bootparams[0]+i];
+        u32 tmp;
+        NDSCart::ReadROMBytes(bootparams[0]+i, (u8*)&tmp, 4);
         ARM9Write32(bootparams[2]+i, tmp);
     }
 
     for (u32 i = 0; i < bootparams[7]; i+=4)
     {
-        u32 tmp = *(u32*)&NDSCart::CartROM[bootparams[4]+i];
+        u32 tmp;
+        NDSCart::ReadROMBytes(bootparams[4]+i, (u8*)&tmp, 4);
         ARM7Write32(bootparams[6]+i, tmp);
     }
 
@@ -511,6 +531,8 @@ void Reset()
     Wifi::Reset();
 
     AREngine::Reset();
+
+    Profiler::Reset();
 }
 
 void Stop()
@@ -759,6 +781,50 @@ void RelocateSave(const char* path, bool write)
     NDSCart::RelocateSave(path, write);
 }
 
+int ForkProcess()
+{
+#ifdef _WIN32
+    printf("ForkProcess: not supported on this platform\n");
+    return -1;
+#else
+    // a GL context can't be carried over to the child
+    if (GPU3D::Renderer != 0)
+    {
+        printf("ForkProcess: not supported with the OpenGL renderer\n");
+        return -1;
+    }
+
+    // only the calling thread survives in the child
+    // so the 3D threads are stopped here and restarted on both sides
+    GPU3D::SoftRenderer::StopRenderThread();
+    GPU3D::StopGeometryThread();
+
+    // pending stdio data would otherwise be written out twice
+    fflush(NULL);
+
+    SaveWriter::PrepareFork();
+
+    pid_t pid = fork();
+    SaveWriter::FinishFork(pid == 0);
+
+    if (pid == 0)
+    {
+        // the child keeps its own copy of the save memory
+        // but mustn't write it back over the parent's save files
+        NDSCart::DetachSave();
+        GBACart::DetachSave();
+        DLDI::DetachImage();
+    }
+    else if (pid < 0)
+        printf("ForkProcess: fork() failed\n");
+
+    GPU3D::SoftRenderer::SetupRenderThread();
+    GPU3D::SetupGeometryThread();
+
+    return (int)pid;
+#endif
+}
+
 
 
 u64 NextTarget()
@@ -794,6 +860,8 @@ void RunSystem(u64 timestamp)
             if (SchedList[i].Timestamp <= SysTimestamp)
             {
                 SchedListMask &= ~(1<<i);
+
+                PROFILE_SCOPE_N(Profiler::Prof_SchedEvent + i);
                 SchedList[i].Func(SchedList[i].Param);
             }
         }
@@ -883,6 +951,12 @@ u32 RunFrame()
 
     NumFrames++;
 
+    SaveWriter::RunFrame();
+
+#ifdef MELONDS_PROFILER
+    Profiler::EndFrame();
+#endif
+
     return GPU::TotalScanlines;
 }
 
@@ -1395,6 +1469,38 @@ void StopDMAs(u32 cpu, u32 mode)
     DMAs[cpu+3]->StopIfNeeded(mode);
 }
 
+s32 BulkCardDMA(u32 cpu, u32 mode, const u8* data, u32 len)
+{
+    // only when exactly one DMA would respond and nothing else is in the way
+    if (DMAsRunning(cpu)) return -1;
+
+    DMA* dma = NULL;
+    for (int i = 0; i < 4; i++)
+    {
+        if (!DMAs[(cpu<<2)+i]->IsInMode(mode)) continue;
+        if (dma) return -1;
+        dma = DMAs[(cpu<<2)+i];
+    }
+
+    if (!dma) return -1;
+
+    s32 cycles = dma->BulkCardTransfer(data, len);
+    if (cycles < 0) return -1;
+
+    // word by word, the CPU would have been stopped for every access the DMA
+    // made. it's charged all at once here, unless the CPU is halted anyway.
+    if (cpu == 0)
+    {
+        if (!ARM9->Halted) ARM9Timestamp += ((u64)cycles << ARM9ClockShift);
+    }
+    else
+    {
+        if (!ARM7->Halted) ARM7Timestamp += (u64)cycles;
+    }
+
+    return cycles;
+}
+
 
 
 
@@ -2016,6 +2122,69 @@ bool ARM9GetMemRegion(u32 addr, bool write, MemRegion* region)
     return false;
 }
 
+// like ARM9GetMemRegion, but also covering the video memory, for bulk DMA.
+// a region is only returned if accesses to it behave exactly like plain
+// memory: VRAM pages are only covered when a single bank is mapped to them.
+bool ARM9GetDMAMemRegion(u32 addr, bool write, MemRegion* region)
+{
+    if (ARM9GetMemRegion(addr, write, region))
+        return true;
+
+    switch (addr & 0xFF000000)
+    {
+    case 0x05000000:
+        if (!(PowerControl9 & ((addr & 0x400) ? (1<<9) : (1<<1)))) break;
+        region->Mem = &GPU::Palette[addr & 0x400];
+        region->Mask = 0x3FF;
+        return true;
+
+    case 0x07000000:
+        if (!(PowerControl9 & ((addr & 0x400) ? (1<<9) : (1<<1)))) break;
+        region->Mem = &GPU::OAM[addr & 0x400];
+        region->Mask = 0x3FF;
+        return true;
+
+    case 0x06000000:
+        {
+            u8* ptr = NULL;
+            switch (addr & 0x00E00000)
+            {
+            case 0x00000000: ptr = GPU::VRAMPtr_ABG[(addr >> 14) & 0x1F]; break;
+            case 0x00200000: ptr = GPU::VRAMPtr_BBG[(addr >> 14) & 0x7]; break;
+            case 0x00400000: ptr = GPU::VRAMPtr_AOBJ[(addr >> 14) & 0xF]; break;
+            case 0x00600000: ptr = GPU::VRAMPtr_BOBJ[(addr >> 14) & 0x7]; break;
+            default:
+                {
+                    // LCDC: same bank layout as in GPU::ReadVRAM_LCDC()
+                    int bank;
+                    u32 mask;
+                    u32 offset = addr & 0xFFFFF;
+                    if      (offset < 0x80000) { bank = offset >> 17; mask = 0x1FFFF; }
+                    else if (offset < 0x90000) { bank = 4; mask = 0xFFFF; }
+                    else if (offset < 0x94000) { bank = 5; mask = 0x3FFF; }
+                    else if (offset < 0x98000) { bank = 6; mask = 0x3FFF; }
+                    else if (offset < 0xA0000) { bank = 7; mask = 0x7FFF; }
+                    else if (offset < 0xA4000) { bank = 8; mask = 0x3FFF; }
+                    else break;
+
+                    if (!(GPU::VRAMMap_LCDC & (1<<bank))) break;
+                    region->Mem = GPU::VRAM[bank];
+                    region->Mask = mask;
+                    return true;
+                }
+            }
+
+            if (!ptr) break;
+            region->Mem = ptr;
+            region->Mask = 0x3FFF;
+            return true;
+        }
+    }
+
+    region->Mem = NULL;
+    return false;
+}
+
 
 
 u8 ARM7Read8(u32 addr)
@@ -2456,6 +2625,38 @@ bool ARM7GetMemRegion(u32 addr, bool write, MemRegion* region)
     return false;
 }
 
+// like ARM7GetMemRegion, for bulk DMA. see ARM9GetDMAMemRegion.
+bool ARM7GetDMAMemRegion(u32 addr, bool write, MemRegion* region)
+{
+    if (ARM7GetMemRegion(addr, write, region))
+        return true;
+
+    switch (addr & 0xFF800000)
+    {
+    case 0x03000000:
+        if (SWRAM_ARM7)
+        {
+            region->Mem = SWRAM_ARM7;
+            region->Mask = SWRAM_ARM7Mask;
+            return true;
+        }
+        break;
+
+    case 0x06000000:
+    case 0x06800000:
+        {
+            u8* ptr = GPU::GetUniqueBankPtr(GPU::VRAMMap_ARM7[(addr >> 17) & 0x1], 0);
+            if (!ptr) break;
+            region->Mem = ptr;
+            region->Mask = 0x1FFFF;
+            return true;
+        }
+    }
+
+    region->Mem = NULL;
+    return false;
+}
+
 
 
 
@@ -98,31 +98,31 @@ typedef struct
 
 } MemRegion;
 
-extern u8 ARM9MemTimings[0x40000][4];
-extern u8 ARM7MemTimings[0x20000][4];
+extern EMUSTATE u8 (*ARM9MemTimings)[4];
+extern EMUSTATE u8 (*ARM7MemTimings)[4];
 
-extern u64 ARM9Timestamp, ARM9Target;
-extern u64 ARM7Timestamp, ARM7Target;
-extern u32 ARM9ClockShift;
+extern EMUSTATE u64 ARM9Timestamp, ARM9Target;
+extern EMUSTATE u64 ARM7Timestamp, ARM7Target;
+extern EMUSTATE u32 ARM9ClockShift;
 
 // hax
-extern u32 IME[2];
-extern u32 IE[2];
-extern u32 IF[2];
-extern Timer Timers[8];
+extern EMUSTATE u32 IME[2];
+extern EMUSTATE u32 IE[2];
+extern EMUSTATE u32 IF[2];
+extern EMUSTATE Timer Timers[8];
 
-extern u16 PowerControl9;
+extern EMUSTATE u16 PowerControl9;
 
-extern u16 ExMemCnt[2];
-extern u8 ROMSeed0[2*8];
-extern u8 ROMSeed1[2*8];
+extern EMUSTATE u16 ExMemCnt[2];
+extern EMUSTATE u8 ROMSeed0[2*8];
+extern EMUSTATE u8 ROMSeed1[2*8];
 
-extern u8 ARM9BIOS[0x1000];
-extern u8 ARM7BIOS[0x4000];
+extern EMUSTATE u8 ARM9BIOS[0x1000];
+extern EMUSTATE u8 ARM7BIOS[0x4000];
 
 #define MAIN_RAM_SIZE 0x400000
 
-extern u8 MainRAM[MAIN_RAM_SIZE];
+extern EMUSTATE u8* MainRAM;
 
 bool Init();
 void DeInit();
@@ -140,6 +140,13 @@ void LoadBIOS();
 void SetupDirectBoot();
 void RelocateSave(const char* path, bool write);
 
+// clones the running console into a child process, sharing memory copy-on-write
+// returns the child's PID in the parent, 0 in the child, -1 on failure
+// the child has no save file attached (see RelocateSave()), and frontend threads
+// (audio, input, ...) don't exist there, so this is meant for headless use
+// for in-process copies, see the memory mode of Savestate
+int ForkProcess();
+
 u32 RunFrame();
 
 void PressKey(u32 key);
@@ -180,6 +187,7 @@ bool DMAsInMode(u32 cpu, u32 mode);
 bool DMAsRunning(u32 cpu);
 void CheckDMAs(u32 cpu, u32 mode);
 void StopDMAs(u32 cpu, u32 mode);
+s32 BulkCardDMA(u32 cpu, u32 mode, const u8* data, u32 len);
 
 void RunTimers(u32 cpu);
 
@@ -191,6 +199,7 @@ void ARM9Write16(u32 addr, u16 val);
 void ARM9Write32(u32 addr, u32 val);
 
 bool ARM9GetMemRegion(u32 addr, bool write, MemRegion* region);
+bool ARM9GetDMAMemRegion(u32 addr, bool write, MemRegion* region);
 
 u8 ARM7Read8(u32 addr);
 u16 ARM7Read16(u32 addr);
@@ -200,6 +209,7 @@ void ARM7Write16(u32 addr, u16 val);
 void ARM7Write32(u32 addr, u32 val);
 
 bool ARM7GetMemRegion(u32 addr, bool write, MemRegion* region);
+bool ARM7GetDMAMemRegion(u32 addr, bool write, MemRegion* region);
 
 u8 ARM9IORead8(u32 addr);
 u16 ARM9IORead16(u32 addr);
@@ -18,30 +18,40 @@
 
 #include <stdio.h>
 #include <string.h>
+#include <algorithm>
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
 #include "NDS.h"
 #include "NDSCart.h"
 #include "ARM.h"
 #include "CRC32.h"
+#include "CompressedROM.h"
+#include "ROMList.h"
+#include "DLDI.h"
+#include "Config.h"
+#include "SaveWriter.h"
 #include "Platform.h"
 
 
 namespace NDSCart_SRAM
 {
 
-u8* SRAM;
-u32 SRAMLength;
+EMUSTATE u8* SRAM;
+EMUSTATE u32 SRAMLength;
 
-char SRAMPath[1024];
+EMUSTATE char SRAMPath[1024];
+EMUSTATE SaveWriter::Save* Writer;
 
 void (*WriteFunc)(u8 val, bool islast);
 
-u32 Hold;
-u8 CurCmd;
-u32 DataPos;
-u8 Data;
+EMUSTATE u32 Hold;
+EMUSTATE u8 CurCmd;
+EMUSTATE u32 DataPos;
+EMUSTATE u8 Data;
 
-u8 StatusReg;
-u32 Addr;
+EMUSTATE u8 StatusReg;
+EMUSTATE u32 Addr;
 
 
 void Write_Null(u8 val, bool islast);
@@ -53,16 +63,23 @@ void Write_Flash(u8 val, bool islast);
 bool Init()
 {
     SRAM = NULL;
+    Writer = NULL;
     return true;
 }
 
 void DeInit()
 {
+    SaveWriter::Close(Writer, true);
+    Writer = NULL;
+
     if (SRAM) delete[] SRAM;
 }
 
 void Reset()
 {
+    SaveWriter::Close(Writer, true);
+    Writer = NULL;
+
     if (SRAM) delete[] SRAM;
     SRAM = NULL;
 }
@@ -86,8 +103,14 @@ void DoSavestate(Savestate* file)
         printf("savestate: VERY BAD!!!! SRAM LENGTH DIFFERENT. %d -> %d\n", oldlen, SRAMLength);
         printf("oh well. loading it anyway. adsfgdsf\n");
 
+        SaveWriter::Close(Writer, true);
+        Writer = NULL;
+
         if (oldlen) delete[] SRAM;
         if (SRAMLength) SRAM = new u8[SRAMLength];
+
+        if (SRAMLength && SRAMPath[0])
+            Writer = SaveWriter::Open(SRAMPath, SRAM, SRAMLength);
     }
     if (SRAMLength)
     {
@@ -95,6 +118,10 @@ void DoSavestate(Savestate* file)
         //    SRAM = new u8[SRAMLength];
 
         file->VarArray(SRAM, SRAMLength);
+
+        // the file will get all of it on the next write
+        if (!file->Saving)
+            SaveWriter::Reload(Writer, SRAM);
     }
 
     // SPI status shito
@@ -110,6 +137,9 @@ void DoSavestate(Savestate* file)
 
 void LoadSave(const char* path, u32 type)
 {
+    SaveWriter::Close(Writer, true);
+    Writer = NULL;
+
     if (SRAM) delete[] SRAM;
 
     strncpy(SRAMPath, path, 1023);
@@ -158,12 +188,24 @@ void LoadSave(const char* path, u32 type)
         break;
     }
 
+    if (SRAMLength && SRAMPath[0])
+        Writer = SaveWriter::Open(SRAMPath, SRAM, SRAMLength);
+
     Hold = 0;
     CurCmd = 0;
     Data = 0;
     StatusReg = 0x00;
 }
 
+void DetachSave()
+{
+    // keep the save memory, but stop writing it back
+    SaveWriter::Close(Writer, false);
+    Writer = NULL;
+
+    SRAMPath[0] = '\0';
+}
+
 void RelocateSave(const char* path, bool write)
 {
     if (!write)
@@ -172,18 +214,21 @@ void RelocateSave(const char* path, bool write)
         return;
     }
 
+    // pending changes still go to the old file
+    SaveWriter::Close(Writer, true);
+    Writer = NULL;
+
     strncpy(SRAMPath, path, 1023);
     SRAMPath[1023] = '\0';
 
-    FILE* f = Platform::OpenFile(path, "wb");
-    if (!f)
+    if (!SaveWriter::WriteFile(path, SRAM, SRAMLength))
     {
         printf("NDSCart_SRAM::RelocateSave: failed to create new file. fuck\n");
         return;
     }
 
-    fwrite(SRAM, SRAMLength, 1, f);
-    fclose(f);
+    if (SRAMLength)
+        Writer = SaveWriter::Open(SRAMPath, SRAM, SRAMLength);
 }
 
 u8 Read()
@@ -206,7 +251,9 @@ void Write_EEPROMTiny(u8 val, bool islast)
         }
         else
         {
-            SRAM[(Addr + ((CurCmd==0x0A)?0x100:0)) & 0x1FF] = val;
+            u32 addr = (Addr + ((CurCmd==0x0A)?0x100:0)) & 0x1FF;
+            SRAM[addr] = val;
+            SaveWriter::MarkDirty(Writer, addr, 1);
             Addr++;
         }
         break;
@@ -253,6 +300,7 @@ void Write_EEPROM(u8 val, bool islast)
         else
         {
             SRAM[Addr & (SRAMLength-1)] = val;
+            SaveWriter::MarkDirty(Writer, Addr & (SRAMLength-1), 1);
             Addr++;
         }
         break;
@@ -296,6 +344,7 @@ void Write_Flash(u8 val, bool islast)
         else
         {
             SRAM[Addr & (SRAMLength-1)] = 0;
+            SaveWriter::MarkDirty(Writer, Addr & (SRAMLength-1), 1);
             Addr++;
         }
         break;
@@ -324,6 +373,7 @@ void Write_Flash(u8 val, bool islast)
         else
         {
             SRAM[Addr & (SRAMLength-1)] = val;
+            SaveWriter::MarkDirty(Writer, Addr & (SRAMLength-1), 1);
             Addr++;
         }
         break;
@@ -344,6 +394,7 @@ void Write_Flash(u8 val, bool islast)
             for (u32 i = 0; i < 0x10000; i++)
             {
                 SRAM[Addr & (SRAMLength-1)] = 0;
+                SaveWriter::MarkDirty(Writer, Addr & (SRAMLength-1), 1);
                 Addr++;
             }
         }
@@ -361,6 +412,7 @@ void Write_Flash(u8 val, bool islast)
             for (u32 i = 0; i < 0x100; i++)
             {
                 SRAM[Addr & (SRAMLength-1)] = 0;
+                SaveWriter::MarkDirty(Writer, Addr & (SRAMLength-1), 1);
                 Addr++;
             }
         }
@@ -439,16 +491,6 @@ void Write(u8 val, u32 hold)
             printf("unknown save SPI command %02X %02X %d\n", CurCmd, val, islast);
         break;
     }
-
-    if (islast && (CurCmd == 0x02 || CurCmd == 0x0A) && (SRAMLength > 0))
-    {
-        FILE* f = Platform::OpenFile(SRAMPath, "wb");
-        if (f)
-        {
-            fwrite(SRAM, SRAMLength, 1, f);
-            fclose(f);
-        }
-    }
 }
 
 }
@@ -457,34 +499,42 @@ void Write(u8 val, u32 hold)
 namespace NDSCart
 {
 
-u16 SPICnt;
-u32 ROMCnt;
+EMUSTATE u16 SPICnt;
+EMUSTATE u32 ROMCnt;
 
-u8 ROMCommand[8];
-u32 ROMDataOut;
+EMUSTATE u8 ROMCommand[8];
+EMUSTATE u32 ROMDataOut;
 
-u8 DataOut[0x4000];
-u32 DataOutPos;
-u32 DataOutLen;
+EMUSTATE u8 DataOut[0x4000];
+EMUSTATE u32 DataOutPos;
+EMUSTATE u32 DataOutLen;
 
-bool CartInserted;
-u8* CartROM;
-u32 CartROMSize;
-u32 CartCRC;
-u32 CartID;
-bool CartIsHomebrew;
+EMUSTATE bool CartInserted;
+EMUSTATE u8* CartROM;
+EMUSTATE u32 CartROMSize;
+EMUSTATE u32 CartROMFileLen;
+EMUSTATE bool CartROMMapped;
+EMUSTATE CompressedROM* CartROMFile;
+EMUSTATE u32 CartROMHeadLen;
+// covers the header and the secure area, which may get reencrypted
+const u32 kROMHeadLength = 0x10000;
+EMUSTATE u32 CartCRC;
+EMUSTATE bool CartCRCValid;
+EMUSTATE u32 CartID;
+EMUSTATE bool CartIsHomebrew;
 
-u32 CmdEncMode;
-u32 DataEncMode;
+EMUSTATE u32 CmdEncMode;
+EMUSTATE u32 DataEncMode;
 
-u32 Key1_KeyBuf[0x412];
+EMUSTATE u32 Key1_KeyBuf[0x412];
 
-u64 Key2_X;
-u64 Key2_Y;
+EMUSTATE u64 Key2_X;
+EMUSTATE u64 Key2_Y;
 
 
 void ROMCommand_Retail(u8* cmd);
 void ROMCommand_RetailNAND(u8* cmd);
+void ROMCommand_Homebrew(u8* cmd);
 
 void (*ROMCommandHandler)(u8* cmd);
 
@@ -595,17 +645,23 @@ void Key2_Encrypt(u8* data, u32 len)
 bool Init()
 {
     if (!NDSCart_SRAM::Init()) return false;
+    if (!DLDI::Init()) return false;
 
     CartROM = NULL;
+    CartROMMapped = false;
+    CartROMFile = NULL;
 
     return true;
 }
 
+void FreeROM();
+
 void DeInit()
 {
-    if (CartROM) delete[] CartROM;
+    FreeROM();
 
     NDSCart_SRAM::DeInit();
+    DLDI::DeInit();
 }
 
 void Reset()
@@ -624,9 +680,10 @@ void Reset()
     DataOutLen = 0;
 
     CartInserted = false;
-    if (CartROM) delete[] CartROM;
-    CartROM = NULL;
+    FreeROM();
+    DLDI::Close();
     CartROMSize = 0;
+    CartCRCValid = false;
     CartID = 0;
     CartIsHomebrew = false;
 
@@ -666,17 +723,28 @@ void DoSavestate(Savestate* file)
 }
 
 
-void ApplyDLDIPatch()
+bool ApplyDLDIPatch()
 {
-    // TODO: embed patches? let the user choose? default to some builtin driver?
+    // the stub is replaced with our driver, which hands sector accesses
+    // to DLDI::ROMCommand()
 
     u32 offset = *(u32*)&CartROM[0x20];
     u32 size = *(u32*)&CartROM[0x2C];
 
+    // the header comes from the ROM, and may be anything.
+    // compressed ROMs: the ARM9 binary has to be in the resident part
+    u32 romlen = CartROMFile ? CartROMHeadLen : CartROMSize;
+    if ((u64)offset + size > romlen)
+    {
+        printf("DLDI: ARM9 binary outside of the ROM%s, can't patch\n",
+               CartROMFile ? "'s resident part" : "");
+        return false;
+    }
+
     u8* binary = &CartROM[offset];
     u32 dldioffset = 0;
 
-    for (u32 i = 0; i < size; i++)
+    for (u32 i = 0; i + 12 <= size; i++)
     {
         if (*(u32*)&binary[i  ] == 0xBF8DA5ED &&
             *(u32*)&binary[i+4] == 0x69684320 &&
@@ -689,51 +757,49 @@ void ApplyDLDIPatch()
 
     if (!dldioffset)
     {
-        return;
+        return false;
     }
 
     printf("DLDI shit found at %08X (%08X)\n", dldioffset, offset+dldioffset);
 
-    FILE* f = fopen("dldi.bin", "rb");
-    if (!f)
-    {
-        printf("no DLDI patch available. oh well\n");
-        return;
-    }
+    const u8* patch = DLDI::Driver;
+    u32 dldisize = DLDI::DriverLength;
 
-    u32 dldisize;
-    fseek(f, 0, SEEK_END);
-    dldisize = ftell(f);
-    fseek(f, 0, SEEK_SET);
+    u32 patchbase = *(u32*)&patch[0x40];
+    u8 fixmask = patch[0x0E];
 
-    u8* patch = new u8[dldisize];
-    fread(patch, dldisize, 1, f);
-    fclose(f);
+    // the driver, and the areas it has fixed up, must be within the binary
+    u32 room = size - dldioffset;
+    bool fits = dldisize <= room;
+    for (int i = 0; i < 4; i++)
+    {
+        if (!(fixmask & (1<<i))) continue;
+
+        u32 fixstart = *(u32*)&patch[0x40 + (i*8)] - patchbase;
+        u32 fixend = *(u32*)&patch[0x44 + (i*8)] - patchbase;
+        if (fixstart > fixend || fixend > room)
+            fits = false;
+    }
 
-    if (*(u32*)&patch[0] != 0xBF8DA5ED ||
-        *(u32*)&patch[4] != 0x69684320 ||
-        *(u32*)&patch[8] != 0x006D6873)
+    if (!fits)
     {
-        printf("bad DLDI patch\n");
-        delete[] patch;
-        return;
+        printf("DLDI stub too close to the end of the ARM9 binary, can't patch\n");
+        return false;
     }
 
     if (patch[0x0D] > binary[dldioffset+0x0F])
     {
         printf("DLDI driver ain't gonna fit, sorry\n");
-        delete[] patch;
-        return;
+        return false;
     }
 
-    printf("existing driver is: %s\n", &binary[dldioffset+0x10]);
-    printf("new driver is: %s\n", &patch[0x10]);
+    printf("existing driver is: %.48s\n", &binary[dldioffset+0x10]);
+    printf("new driver is: %.48s\n", &patch[0x10]);
 
     u32 memaddr = *(u32*)&binary[dldioffset+0x40];
     if (memaddr == 0)
         memaddr = *(u32*)&binary[dldioffset+0x68] - 0x80;
 
-    u32 patchbase = *(u32*)&patch[0x40];
     u32 delta = memaddr - patchbase;
 
     u32 patchsize = 1 << patch[0x0D];
@@ -757,8 +823,6 @@ void ApplyDLDIPatch()
     *(u32*)&binary[dldioffset+0x78] += delta;
     *(u32*)&binary[dldioffset+0x7C] += delta;
 
-    u8 fixmask = patch[0x0E];
-
     if (fixmask & 0x01)
     {
         u32 fixstart = *(u32*)&patch[0x40] - patchbase;
@@ -803,72 +867,108 @@ void ApplyDLDIPatch()
         memset(&binary[dldioffset+fixstart], 0, fixend-fixstart);
     }
 
-    delete[] patch;
     printf("applied DLDI patch\n");
+    return true;
 }
 
 
-bool ReadROMParams(u32 gamecode, u32* params)
+ROMList::Entry GetROMParams(u32 gamecode)
 {
-    // format for romlist.bin:
-    // [gamecode] [ROM size] [save type] [reserved]
-    // list must be sorted by gamecode
+    const ROMList::Entry* entry = ROMList::Find(gamecode);
+    if (entry)
+    {
+        printf("ROM entry: %08X %08X %08X\n", entry->ROMSize, entry->SaveType, entry->Reserved);
+        return *entry;
+    }
 
-    FILE* f = Platform::OpenDataFile("romlist.bin");
-    if (!f) return false;
+    // set defaults
+    printf("ROM entry not found\n");
+
+    ROMList::Entry ret;
+    ret.GameCode = gamecode;
+    ret.ROMSize = CartROMSize;
+    if (*(u32*)&CartROM[0x20] < 0x4000)
+        ret.SaveType = 0; // no saveRAM for homebrew
+    else
+        ret.SaveType = 2; // assume EEPROM 64k (TODO FIXME)
+    ret.Reserved = 0;
+    return ret;
+}
 
-    fseek(f, 0, SEEK_END);
-    u32 len = (u32)ftell(f);
-    u32 maxlen = len;
-    len >>= 4; // 16 bytes per entry
 
-    u32 offset = 0;
-    u32 chk_size = len >> 1;
-    for (;;)
+bool MapROM(FILE* f, u32 len)
+{
+#ifdef _WIN32
+    return false;
+#else
+    // not a real file (ie. loaded from memory)
+    int fd = fileno(f);
+    if (fd < 0) return false;
+
+    // the padding up to CartROMSize is anonymous memory: it doesn't take
+    // any space until something writes to it.
+    // the file is mapped over the start of it, private and writable so the
+    // secure area can be reencrypted. pages that aren't written to are
+    // shared with the page cache, and with other instances.
+    u8* base = (u8*)mmap(NULL, CartROMSize, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED) return false;
+
+    if (len > 0 && mmap(base, len, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_FIXED, fd, 0) == MAP_FAILED)
     {
-        u32 key = 0;
-        fseek(f, offset + (chk_size << 4), SEEK_SET);
-        fread(&key, 4, 1, f);
+        munmap(base, CartROMSize);
+        return false;
+    }
 
-        printf("chk_size=%d, key=%08X, wanted=%08X, offset=%08X\n", chk_size, key, gamecode, offset);
+    CartROM = base;
+    CartROMMapped = true;
+    return true;
+#endif
+}
 
-        if (key == gamecode)
-        {
-            fread(params, 4, 3, f);
-            fclose(f);
-            return true;
-        }
-        else
-        {
-            if (key < gamecode)
-            {
-                if (chk_size == 0)
-                    offset += 0x10;
-                else
-                    offset += (chk_size << 4);
-            }
-            else if (chk_size == 0)
-            {
-                fclose(f);
-                return false;
-            }
+void FreeROM()
+{
+    if (CartROMFile)
+    {
+        delete CartROMFile;
+        CartROMFile = NULL;
+    }
 
-            chk_size >>= 1;
-        }
+    if (!CartROM) return;
 
-        if (offset >= maxlen)
-        {
-            fclose(f);
-            return false;
-        }
-    }
+#ifndef _WIN32
+    if (CartROMMapped)
+        munmap(CartROM, CartROMSize);
+    else
+#endif
+        delete[] CartROM;
+
+    CartROM = NULL;
+    CartROMMapped = false;
 }
 
+u32 GetROMCRC()
+{
+    if (!CartROM) return 0;
+
+    if (!CartCRCValid)
+    {
+        // the padding is all zeroes, no need to go through it
+        // compressed ROMs store the CRC of their contents
+        if (CartROMFile)
+            CartCRC = CartROMFile->CRC;
+        else
+            CartCRC = CRC32_Parallel(CartROM, CartROMFileLen);
+        CartCRC = CRC32_ZeroExtend(CartCRC, CartROMSize - CartROMFileLen);
+        CartCRCValid = true;
+    }
+
+    return CartCRC;
+}
 
 bool LoadROM(const char* path, const char* sram, bool direct)
 {
-    // TODO: streaming mode? for really big ROMs or systems with limited RAM
-    // for now we're lazy
+    // the ROM is mapped rather than read when possible, so only the parts
+    // that are actually accessed get loaded
 
     FILE* f = Platform::OpenFile(path, "rb");
     if (!f)
@@ -876,47 +976,70 @@ bool LoadROM(const char* path, const char* sram, bool direct)
         return false;
     }
 
+    CompressedROM* comp = NULL;
+    if (CompressedROM::IsCompressed(f))
+    {
+        comp = new CompressedROM(f);
+        if (comp->Error)
+        {
+            delete comp;
+            return false;
+        }
+    }
+
     NDS::Reset();
 
-    fseek(f, 0, SEEK_END);
-    u32 len = (u32)ftell(f);
+    u32 len;
+    if (comp)
+        len = comp->Length;
+    else
+    {
+        fseek(f, 0, SEEK_END);
+        len = (u32)ftell(f);
+    }
 
     CartROMSize = 0x200;
     while (CartROMSize < len)
         CartROMSize <<= 1;
 
-    u32 gamecode;
-    fseek(f, 0x0C, SEEK_SET);
-    fread(&gamecode, 4, 1, f);
-    printf("Game code: %c%c%c%c\n", gamecode&0xFF, (gamecode>>8)&0xFF, (gamecode>>16)&0xFF, gamecode>>24);
-
-    CartROM = new u8[CartROMSize];
-    memset(CartROM, 0, CartROMSize);
-    fseek(f, 0, SEEK_SET);
-    fread(CartROM, 1, len, f);
+    CartROMFileLen = len;
+    if (comp)
+    {
+        // compressed ROM: only the start (header, secure area) is kept in
+        // memory, the rest is decompressed as card reads reach it.
+        // homebrew keeps its ARM9 binary resident too, for DLDI patching.
+        u32 arm9[4];
+        comp->Read(0x20, (u8*)arm9, 16);
+        CartROMHeadLen = kROMHeadLength;
+        if (arm9[0] < 0x4000 && (u64)arm9[0] + arm9[3] > CartROMHeadLen)
+            CartROMHeadLen = (arm9[0] + arm9[3] + 0xFFF) & ~0xFFF;
+        CartROMHeadLen = std::min(CartROMSize, CartROMHeadLen);
+        CartROM = new u8[CartROMHeadLen];
+        comp->Read(0, CartROM, CartROMHeadLen);
+        CartROMFile = comp;
+    }
+    else
+    {
+        if (!MapROM(f, len))
+        {
+            CartROM = new u8[CartROMSize];
+            memset(CartROM, 0, CartROMSize);
+            fseek(f, 0, SEEK_SET);
+            fread(CartROM, 1, len, f);
+        }
 
-    fclose(f);
-    //CartROM = f;
+        fclose(f);
+    }
 
-    CartCRC = CRC32(CartROM, CartROMSize);
-    printf("ROM CRC32: %08X\n", CartCRC);
+    u32 gamecode = *(u32*)&CartROM[0x0C];
+    printf("Game code: %c%c%c%c\n", gamecode&0xFF, (gamecode>>8)&0xFF, (gamecode>>16)&0xFF, gamecode>>24);
 
-    u32 romparams[3];
-    if (!ReadROMParams(gamecode, romparams))
-    {
-        // set defaults
-        printf("ROM entry not found\n");
+    // the CRC is only computed when asked for (GetROMCRC())
+    CartCRCValid = false;
 
-        romparams[0] = CartROMSize;
-        if (*(u32*)&CartROM[0x20] < 0x4000)
-            romparams[1] = 0; // no saveRAM for homebrew
-        else
-            romparams[1] = 2; // assume EEPROM 64k (TODO FIXME)
-    }
-    else
-        printf("ROM entry: %08X %08X %08X\n", romparams[0], romparams[1], romparams[2]);
+    ROMList::Entry romparams = GetROMParams(gamecode);
 
-    if (romparams[0] != len) printf("!! bad ROM size %d (expected %d) rounded to %d\n", len, romparams[0], CartROMSize);
+    if (romparams.ROMSize != len) printf("!! bad ROM size %d (expected %d) rounded to %d\n", len, romparams.ROMSize, CartROMSize);
 
     // generate a ROM ID
     // note: most games don't check the actual value
@@ -928,14 +1051,22 @@ bool LoadROM(const char* path, const char* sram, bool direct)
     else
         CartID |= (0x100 - (CartROMSize >> 28)) << 8;
 
-    if (romparams[1] == 8)
+    if (romparams.SaveType == 8)
         CartID |= 0x08000000; // NAND flag
 
     printf("Cart ID: %08X\n", CartID);
 
-    if (*(u32*)&CartROM[0x20] < 0x4000)
+    bool dldi = false;
+    if (*(u32*)&CartROM[0x20] < 0x4000 && Config::DLDIEnable)
     {
-        //ApplyDLDIPatch();
+        if (DLDI::Open(Config::DLDISDPath))
+        {
+            // the CRC is that of the ROM file
+            GetROMCRC();
+
+            dldi = ApplyDLDIPatch();
+            if (!dldi) DLDI::Close();
+        }
     }
 
     if (direct)
@@ -948,9 +1079,11 @@ bool LoadROM(const char* path, const char* sram, bool direct)
 
     CartInserted = true;
 
-    // TODO: support more fancy cart types (homebrew?, flashcarts, etc)
+    // TODO: support more fancy cart types (flashcarts, etc)
     if (CartID & 0x08000000)
         ROMCommandHandler = ROMCommand_RetailNAND;
+    else if (dldi)
+        ROMCommandHandler = ROMCommand_Homebrew;
     else
         ROMCommandHandler = ROMCommand_Retail;
 
@@ -964,6 +1097,9 @@ bool LoadROM(const char* path, const char* sram, bool direct)
             {
                 printf("Re-encrypting cart secure area\n");
 
+                // the CRC is that of the ROM file
+                GetROMCRC();
+
                 strncpy((char*)&CartROM[arm9base], "encryObj", 8);
 
                 Key1_InitKeycode(gamecode, 3, 2);
@@ -984,7 +1120,7 @@ bool LoadROM(const char* path, const char* sram, bool direct)
 
     // save
     printf("Save file: %s\n", sram);
-    NDSCart_SRAM::LoadSave(sram, romparams[1]);
+    NDSCart_SRAM::LoadSave(sram, romparams.SaveType);
 
     return true;
 }
@@ -995,6 +1131,32 @@ void RelocateSave(const char* path, bool write)
     NDSCart_SRAM::RelocateSave(path, write);
 }
 
+void DetachSave()
+{
+    NDSCart_SRAM::DetachSave();
+}
+
+void ReadROMBytes(u32 addr, u8* dst, u32 len)
+{
+    if (!CartROMFile)
+    {
+        memcpy(dst, CartROM+addr, len);
+        return;
+    }
+
+    if (addr < CartROMHeadLen)
+    {
+        u32 chunk = std::min(len, CartROMHeadLen - addr);
+        memcpy(dst, CartROM+addr, chunk);
+        addr += chunk;
+        dst += chunk;
+        len -= chunk;
+    }
+
+    if (len > 0)
+        CartROMFile->Read(addr, dst, len);
+}
+
 void ReadROM(u32 addr, u32 len, u32 offset)
 {
     if (!CartInserted) return;
@@ -1003,7 +1165,7 @@ void ReadROM(u32 addr, u32 len, u32 offset)
     if ((addr+len) > CartROMSize)
         len = CartROMSize - addr;
 
-    memcpy(DataOut+offset, CartROM+addr, len);
+    ReadROMBytes(addr, DataOut+offset, len);
 }
 
 void ReadROM_B7(u32 addr, u32 len, u32 offset)
@@ -1017,7 +1179,7 @@ void ReadROM_B7(u32 addr, u32 len, u32 offset)
             addr = 0x8000 + (addr & 0x1FF);
     }
 
-    memcpy(DataOut+offset, CartROM+addr, len);
+    ReadROMBytes(addr, DataOut+offset, len);
 }
 
 
@@ -1031,6 +1193,31 @@ void ROMEndTransfer(u32 param)
 
 void ROMPrepareData(u32 param)
 {
+    if (DataOutPos == 0 && DataOutLen > 4)
+    {
+        // a DMA is usually armed to pull every word as soon as it's ready.
+        // if so, move the whole transfer in one go and schedule its end for
+        // when the last word would have been read: each word costs the DMA
+        // access plus 4 transfer cycles before the next one is ready, with
+        // the gap2 delay at every 0x200-byte block boundary.
+        u32 cpu = (NDS::ExMemCnt[0] >> 11) & 0x1;
+        s32 dmacycles = NDS::BulkCardDMA(cpu, cpu ? 0x12 : 0x05, DataOut, DataOutLen);
+        if (dmacycles >= 0)
+        {
+            u32 xfercycle = (ROMCnt & (1<<27)) ? 8 : 5;
+            u32 numwords = DataOutLen >> 2;
+            u32 delay = 4 * (numwords - 1);
+            if (!(ROMCnt & (1<<30)))
+                delay += ((DataOutLen - 1) >> 9) * ((ROMCnt >> 16) & 0x3F);
+
+            DataOutPos = DataOutLen;
+            ROMDataOut = *(u32*)&DataOut[DataOutLen - 4];
+
+            NDS::ScheduleEvent(NDS::Event_ROMTransfer, true, dmacycles + xfercycle*delay, ROMEndTransfer, 0);
+            return;
+        }
+    }
+
     if (DataOutPos >= DataOutLen)
         ROMDataOut = 0;
     else
@@ -1129,6 +1316,27 @@ void ROMCommand_RetailNAND(u8* cmd)
 }
 
 
+void ROMCommand_Homebrew(u8* cmd)
+{
+    switch (cmd[0])
+    {
+    case 0xC8: // DLDI: set buffer
+    case 0xC9: // DLDI: read sectors
+    case 0xCA: // DLDI: write sectors
+        {
+            u32 status = DLDI::ROMCommand(cmd);
+            for (u32 pos = 0; pos < DataOutLen; pos += 4)
+                *(u32*)&DataOut[pos] = status;
+        }
+        break;
+
+    default:
+        ROMCommand_Retail(cmd);
+        break;
+    }
+}
+
+
 void WriteROMCnt(u32 val)
 {
     ROMCnt = (val & 0xFF7F7FFF) | (ROMCnt & 0x00800000);
@@ -24,19 +24,19 @@
 namespace NDSCart
 {
 
-extern u16 SPICnt;
-extern u32 ROMCnt;
+extern EMUSTATE u16 SPICnt;
+extern EMUSTATE u32 ROMCnt;
 
-extern u8 ROMCommand[8];
-extern u32 ROMDataOut;
+extern EMUSTATE u8 ROMCommand[8];
+extern EMUSTATE u32 ROMDataOut;
 
-extern u8 EncSeed0[5];
-extern u8 EncSeed1[5];
+extern EMUSTATE u8 EncSeed0[5];
+extern EMUSTATE u8 EncSeed1[5];
 
-extern u8* CartROM;
-extern u32 CartROMSize;
+extern EMUSTATE u8* CartROM;
+extern EMUSTATE u32 CartROMSize;
 
-extern u32 CartID;
+extern EMUSTATE u32 CartID;
 
 bool Init();
 void DeInit();
@@ -45,7 +45,12 @@ void Reset();
 void DoSavestate(Savestate* file);
 
 bool LoadROM(const char* path, const char* sram, bool direct);
+// CRC32 of the ROM (padded to CartROMSize), computed on first use
+u32 GetROMCRC();
+// copies ROM contents, decompressing them if needed
+void ReadROMBytes(u32 addr, u8* dst, u32 len);
 void RelocateSave(const char* path, bool write);
+void DetachSave();
 
 void WriteROMCnt(u32 val);
 u32 ReadROMData();
@@ -21,15 +21,40 @@
 
 
 DO_PROCLIST(DECLPROC);
+DO_PROCLIST_OPTIONAL(DECLPROC);
 
 
 bool OpenGL_Init()
 {
     DO_PROCLIST(LOADPROC);
+    DO_PROCLIST_OPTIONAL(LOADPROC_OPTIONAL);
 
     return true;
 }
 
+bool OpenGL_Supports(int major, int minor, const char* extension)
+{
+    GLint curmajor = 0, curminor = 0;
+    glGetIntegerv(GL_MAJOR_VERSION, &curmajor);
+    glGetIntegerv(GL_MINOR_VERSION, &curminor);
+    if (curmajor > major || (curmajor == major && curminor >= minor))
+        return true;
+
+    if (!extension)
+        return false;
+
+    GLint numext = 0;
+    glGetIntegerv(GL_NUM_EXTENSIONS, &numext);
+    for (int i = 0; i < numext; i++)
+    {
+        const char* ext = (const char*)glGetStringi(GL_EXTENSIONS, i);
+        if (ext && !strcmp(ext, extension))
+            return true;
+    }
+
+    return false;
+}
+
 bool OpenGL_BuildShaderProgram(const char* vs, const char* fs, GLuint* ids, const char* name)
 {
     int len;
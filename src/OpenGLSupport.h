@@ -43,6 +43,9 @@
     name = (PFN##type##PROC)Platform::GL_GetProcAddress(#name); \
     if (!name) { printf("OpenGL: " #name " not found\n"); return false; }
 
+#define LOADPROC_OPTIONAL(type, name)  \
+    name = (PFN##type##PROC)Platform::GL_GetProcAddress(#name);
+
 
 // if you need more OpenGL functions, add them to the macronator here
 // TODO: handle conditionally loading certain functions for different GL versions
@@ -122,11 +125,27 @@
     func(GLGETSTRINGI, glGetStringi); \
 
 
+// functions that not every OpenGL version we run on has
+// they may be missing (or not usable) after OpenGL_Init(), so
+// OpenGL_Supports() should be checked before using them
+
+#define DO_PROCLIST_OPTIONAL(func) \
+    func(GLFENCESYNC, glFenceSync); \
+    func(GLCLIENTWAITSYNC, glClientWaitSync); \
+    func(GLDELETESYNC, glDeleteSync); \
+    func(GLBUFFERSTORAGE, glBufferStorage); \
+
+
 DO_PROCLIST(DECLPROC_EXT);
+DO_PROCLIST_OPTIONAL(DECLPROC_EXT);
 
 
 bool OpenGL_Init();
 
+// whether the current context is at least the given OpenGL version,
+// or has the given extension (can be NULL)
+bool OpenGL_Supports(int major, int minor, const char* extension);
+
 bool OpenGL_BuildShaderProgram(const char* vs, const char* fs, GLuint* ids, const char* name);
 bool OpenGL_LinkShaderProgram(GLuint* ids);
 void OpenGL_DeleteShaderProgram(GLuint* ids);
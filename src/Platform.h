@@ -64,6 +64,10 @@ inline bool LocalFileExists(const char* name)
     return true;
 }
 
+// renames a file, replacing the destination if it exists.
+// should be atomic where the OS allows it, as it's used to commit save files.
+bool RenameFile(const char* oldpath, const char* newpath);
+
 void* Thread_Create(void (*func)());
 void Thread_Free(void* thread);
 void Thread_Wait(void* thread);
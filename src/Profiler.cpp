@@ -0,0 +1,121 @@
+/*
+    Copyright 2016-2020 Arisotura
+
+    This file is part of melonDS.
+
+    melonDS is free software: you can redistribute it and/or modify it under
+    the terms of the GNU General Public License as published by the Free
+    Software Foundation, either version 3 of the License, or (at your option)
+    any later version.
+
+    melonDS is distributed in the hope that it will be useful, but WITHOUT ANY
+    WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+    FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with melonDS. If not, see http://www.gnu.org/licenses/.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include "Profiler.h"
+
+
+namespace Profiler
+{
+
+EMUSTATE Stats Current;
+EMUSTATE AsyncCounter AsyncCounters[Prof_MAX];
+EMUSTATE Stats LastFrame;
+EMUSTATE Stats Total;
+
+const char* Names[Prof_MAX] =
+{
+    "ARM9Execute",
+    "ARM7Execute",
+    "DMA9",
+    "DMA7",
+    "GPU2DDrawScanline",
+    "GPU3DRun",
+    "GPU3DExecuteCommand",
+    "SoftRenderPolygons",
+    "SPUMix",
+    "WifiUSTimer",
+
+    "Event_LCD",
+    "Event_SPU",
+    "Event_Wifi",
+    "Event_DisplayFIFO",
+    "Event_ROMTransfer",
+    "Event_ROMSPITransfer",
+    "Event_SPITransfer",
+    "Event_Div",
+    "Event_Sqrt",
+};
+
+
+void Reset()
+{
+    memset(&Current, 0, sizeof(Current));
+    memset(&LastFrame, 0, sizeof(LastFrame));
+    memset(&Total, 0, sizeof(Total));
+
+    for (int i = 0; i < Prof_MAX; i++)
+    {
+        AsyncCounters[i].Nanoseconds.store(0, std::memory_order_relaxed);
+        AsyncCounters[i].Calls.store(0, std::memory_order_relaxed);
+    }
+}
+
+void EndFrame()
+{
+    for (int i = 0; i < Prof_MAX; i++)
+    {
+        Current.Counters[i].Nanoseconds += AsyncCounters[i].Nanoseconds.exchange(0, std::memory_order_relaxed);
+        Current.Counters[i].Calls += AsyncCounters[i].Calls.exchange(0, std::memory_order_relaxed);
+    }
+
+    for (int i = 0; i < Prof_MAX; i++)
+    {
+        Total.Counters[i].Nanoseconds += Current.Counters[i].Nanoseconds;
+        Total.Counters[i].Calls += Current.Counters[i].Calls;
+    }
+    Total.Frames++;
+
+    Current.Frames = 1;
+    LastFrame = Current;
+    memset(&Current, 0, sizeof(Current));
+}
+
+const Stats* GetLastFrame()
+{
+    return &LastFrame;
+}
+
+const Stats* GetTotal()
+{
+    return &Total;
+}
+
+const char* GetName(int id)
+{
+    if (id < 0 || id >= Prof_MAX) return "";
+    return Names[id] ? Names[id] : "";
+}
+
+void WriteJSON(FILE* file, const Stats* stats)
+{
+    fprintf(file, "{\"frames\": %u, \"counters\": {", stats->Frames);
+
+    for (int i = 0; i < Prof_MAX; i++)
+    {
+        const Counter& c = stats->Counters[i];
+        fprintf(file, "%s\"%s\": {\"ns\": %llu, \"calls\": %llu}",
+                i ? ", " : "", GetName(i),
+                (unsigned long long)c.Nanoseconds, (unsigned long long)c.Calls);
+    }
+
+    fprintf(file, "}}\n");
+}
+
+}
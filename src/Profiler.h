@@ -0,0 +1,152 @@
+/*
+    Copyright 2016-2020 Arisotura
+
+    This file is part of melonDS.
+
+    melonDS is free software: you can redistribute it and/or modify it under
+    the terms of the GNU General Public License as published by the Free
+    Software Foundation, either version 3 of the License, or (at your option)
+    any later version.
+
+    melonDS is distributed in the hope that it will be useful, but WITHOUT ANY
+    WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+    FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with melonDS. If not, see http://www.gnu.org/licenses/.
+*/
+
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include <stdio.h>
+#include <atomic>
+#include <chrono>
+#include "types.h"
+#include "NDS.h"
+
+// host-time profiling counters, built in with MELONDS_PROFILER
+// (cmake -DENABLE_PROFILER=ON). without it, PROFILE_SCOPE() compiles to
+// nothing and all the counters stay at zero.
+//
+// times are inclusive: a counter includes whatever else got profiled while
+// it was running (for example GPU3D::ExecuteCommand under ARM9 Execute when
+// the ARM9 writes to the GXFIFO, or SPU::Mix under its scheduler event).
+//
+// code that may run on the 3D render or geometry threads uses
+// PROFILE_SCOPE_ASYNC() instead: those counters are atomic, and moved into
+// the frame's counters by EndFrame() on the emulator thread. they count in
+// the frame during which the scope ended. the worker threads are only used
+// without MULTI_INSTANCE (where EMUSTATE is shared by all threads), so they
+// always update the counters of the instance that started them.
+
+namespace Profiler
+{
+
+enum
+{
+    Prof_ARM9Execute = 0,
+    Prof_ARM7Execute,
+    Prof_DMA9,
+    Prof_DMA7,
+    Prof_GPU2DDrawScanline,
+    Prof_GPU3DRun,
+    Prof_GPU3DExecuteCommand,
+    Prof_SoftRenderPolygons,
+    Prof_SPUMix,
+    Prof_WifiUSTimer,
+
+    // one per scheduler event, in NDS::Event_* order
+    Prof_SchedEvent,
+
+    Prof_MAX = Prof_SchedEvent + NDS::Event_MAX
+};
+
+typedef struct
+{
+    u64 Nanoseconds;
+    u64 Calls;
+
+} Counter;
+
+typedef struct
+{
+    Counter Counters[Prof_MAX];
+    u32 Frames;
+
+} Stats;
+
+typedef struct
+{
+    std::atomic<u64> Nanoseconds;
+    std::atomic<u64> Calls;
+
+} AsyncCounter;
+
+extern EMUSTATE Stats Current;
+extern EMUSTATE AsyncCounter AsyncCounters[Prof_MAX];
+
+void Reset();
+
+// called at the end of every emulated frame
+void EndFrame();
+
+// counters for the last complete frame
+const Stats* GetLastFrame();
+// counters accumulated since the last Reset()
+const Stats* GetTotal();
+
+const char* GetName(int id);
+
+// writes the given counters as a JSON object
+void WriteJSON(FILE* file, const Stats* stats);
+
+
+class Scope
+{
+public:
+    Scope(int id) : ID(id), Start(std::chrono::steady_clock::now()) {}
+    ~Scope()
+    {
+        auto end = std::chrono::steady_clock::now();
+        Counter& c = Current.Counters[ID];
+        c.Nanoseconds += std::chrono::duration_cast<std::chrono::nanoseconds>(end - Start).count();
+        c.Calls++;
+    }
+
+private:
+    int ID;
+    std::chrono::steady_clock::time_point Start;
+};
+
+class AsyncScope
+{
+public:
+    AsyncScope(int id) : ID(id), Start(std::chrono::steady_clock::now()) {}
+    ~AsyncScope()
+    {
+        auto end = std::chrono::steady_clock::now();
+        AsyncCounter& c = AsyncCounters[ID];
+        c.Nanoseconds.fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>(end - Start).count(),
+                                std::memory_order_relaxed);
+        c.Calls.fetch_add(1, std::memory_order_relaxed);
+    }
+
+private:
+    int ID;
+    std::chrono::steady_clock::time_point Start;
+};
+
+}
+
+#ifdef MELONDS_PROFILER
+#define PROFILE_SCOPE(id) Profiler::Scope _profscope(Profiler::id)
+#define PROFILE_SCOPE_N(id) Profiler::Scope _profscope(id)
+#define PROFILE_SCOPE_ASYNC(id) Profiler::AsyncScope _profscope(Profiler::id)
+#else
+#define PROFILE_SCOPE(id)
+#define PROFILE_SCOPE_N(id)
+#define PROFILE_SCOPE_ASYNC(id)
+#endif
+
+#endif // PROFILER_H
@@ -0,0 +1,128 @@
+/*
+    Copyright 2016-2020 Arisotura
+
+    This file is part of melonDS.
+
+    melonDS is free software: you can redistribute it and/or modify it under
+    the terms of the GNU General Public License as published by the Free
+    Software Foundation, either version 3 of the License, or (at your option)
+    any later version.
+
+    melonDS is distributed in the hope that it will be useful, but WITHOUT ANY
+    WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+    FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with melonDS. If not, see http://www.gnu.org/licenses/.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
+#include "ROMList.h"
+#include "Platform.h"
+
+
+namespace ROMList
+{
+
+bool LoadList(std::vector<Entry>& list)
+{
+    // format for romlist.bin:
+    // [gamecode] [ROM size] [save type] [reserved]
+    // list must be sorted by gamecode
+
+    FILE* f = Platform::OpenDataFile("romlist.bin");
+    if (!f) return false;
+
+    fseek(f, 0, SEEK_END);
+    u32 len = (u32)ftell(f) / sizeof(Entry);
+    fseek(f, 0, SEEK_SET);
+
+    list.resize(len);
+    if (len > 0)
+        len = (u32)fread(&list[0], sizeof(Entry), len, f);
+    list.resize(len);
+
+    fclose(f);
+    return true;
+}
+
+void LoadUserList(std::vector<Entry>& list)
+{
+    FILE* f = Platform::OpenLocalFile("romlist_user.txt", "r");
+    if (!f) return;
+
+    char line[256];
+    int linenum = 0;
+    while (fgets(line, sizeof(line), f))
+    {
+        linenum++;
+
+        char* p = line;
+        while (*p == ' ' || *p == '\t') p++;
+        if (*p == ';' || *p == '\r' || *p == '\n' || *p == '\0') continue;
+
+        char code[5];
+        unsigned int romsize, savetype;
+        if (sscanf(p, "%4s %x %u", code, &romsize, &savetype) != 3 || strlen(code) != 4)
+        {
+            printf("romlist_user.txt:%d: bad entry\n", linenum);
+            continue;
+        }
+
+        Entry entry;
+        memcpy(&entry.GameCode, code, 4);
+        entry.ROMSize = romsize;
+        entry.SaveType = savetype;
+        entry.Reserved = 0;
+
+        list.push_back(entry);
+    }
+
+    fclose(f);
+}
+
+const std::vector<Entry>& GetList()
+{
+    // built once for the whole process, read-only afterwards
+    static const std::vector<Entry> list = []()
+    {
+        std::vector<Entry> ret;
+        LoadUserList(ret);
+
+        // user entries go first, latest first, so that the stable sort
+        // keeps them ahead of the other entries for the same gamecode,
+        // which then get dropped
+        std::reverse(ret.begin(), ret.end());
+
+        std::vector<Entry> base;
+        if (!LoadList(base))
+            printf("romlist.bin not found\n");
+        ret.insert(ret.end(), base.begin(), base.end());
+
+        std::stable_sort(ret.begin(), ret.end(),
+            [](const Entry& a, const Entry& b) { return a.GameCode < b.GameCode; });
+        ret.erase(std::unique(ret.begin(), ret.end(),
+            [](const Entry& a, const Entry& b) { return a.GameCode == b.GameCode; }), ret.end());
+
+        return ret;
+    }();
+
+    return list;
+}
+
+const Entry* Find(u32 gamecode)
+{
+    const std::vector<Entry>& list = GetList();
+
+    auto it = std::lower_bound(list.begin(), list.end(), gamecode,
+        [](const Entry& e, u32 code) { return e.GameCode < code; });
+    if (it == list.end() || it->GameCode != gamecode)
+        return NULL;
+
+    return &*it;
+}
+
+}
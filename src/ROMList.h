@@ -0,0 +1,49 @@
+/*
+    Copyright 2016-2020 Arisotura
+
+    This file is part of melonDS.
+
+    melonDS is free software: you can redistribute it and/or modify it under
+    the terms of the GNU General Public License as published by the Free
+    Software Foundation, either version 3 of the License, or (at your option)
+    any later version.
+
+    melonDS is distributed in the hope that it will be useful, but WITHOUT ANY
+    WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+    FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with melonDS. If not, see http://www.gnu.org/licenses/.
+*/
+
+#ifndef ROMLIST_H
+#define ROMLIST_H
+
+#include "types.h"
+
+// database of DS ROM parameters (ROM size, save memory type), by gamecode.
+//
+// romlist.bin is loaded once, on the first lookup, and kept in memory.
+// entries from romlist_user.txt, if present, are added on top of it and
+// take precedence. that file has one entry per line:
+//   <gamecode> <ROM size, hex> <save type>
+// for example 'ABCE 4000000 3'. lines starting with ';' are ignored
+// ('#' can appear in gamecodes).
+
+namespace ROMList
+{
+
+struct Entry
+{
+    u32 GameCode;
+    u32 ROMSize;
+    u32 SaveType;
+    u32 Reserved;
+};
+
+// returns NULL if the gamecode isn't in the list
+const Entry* Find(u32 gamecode);
+
+}
+
+#endif // ROMLIST_H
@@ -19,30 +19,34 @@
 #include <stdio.h>
 #include <string.h>
 #include <time.h>
+#include "NDS.h"
 #include "RTC.h"
 
 
 namespace RTC
 {
 
-u16 IO;
+EMUSTATE u16 IO;
 
-u8 Input;
-u32 InputBit;
-u32 InputPos;
+EMUSTATE u8 Input;
+EMUSTATE u32 InputBit;
+EMUSTATE u32 InputPos;
 
-u8 Output[8];
-u32 OutputBit;
-u32 OutputPos;
+EMUSTATE u8 Output[8];
+EMUSTATE u32 OutputBit;
+EMUSTATE u32 OutputPos;
 
-u8 CurCmd;
+EMUSTATE u8 CurCmd;
 
-u8 StatusReg1;
-u8 StatusReg2;
-u8 Alarm1[3];
-u8 Alarm2[3];
-u8 ClockAdjust;
-u8 FreeReg;
+EMUSTATE u8 StatusReg1;
+EMUSTATE u8 StatusReg2;
+EMUSTATE u8 Alarm1[3];
+EMUSTATE u8 Alarm2[3];
+EMUSTATE u8 ClockAdjust;
+EMUSTATE u8 FreeReg;
+
+// -1: use the host clock
+EMUSTATE s64 ClockBase = -1;
 
 
 bool Init()
@@ -103,6 +107,26 @@ u8 BCD(u8 val)
     return (val % 10) | ((val / 10) << 4);
 }
 
+struct tm* GetTime()
+{
+    time_t timestamp;
+
+    if (ClockBase >= 0)
+    {
+        // fixed clock: doesn't depend on the host's clock or timezone
+        timestamp = (time_t)(ClockBase + (s64)(NDS::GetSysClockCycles(0) / 33513982));
+        return gmtime(&timestamp);
+    }
+
+    time(&timestamp);
+    return localtime(&timestamp);
+}
+
+void SetClockBase(s64 base)
+{
+    ClockBase = base;
+}
+
 
 void ByteIn(u8 val)
 {
@@ -126,10 +150,7 @@ void ByteIn(u8 val)
 
             case 0x20:
                 {
-                    time_t timestamp;
-                    struct tm* timedata;
-                    time(&timestamp);
-                    timedata = localtime(&timestamp);
+                    struct tm* timedata = GetTime();
 
                     Output[0] = BCD(timedata->tm_year - 100);
                     Output[1] = BCD(timedata->tm_mon + 1);
@@ -143,10 +164,7 @@ void ByteIn(u8 val)
 
             case 0x60:
                 {
-                    time_t timestamp;
-                    struct tm* timedata;
-                    time(&timestamp);
-                    timedata = localtime(&timestamp);
+                    struct tm* timedata = GetTime();
 
                     Output[0] = BCD(timedata->tm_hour);
                     Output[1] = BCD(timedata->tm_min);
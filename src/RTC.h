@@ -33,6 +33,11 @@ void DoSavestate(Savestate* file);
 u16 Read();
 void Write(u16 val, bool byte);
 
+// makes the clock start at the given time (in seconds since 1970, read as
+// the DS's local time) and follow emulated time instead of the host clock,
+// so runs are reproducible. -1 goes back to the host clock.
+void SetClockBase(s64 base);
+
 }
 
 #endif
@@ -28,19 +28,19 @@
 namespace SPI_Firmware
 {
 
-u8* Firmware;
-u32 FirmwareLength;
-u32 FirmwareMask;
+EMUSTATE u8* Firmware;
+EMUSTATE u32 FirmwareLength;
+EMUSTATE u32 FirmwareMask;
 
-u32 UserSettings;
+EMUSTATE u32 UserSettings;
 
-u32 Hold;
-u8 CurCmd;
-u32 DataPos;
-u8 Data;
+EMUSTATE u32 Hold;
+EMUSTATE u8 CurCmd;
+EMUSTATE u32 DataPos;
+EMUSTATE u8 Data;
 
-u8 StatusReg;
-u32 Addr;
+EMUSTATE u8 StatusReg;
+EMUSTATE u32 Addr;
 
 
 u16 CRC16(u8* data, u32 len, u32 start)
@@ -341,13 +341,13 @@ void Write(u8 val, u32 hold)
 namespace SPI_Powerman
 {
 
-u32 Hold;
-u32 DataPos;
-u8 Index;
-u8 Data;
+EMUSTATE u32 Hold;
+EMUSTATE u32 DataPos;
+EMUSTATE u8 Index;
+EMUSTATE u8 Data;
 
-u8 Registers[8];
-u8 RegMasks[8];
+EMUSTATE u8 Registers[8];
+EMUSTATE u8 RegMasks[8];
 
 
 bool Init()
@@ -445,16 +445,16 @@ void Write(u8 val, u32 hold)
 namespace SPI_TSC
 {
 
-u32 DataPos;
-u8 ControlByte;
-u8 Data;
+EMUSTATE u32 DataPos;
+EMUSTATE u8 ControlByte;
+EMUSTATE u8 Data;
 
-u16 ConvResult;
+EMUSTATE u16 ConvResult;
 
-u16 TouchX, TouchY;
+EMUSTATE u16 TouchX, TouchY;
 
-s16 MicBuffer[1024];
-int MicBufferLen;
+EMUSTATE s16 MicBuffer[1024];
+EMUSTATE int MicBufferLen;
 
 
 bool Init()
@@ -579,9 +579,9 @@ void Write(u8 val, u32 hold)
 namespace SPI
 {
 
-u16 Cnt;
+EMUSTATE u16 Cnt;
 
-u32 CurDevice;
+EMUSTATE u32 CurDevice;
 
 
 bool Init()
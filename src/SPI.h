@@ -43,7 +43,7 @@ void MicInputFrame(s16* data, int samples);
 namespace SPI
 {
 
-extern u16 Cnt;
+extern EMUSTATE u16 Cnt;
 
 bool Init();
 void DeInit();
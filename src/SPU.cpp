@@ -20,6 +20,7 @@
 #include <string.h>
 #include "NDS.h"
 #include "SPU.h"
+#include "Profiler.h"
 
 
 // SPU TODO
@@ -63,17 +64,17 @@ const s16 PSGTable[8][8] =
 const u32 kSamplesPerRun = 1;
 
 const u32 OutputBufferSize = 2*1024;
-s16 OutputBuffer[2 * OutputBufferSize];
-volatile u32 OutputReadOffset;
-volatile u32 OutputWriteOffset;
+EMUSTATE s16 OutputBuffer[2 * OutputBufferSize];
+EMUSTATE volatile u32 OutputReadOffset;
+EMUSTATE volatile u32 OutputWriteOffset;
 
 
-u16 Cnt;
-u8 MasterVolume;
-u16 Bias;
+EMUSTATE u16 Cnt;
+EMUSTATE u8 MasterVolume;
+EMUSTATE u16 Bias;
 
-Channel* Channels[16];
-CaptureUnit* Capture[2];
+EMUSTATE Channel* Channels[16];
+EMUSTATE CaptureUnit* Capture[2];
 
 
 bool Init()
@@ -579,6 +580,8 @@ void CaptureUnit::Run(s32 sample)
 
 void Mix(u32 samples)
 {
+    PROFILE_SCOPE(Prof_SPUMix);
+
     s32 channelbuf[32];
     s32 leftbuf[32], rightbuf[32];
     s32 ch0buf[32], ch1buf[32], ch2buf[32], ch3buf[32];
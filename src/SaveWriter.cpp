@@ -0,0 +1,326 @@
+/*
+    Copyright 2016-2020 Arisotura
+
+    This file is part of melonDS.
+
+    melonDS is free software: you can redistribute it and/or modify it under
+    the terms of the GNU General Public License as published by the Free
+    Software Foundation, either version 3 of the License, or (at your option)
+    any later version.
+
+    melonDS is distributed in the hope that it will be useful, but WITHOUT ANY
+    WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+    FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with melonDS. If not, see http://www.gnu.org/licenses/.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <atomic>
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+#include "SaveWriter.h"
+#include "Platform.h"
+
+
+namespace SaveWriter
+{
+
+// flush once the save memory has been left alone for ~0.5s
+const u32 kQuietFrames = 30;
+// but don't hold changes back for more than ~10s if the game keeps writing
+const u32 kMaxDirtyFrames = 600;
+
+const int kMaxInstanceSaves = 4;
+
+struct Save
+{
+    char Path[1024];
+
+    u8* Data;
+    u8* Shadow;
+    u32 Length;
+
+    // only accessed by the emulation thread
+    u32 DirtyStart, DirtyEnd;
+    bool DirtyAll;
+    u32 QuietFrames;
+    u32 DirtyFrames;
+
+    // set while the shadow buffer belongs to the worker thread
+    std::atomic<bool> Pending;
+
+    Save* Next;
+};
+
+// the worker and the save list are shared by all emulator instances.
+// the worker thread is started on first use and stays around.
+Save* SaveList = NULL;
+void* WorkerThread = NULL;
+void* WorkerSema = NULL;
+
+// saves opened by this instance
+EMUSTATE Save* InstanceSaves[kMaxInstanceSaves];
+
+
+void* GetListLock()
+{
+    // created on first use, which may happen on several threads at once
+    static void* lock = []()
+    {
+        void* sema = Platform::Semaphore_Create();
+        Platform::Semaphore_Post(sema);
+        return sema;
+    }();
+
+    return lock;
+}
+
+void Lock()
+{
+    Platform::Semaphore_Wait(GetListLock());
+}
+
+void Unlock()
+{
+    Platform::Semaphore_Post(GetListLock());
+}
+
+
+void WorkerFunc()
+{
+    for (;;)
+    {
+        Platform::Semaphore_Wait(WorkerSema);
+
+        Lock();
+
+        for (Save* save = SaveList; save; save = save->Next)
+        {
+            if (!save->Pending.load(std::memory_order_acquire))
+                continue;
+
+            if (!WriteFile(save->Path, save->Shadow, save->Length))
+                printf("SaveWriter: failed to write %s\n", save->Path);
+
+            save->Pending.store(false, std::memory_order_release);
+        }
+
+        Unlock();
+    }
+}
+
+void Snapshot(Save* save)
+{
+    if (save->DirtyAll)
+        memcpy(save->Shadow, save->Data, save->Length);
+    else if (save->DirtyEnd > save->DirtyStart)
+        memcpy(&save->Shadow[save->DirtyStart], &save->Data[save->DirtyStart], save->DirtyEnd - save->DirtyStart);
+
+    save->DirtyStart = 0;
+    save->DirtyEnd = 0;
+    save->DirtyAll = false;
+    save->QuietFrames = 0;
+    save->DirtyFrames = 0;
+}
+
+
+Save* Open(const char* path, u8* data, u32 length)
+{
+    Save* save = new Save;
+
+    strncpy(save->Path, path, 1023);
+    save->Path[1023] = '\0';
+
+    save->Data = data;
+    save->Length = length;
+    save->Shadow = new u8[length];
+    memcpy(save->Shadow, data, length);
+
+    save->DirtyStart = 0;
+    save->DirtyEnd = 0;
+    save->DirtyAll = false;
+    save->QuietFrames = 0;
+    save->DirtyFrames = 0;
+    save->Pending.store(false);
+
+    Lock();
+
+    save->Next = SaveList;
+    SaveList = save;
+
+    if (!WorkerThread)
+    {
+        WorkerSema = Platform::Semaphore_Create();
+        WorkerThread = Platform::Thread_Create(WorkerFunc);
+    }
+
+    Unlock();
+
+    int i;
+    for (i = 0; i < kMaxInstanceSaves; i++)
+    {
+        if (!InstanceSaves[i])
+        {
+            InstanceSaves[i] = save;
+            break;
+        }
+    }
+    if (i == kMaxInstanceSaves)
+        printf("SaveWriter: too many saves open, %s will only be written on close\n", path);
+
+    return save;
+}
+
+void Close(Save* save, bool flush)
+{
+    if (!save) return;
+
+    for (int i = 0; i < kMaxInstanceSaves; i++)
+    {
+        if (InstanceSaves[i] == save)
+            InstanceSaves[i] = NULL;
+    }
+
+    // holding the lock guarantees the worker isn't writing this save out
+    Lock();
+
+    bool found = false;
+    for (Save** link = &SaveList; *link; link = &(*link)->Next)
+    {
+        if (*link == save)
+        {
+            *link = save->Next;
+            found = true;
+            break;
+        }
+    }
+
+    if (found && flush)
+    {
+        bool pending = save->Pending.load(std::memory_order_acquire);
+        bool dirty = save->DirtyEnd > save->DirtyStart;
+
+        if (pending || dirty)
+        {
+            Snapshot(save);
+            if (!WriteFile(save->Path, save->Shadow, save->Length))
+                printf("SaveWriter: failed to write %s\n", save->Path);
+        }
+    }
+
+    Unlock();
+
+    delete[] save->Shadow;
+    delete save;
+}
+
+void Reload(Save* save, u8* data)
+{
+    if (!save) return;
+
+    save->Data = data;
+    save->DirtyAll = true;
+}
+
+void MarkDirty(Save* save, u32 offset, u32 len)
+{
+    if (!save) return;
+
+    u32 end = offset + len;
+    if (end > save->Length) end = save->Length;
+    if (offset >= end) return;
+
+    if (save->DirtyEnd > save->DirtyStart)
+    {
+        if (offset < save->DirtyStart) save->DirtyStart = offset;
+        if (end > save->DirtyEnd) save->DirtyEnd = end;
+    }
+    else
+    {
+        save->DirtyStart = offset;
+        save->DirtyEnd = end;
+    }
+
+    save->QuietFrames = 0;
+}
+
+void RunFrame()
+{
+    for (int i = 0; i < kMaxInstanceSaves; i++)
+    {
+        Save* save = InstanceSaves[i];
+        if (!save) continue;
+        if (save->DirtyEnd <= save->DirtyStart) continue;
+
+        save->QuietFrames++;
+        save->DirtyFrames++;
+        if (save->QuietFrames < kQuietFrames && save->DirtyFrames < kMaxDirtyFrames)
+            continue;
+
+        // the worker is still busy with the previous flush, try again next frame
+        if (save->Pending.load(std::memory_order_acquire))
+            continue;
+
+        Snapshot(save);
+        save->Pending.store(true, std::memory_order_release);
+        Platform::Semaphore_Post(WorkerSema);
+    }
+}
+
+bool WriteFile(const char* path, u8* data, u32 length)
+{
+    char tmppath[1040];
+    snprintf(tmppath, sizeof(tmppath), "%s.tmp", path);
+
+    FILE* f = Platform::OpenFile(tmppath, "wb");
+    if (!f) return false;
+
+    bool ok = (length == 0) || (fwrite(data, length, 1, f) == 1);
+    ok = ok && (fflush(f) == 0);
+
+    // make sure the data is on disk before it replaces the old file
+#ifdef _WIN32
+    if (ok) _commit(_fileno(f));
+#else
+    if (ok) fsync(fileno(f));
+#endif
+
+    fclose(f);
+
+    if (!ok)
+    {
+        remove(tmppath);
+        return false;
+    }
+
+    return Platform::RenameFile(tmppath, path);
+}
+
+
+void PrepareFork()
+{
+    // keep the worker from being in the middle of a write
+    Lock();
+}
+
+void FinishFork(bool child)
+{
+    if (child)
+    {
+        // the worker thread doesn't exist here, and the saves in the list
+        // belong to the parent. the carts let go of theirs with Close().
+        SaveList = NULL;
+        WorkerThread = NULL;
+        WorkerSema = NULL;
+    }
+
+    Unlock();
+}
+
+}
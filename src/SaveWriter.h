@@ -0,0 +1,64 @@
+/*
+    Copyright 2016-2020 Arisotura
+
+    This file is part of melonDS.
+
+    melonDS is free software: you can redistribute it and/or modify it under
+    the terms of the GNU General Public License as published by the Free
+    Software Foundation, either version 3 of the License, or (at your option)
+    any later version.
+
+    melonDS is distributed in the hope that it will be useful, but WITHOUT ANY
+    WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+    FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with melonDS. If not, see http://www.gnu.org/licenses/.
+*/
+
+#ifndef SAVEWRITER_H
+#define SAVEWRITER_H
+
+#include "types.h"
+
+// writes cart save memory back to its file in the background.
+//
+// the emulated side only marks which parts of the save memory it changed.
+// once a save has gone untouched for a little while (or has been dirty for
+// too long), the dirty range is copied to a shadow buffer at the end of the
+// frame, and a worker thread writes that out to a temporary file which then
+// replaces the save file. the emulation thread never waits for the disk,
+// except when a save is closed, which flushes it synchronously.
+
+namespace SaveWriter
+{
+
+struct Save;
+
+// starts tracking the given save memory, backed by the given file.
+// the memory stays owned by the caller, and must stay valid until Close().
+Save* Open(const char* path, u8* data, u32 length);
+
+// flushes any pending changes if 'flush' is set, and stops tracking the save
+void Close(Save* save, bool flush);
+
+// to be called when the save memory was reallocated or replaced wholesale
+// (ie. savestate loading): the next flush will write all of it out
+void Reload(Save* save, u8* data);
+
+void MarkDirty(Save* save, u32 offset, u32 len);
+
+// called at the end of every frame
+void RunFrame();
+
+// writes a whole file as safely as possible (temporary file + rename)
+bool WriteFile(const char* path, u8* data, u32 length);
+
+// around NDS::ForkProcess(): the child process doesn't get the worker thread,
+// nor does it write back the parent's saves
+void PrepareFork();
+void FinishFork(bool child);
+
+}
+
+#endif // SAVEWRITER_H
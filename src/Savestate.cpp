@@ -17,6 +17,8 @@
 */
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include "Savestate.h"
 #include "Platform.h"
 
@@ -45,13 +47,16 @@
 
 Savestate::Savestate(const char* filename, bool save)
 {
-    const char* magic = "MELN";
-
     Error = false;
 
+    buffer = NULL;
+    bufferCapacity = 0;
+    bufferLength = 0;
+    bufferPos = 0;
+    bufferOwned = false;
+
     if (save)
     {
-        Saving = true;
         file = Platform::OpenFile(filename, "wb");
         if (!file)
         {
@@ -60,17 +65,10 @@ Savestate::Savestate(const char* filename, bool save)
             return;
         }
 
-        VersionMajor = SAVESTATE_MAJOR;
-        VersionMinor = SAVESTATE_MINOR;
-
-        fwrite(magic, 4, 1, file);
-        fwrite(&VersionMajor, 2, 1, file);
-        fwrite(&VersionMinor, 2, 1, file);
-        fseek(file, 8, SEEK_CUR); // length to be fixed later
+        WriteHeader();
     }
     else
     {
-        Saving = false;
         file = Platform::OpenFile(filename, "rb");
         if (!file)
         {
@@ -79,79 +77,256 @@ Savestate::Savestate(const char* filename, bool save)
             return;
         }
 
-        u32 len;
         fseek(file, 0, SEEK_END);
-        len = (u32)ftell(file);
+        u32 len = (u32)ftell(file);
         fseek(file, 0, SEEK_SET);
 
-        u32 buf = 0;
+        ReadHeader(len);
+    }
+}
 
-        fread(&buf, 4, 1, file);
-        if (buf != ((u32*)magic)[0])
-        {
-            printf("savestate: invalid magic %08X\n", buf);
-            Error = true;
-            return;
-        }
+Savestate::Savestate(u32 initlength)
+{
+    Error = false;
 
-        VersionMajor = 0;
-        VersionMinor = 0;
+    file = NULL;
 
-        fread(&VersionMajor, 2, 1, file);
-        if (VersionMajor != SAVESTATE_MAJOR)
-        {
-            printf("savestate: bad version major %d, expecting %d\n", VersionMajor, SAVESTATE_MAJOR);
-            Error = true;
-            return;
-        }
+    if (initlength < 0x10) initlength = 0x10;
+
+    buffer = (u8*)malloc(initlength);
+    bufferCapacity = initlength;
+    bufferLength = 0;
+    bufferPos = 0;
+    bufferOwned = true;
+
+    if (!buffer)
+    {
+        printf("savestate: failed to allocate %d bytes\n", initlength);
+        Error = true;
+        return;
+    }
+
+    WriteHeader();
+}
 
-        fread(&VersionMinor, 2, 1, file);
-        if (VersionMinor > SAVESTATE_MINOR)
+Savestate::Savestate(const u8* data, u32 length)
+{
+    Error = false;
+
+    file = NULL;
+
+    buffer = (u8*)data;
+    bufferCapacity = length;
+    bufferLength = length;
+    bufferPos = 0;
+    bufferOwned = false;
+
+    ReadHeader(length);
+}
+
+Savestate::~Savestate()
+{
+    if (!Error && Saving)
+    {
+        CloseSection();
+
+        u32 len = bufferLength;
+        if (file)
         {
-            printf("savestate: state from the future, %d > %d\n", VersionMinor, SAVESTATE_MINOR);
-            Error = true;
-            return;
+            fseek(file, 0, SEEK_END);
+            len = (u32)ftell(file);
         }
+        Seek(8);
+        Write(&len, 4);
+    }
+
+    if (file) fclose(file);
+    if (bufferOwned && buffer) free(buffer);
+}
+
+u8* Savestate::ReleaseBuffer(u32* length)
+{
+    if (Error || !Saving || !bufferOwned) return NULL;
+
+    CloseSection();
+    CurSection = -1;
+
+    u32 len = bufferLength;
+    Seek(8);
+    Write(&len, 4);
+
+    u8* ret = buffer;
+    *length = len;
+
+    buffer = NULL;
+    bufferOwned = false;
+    Error = true; // this savestate can't be used anymore
+
+    return ret;
+}
+
+void Savestate::WriteHeader()
+{
+    const char* magic = "MELN";
+
+    Saving = true;
+
+    VersionMajor = SAVESTATE_MAJOR;
+    VersionMinor = SAVESTATE_MINOR;
+
+    u32 zero = 0;
+    Write(magic, 4);
+    Write(&VersionMajor, 2);
+    Write(&VersionMinor, 2);
+    Write(&zero, 4); // length to be fixed later
+    Write(&zero, 4);
+
+    CurSection = -1;
+}
+
+void Savestate::ReadHeader(u32 len)
+{
+    const char* magic = "MELN";
 
-        buf = 0;
-        fread(&buf, 4, 1, file);
-        if (buf != len)
+    Saving = false;
+
+    u32 buf = 0;
+
+    Read(&buf, 4);
+    if (buf != ((u32*)magic)[0])
+    {
+        printf("savestate: invalid magic %08X\n", buf);
+        Error = true;
+        return;
+    }
+
+    VersionMajor = 0;
+    VersionMinor = 0;
+
+    Read(&VersionMajor, 2);
+    if (VersionMajor != SAVESTATE_MAJOR)
+    {
+        printf("savestate: bad version major %d, expecting %d\n", VersionMajor, SAVESTATE_MAJOR);
+        Error = true;
+        return;
+    }
+
+    Read(&VersionMinor, 2);
+    if (VersionMinor > SAVESTATE_MINOR)
+    {
+        printf("savestate: state from the future, %d > %d\n", VersionMinor, SAVESTATE_MINOR);
+        Error = true;
+        return;
+    }
+
+    buf = 0;
+    Read(&buf, 4);
+    if (buf != len)
+    {
+        printf("savestate: bad length %d\n", buf);
+        Error = true;
+        return;
+    }
+
+    Seek(Tell() + 4);
+
+    CurSection = -1;
+}
+
+void Savestate::CloseSection()
+{
+    if (CurSection == -1) return;
+
+    u32 pos = Tell();
+    Seek(CurSection+4);
+
+    u32 len = pos - CurSection;
+    Write(&len, 4);
+
+    Seek(pos);
+}
+
+void Savestate::Write(const void* data, u32 len)
+{
+    if (file)
+    {
+        fwrite(data, len, 1, file);
+        return;
+    }
+
+    if ((bufferPos + len) > bufferCapacity)
+    {
+        u32 newlen = bufferCapacity;
+        while ((bufferPos + len) > newlen)
+            newlen <<= 1;
+
+        u8* newbuf = (u8*)realloc(buffer, newlen);
+        if (!newbuf)
         {
-            printf("savestate: bad length %d\n", buf);
+            printf("savestate: failed to grow buffer to %d bytes\n", newlen);
             Error = true;
             return;
         }
 
-        fseek(file, 4, SEEK_CUR);
+        buffer = newbuf;
+        bufferCapacity = newlen;
     }
 
-    CurSection = -1;
+    memcpy(&buffer[bufferPos], data, len);
+    bufferPos += len;
+    if (bufferPos > bufferLength)
+        bufferLength = bufferPos;
 }
 
-Savestate::~Savestate()
+void Savestate::Read(void* data, u32 len)
 {
-    if (Error) return;
+    if (file)
+    {
+        fread(data, len, 1, file);
+        return;
+    }
 
-    if (Saving)
+    // reading past the end behaves like fread() on a short file: the data is left untouched
+    if ((bufferPos + len) > bufferLength)
     {
-        if (CurSection != -1)
-        {
-            u32 pos = (u32)ftell(file);
-            fseek(file, CurSection+4, SEEK_SET);
+        bufferPos = bufferLength;
+        return;
+    }
 
-            u32 len = pos - CurSection;
-            fwrite(&len, 4, 1, file);
+    memcpy(data, &buffer[bufferPos], len);
+    bufferPos += len;
+}
 
-            fseek(file, pos, SEEK_SET);
-        }
+u32 Savestate::Tell()
+{
+    if (file) return (u32)ftell(file);
+    return bufferPos;
+}
 
-        fseek(file, 0, SEEK_END);
-        u32 len = (u32)ftell(file);
-        fseek(file, 8, SEEK_SET);
-        fwrite(&len, 4, 1, file);
+void Savestate::Seek(u32 pos)
+{
+    if (file)
+    {
+        fseek(file, pos, SEEK_SET);
+        return;
     }
 
-    if (file) fclose(file);
+    if (Saving && pos > bufferLength)
+    {
+        // skipping past the end while saving leaves zeroes behind, like fseek() would
+        u32 len = pos - bufferLength;
+        bufferPos = bufferLength;
+        while (len)
+        {
+            const u8 zero[16] = {0};
+            u32 chunk = len > 16 ? 16 : len;
+            Write(zero, chunk);
+            len -= chunk;
+        }
+        return;
+    }
+
+    bufferPos = (pos > bufferLength) ? bufferLength : pos;
 }
 
 void Savestate::Section(const char* magic)
@@ -160,31 +335,23 @@ void Savestate::Section(const char* magic)
 
     if (Saving)
     {
-        if (CurSection != -1)
-        {
-            u32 pos = (u32)ftell(file);
-            fseek(file, CurSection+4, SEEK_SET);
+        CloseSection();
 
-            u32 len = pos - CurSection;
-            fwrite(&len, 4, 1, file);
-
-            fseek(file, pos, SEEK_SET);
-        }
+        CurSection = Tell();
 
-        CurSection = (u32)ftell(file);
-
-        fwrite(magic, 4, 1, file);
-        fseek(file, 12, SEEK_CUR);
+        u32 zero[3] = {0, 0, 0};
+        Write(magic, 4);
+        Write(zero, 12);
     }
     else
     {
-        fseek(file, 0x10, SEEK_SET);
+        Seek(0x10);
 
         for (;;)
         {
             u32 buf = 0;
 
-            fread(&buf, 4, 1, file);
+            Read(&buf, 4);
             if (buf != ((u32*)magic)[0])
             {
                 if (buf == 0)
@@ -194,12 +361,12 @@ void Savestate::Section(const char* magic)
                 }
 
                 buf = 0;
-                fread(&buf, 4, 1, file);
-                fseek(file, buf-8, SEEK_CUR);
+                Read(&buf, 4);
+                Seek(Tell() + buf-8);
                 continue;
             }
 
-            fseek(file, 12, SEEK_CUR);
+            Seek(Tell() + 12);
             break;
         }
     }
@@ -211,11 +378,11 @@ void Savestate::Var8(u8* var)
 
     if (Saving)
     {
-        fwrite(var, 1, 1, file);
+        Write(var, 1);
     }
     else
     {
-        fread(var, 1, 1, file);
+        Read(var, 1);
     }
 }
 
@@ -225,11 +392,11 @@ void Savestate::Var16(u16* var)
 
     if (Saving)
     {
-        fwrite(var, 2, 1, file);
+        Write(var, 2);
     }
     else
     {
-        fread(var, 2, 1, file);
+        Read(var, 2);
     }
 }
 
@@ -239,11 +406,11 @@ void Savestate::Var32(u32* var)
 
     if (Saving)
     {
-        fwrite(var, 4, 1, file);
+        Write(var, 4);
     }
     else
     {
-        fread(var, 4, 1, file);
+        Read(var, 4);
     }
 }
 
@@ -253,11 +420,11 @@ void Savestate::Var64(u64* var)
 
     if (Saving)
     {
-        fwrite(var, 8, 1, file);
+        Write(var, 8);
     }
     else
     {
-        fread(var, 8, 1, file);
+        Read(var, 8);
     }
 }
 
@@ -267,10 +434,10 @@ void Savestate::VarArray(void* data, u32 len)
 
     if (Saving)
     {
-        fwrite(data, len, 1, file);
+        Write(data, len);
     }
     else
     {
-        fread(data, len, 1, file);
+        Read(data, len);
     }
 }
@@ -29,8 +29,17 @@ class Savestate
 {
 public:
     Savestate(const char* filename, bool save);
+
+    // memory savestates
+    // * saving: data goes to an internal buffer, 'initlength' being its initial size
+    //   the result can be taken with ReleaseBuffer() (to be free()'d by the caller)
+    // * loading: reads from the given buffer (not copied, must stay valid)
+    Savestate(u32 initlength);
+    Savestate(const u8* data, u32 length);
     ~Savestate();
 
+    u8* ReleaseBuffer(u32* length);
+
     bool Error;
 
     bool Saving;
@@ -57,6 +66,21 @@ public:
 
 private:
     FILE* file;
+
+    u8* buffer;
+    u32 bufferCapacity;
+    u32 bufferLength;
+    u32 bufferPos;
+    bool bufferOwned;
+
+    void WriteHeader();
+    void ReadHeader(u32 len);
+    void CloseSection();
+
+    void Write(const void* data, u32 len);
+    void Read(void* data, u32 len);
+    u32 Tell();
+    void Seek(u32 pos);
 };
 
 #endif // SAVESTATE_H
@@ -23,6 +23,7 @@
 #include "Wifi.h"
 #include "WifiAP.h"
 #include "Platform.h"
+#include "Profiler.h"
 
 
 namespace Wifi
@@ -31,29 +32,29 @@ namespace Wifi
 //#define WIFI_LOG printf
 #define WIFI_LOG(...) {}
 
-u8 RAM[0x2000];
-u16 IO[0x1000>>1];
+EMUSTATE u8 RAM[0x2000];
+EMUSTATE u16 IO[0x1000>>1];
 
 #define IOPORT(x) IO[(x)>>1]
 
-u16 Random;
+EMUSTATE u16 Random;
 
-u64 USCounter;
-u64 USCompare;
-bool BlockBeaconIRQ14;
+EMUSTATE u64 USCounter;
+EMUSTATE u64 USCompare;
+EMUSTATE bool BlockBeaconIRQ14;
 
-u32 CmdCounter;
+EMUSTATE u32 CmdCounter;
 
-u16 BBCnt;
-u8 BBWrite;
-u8 BBRegs[0x100];
-u8 BBRegsRO[0x100];
+EMUSTATE u16 BBCnt;
+EMUSTATE u8 BBWrite;
+EMUSTATE u8 BBRegs[0x100];
+EMUSTATE u8 BBRegsRO[0x100];
 
-u8 RFVersion;
-u16 RFCnt;
-u16 RFData1;
-u16 RFData2;
-u32 RFRegs[0x40];
+EMUSTATE u8 RFVersion;
+EMUSTATE u16 RFCnt;
+EMUSTATE u16 RFData1;
+EMUSTATE u16 RFData2;
+EMUSTATE u32 RFRegs[0x40];
 
 typedef struct
 {
@@ -66,23 +67,23 @@ typedef struct
 
 } TXSlot;
 
-TXSlot TXSlots[6];
+EMUSTATE TXSlot TXSlots[6];
 
-u8 RXBuffer[2048];
-u32 RXBufferPtr;
-u32 RXTime;
-u32 RXHalfwordTimeMask;
-u16 RXEndAddr;
+EMUSTATE u8 RXBuffer[2048];
+EMUSTATE u32 RXBufferPtr;
+EMUSTATE u32 RXTime;
+EMUSTATE u32 RXHalfwordTimeMask;
+EMUSTATE u16 RXEndAddr;
 
-u32 ComStatus; // 0=waiting for packets  1=receiving  2=sending
-u32 TXCurSlot;
-u32 RXCounter;
+EMUSTATE u32 ComStatus; // 0=waiting for packets  1=receiving  2=sending
+EMUSTATE u32 TXCurSlot;
+EMUSTATE u32 RXCounter;
 
-int MPReplyTimer;
-int MPNumReplies;
+EMUSTATE int MPReplyTimer;
+EMUSTATE int MPNumReplies;
 
-bool MPInited;
-bool LANInited;
+EMUSTATE bool MPInited;
+EMUSTATE bool LANInited;
 
 
 
@@ -966,6 +967,8 @@ void MSTimer()
 
 void USTimer(u32 param)
 {
+    PROFILE_SCOPE(Prof_WifiUSTimer);
+
     WifiAP::USTimer();
 
     if (IOPORT(W_USCountCnt))
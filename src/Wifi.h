@@ -142,7 +142,7 @@ enum
 };
 
 
-extern bool MPInited;
+extern EMUSTATE bool MPInited;
 
 
 bool Init();
@@ -65,21 +65,21 @@ const u8 APMac[6] = {AP_MAC};
 #define PALIGN_4(p, base)  while (PLEN(p,base) & 0x3) *p++ = 0xFF;
 
 
-u64 USCounter;
+EMUSTATE u64 USCounter;
 
-u16 SeqNo;
+EMUSTATE u16 SeqNo;
 
-bool BeaconDue;
+EMUSTATE bool BeaconDue;
 
-u8 PacketBuffer[2048];
-int PacketLen;
-int RXNum;
+EMUSTATE u8 PacketBuffer[2048];
+EMUSTATE int PacketLen;
+EMUSTATE int RXNum;
 
-u8 LANBuffer[2048];
+EMUSTATE u8 LANBuffer[2048];
 
 // this is a lazy AP, we only keep track of one client
 // 0=disconnected 1=authenticated 2=associated
-int ClientStatus;
+EMUSTATE int ClientStatus;
 
 
 bool Init()
@@ -0,0 +1,374 @@
+/*
+    Copyright 2016-2020 Arisotura
+
+    This file is part of melonDS.
+
+    melonDS is free software: you can redistribute it and/or modify it under
+    the terms of the GNU General Public License as published by the Free
+    Software Foundation, either version 3 of the License, or (at your option)
+    any later version.
+
+    melonDS is distributed in the hope that it will be useful, but WITHOUT ANY
+    WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+    FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with melonDS. If not, see http://www.gnu.org/licenses/.
+*/
+
+// null platform for headless builds
+// no SDL/GTK/libui dependency: files come from the filesystem or from memory,
+// threads use the standard library, and networking is not available.
+// OpenGL is only available where EGL can make a context without a display.
+
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#ifdef _WIN32
+#include <windows.h>
+#endif
+#ifdef HEADLESS_EGL
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#endif
+#include "../Platform.h"
+#include "../Config.h"
+#include "Platform_Headless.h"
+
+
+namespace Config
+{
+
+ConfigEntry PlatformConfigFile[] =
+{
+    {"", -1, NULL, 0, NULL, 0}
+};
+
+}
+
+
+namespace Platform
+{
+
+typedef struct
+{
+    std::string Name;
+    const u8* Data;
+    u32 Length;
+
+} MemoryFile;
+
+EMUSTATE std::vector<MemoryFile>* MemoryFiles;
+
+
+typedef struct
+{
+    std::mutex Lock;
+    std::condition_variable Cond;
+    int Count;
+
+} Semaphore;
+
+
+void SetMemoryFile(const char* name, const u8* data, u32 len)
+{
+    if (!MemoryFiles) MemoryFiles = new std::vector<MemoryFile>();
+
+    for (MemoryFile& file : *MemoryFiles)
+    {
+        if (file.Name == name)
+        {
+            file.Data = data;
+            file.Length = len;
+            return;
+        }
+    }
+
+    MemoryFile file;
+    file.Name = name;
+    file.Data = data;
+    file.Length = len;
+    MemoryFiles->push_back(file);
+}
+
+void ClearMemoryFiles()
+{
+    delete MemoryFiles;
+    MemoryFiles = NULL;
+}
+
+FILE* OpenMemoryFile(const char* path, const char* mode)
+{
+    if (!MemoryFiles) return NULL;
+    if (mode[0] != 'r' || strchr(mode, '+')) return NULL;
+
+    for (MemoryFile& file : *MemoryFiles)
+    {
+        if (file.Name != path) continue;
+
+#ifdef _WIN32
+        // no fmemopen() there
+        FILE* f = tmpfile();
+        if (!f) return NULL;
+        fwrite(file.Data, file.Length, 1, f);
+        rewind(f);
+        return f;
+#else
+        if (!file.Length) return NULL;
+        return fmemopen((void*)file.Data, file.Length, "rb");
+#endif
+    }
+
+    return NULL;
+}
+
+
+void StopEmu()
+{
+}
+
+
+FILE* OpenFile(const char* path, const char* mode, bool mustexist)
+{
+    FILE* ret = OpenMemoryFile(path, mode);
+    if (ret) return ret;
+
+    if (mustexist)
+    {
+        ret = fopen(path, "rb");
+        if (ret) ret = freopen(path, mode, ret);
+    }
+    else
+        ret = fopen(path, mode);
+
+    return ret;
+}
+
+FILE* OpenLocalFile(const char* path, const char* mode)
+{
+    // no configuration directory here: everything is relative to the working directory
+    return OpenFile(path, mode, mode[0] != 'w');
+}
+
+FILE* OpenDataFile(const char* path)
+{
+    return OpenLocalFile(path, "rb");
+}
+
+bool RenameFile(const char* oldpath, const char* newpath)
+{
+#ifdef _WIN32
+    return MoveFileExA(oldpath, newpath, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0;
+#else
+    return rename(oldpath, newpath) == 0;
+#endif
+}
+
+
+void* Thread_Create(void (*func)())
+{
+    return new std::thread(func);
+}
+
+void Thread_Free(void* thread)
+{
+    delete (std::thread*)thread;
+}
+
+void Thread_Wait(void* thread)
+{
+    ((std::thread*)thread)->join();
+}
+
+
+void* Semaphore_Create()
+{
+    Semaphore* sema = new Semaphore;
+    sema->Count = 0;
+    return sema;
+}
+
+void Semaphore_Free(void* sema)
+{
+    delete (Semaphore*)sema;
+}
+
+void Semaphore_Reset(void* sema)
+{
+    Semaphore* s = (Semaphore*)sema;
+    std::lock_guard<std::mutex> lock(s->Lock);
+    s->Count = 0;
+}
+
+void Semaphore_Wait(void* sema)
+{
+    Semaphore* s = (Semaphore*)sema;
+    std::unique_lock<std::mutex> lock(s->Lock);
+    s->Cond.wait(lock, [s]{ return s->Count > 0; });
+    s->Count--;
+}
+
+void Semaphore_Post(void* sema)
+{
+    Semaphore* s = (Semaphore*)sema;
+    {
+        std::lock_guard<std::mutex> lock(s->Lock);
+        s->Count++;
+    }
+    s->Cond.notify_one();
+}
+
+
+#ifdef HEADLESS_EGL
+
+EMUSTATE EGLDisplay GLDisplay = EGL_NO_DISPLAY;
+EMUSTATE EGLContext GLContext = EGL_NO_CONTEXT;
+
+bool GL_InitContext()
+{
+    if (GLContext != EGL_NO_CONTEXT)
+        return true;
+
+    // the surfaceless platform works without any display server,
+    // for example with Mesa's software rasterizer
+    PFNEGLGETPLATFORMDISPLAYEXTPROC getplatformdisplay =
+        (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+    if (getplatformdisplay)
+        GLDisplay = getplatformdisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+    if (GLDisplay == EGL_NO_DISPLAY)
+        GLDisplay = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+
+    if (GLDisplay == EGL_NO_DISPLAY || !eglInitialize(GLDisplay, NULL, NULL))
+    {
+        printf("EGL: no display available\n");
+        GLDisplay = EGL_NO_DISPLAY;
+        return false;
+    }
+
+    if (!eglBindAPI(EGL_OPENGL_API))
+    {
+        printf("EGL: OpenGL isn't supported\n");
+        GL_DeInitContext();
+        return false;
+    }
+
+    // nothing is drawn to a surface, the renderer uses its own framebuffers
+    const EGLint configattribs[] =
+    {
+        EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+        EGL_NONE
+    };
+    EGLConfig config;
+    EGLint numconfigs = 0;
+    if (!eglChooseConfig(GLDisplay, configattribs, &config, 1, &numconfigs) || numconfigs < 1)
+        config = EGL_NO_CONFIG_KHR;
+
+    // same as the frontends: OpenGL 3.2 core
+    const EGLint contextattribs[] =
+    {
+        EGL_CONTEXT_MAJOR_VERSION, 3,
+        EGL_CONTEXT_MINOR_VERSION, 2,
+        EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+        EGL_NONE
+    };
+    GLContext = eglCreateContext(GLDisplay, config, EGL_NO_CONTEXT, contextattribs);
+    if (GLContext == EGL_NO_CONTEXT)
+    {
+        printf("EGL: failed to create an OpenGL 3.2 context (%04X)\n", eglGetError());
+        GL_DeInitContext();
+        return false;
+    }
+
+    if (!eglMakeCurrent(GLDisplay, EGL_NO_SURFACE, EGL_NO_SURFACE, GLContext))
+    {
+        printf("EGL: failed to make the context current (%04X)\n", eglGetError());
+        GL_DeInitContext();
+        return false;
+    }
+
+    return true;
+}
+
+void GL_DeInitContext()
+{
+    if (GLDisplay == EGL_NO_DISPLAY)
+        return;
+
+    eglMakeCurrent(GLDisplay, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+    if (GLContext != EGL_NO_CONTEXT)
+        eglDestroyContext(GLDisplay, GLContext);
+    eglTerminate(GLDisplay);
+
+    GLContext = EGL_NO_CONTEXT;
+    GLDisplay = EGL_NO_DISPLAY;
+}
+
+void* GL_GetProcAddress(const char* proc)
+{
+    return (void*)eglGetProcAddress(proc);
+}
+
+#else
+
+bool GL_InitContext()
+{
+    return false;
+}
+
+void GL_DeInitContext()
+{
+}
+
+void* GL_GetProcAddress(const char* proc)
+{
+    // no GL context: the software renderer is used
+    return NULL;
+}
+
+#endif
+
+
+bool MP_Init()
+{
+    return false;
+}
+
+void MP_DeInit()
+{
+}
+
+int MP_SendPacket(u8* data, int len)
+{
+    return 0;
+}
+
+int MP_RecvPacket(u8* data, bool block)
+{
+    return 0;
+}
+
+
+bool LAN_Init()
+{
+    return false;
+}
+
+void LAN_DeInit()
+{
+}
+
+int LAN_SendPacket(u8* data, int len)
+{
+    return 0;
+}
+
+int LAN_RecvPacket(u8* data)
+{
+    return 0;
+}
+
+}
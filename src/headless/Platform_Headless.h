@@ -0,0 +1,45 @@
+/*
+    Copyright 2016-2020 Arisotura
+
+    This file is part of melonDS.
+
+    melonDS is free software: you can redistribute it and/or modify it under
+    the terms of the GNU General Public License as published by the Free
+    Software Foundation, either version 3 of the License, or (at your option)
+    any later version.
+
+    melonDS is distributed in the hope that it will be useful, but WITHOUT ANY
+    WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+    FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with melonDS. If not, see http://www.gnu.org/licenses/.
+*/
+
+#ifndef PLATFORM_HEADLESS_H
+#define PLATFORM_HEADLESS_H
+
+#include "../types.h"
+
+namespace Platform
+{
+
+// memory files
+// lets files the core asks for (BIOS, firmware, ROMs, ...) be served from
+// memory instead of the filesystem. the data isn't copied, so it must stay
+// valid as long as the core may open the file. memory files are read-only.
+// with MULTI_INSTANCE, they are only visible to the calling thread's instance.
+void SetMemoryFile(const char* name, const u8* data, u32 len);
+void ClearMemoryFiles();
+
+// OpenGL
+// creates an offscreen OpenGL 3.2 context and makes it current on the calling
+// thread, after which OpenGL_Init() and the OpenGL renderer can be used.
+// needs EGL (with Mesa, this also works without a GPU or a display server),
+// returns false where it isn't available.
+bool GL_InitContext();
+void GL_DeInitContext();
+
+}
+
+#endif // PLATFORM_HEADLESS_H
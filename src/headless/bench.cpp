@@ -0,0 +1,302 @@
+/*
+    Copyright 2016-2020 Arisotura
+
+    This file is part of melonDS.
+
+    melonDS is free software: you can redistribute it and/or modify it under
+    the terms of the GNU General Public License as published by the Free
+    Software Foundation, either version 3 of the License, or (at your option)
+    any later version.
+
+    melonDS is distributed in the hope that it will be useful, but WITHOUT ANY
+    WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+    FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with melonDS. If not, see http://www.gnu.org/licenses/.
+*/
+
+// melonDS-bench: runs a ROM headless for a fixed number of frames, as fast
+// as possible, and reports timings and a hash of the final framebuffer.
+// BIOS and firmware files are looked up in the current directory.
+//
+// The input file is a text file with one line per frame:
+//   <held keys, hex> [<touch x> <touch y>]
+// key bits are the same as KEYINPUT (bit 0: A ... bit 9: L), bit 10 is X
+// and bit 11 is Y. Lines starting with '#' are ignored. The last line keeps
+// being applied once the file runs out.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <vector>
+#include "../NDS.h"
+#include "../NDSCart.h"
+#include "../GPU.h"
+#include "../SPU.h"
+#include "../RTC.h"
+#include "../CRC32.h"
+#include "../Profiler.h"
+#include "../Config.h"
+
+
+struct FrameInput
+{
+    u32 Keys;
+    bool Touching;
+    u16 TouchX, TouchY;
+};
+
+// 2000-01-01 00:00:00, so the RTC reads the same on every run
+const s64 kClockBase = 946684800;
+
+
+bool LoadInputFile(const char* path, std::vector<FrameInput>& inputs)
+{
+    FILE* f = fopen(path, "r");
+    if (!f)
+    {
+        printf("bench: can't open input file %s\n", path);
+        return false;
+    }
+
+    char line[256];
+    int linenum = 0;
+    while (fgets(line, sizeof(line), f))
+    {
+        linenum++;
+
+        char* p = line;
+        while (*p == ' ' || *p == '\t') p++;
+        if (*p == '#' || *p == '\r' || *p == '\n' || *p == '\0') continue;
+
+        unsigned int keys;
+        int x, y;
+        int n = sscanf(p, "%x %d %d", &keys, &x, &y);
+        if (n != 1 && n != 3)
+        {
+            printf("bench: %s:%d: bad input line\n", path, linenum);
+            fclose(f);
+            return false;
+        }
+
+        FrameInput input;
+        input.Keys = keys & 0xFFF;
+        input.Touching = (n == 3);
+        input.TouchX = (n == 3) ? (u16)std::min(std::max(x, 0), 255) : 0;
+        input.TouchY = (n == 3) ? (u16)std::min(std::max(y, 0), 191) : 0;
+        inputs.push_back(input);
+    }
+
+    fclose(f);
+    return true;
+}
+
+void ApplyInput(const FrameInput& input)
+{
+    // the core takes a mask of released keys
+    NDS::SetKeyMask(~input.Keys & 0xFFF);
+
+    if (input.Touching)
+    {
+        NDS::TouchScreen(input.TouchX, input.TouchY);
+        NDS::PressKey(16+6);
+    }
+    else
+    {
+        NDS::ReleaseScreen();
+        NDS::ReleaseKey(16+6);
+    }
+}
+
+double Percentile(const std::vector<double>& sorted, double p)
+{
+    if (sorted.empty()) return 0;
+
+    size_t idx = (size_t)(p * (sorted.size() - 1) + 0.5);
+    return sorted[idx];
+}
+
+void PrintJSONString(const char* str)
+{
+    putchar('"');
+    for (; *str; str++)
+    {
+        if (*str == '"' || *str == '\\') putchar('\\');
+        putchar(*str);
+    }
+    putchar('"');
+}
+
+void PrintUsage()
+{
+    printf("usage: melonDS-bench [-n frames] [-i inputfile] [-s savefile] [-d sdimage] [-p proffile] [-c capfile [-cn frames]] [-g] [-j] rom\n");
+    printf("  -n frames     number of frames to run (default: 3600)\n");
+    printf("  -i inputfile  input to replay, see bench.cpp for the format\n");
+    printf("  -s savefile   save file to load (never written back)\n");
+    printf("  -d sdimage    SD card image for homebrew, through DLDI (written to!)\n");
+#ifdef MELONDS_PROFILER
+    printf("  -p proffile   write the profiling counters for the whole run as JSON\n");
+#endif
+    printf("  -c capfile    capture the last frames' 3D data, for melonDS-gxreplay\n");
+    printf("  -cn frames    number of frames to capture (default: 1)\n");
+    printf("  -g            run the geometry engine on its own thread\n");
+    printf("  -j            print the results as JSON, on the last line of the output\n");
+}
+
+
+int main(int argc, char** argv)
+{
+    u32 numframes = 3600;
+    const char* inputpath = NULL;
+    const char* savepath = "";
+    const char* rompath = NULL;
+    const char* profpath = NULL;
+    const char* cappath = NULL;
+    u32 capframes = 1;
+    bool json = false;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "-n") && (i+1) < argc)
+            numframes = (u32)strtoul(argv[++i], NULL, 0);
+        else if (!strcmp(argv[i], "-i") && (i+1) < argc)
+            inputpath = argv[++i];
+        else if (!strcmp(argv[i], "-s") && (i+1) < argc)
+            savepath = argv[++i];
+        else if (!strcmp(argv[i], "-d") && (i+1) < argc)
+        {
+            Config::DLDIEnable = 1;
+            strncpy(Config::DLDISDPath, argv[++i], 1023);
+            Config::DLDISDPath[1023] = '\0';
+        }
+        else if (!strcmp(argv[i], "-p") && (i+1) < argc)
+            profpath = argv[++i];
+        else if (!strcmp(argv[i], "-c") && (i+1) < argc)
+            cappath = argv[++i];
+        else if (!strcmp(argv[i], "-cn") && (i+1) < argc)
+            capframes = (u32)strtoul(argv[++i], NULL, 0);
+        else if (!strcmp(argv[i], "-g"))
+            Config::ThreadedGeometry = 1;
+        else if (!strcmp(argv[i], "-j"))
+            json = true;
+        else if (argv[i][0] != '-' && !rompath)
+            rompath = argv[i];
+        else
+        {
+            PrintUsage();
+            return 1;
+        }
+    }
+
+    if (!rompath || numframes == 0)
+    {
+        PrintUsage();
+        return 1;
+    }
+
+    std::vector<FrameInput> inputs;
+    if (inputpath && !LoadInputFile(inputpath, inputs))
+        return 1;
+
+    if (!NDS::Init())
+    {
+        printf("bench: failed to init the emulator\n");
+        return 1;
+    }
+    GPU3D::InitRenderer(false);
+
+    // direct boot, so the firmware settings and boot menu don't affect timings
+    if (!NDS::LoadROM(rompath, savepath, true))
+    {
+        printf("bench: failed to load %s\n", rompath);
+        NDS::DeInit();
+        return 1;
+    }
+
+    // runs must not modify the save file they started from
+    NDSCart::DetachSave();
+
+    RTC::SetClockBase(kClockBase);
+
+    // leave out the loading
+    Profiler::Reset();
+
+    std::vector<double> frametimes;
+    frametimes.reserve(numframes);
+
+    auto start = std::chrono::steady_clock::now();
+    auto last = start;
+
+    for (u32 i = 0; i < numframes; i++)
+    {
+        if (!inputs.empty())
+            ApplyInput(inputs[std::min((size_t)i, inputs.size()-1)]);
+
+        if (cappath && i == numframes - std::min(capframes, numframes))
+        {
+            if (!GPU3D::Capture::Start(cappath, capframes))
+                cappath = NULL;
+        }
+
+        NDS::RunFrame();
+        SPU::DrainOutput();
+
+        auto now = std::chrono::steady_clock::now();
+        frametimes.push_back(std::chrono::duration<double, std::milli>(now - last).count());
+        last = now;
+    }
+
+    double total = std::chrono::duration<double>(last - start).count();
+
+    u32 fbhash[2];
+    for (int s = 0; s < 2; s++)
+        fbhash[s] = CRC32((u8*)GPU::Framebuffer[GPU::FrontBuffer][s], 256*192*4);
+
+    if (profpath)
+    {
+#ifdef MELONDS_PROFILER
+        FILE* f = fopen(profpath, "w");
+        if (f)
+        {
+            Profiler::WriteJSON(f, Profiler::GetTotal());
+            fclose(f);
+        }
+        else
+            printf("bench: can't write %s\n", profpath);
+#else
+        printf("bench: profiling counters not built in (ENABLE_PROFILER)\n");
+#endif
+    }
+
+    GPU3D::Capture::Stop();
+    NDS::DeInit();
+
+    std::sort(frametimes.begin(), frametimes.end());
+    double fps = numframes / total;
+    double p50 = Percentile(frametimes, 0.50);
+    double p90 = Percentile(frametimes, 0.90);
+    double p99 = Percentile(frametimes, 0.99);
+    double pmax = frametimes.back();
+
+    if (json)
+    {
+        // the core logs to stdout too, so keep this on a single line
+        printf("{\"rom\": ");
+        PrintJSONString(rompath);
+        printf(", \"frames\": %u, \"seconds\": %.4f, \"fps\": %.2f, "
+               "\"frame_ms\": {\"p50\": %.4f, \"p90\": %.4f, \"p99\": %.4f, \"max\": %.4f}, "
+               "\"fb_crc32\": [\"%08X\", \"%08X\"]}\n",
+               numframes, total, fps, p50, p90, p99, pmax, fbhash[0], fbhash[1]);
+    }
+    else
+    {
+        printf("%s: %u frames in %.3f s, %.2f fps\n", rompath, numframes, total, fps);
+        printf("frame time (ms): p50 %.3f, p90 %.3f, p99 %.3f, max %.3f\n", p50, p90, p99, pmax);
+        printf("framebuffer CRC32: top %08X, bottom %08X\n", fbhash[0], fbhash[1]);
+    }
+
+    return 0;
+}
@@ -0,0 +1,125 @@
+/*
+    Copyright 2016-2020 Arisotura
+
+    This file is part of melonDS.
+
+    melonDS is free software: you can redistribute it and/or modify it under
+    the terms of the GNU General Public License as published by the Free
+    Software Foundation, either version 3 of the License, or (at your option)
+    any later version.
+
+    melonDS is distributed in the hope that it will be useful, but WITHOUT ANY
+    WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+    FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with melonDS. If not, see http://www.gnu.org/licenses/.
+*/
+
+// melonDS-crc32bench: compares the CRC32 implementations, checking that they
+// agree and measuring their throughput.
+// usage: melonDS-crc32bench [size in MB]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <vector>
+#include "../CRC32.h"
+
+
+typedef u32 (*CRCFunc)(const u8* data, u32 len);
+
+u32 Bytewise(const u8* data, u32 len) { return CRC32_Bytewise(0, data, len); }
+u32 Slice8(const u8* data, u32 len)   { return CRC32_Slice8(0, data, len); }
+u32 PCLMUL(const u8* data, u32 len)   { return CRC32_PCLMUL(0, data, len); }
+
+// incremental, in odd-sized pieces
+u32 Incremental(const u8* data, u32 len)
+{
+    u32 crc = 0;
+    u32 pos = 0;
+    while (pos < len)
+    {
+        u32 piece = std::min(len - pos, (u32)1000003);
+        crc = CRC32_Update(crc, &data[pos], piece);
+        pos += piece;
+    }
+    return crc;
+}
+
+u32 Parallel(const u8* data, u32 len) { return CRC32_Parallel(data, len); }
+
+
+int main(int argc, char** argv)
+{
+    u32 size = 256;
+    if (argc > 1) size = (u32)strtoul(argv[1], NULL, 0);
+    if (size < 1 || size > 2048)
+    {
+        printf("usage: melonDS-crc32bench [size in MB, 1-2048]\n");
+        return 1;
+    }
+    u32 len = size * 1024 * 1024;
+
+    std::vector<u8> buf(len + 1);
+    u32 seed = 0x12345678;
+    for (u32 i = 0; i < len + 1; i++)
+    {
+        seed = seed * 1103515245 + 12345;
+        buf[i] = seed >> 24;
+    }
+
+    struct
+    {
+        const char* Name;
+        CRCFunc Func;
+        bool Unaligned;
+
+    } tests[] =
+    {
+        {"bytewise", Bytewise, false},
+        {"slice8", Slice8, false},
+        {"slice8 (unaligned)", Slice8, true},
+        {"pclmul", PCLMUL, false},
+        {"pclmul (unaligned)", PCLMUL, true},
+        {"incremental", Incremental, false},
+        {"parallel", Parallel, false},
+    };
+
+    printf("CRC32 over %u MB, PCLMULQDQ %s\n", size, CRC32_HasPCLMUL() ? "available" : "not available");
+
+    u32 ref[2];
+    ref[0] = Bytewise(&buf[0], len);
+    ref[1] = Bytewise(&buf[1], len);
+
+    bool ok = true;
+    for (auto& test : tests)
+    {
+        const u8* data = &buf[test.Unaligned ? 1 : 0];
+
+        auto start = std::chrono::steady_clock::now();
+        u32 crc = test.Func(data, len);
+        auto end = std::chrono::steady_clock::now();
+
+        double secs = std::chrono::duration<double>(end - start).count();
+        bool match = (crc == ref[test.Unaligned ? 1 : 0]);
+        if (!match) ok = false;
+
+        printf("%-20s %08X  %8.3f ms  %7.2f GB/s%s\n", test.Name, crc, secs * 1000.0,
+               (len / secs) / (1024.0*1024.0*1024.0), match ? "" : "  MISMATCH");
+    }
+
+    // padding with zeroes, as done for ROM images
+    u32 half = len / 2;
+    u32 zeroed = CRC32_ZeroExtend(Bytewise(&buf[0], half), len - half);
+    memset(&buf[half], 0, len - half);
+    if (zeroed != Bytewise(&buf[0], len))
+    {
+        printf("zero extension MISMATCH\n");
+        ok = false;
+    }
+
+    return ok ? 0 : 1;
+}
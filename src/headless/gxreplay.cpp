@@ -0,0 +1,236 @@
+/*
+    Copyright 2016-2020 Arisotura
+
+    This file is part of melonDS.
+
+    melonDS is free software: you can redistribute it and/or modify it under
+    the terms of the GNU General Public License as published by the Free
+    Software Foundation, either version 3 of the License, or (at your option)
+    any later version.
+
+    melonDS is distributed in the hope that it will be useful, but WITHOUT ANY
+    WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+    FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with melonDS. If not, see http://www.gnu.org/licenses/.
+*/
+
+// melonDS-gxreplay: renders frames captured with GPU3D::Capture (for example
+// with melonDS-bench -c) without emulating anything else, and reports how
+// long each frame took to render along with a hash of the 3D output.
+//
+// usage: melonDS-gxreplay [-r soft|gl] [-t] [-s scale] [-l loops] capfile
+//
+// -s sets the OpenGL renderer's internal resolution (1 = native).
+// with -l, the capture is rendered several times over; the per-frame output
+// is only printed for the first pass, the timings cover all of them. the
+// OpenGL renderer runs in an offscreen context (see Platform_Headless.h),
+// and also reports its draw calls; without one, it falls back to the software
+// renderer. with Mesa's software rasterizer, this works without a GPU.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <vector>
+#include "../NDS.h"
+#include "../GPU.h"
+#include "../CRC32.h"
+#include "../Config.h"
+#include "../OpenGLSupport.h"
+#include "Platform_Headless.h"
+
+
+void PrintUsage()
+{
+    printf("usage: melonDS-gxreplay [-r soft|gl] [-t] [-s scale] [-l loops] capfile\n");
+    printf("  -r renderer   3D renderer to use (default: soft)\n");
+    printf("  -t            use the software renderer's thread\n");
+    printf("  -s scale      OpenGL internal resolution, 1 to 8 (default: 1)\n");
+    printf("  -l loops      number of times to go through the capture (default: 1)\n");
+}
+
+double Percentile(const std::vector<double>& sorted, double p)
+{
+    if (sorted.empty()) return 0;
+
+    size_t idx = (size_t)(p * (sorted.size() - 1) + 0.5);
+    return sorted[idx];
+}
+
+// reads the 3D output back, which also waits for it to be done
+void FetchOutput(u32** lines)
+{
+    if (GPU3D::Renderer != 0)
+        GPU3D::GLRenderer::PrepareCaptureFrame();
+
+    for (int y = 0; y < 192; y++)
+        lines[y] = GPU3D::GetLine(y);
+
+    GPU3D::VCount144();
+}
+
+
+int main(int argc, char** argv)
+{
+    const char* path = NULL;
+    bool gl = false;
+    u32 loops = 1;
+
+    Config::Threaded3D = 0;
+    Config::GL_ScaleFactor = 1;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "-r") && (i+1) < argc)
+        {
+            i++;
+            if (!strcmp(argv[i], "gl"))        gl = true;
+            else if (!strcmp(argv[i], "soft")) gl = false;
+            else
+            {
+                PrintUsage();
+                return 1;
+            }
+        }
+        else if (!strcmp(argv[i], "-t"))
+            Config::Threaded3D = 1;
+        else if (!strcmp(argv[i], "-s") && (i+1) < argc)
+            Config::GL_ScaleFactor = std::min(std::max(atoi(argv[++i]), 1), 8);
+        else if (!strcmp(argv[i], "-l") && (i+1) < argc)
+            loops = (u32)strtoul(argv[++i], NULL, 0);
+        else if (argv[i][0] != '-' && !path)
+            path = argv[i];
+        else
+        {
+            PrintUsage();
+            return 1;
+        }
+    }
+
+    if (!path || loops == 0)
+    {
+        PrintUsage();
+        return 1;
+    }
+
+    if (!NDS::Init())
+    {
+        printf("gxreplay: failed to init the emulator\n");
+        return 1;
+    }
+
+    if (gl && !(Platform::GL_InitContext() && OpenGL_Init()))
+        gl = false;
+
+    Config::_3DRenderer = gl ? 1 : 0;
+    int renderer = GPU3D::InitRenderer(gl);
+    if (gl && renderer != 1)
+        printf("gxreplay: OpenGL isn't available, using the software renderer\n");
+
+    u32 numframes = GPU3D::Capture::OpenReplay(path);
+    if (!numframes)
+    {
+        NDS::DeInit();
+        Platform::GL_DeInitContext();
+        return 1;
+    }
+
+    u32* lines[192];
+
+    // a renderer thread starts out rendering a frame of its own
+    if (renderer == 0 && Config::Threaded3D)
+        FetchOutput(lines);
+
+    std::vector<double> frametimes;
+    frametimes.reserve(numframes * loops);
+    u32 allcrc = 0;
+    u64 drawcalls = 0;
+    bool ok = true;
+
+    for (u32 l = 0; l < loops && ok; l++)
+    {
+        GPU3D::Capture::RewindReplay();
+
+        for (u32 i = 0; i < numframes; i++)
+        {
+            if (!GPU3D::Capture::ReplayFrame())
+            {
+                ok = false;
+                break;
+            }
+
+            // always render, even if the frame is the same as the previous one
+            GPU3D::RenderFrameRepeats = 0;
+
+            auto start = std::chrono::steady_clock::now();
+            if (renderer == 0) GPU3D::SoftRenderer::RenderFrame();
+            else               GPU3D::GLRenderer::RenderFrame();
+            FetchOutput(lines);
+            auto end = std::chrono::steady_clock::now();
+
+            double ms = std::chrono::duration<double, std::milli>(end - start).count();
+            frametimes.push_back(ms);
+
+            u32 numdraws = (renderer == 1) ? GPU3D::GLRenderer::GetDrawCallCount() : 0;
+            drawcalls += numdraws;
+
+            if (l == 0)
+            {
+                u32 crc = 0;
+                for (int y = 0; y < 192; y++)
+                    crc = CRC32_Update(crc, (u8*)lines[y], 256*4);
+
+                allcrc = CRC32_Update(allcrc, (u8*)&crc, 4);
+                if (renderer == 1)
+                    printf("frame %u: %.3f ms, %u polygons, %u draw calls, CRC32 %08X\n",
+                           i, ms, GPU3D::RenderNumPolygons, numdraws, crc);
+                else
+                    printf("frame %u: %.3f ms, %u polygons, CRC32 %08X\n",
+                           i, ms, GPU3D::RenderNumPolygons, crc);
+            }
+        }
+    }
+
+    u32 readbacks = 0, stalls = 0;
+    u32 texdecodes = 0;
+    u64 texupload = 0;
+    if (renderer == 1)
+    {
+        GPU3D::GLRenderer::GetReadbackStats(&readbacks, &stalls);
+        GPU3D::GLRenderer::GetTexCacheStats(&texdecodes, &texupload);
+    }
+
+    GPU3D::Capture::CloseReplay();
+    NDS::DeInit();
+    Platform::GL_DeInitContext();
+
+    if (!ok || frametimes.empty())
+    {
+        printf("gxreplay: failed to replay %s\n", path);
+        return 1;
+    }
+
+    double total = 0;
+    for (double t : frametimes) total += t;
+
+    std::sort(frametimes.begin(), frametimes.end());
+    printf("%s: %u frames x %u, %s renderer%s\n", path, numframes, loops,
+           renderer ? "OpenGL" : "software",
+           (renderer == 0 && Config::Threaded3D) ? " (threaded)" : "");
+    printf("render time (ms): avg %.3f, p50 %.3f, p90 %.3f, p99 %.3f, max %.3f\n",
+           total / frametimes.size(),
+           Percentile(frametimes, 0.50), Percentile(frametimes, 0.90),
+           Percentile(frametimes, 0.99), frametimes.back());
+    if (renderer == 1)
+    {
+        printf("draw calls per frame: avg %.1f\n", (double)drawcalls / frametimes.size());
+        printf("capture readbacks: %u, waited for %u\n", readbacks, stalls);
+        printf("textures decoded: %u, %.1f KB uploaded\n", texdecodes, texupload / 1024.0);
+    }
+    printf("output CRC32: %08X\n", allcrc);
+
+    return 0;
+}
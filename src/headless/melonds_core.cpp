@@ -0,0 +1,170 @@
+/*
+    Copyright 2016-2020 Arisotura
+
+    This file is part of melonDS.
+
+    melonDS is free software: you can redistribute it and/or modify it under
+    the terms of the GNU General Public License as published by the Free
+    Software Foundation, either version 3 of the License, or (at your option)
+    any later version.
+
+    melonDS is distributed in the hope that it will be useful, but WITHOUT ANY
+    WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+    FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with melonDS. If not, see http://www.gnu.org/licenses/.
+*/
+
+#include <stdio.h>
+#include <vector>
+#include "../NDS.h"
+#include "../GPU.h"
+#include "../SPU.h"
+#include "Platform_Headless.h"
+#include "melonds_core.h"
+
+
+struct melonds_instance
+{
+    std::vector<s16> Audio;
+    bool ROMLoaded;
+};
+
+namespace
+{
+
+// there is one console per thread with MULTI_INSTANCE, one per process otherwise
+EMUSTATE melonds_instance* CurInstance;
+
+const char* kSystemFileNames[3] = {"bios9.bin", "bios7.bin", "firmware.bin"};
+const char* kROMFileName = ":melonds_rom:";
+
+bool CheckInstance(melonds_instance* inst)
+{
+    if (inst && inst == CurInstance) return true;
+
+    printf("melonds_core: instance %p used from the wrong thread\n", inst);
+    return false;
+}
+
+}
+
+
+melonds_instance* melonds_create(void)
+{
+    if (CurInstance) return NULL;
+
+    if (!NDS::Init()) return NULL;
+    GPU3D::InitRenderer(false);
+
+    melonds_instance* inst = new melonds_instance;
+    inst->ROMLoaded = false;
+
+    CurInstance = inst;
+    return inst;
+}
+
+void melonds_destroy(melonds_instance* inst)
+{
+    if (!CheckInstance(inst)) return;
+
+    NDS::DeInit();
+    Platform::ClearMemoryFiles();
+
+    delete inst;
+    CurInstance = NULL;
+}
+
+int melonds_set_system_file(melonds_instance* inst, int which, const void* data, size_t len)
+{
+    if (!CheckInstance(inst)) return 0;
+    if (which < MELONDS_FILE_BIOS9 || which > MELONDS_FILE_FIRMWARE) return 0;
+
+    Platform::SetMemoryFile(kSystemFileNames[which], (const u8*)data, (u32)len);
+    return 1;
+}
+
+int melonds_load_rom(melonds_instance* inst, const void* data, size_t len, const char* savepath, int directboot)
+{
+    if (!CheckInstance(inst)) return 0;
+
+    Platform::SetMemoryFile(kROMFileName, (const u8*)data, (u32)len);
+    bool res = NDS::LoadROM(kROMFileName, savepath ? savepath : "", directboot != 0);
+    Platform::SetMemoryFile(kROMFileName, NULL, 0);
+
+    if (!res) return 0;
+
+    SPU::InitOutput();
+    inst->ROMLoaded = true;
+    return 1;
+}
+
+void melonds_set_keys(melonds_instance* inst, uint32_t keys)
+{
+    if (!CheckInstance(inst)) return;
+
+    // the core takes a mask of released keys
+    NDS::SetKeyMask(~keys & 0xFFF);
+}
+
+void melonds_set_touch(melonds_instance* inst, int touching, int x, int y)
+{
+    if (!CheckInstance(inst)) return;
+
+    if (touching)
+    {
+        if (x < 0) x = 0; else if (x > 255) x = 255;
+        if (y < 0) y = 0; else if (y > 191) y = 191;
+
+        NDS::TouchScreen(x, y);
+        NDS::PressKey(16+6);
+    }
+    else
+    {
+        NDS::ReleaseScreen();
+        NDS::ReleaseKey(16+6);
+    }
+}
+
+uint32_t melonds_run_frames(melonds_instance* inst, uint32_t frames)
+{
+    if (!CheckInstance(inst)) return 0;
+    if (!inst->ROMLoaded) return 0;
+
+    inst->Audio.clear();
+
+    for (uint32_t i = 0; i < frames; i++)
+    {
+        NDS::RunFrame();
+
+        // drain the SPU output every frame, as it only holds a few frames' worth.
+        // this is the one copy the audio goes through
+        int avail = SPU::GetOutputSize();
+        if (avail > 0)
+        {
+            size_t pos = inst->Audio.size();
+            inst->Audio.resize(pos + avail*2);
+            int got = SPU::ReadOutput(&inst->Audio[pos], avail);
+            inst->Audio.resize(pos + got*2);
+        }
+    }
+
+    return frames;
+}
+
+const uint32_t* melonds_get_framebuffer(melonds_instance* inst, int screen)
+{
+    if (!CheckInstance(inst)) return NULL;
+    if (screen != MELONDS_SCREEN_TOP && screen != MELONDS_SCREEN_BOTTOM) return NULL;
+
+    return GPU::Framebuffer[GPU::FrontBuffer][screen];
+}
+
+size_t melonds_get_audio(melonds_instance* inst, const int16_t** samples)
+{
+    if (!CheckInstance(inst)) return 0;
+
+    *samples = inst->Audio.empty() ? NULL : &inst->Audio[0];
+    return inst->Audio.size() / 2;
+}
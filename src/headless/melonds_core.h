@@ -0,0 +1,109 @@
+/*
+    Copyright 2016-2020 Arisotura
+
+    This file is part of melonDS.
+
+    melonDS is free software: you can redistribute it and/or modify it under
+    the terms of the GNU General Public License as published by the Free
+    Software Foundation, either version 3 of the License, or (at your option)
+    any later version.
+
+    melonDS is distributed in the hope that it will be useful, but WITHOUT ANY
+    WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+    FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with melonDS. If not, see http://www.gnu.org/licenses/.
+*/
+
+#ifndef MELONDS_CORE_H
+#define MELONDS_CORE_H
+
+// C API for embedding the emulator core
+//
+// an instance is a whole emulated DS. there can be one per process, or, when
+// the core is built with MULTI_INSTANCE, one per thread. either way, an instance
+// must only be used from the thread that created it.
+//
+// pointers returned by the API point into buffers owned by the instance. they
+// stay valid until the next call that runs the emulator on that instance.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(_WIN32)
+#define MELONDS_API __declspec(dllexport)
+#else
+#define MELONDS_API __attribute__((visibility("default")))
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct melonds_instance melonds_instance;
+
+enum
+{
+    MELONDS_FILE_BIOS9 = 0,
+    MELONDS_FILE_BIOS7,
+    MELONDS_FILE_FIRMWARE
+};
+
+enum
+{
+    MELONDS_SCREEN_TOP = 0,
+    MELONDS_SCREEN_BOTTOM
+};
+
+// key bits, as in the KEYINPUT/EXTKEYIN registers
+enum
+{
+    MELONDS_KEY_A      = (1 << 0),
+    MELONDS_KEY_B      = (1 << 1),
+    MELONDS_KEY_SELECT = (1 << 2),
+    MELONDS_KEY_START  = (1 << 3),
+    MELONDS_KEY_RIGHT  = (1 << 4),
+    MELONDS_KEY_LEFT   = (1 << 5),
+    MELONDS_KEY_UP     = (1 << 6),
+    MELONDS_KEY_DOWN   = (1 << 7),
+    MELONDS_KEY_R      = (1 << 8),
+    MELONDS_KEY_L      = (1 << 9),
+    MELONDS_KEY_X      = (1 << 10),
+    MELONDS_KEY_Y      = (1 << 11)
+};
+
+// returns NULL if the calling thread can't get an instance
+MELONDS_API melonds_instance* melonds_create(void);
+MELONDS_API void melonds_destroy(melonds_instance* inst);
+
+// BIOS/firmware images, not copied: they must stay valid while the instance exists
+// they are read when a ROM is loaded. returns 0 on failure
+MELONDS_API int melonds_set_system_file(melonds_instance* inst, int which, const void* data, size_t len);
+
+// the ROM image isn't copied either, and must stay valid during the call only
+// savepath may be NULL, in which case save memory isn't persisted
+// returns 0 on failure
+MELONDS_API int melonds_load_rom(melonds_instance* inst, const void* data, size_t len, const char* savepath, int directboot);
+
+// keys: combination of MELONDS_KEY_* for the keys currently held
+MELONDS_API void melonds_set_keys(melonds_instance* inst, uint32_t keys);
+MELONDS_API void melonds_set_touch(melonds_instance* inst, int touching, int x, int y);
+
+// runs the given amount of frames, returns how many were run
+MELONDS_API uint32_t melonds_run_frames(melonds_instance* inst, uint32_t frames);
+
+// last completed frame: 256x192 pixels, 32-bit BGRA
+MELONDS_API const uint32_t* melonds_get_framebuffer(melonds_instance* inst, int screen);
+
+// audio produced by the last melonds_run_frames() call. the SPU output is a
+// ring buffer, so it is copied out once per emulated frame into a buffer that
+// holds the whole call's worth of audio.
+// interleaved stereo 16-bit samples at 32823.6 Hz. returns the amount of sample pairs
+MELONDS_API size_t melonds_get_audio(melonds_instance* inst, const int16_t** samples);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // MELONDS_CORE_H
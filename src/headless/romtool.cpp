@@ -0,0 +1,267 @@
+/*
+    Copyright 2016-2020 Arisotura
+
+    This file is part of melonDS.
+
+    melonDS is free software: you can redistribute it and/or modify it under
+    the terms of the GNU General Public License as published by the Free
+    Software Foundation, either version 3 of the License, or (at your option)
+    any later version.
+
+    melonDS is distributed in the hope that it will be useful, but WITHOUT ANY
+    WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+    FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with melonDS. If not, see http://www.gnu.org/licenses/.
+*/
+
+// melonDS-romtool: converts ROMs to and from the compressed container
+// (see CompressedROM.h), and measures cart read throughput.
+//
+// usage:
+//   melonDS-romtool compress [-b blocksize] [-l level] in out
+//   melonDS-romtool decompress in out
+//   melonDS-romtool bench rom [rom...]
+//
+// bench loads each ROM like the emulator does (BIOS and firmware files are
+// looked up in the current directory) and times card reads through it:
+// random 0x200-byte reads, as games do when streaming data, and sequential
+// 0x4000-byte reads. Pass both a plain and a compressed copy to compare.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <vector>
+#include "../NDS.h"
+#include "../NDSCart.h"
+#include "../GPU.h"
+#include "../CompressedROM.h"
+#include "../CRC32.h"
+
+
+void PrintUsage()
+{
+    printf("usage: melonDS-romtool compress [-b blocksize] [-l level] in out\n");
+    printf("       melonDS-romtool decompress in out\n");
+    printf("       melonDS-romtool bench rom [rom...]\n");
+}
+
+int Compress(int argc, char** argv)
+{
+    u32 blocksize = 0x10000;
+    int level = 9;
+    const char* paths[2] = {NULL, NULL};
+    int numpaths = 0;
+
+    for (int i = 0; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "-b") && (i+1) < argc)
+            blocksize = (u32)strtoul(argv[++i], NULL, 0);
+        else if (!strcmp(argv[i], "-l") && (i+1) < argc)
+            level = atoi(argv[++i]);
+        else if (argv[i][0] != '-' && numpaths < 2)
+            paths[numpaths++] = argv[i];
+        else
+        {
+            PrintUsage();
+            return 1;
+        }
+    }
+
+    if (numpaths != 2)
+    {
+        PrintUsage();
+        return 1;
+    }
+
+    FILE* in = fopen(paths[0], "rb");
+    if (!in)
+    {
+        printf("romtool: can't open %s\n", paths[0]);
+        return 1;
+    }
+
+    if (CompressedROM::IsCompressed(in))
+    {
+        printf("romtool: %s is already compressed\n", paths[0]);
+        fclose(in);
+        return 1;
+    }
+
+    FILE* out = fopen(paths[1], "wb");
+    if (!out)
+    {
+        printf("romtool: can't create %s\n", paths[1]);
+        fclose(in);
+        return 1;
+    }
+
+    bool ok = CompressedROM::Compress(in, out, blocksize, level);
+
+    fseek(in, 0, SEEK_END);
+    fseek(out, 0, SEEK_END);
+    long inlen = ftell(in);
+    long outlen = ftell(out);
+    fclose(in);
+    fclose(out);
+
+    if (!ok)
+    {
+        printf("romtool: failed to compress %s\n", paths[0]);
+        remove(paths[1]);
+        return 1;
+    }
+
+    printf("%s: %ld -> %ld bytes (%.1f%%)\n", paths[0], inlen, outlen,
+           inlen ? (outlen * 100.0 / inlen) : 0.0);
+    return 0;
+}
+
+int Decompress(int argc, char** argv)
+{
+    if (argc != 2)
+    {
+        PrintUsage();
+        return 1;
+    }
+
+    FILE* in = fopen(argv[0], "rb");
+    if (!in)
+    {
+        printf("romtool: can't open %s\n", argv[0]);
+        return 1;
+    }
+
+    if (!CompressedROM::IsCompressed(in))
+    {
+        printf("romtool: %s isn't compressed\n", argv[0]);
+        fclose(in);
+        return 1;
+    }
+
+    CompressedROM rom(in);
+    if (rom.Error)
+        return 1;
+
+    FILE* out = fopen(argv[1], "wb");
+    if (!out)
+    {
+        printf("romtool: can't create %s\n", argv[1]);
+        return 1;
+    }
+
+    std::vector<u8> buf(0x100000);
+    u32 crc = 0;
+    bool ok = true;
+    for (u32 pos = 0; pos < rom.Length && ok; pos += buf.size())
+    {
+        u32 len = std::min((u32)buf.size(), rom.Length - pos);
+        rom.Read(pos, &buf[0], len);
+        crc = CRC32_Update(crc, &buf[0], len);
+        ok = fwrite(&buf[0], len, 1, out) == 1;
+    }
+    fclose(out);
+
+    if (!ok || crc != rom.CRC)
+    {
+        printf("romtool: %s: %s\n", argv[0], ok ? "CRC mismatch" : "write error");
+        remove(argv[1]);
+        return 1;
+    }
+
+    printf("%s: %u bytes, CRC32 %08X\n", argv[0], rom.Length, crc);
+    return 0;
+}
+
+int Bench(int argc, char** argv)
+{
+    if (argc < 1)
+    {
+        PrintUsage();
+        return 1;
+    }
+
+    if (!NDS::Init())
+    {
+        printf("romtool: failed to init the emulator\n");
+        return 1;
+    }
+    GPU3D::InitRenderer(false);
+
+    int ret = 0;
+    for (int i = 0; i < argc; i++)
+    {
+        auto start = std::chrono::steady_clock::now();
+        bool loaded = NDS::LoadROM(argv[i], "", false);
+        auto end = std::chrono::steady_clock::now();
+        if (!loaded)
+        {
+            printf("romtool: failed to load %s\n", argv[i]);
+            ret = 1;
+            continue;
+        }
+        NDSCart::DetachSave();
+
+        double loadtime = std::chrono::duration<double>(end - start).count();
+
+        u32 romsize = NDSCart::CartROMSize;
+        std::vector<u8> buf(0x4000);
+
+        // random reads: as many as needed to go through the ROM once,
+        // capped so huge ROMs don't take forever
+        u32 numreads = std::min(romsize / 0x200, (u32)0x40000);
+        u32 seed = 0x12345678;
+        start = std::chrono::steady_clock::now();
+        for (u32 j = 0; j < numreads; j++)
+        {
+            seed = seed * 1103515245 + 12345;
+            u32 addr = (seed % (romsize / 0x200)) * 0x200;
+            NDSCart::ReadROMBytes(addr, &buf[0], 0x200);
+        }
+        end = std::chrono::steady_clock::now();
+        double randtime = std::chrono::duration<double>(end - start).count();
+
+        u32 crc = 0;
+        start = std::chrono::steady_clock::now();
+        for (u32 addr = 0; addr < romsize; addr += 0x4000)
+        {
+            u32 len = std::min((u32)0x4000, romsize - addr);
+            NDSCart::ReadROMBytes(addr, &buf[0], len);
+            crc = CRC32_Update(crc, &buf[0], len);
+        }
+        end = std::chrono::steady_clock::now();
+        double seqtime = std::chrono::duration<double>(end - start).count();
+
+        const double mb = 1024.0 * 1024.0;
+        printf("%s: load %.2f ms, random 0x200 reads %.1f MB/s, sequential 0x4000 reads %.1f MB/s (CRC32 %08X)\n",
+               argv[i], loadtime * 1000.0,
+               (numreads * 0x200) / randtime / mb,
+               romsize / seqtime / mb, crc);
+    }
+
+    NDS::DeInit();
+    return ret;
+}
+
+
+int main(int argc, char** argv)
+{
+    if (argc < 2)
+    {
+        PrintUsage();
+        return 1;
+    }
+
+    if (!strcmp(argv[1], "compress"))
+        return Compress(argc-2, &argv[2]);
+    if (!strcmp(argv[1], "decompress"))
+        return Decompress(argc-2, &argv[2]);
+    if (!strcmp(argv[1], "bench"))
+        return Bench(argc-2, &argv[2]);
+
+    PrintUsage();
+    return 1;
+}
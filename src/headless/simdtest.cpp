@@ -0,0 +1,320 @@
+/*
+    Copyright 2016-2020 Arisotura
+
+    This file is part of melonDS.
+
+    melonDS is free software: you can redistribute it and/or modify it under
+    the terms of the GNU General Public License as published by the Free
+    Software Foundation, either version 3 of the License, or (at your option)
+    any later version.
+
+    melonDS is distributed in the hope that it will be useful, but WITHOUT ANY
+    WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+    FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with melonDS. If not, see http://www.gnu.org/licenses/.
+*/
+
+// melonDS-simdtest: checks that the SIMD versions of the 3D engine's kernels
+// give the exact same results as the scalar code, on random inputs and on
+// edge cases (values that overflow or wrap, negative fixed-point values,
+// levels that need clamping). the software renderer's final pass is checked
+// the same way, over whole screens of random pixels.
+// usage: melonDS-simdtest [iterations]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
+#include "../GPU3D.h"
+
+
+u32 Seed = 0x12345678;
+
+u32 Random()
+{
+    Seed ^= Seed << 13;
+    Seed ^= Seed >> 17;
+    Seed ^= Seed << 5;
+    return Seed;
+}
+
+// values that tend to break things: the s32 limits, around zero, around 1.0
+// in 20.12 fixed point, and the limits of the 16-bit and 10-bit ranges
+const s32 EdgeValues[] =
+{
+    0, 1, -1, 2, -2,
+    0x1000, -0x1000, 0xFFF, -0xFFF, 0x1001, -0x1001,
+    0x7FFF, -0x8000, 0x200, -0x200, 0x1FF, -0x1FF,
+    0x7FFFFFFF, (s32)0x80000000, 0x7FFFFFFE, (s32)0x80000001,
+    0x40000000, -0x40000000, 0x00FFFFFF, -0x01000000,
+};
+const int NumEdgeValues = sizeof(EdgeValues) / sizeof(EdgeValues[0]);
+
+// one in four is an edge value, the rest are random within 'bits' bits
+s32 RandomValue(int bits)
+{
+    u32 r = Random();
+    if ((r & 3) == 0)
+        return EdgeValues[(r >> 2) % NumEdgeValues];
+
+    s32 val = (s32)Random();
+    if (bits < 32) val >>= (32 - bits);
+    return val;
+}
+
+bool Fail(const char* test, int iter)
+{
+    printf("%s: MISMATCH at iteration %d\n", test, iter);
+    return false;
+}
+
+
+// the SIMD code only exists on x86
+#if defined(__x86_64__) || defined(__i386__)
+
+bool TestVecMult(int iters)
+{
+    for (int i = 0; i < iters; i++)
+    {
+        int bits = (i & 1) ? 32 : 20;
+        s32 v[4], mat[16];
+        for (int k = 0; k < 4; k++) v[k] = RandomValue(bits);
+        for (int k = 0; k < 16; k++) mat[k] = RandomValue(bits);
+
+        s32 ref[4], out[4];
+        GPU3D::VecMult4x4_Scalar(ref, v, mat);
+        GPU3D::VecMult4x4_SSE41(out, v, mat);
+        if (memcmp(ref, out, sizeof(ref)))
+            return Fail("VecMult4x4_SSE41", i);
+    }
+
+    return true;
+}
+
+bool TestMatrixMult(int iters, int level)
+{
+    for (int i = 0; i < iters; i++)
+    {
+        int bits = (i & 1) ? 32 : 20;
+        s32 m[16], s[16];
+        for (int k = 0; k < 16; k++) m[k] = RandomValue(bits);
+        for (int k = 0; k < 16; k++) s[k] = RandomValue(bits);
+
+        s32 ref[16], out[16];
+        memcpy(ref, m, sizeof(m));
+        GPU3D::MatrixMult4x4_Scalar(ref, s);
+
+        memcpy(out, m, sizeof(m));
+        GPU3D::MatrixMult4x4_SSE41(out, s);
+        if (memcmp(ref, out, sizeof(ref)))
+            return Fail("MatrixMult4x4_SSE41", i);
+
+        if (level >= GPU3D::SIMD_AVX2)
+        {
+            memcpy(out, m, sizeof(m));
+            GPU3D::MatrixMult4x4_AVX2(out, s);
+            if (memcmp(ref, out, sizeof(ref)))
+                return Fail("MatrixMult4x4_AVX2", i);
+        }
+    }
+
+    return true;
+}
+
+bool TestClipOutcodes(int iters)
+{
+    GPU3D::Vertex vertices[10];
+
+    for (int i = 0; i < iters; i++)
+    {
+        int nverts = 1 + (Random() % 10);
+        int start = Random() % nverts;
+
+        memset(vertices, 0, sizeof(vertices));
+        for (int j = 0; j < nverts; j++)
+        {
+            s32* pos = vertices[j].Position;
+            pos[3] = RandomValue((i & 1) ? 32 : 16);
+
+            // right on the planes, just past them, or anywhere.
+            // done unsigned, as W can be one of the s32 limits
+            u32 w = (u32)pos[3];
+            for (int k = 0; k < 3; k++)
+            {
+                switch (Random() & 3)
+                {
+                case 0: pos[k] = (s32)((Random() & 1) ? w : -w); break;
+                case 1: pos[k] = (s32)(w + 1); break;
+                case 2: pos[k] = (s32)(-w - 1); break;
+                case 3: pos[k] = RandomValue(32); break;
+                }
+            }
+        }
+
+        u32 refor, refand, outor, outand;
+        GPU3D::ClipOutcodes_Scalar(vertices, start, nverts, &refor, &refand);
+        GPU3D::ClipOutcodes_SSE41(vertices, start, nverts, &outor, &outand);
+        if (refor != outor || refand != outand)
+            return Fail("ClipOutcodes_SSE41", i);
+    }
+
+    return true;
+}
+
+bool TestLightLevels(int iters)
+{
+    for (int i = 0; i < iters; i++)
+    {
+        // normals and light directions are 10-bit on hardware, but anything
+        // that fits in their storage can show up. the matrix can overflow
+        // the products, which then have to wrap the same way.
+        int bits = (i & 1) ? 16 : 10;
+
+        s16 normal[3];
+        s32 vecmatrix[16];
+        s16 lightdir[4][3];
+        for (int k = 0; k < 3; k++) normal[k] = (s16)RandomValue(bits);
+        for (int k = 0; k < 16; k++) vecmatrix[k] = RandomValue((i & 2) ? 32 : 14);
+        for (int l = 0; l < 4; l++)
+            for (int k = 0; k < 3; k++) lightdir[l][k] = (s16)RandomValue(bits);
+
+        s32 refdiff[4], refshine[4], outdiff[4], outshine[4];
+        GPU3D::LightLevels_Scalar(normal, vecmatrix, lightdir, refdiff, refshine);
+        GPU3D::LightLevels_SSE41(normal, vecmatrix, lightdir, outdiff, outshine);
+        if (memcmp(refdiff, outdiff, sizeof(refdiff)) || memcmp(refshine, outshine, sizeof(refshine)))
+            return Fail("LightLevels_SSE41", i);
+    }
+
+    return true;
+}
+
+// random pixels for the final pass, both layers and the border. polygon IDs
+// are picked among a few so that neighbours often share them, and depths are
+// often right around the fog offset.
+void FillPixels()
+{
+    using namespace GPU3D;
+
+    for (int layer = 0; layer < 2; layer++)
+    {
+        for (int y = -1; y <= 192; y++)
+        {
+            for (int x = -1; x <= 256; x++)
+            {
+                u32 color = Random() & 0x1F3F3F3F;
+
+                u32 depth;
+                switch (Random() & 3)
+                {
+                case 0: depth = RenderFogOffset; break;
+                case 1: depth = (RenderFogOffset + (Random() & 0xFFF) - 0x800) & 0xFFFFFF; break;
+                default: depth = Random() & 0xFFFFFF; break;
+                }
+
+                u32 attr = Random() & 0x0040801F;
+                attr |= (Random() & 3) << 24; // opaque polygon ID
+                attr |= (Random() & 3) << 16; // translucent polygon ID
+
+                // full and zero coverage are handled separately
+                switch (Random() & 3)
+                {
+                case 0: attr |= 0x1F << 8; break;
+                case 1: break;
+                default: attr |= (Random() & 0x1F) << 8; break;
+                }
+
+                SoftRenderer::SetPixel(layer, x, y, color, depth, attr);
+            }
+        }
+    }
+}
+
+bool TestFinalPass(int iters)
+{
+    using namespace GPU3D;
+
+    std::vector<u32> ref(256 * 192);
+
+    for (int i = 0; i < iters; i++)
+    {
+        // every combination of antialiasing, edge marking, fog alpha only and fog
+        RenderDispCnt = (i & 0xF) << 4;
+
+        for (int k = 0; k < 8; k++) RenderEdgeTable[k] = Random() & 0x7FFF;
+        RenderFogColor = Random() & 0x001F7FFF;
+        RenderFogOffset = Random() & 0x7FFF;
+        if (i & 0x10) RenderFogOffset *= 0x200;
+        RenderFogShift = Random() & 0xF;
+        for (int k = 0; k < 34; k++)
+            RenderFogDensityTable[k] = (Random() & 1) ? 127 : (Random() & 0x7F);
+
+        u32 seed = Seed;
+        FillPixels();
+        SoftRenderer::FinalPass(false);
+        for (int y = 0; y < 192; y++)
+            memcpy(&ref[y * 256], SoftRenderer::GetLine(y), 256 * 4);
+
+        Seed = seed;
+        FillPixels();
+        SoftRenderer::FinalPass(true);
+        for (int y = 0; y < 192; y++)
+        {
+            if (memcmp(&ref[y * 256], SoftRenderer::GetLine(y), 256 * 4))
+            {
+                printf("ScanlineFinalPass_AVX2: MISMATCH at iteration %d, line %d (DISPCNT %04X)\n",
+                       i, y, RenderDispCnt);
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+#endif
+
+
+int main(int argc, char** argv)
+{
+    int iters = 1000000;
+    if (argc > 1) iters = (int)strtol(argv[1], NULL, 0);
+    if (iters < 1)
+    {
+        printf("usage: melonDS-simdtest [iterations]\n");
+        return 1;
+    }
+
+#if defined(__x86_64__) || defined(__i386__)
+    int level = GPU3D::SIMDLevel();
+    if (level < GPU3D::SIMD_SSE41)
+    {
+        printf("SSE4.1 not available, nothing to test\n");
+        return 0;
+    }
+
+    printf("%d iterations, AVX2 %s\n", iters, (level >= GPU3D::SIMD_AVX2) ? "available" : "not available");
+
+    bool ok = true;
+    ok = TestVecMult(iters) && ok;
+    ok = TestMatrixMult(iters, level) && ok;
+    ok = TestClipOutcodes(iters) && ok;
+    ok = TestLightLevels(iters) && ok;
+
+    if (level >= GPU3D::SIMD_AVX2)
+    {
+        // a whole screen per iteration
+        GPU3D::SoftRenderer::Init();
+        ok = TestFinalPass(std::max(iters / 10000, 16)) && ok;
+        GPU3D::SoftRenderer::DeInit();
+    }
+
+    printf("%s\n", ok ? "all OK" : "FAILED");
+    return ok ? 0 : 1;
+#else
+    printf("no SIMD code on this architecture, nothing to test\n");
+    return 0;
+#endif
+}
@@ -324,6 +324,33 @@ FILE* OpenDataFile(const char* path)
 
 #endif
 
+bool RenameFile(const char* oldpath, const char* newpath)
+{
+#ifdef __WIN32__
+
+    int len = MultiByteToWideChar(CP_UTF8, 0, oldpath, -1, NULL, 0);
+    if (len < 1) return false;
+    WCHAR* fatold = new WCHAR[len];
+    MultiByteToWideChar(CP_UTF8, 0, oldpath, -1, fatold, len);
+
+    len = MultiByteToWideChar(CP_UTF8, 0, newpath, -1, NULL, 0);
+    if (len < 1) { delete[] fatold; return false; }
+    WCHAR* fatnew = new WCHAR[len];
+    MultiByteToWideChar(CP_UTF8, 0, newpath, -1, fatnew, len);
+
+    bool ret = MoveFileExW(fatold, fatnew, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0;
+
+    delete[] fatold;
+    delete[] fatnew;
+    return ret;
+
+#else
+
+    return rename(oldpath, newpath) == 0;
+
+#endif
+}
+
 
 void* Thread_Create(void (*func)())
 {
@@ -50,6 +50,7 @@
 #include "../Config.h"
 
 #include "../Savestate.h"
+#include "../Profiler.h"
 
 #include "OSD.h"
 
@@ -941,6 +942,11 @@ int EmuThreadFunc(void* burp)
     float samplesleft = 0;
     u32 nsamples = 0;
 
+#ifdef MELONDS_PROFILER
+    u32 profcount = 0;
+    Profiler::Stats lastprof = *Profiler::GetTotal();
+#endif
+
     char melontitle[100];
     SDL_mutex* titlemutex = SDL_CreateMutex();
     void* titledata[2] = {melontitle, titlemutex};
@@ -1112,6 +1118,37 @@ int EmuThreadFunc(void* burp)
                 sprintf(melontitle, "[%d/%.0f] melonDS " MELONDS_VERSION, fps, fpstarget);
                 SDL_UnlockMutex(titlemutex);
                 uiQueueMain(UpdateWindowTitle, titledata);
+
+#ifdef MELONDS_PROFILER
+                profcount++;
+                if (profcount >= 4)
+                {
+                    // average host time per frame since the last report
+                    profcount = 0;
+
+                    const Profiler::Stats* prof = Profiler::GetTotal();
+                    u32 profframes = prof->Frames - lastprof.Frames;
+                    if (prof->Frames > lastprof.Frames)
+                    {
+                        auto ms = [&](int id) -> float
+                        {
+                            u64 ns = prof->Counters[id].Nanoseconds - lastprof.Counters[id].Nanoseconds;
+                            return (ns / 1000000.0f) / profframes;
+                        };
+
+                        char msg[256];
+                        sprintf(msg, "ARM9 %.2f ARM7 %.2f DMA %.2f 2D %.2f 3D %.2f rast %.2f SPU %.2f ms",
+                                ms(Profiler::Prof_ARM9Execute), ms(Profiler::Prof_ARM7Execute),
+                                ms(Profiler::Prof_DMA9) + ms(Profiler::Prof_DMA7),
+                                ms(Profiler::Prof_GPU2DDrawScanline), ms(Profiler::Prof_GPU3DRun),
+                                ms(Profiler::Prof_SoftRenderPolygons), ms(Profiler::Prof_SPUMix));
+                        OSD::AddMessage(0, msg);
+                    }
+
+                    // (if the console was reset in the meantime, this just starts over)
+                    lastprof = *prof;
+                }
+#endif
             }
         }
         else
@@ -2033,7 +2070,7 @@ void OnDropFile(uiWindow* window, char* file, void* blarg)
     char* ext = &file[strlen(file)-3];
     int prevstatus = EmuRunning;
 
-    if (!strcasecmp(ext, "nds") || !strcasecmp(ext, "srl"))
+    if (!strcasecmp(ext, "nds") || !strcasecmp(ext, "srl") || !strcasecmp(ext, "ndz"))
     {
         if (RunningSomething)
         {
@@ -2043,7 +2080,7 @@ void OnDropFile(uiWindow* window, char* file, void* blarg)
 
         TryLoadROM(file, 0, prevstatus);
     }
-    else if (!strcasecmp(ext, "gba"))
+    else if (!strcasecmp(ext, "gba") || !strcasecmp(ext, "gbz"))
     {
         TryLoadROM(file, 1, prevstatus);
     }
@@ -2076,7 +2113,7 @@ void OnOpenFile(uiMenuItem* item, uiWindow* window, void* blarg)
     EmuRunning = 2;
     while (EmuStatus != 2);
 
-    char* file = uiOpenFile(window, "DS ROM (*.nds)|*.nds;*.srl|GBA ROM (*.gba)|*.gba|Any file|*.*", Config::LastROMFolder);
+    char* file = uiOpenFile(window, "DS ROM (*.nds)|*.nds;*.srl;*.ndz|GBA ROM (*.gba)|*.gba;*.gbz|Any file|*.*", Config::LastROMFolder);
     if (!file)
     {
         EmuRunning = prevstatus;
@@ -2089,7 +2126,7 @@ void OnOpenFile(uiMenuItem* item, uiWindow* window, void* blarg)
     Config::LastROMFolder[pos] = '\0';
     char* ext = &file[strlen(file)-3];
 
-    if (!strcasecmp(ext, "gba"))
+    if (!strcasecmp(ext, "gba") || !strcasecmp(ext, "gbz"))
     {
         TryLoadROM(file, 1, prevstatus);
     }
@@ -2967,7 +3004,7 @@ int main(int argc, char** argv)
         char* file = argv[1];
         char* ext = &file[strlen(file)-3];
 
-        if (!strcasecmp(ext, "nds") || !strcasecmp(ext, "srl"))
+        if (!strcasecmp(ext, "nds") || !strcasecmp(ext, "srl") || !strcasecmp(ext, "ndz"))
         {
             strncpy(ROMPath[0], file, 1023);
             ROMPath[0][1023] = '\0';
@@ -2983,7 +3020,7 @@ int main(int argc, char** argv)
             file = argv[2];
             ext = &file[strlen(file)-3];
 
-            if (!strcasecmp(ext, "gba"))
+            if (!strcasecmp(ext, "gba") || !strcasecmp(ext, "gbz"))
             {
                 strncpy(ROMPath[1], file, 1023);
                 ROMPath[1][1023] = '\0';
@@ -28,4 +28,18 @@ typedef signed short        s16;
 typedef signed int          s32;
 typedef signed long long int     s64;
 
+// storage for the emulated console's state
+// with MULTI_INSTANCE, every thread that runs the core gets its own console,
+// which allows running several instances in one process. the frontend has
+// to drive each instance (and read its framebuffer/audio) from its own thread.
+// thread-local storage is set up for every thread the process creates, not
+// just those running an instance, so large buffers shouldn't be declared this
+// way: they're allocated in their module's Init() instead, and only the
+// pointer to them is per-thread.
+#ifdef MULTI_INSTANCE
+#define EMUSTATE thread_local
+#else
+#define EMUSTATE
+#endif
+
 #endif // TYPES_H